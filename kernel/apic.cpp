@@ -0,0 +1,140 @@
+#include <apic.h>
+#include <assert.h>
+#include <io.h>
+#include <isr.h>
+#include <kernel.h>
+#include <ktask.h>
+#include <paging.h>
+#include <timer.h>
+
+// Local APIC register offsets.
+// https://wiki.osdev.org/APIC#Local_APIC_registers
+namespace {
+
+constexpr uint32_t kLAPICID = 0x20;
+constexpr uint32_t kLAPICTaskPriority = 0x80;
+constexpr uint32_t kLAPICEOI = 0xB0;
+constexpr uint32_t kLAPICSpuriousVector = 0xF0;
+constexpr uint32_t kLAPICICRLow = 0x300;
+constexpr uint32_t kLAPICICRHigh = 0x310;
+constexpr uint32_t kLAPICLVTTimer = 0x320;
+constexpr uint32_t kLAPICTimerInitCount = 0x380;
+constexpr uint32_t kLAPICTimerCurrentCount = 0x390;
+constexpr uint32_t kLAPICTimerDivide = 0x3E0;
+
+constexpr uint32_t kLAPICSoftwareEnable = 0x100;
+constexpr uint32_t kICRDeliveryPending = 1 << 12;
+constexpr uint32_t kICRInit = 0x4500;     // INIT, level assert
+constexpr uint32_t kICRStartup = 0x4600;  // Startup IPI, level assert
+constexpr uint32_t kLVTMasked = 1 << 16;
+constexpr uint32_t kLVTPeriodic = 1 << 17;
+constexpr uint32_t kTimerDivideBy16 = 0x3;
+
+volatile uint32_t *LAPICBase = nullptr;
+
+// Number of timer counts (with a divider of 16) in one scheduling quantum.
+uint32_t TimerCountsPerQuantum = 0;
+
+uint32_t LAPICRead(uint32_t reg) { return LAPICBase[reg / sizeof(uint32_t)]; }
+
+void LAPICWrite(uint32_t reg, uint32_t val) {
+  LAPICBase[reg / sizeof(uint32_t)] = val;
+}
+
+void WaitForICRDelivery() {
+  while (LAPICRead(kLAPICICRLow) & kICRDeliveryPending) asm volatile("pause");
+}
+
+void LAPICTimerCallback(X86Registers *regs) {
+  // schedule() does not return if it switches tasks, so acknowledge the
+  // interrupt before calling it.
+  LAPICSendEOI();
+
+  // This fires once per quantum rather than once per tick.
+  AccountTimerTicks(kQuanta);
+  schedule(regs);
+}
+
+void SpuriousCallback([[maybe_unused]] X86Registers *regs) {
+  // Spurious interrupts should not be acknowledged.
+}
+
+}  // namespace
+
+void MapLAPIC(uint32_t paddr) {
+  assert(!LAPICBase && "The local APIC was already mapped.");
+  void *frame = PageAddr4M(PageIndex4M(paddr));
+  GetKernelPageDirectory().AddPage(reinterpret_cast<void *>(APIC_MMIO_START),
+                                   frame, PG_CACHE_DISABLE | PG_WRITE_THROUGH,
+                                   /*allow_physical_reuse=*/true);
+  LAPICBase = reinterpret_cast<volatile uint32_t *>(
+      APIC_MMIO_START + (paddr & ~kPageMask4M));
+
+  RegisterInterruptHandler(kLAPICTimerInterrupt, LAPICTimerCallback);
+  RegisterInterruptHandler(kLAPICSpuriousInterrupt, SpuriousCallback);
+}
+
+bool LAPICIsMapped() { return LAPICBase; }
+
+void EnableLAPIC() {
+  LAPICWrite(kLAPICTaskPriority, 0);
+  LAPICWrite(kLAPICSpuriousVector,
+             kLAPICSoftwareEnable | kLAPICSpuriousInterrupt);
+}
+
+uint8_t GetLAPICID() {
+  return static_cast<uint8_t>(LAPICRead(kLAPICID) >> 24);
+}
+
+void LAPICSendEOI() { LAPICWrite(kLAPICEOI, 0); }
+
+void LAPICSendINIT(uint8_t apic_id) {
+  LAPICWrite(kLAPICICRHigh, static_cast<uint32_t>(apic_id) << 24);
+  LAPICWrite(kLAPICICRLow, kICRInit);
+  WaitForICRDelivery();
+}
+
+void LAPICSendStartup(uint8_t apic_id, uint8_t vector) {
+  LAPICWrite(kLAPICICRHigh, static_cast<uint32_t>(apic_id) << 24);
+  LAPICWrite(kLAPICICRLow, kICRStartup | vector);
+  WaitForICRDelivery();
+}
+
+void CalibrateLAPICTimer() {
+  assert(InterruptsAreEnabled() && "The PIT is needed for calibration.");
+
+  LAPICWrite(kLAPICTimerDivide, kTimerDivideBy16);
+  LAPICWrite(kLAPICLVTTimer, kLVTMasked | kLAPICTimerInterrupt);
+
+  // Start on a tick boundary so we measure whole ticks.
+  uint32_t start = GetTicks();
+  while (GetTicks() == start) {}
+
+  LAPICWrite(kLAPICTimerInitCount, UINT32_MAX);
+  start = GetTicks();
+  while (GetTicks() - start < kQuanta) {}
+  uint32_t remaining = LAPICRead(kLAPICTimerCurrentCount);
+  LAPICWrite(kLAPICTimerInitCount, 0);
+
+  TimerCountsPerQuantum = UINT32_MAX - remaining;
+  assert(TimerCountsPerQuantum && "The local APIC timer did not count.");
+  DebugPrint("Local APIC timer counts per quantum: {}\n",
+             TimerCountsPerQuantum);
+}
+
+void StartLAPICTimer() {
+  assert(TimerCountsPerQuantum && "The local APIC timer is not calibrated.");
+  LAPICWrite(kLAPICTimerDivide, kTimerDivideBy16);
+  LAPICWrite(kLAPICLVTTimer, kLVTPeriodic | kLAPICTimerInterrupt);
+  LAPICWrite(kLAPICTimerInitCount, TimerCountsPerQuantum);
+}
+
+void StopLAPICTimer() {
+  LAPICWrite(kLAPICLVTTimer, kLVTMasked | kLAPICTimerInterrupt);
+  LAPICWrite(kLAPICTimerInitCount, 0);
+}
+
+void IODelay(uint32_t us) {
+  // Each write to the unused POST port takes about a microsecond.
+  while (us--) Write8(0x80, 0);
+}
@@ -0,0 +1,100 @@
+#include <assert.h>
+#include <channel.h>
+#include <ktask.h>
+#include <paging.h>
+#include <spinlock.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/channel.h>
+#include <sys/syscall.h>
+
+static_assert(sizeof(ChannelPage) <= kPageSize4M);
+
+namespace {
+
+// Ids are the index of a channel in the table with its generation above it, so
+// an id is not mistaken for a later channel reusing the same entry.
+constexpr uint32_t kMaxChannels = 64;
+constexpr uint32_t kChannelIndexBits = 8;
+constexpr uint32_t kMaxChannelGeneration =
+    UINT32_MAX >> (kChannelIndexBits + 1);
+static_assert(kMaxChannels <= (1 << kChannelIndexBits));
+
+struct ChannelEntry {
+  const void *frame;  // Null if this entry is unused.
+  uint32_t generation;
+};
+
+// Taken before the page directory lock.
+Spinlock ChannelLock("channels");
+ChannelEntry Channels[kMaxChannels] GUARDED_BY(ChannelLock);
+
+// The table holds a reference to each channel's frame, so a channel is dead
+// once that is the only one left.
+bool ChannelIsLive(const ChannelEntry &entry) {
+  return GetPhysicalBitmap4M().getRefs(PageIndex4M(entry.frame)) > 1;
+}
+
+void FreeChannel(ChannelEntry &entry) {
+  GetPhysicalBitmap4M().setPageFrameFree(PageIndex4M(entry.frame));
+  entry.frame = nullptr;
+}
+
+void InitRing(ChannelRing &ring) {
+  memset(&ring, 0, offsetof(ChannelRing, slots));
+  for (uint32_t i = 0; i < CHANNEL_SLOTS; ++i) ring.slots[i].seq = i;
+}
+
+}  // namespace
+
+int32_t CreateChannel(void **addr) {
+  IRQSaveLockRAII<Spinlock> lock(ChannelLock);
+
+  // Take an unused entry, or free a dead channel to reuse its entry.
+  ChannelEntry *entry = nullptr;
+  for (ChannelEntry &candidate : Channels) {
+    if (candidate.frame && ChannelIsLive(candidate)) continue;
+    if (candidate.frame) FreeChannel(candidate);
+    entry = &candidate;
+    break;
+  }
+  if (!entry) return CHANNEL_NO_SPACE;
+
+  PageDirectory &pd = GetCurrentTask()->getPageDirectory();
+  void *vaddr = pd.AddNextFreeUserPage(PG_USER, /*start=*/1);
+  if (!vaddr) return CHANNEL_NO_SPACE;
+
+  entry->frame = pd.GetPhysicalAddr(vaddr);
+  GetPhysicalBitmap4M().Ref(PageIndex4M(entry->frame));
+  entry->generation = (entry->generation + 1) & kMaxChannelGeneration;
+
+  auto *page = static_cast<ChannelPage *>(vaddr);
+  InitRing(page->rings[0]);
+  InitRing(page->rings[1]);
+
+  *addr = vaddr;
+  auto index = static_cast<uint32_t>(entry - Channels);
+  return static_cast<int32_t>((entry->generation << kChannelIndexBits) |
+                              index);
+}
+
+int32_t AttachChannel(uint32_t id, void **addr) {
+  IRQSaveLockRAII<Spinlock> lock(ChannelLock);
+
+  uint32_t index = id & ((1 << kChannelIndexBits) - 1);
+  if (index >= kMaxChannels) return CHANNEL_NOT_FOUND;
+  ChannelEntry &entry = Channels[index];
+  if (!entry.frame || entry.generation != id >> kChannelIndexBits)
+    return CHANNEL_NOT_FOUND;
+  if (!ChannelIsLive(entry)) {
+    FreeChannel(entry);
+    return CHANNEL_NOT_FOUND;
+  }
+
+  void *vaddr =
+      GetCurrentTask()->getPageDirectory().MapNextFreeUserPage(entry.frame,
+                                                               PG_USER);
+  if (!vaddr) return CHANNEL_NO_SPACE;
+  *addr = vaddr;
+  return 0;
+}
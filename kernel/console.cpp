@@ -0,0 +1,57 @@
+#include <console.h>
+#include <isr.h>
+#include <serial.h>
+#include <spinlock.h>
+
+namespace {
+
+// Characters typed while the buffer is full are dropped.
+constexpr uint32_t kConsoleInputSize = 256;
+
+struct ConsoleInput {
+  Spinlock lock;
+  uint32_t head GUARDED_BY(lock);  // Where the next read starts.
+  uint32_t size GUARDED_BY(lock);  // How many characters are buffered.
+  char buffer[kConsoleInputSize] GUARDED_BY(lock);
+  WaitQueue readers;
+};
+
+ConsoleInput Input;
+
+void SerialCallback([[maybe_unused]] X86Registers *regs) {
+  bool received = false;
+  {
+    IRQSaveLockRAII<Spinlock> lock(Input.lock);
+    char c;
+    while (serial::TryRead(c)) {
+      received = true;
+      if (Input.size == kConsoleInputSize) continue;
+      Input.buffer[(Input.head + Input.size) % kConsoleInputSize] = c;
+      ++Input.size;
+    }
+  }
+  if (received) Input.readers.WakeAll();
+}
+
+}  // namespace
+
+void InitConsoleInput() {
+  RegisterInterruptHandler(IRQ4, SerialCallback);
+  serial::EnableReceiveInterrupt();
+}
+
+bool TryReadConsoleInput(char &c) {
+  IRQSaveLockRAII<Spinlock> lock(Input.lock);
+  if (!Input.size) return false;
+  c = Input.buffer[Input.head];
+  Input.head = (Input.head + 1) % kConsoleInputSize;
+  --Input.size;
+  return true;
+}
+
+bool PollConsoleInput(WaitQueue::Entry *entry, Waiter &waiter) {
+  IRQSaveLockRAII<Spinlock> lock(Input.lock);
+  if (Input.size) return true;
+  if (entry) Input.readers.Add(*entry, waiter);
+  return false;
+}
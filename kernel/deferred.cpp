@@ -0,0 +1,126 @@
+#include <assert.h>
+#include <deferred.h>
+#include <kernel.h>
+#include <ktask.h>
+
+namespace {
+
+// This must be a power of 2 so positions can wrap around without skipping
+// slots.
+constexpr uint32_t kNumWorkItems = 64;
+static_assert((kNumWorkItems & (kNumWorkItems - 1)) == 0);
+
+// Each slot's sequence number says who can use it next. A producer can fill the
+// slot for position `pos` once its sequence is `pos`, and a consumer can take
+// it once the producer sets it to `pos + 1`. The consumer then sets it to
+// `pos + kNumWorkItems` to hand the slot to the next lap of producers.
+struct WorkItem {
+  uint32_t seq;
+  DeferredFunc func;
+  uint32_t arg;
+};
+
+WorkItem WorkRing[kNumWorkItems];
+uint32_t EnqueuePos;
+uint32_t DequeuePos;
+
+KernelTask *Worker = nullptr;
+volatile bool StopWorker = false;
+
+uint32_t LoadAcquire(const uint32_t &val) {
+  return __atomic_load_n(&val, __ATOMIC_ACQUIRE);
+}
+
+void StoreRelease(uint32_t &val, uint32_t new_val) {
+  __atomic_store_n(&val, new_val, __ATOMIC_RELEASE);
+}
+
+bool TryClaim(uint32_t &pos_ref, uint32_t &pos) {
+  return __atomic_compare_exchange_n(&pos_ref, &pos, pos + 1, /*weak=*/false,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+// Take the next queued item, if any.
+bool Dequeue(DeferredFunc &func, uint32_t &arg) {
+  uint32_t pos = __atomic_load_n(&DequeuePos, __ATOMIC_RELAXED);
+  while (true) {
+    WorkItem &item = WorkRing[pos % kNumWorkItems];
+    int32_t diff = static_cast<int32_t>(LoadAcquire(item.seq) - (pos + 1));
+    if (diff < 0) return false;  // Empty, or the producer is still filling it.
+    if (diff == 0) {
+      if (!TryClaim(DequeuePos, pos)) continue;
+      func = item.func;
+      arg = item.arg;
+      StoreRelease(item.seq, pos + kNumWorkItems);
+      return true;
+    }
+    // Another consumer took this slot first.
+    pos = __atomic_load_n(&DequeuePos, __ATOMIC_RELAXED);
+  }
+}
+
+// Whether the next slot to dequeue has been filled.
+bool HasQueuedWork() {
+  uint32_t pos = __atomic_load_n(&DequeuePos, __ATOMIC_RELAXED);
+  return LoadAcquire(WorkRing[pos % kNumWorkItems].seq) == pos + 1;
+}
+
+// Block whenever the ring is empty. DeferWork() wakes the worker after queuing,
+// and the worker checks the ring after PrepareToBlock(), so new work is never
+// missed.
+void WorkerLoop(void *) {
+  while (!StopWorker) {
+    if (RunDeferredWork()) continue;
+    PrepareToBlock();
+    if (StopWorker || HasQueuedWork()) continue;
+    BlockCurrentTask();
+  }
+}
+
+}  // namespace
+
+bool DeferWork(DeferredFunc func, uint32_t arg) {
+  uint32_t pos = __atomic_load_n(&EnqueuePos, __ATOMIC_RELAXED);
+  while (true) {
+    WorkItem &item = WorkRing[pos % kNumWorkItems];
+    int32_t diff = static_cast<int32_t>(LoadAcquire(item.seq) - pos);
+    if (diff < 0) return false;  // Full.
+    if (diff == 0) {
+      if (!TryClaim(EnqueuePos, pos)) continue;
+      item.func = func;
+      item.arg = arg;
+      StoreRelease(item.seq, pos + 1);
+      if (KernelTask *worker = __atomic_load_n(&Worker, __ATOMIC_ACQUIRE))
+        worker->Wake();
+      return true;
+    }
+    // Another producer took this slot first.
+    pos = __atomic_load_n(&EnqueuePos, __ATOMIC_RELAXED);
+  }
+}
+
+bool RunDeferredWork() {
+  bool ran = false;
+  DeferredFunc func;
+  uint32_t arg;
+  while (Dequeue(func, arg)) {
+    func(arg);
+    ran = true;
+  }
+  return ran;
+}
+
+void InitDeferredWork() {
+  assert(!Worker && "This function should not be called twice.");
+  for (uint32_t i = 0; i < kNumWorkItems; ++i) WorkRing[i].seq = i;
+  __atomic_store_n(&Worker, new KernelTask(WorkerLoop), __ATOMIC_RELEASE);
+}
+
+void StopDeferredWork() {
+  KernelTask *worker = Worker;
+  __atomic_store_n(&Worker, nullptr, __ATOMIC_RELEASE);
+  StopWorker = true;
+  worker->Wake();
+  delete worker;
+  RunDeferredWork();
+}
@@ -1,8 +1,12 @@
+#include <apic.h>
+#include <assert.h>
 #include <descriptortables.h>
 #include <io.h>
+#include <smp.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/vdso.h>
 
 // Initialises the GDT and IDT, and defines the default ISR and IRQ handler.
 // Based on code from Bran's kernel development tutorials.
@@ -10,9 +14,7 @@
 
 constexpr uint8_t kDPLUser = 0x60;
 
-constexpr size_t kNumGDTEntries = 6;
-gdt_entry_t gdt_entries[kNumGDTEntries];
-gdt_ptr_t gdt_ptr;
+constexpr size_t kNumGDTEntries = 7;
 idt_entry_t idt_entries[256];
 idt_ptr_t idt_ptr;
 
@@ -55,6 +57,8 @@ extern void isr28();
 extern void isr29();
 extern void isr30();
 extern void isr31();
+extern void isr48();
+extern void isr255();
 
 extern void irq0();
 extern void irq1();
@@ -115,11 +119,23 @@ struct tss_entry_t {
 } __attribute__((packed));
 static_assert(sizeof(tss_entry_t) == 104, "");
 
-tss_entry_t tss_entry;
+// Each CPU gets its own GDT and TSS. The TSS holds the esp0 the CPU switches to
+// when entering ring 0 from the user task it's running, so it cannot be shared.
+// Keeping a whole GDT per CPU means every CPU can use the same TSS selector.
+struct CPUDescriptorTables {
+  gdt_entry_t gdt_entries[kNumGDTEntries];
+  gdt_ptr_t gdt_ptr;
+
+  // Keep the TSS fields naturally aligned so GetKernelStackSlot() can hand out
+  // a pointer into it.
+  alignas(4) tss_entry_t tss_entry;
+};
+
+CPUDescriptorTables CPUTables[kMaxCPUs];
 
 // Set the value of one GDT entry.
-void GDTSetGate(int32_t num, uint32_t base, uint32_t limit, uint8_t access,
-                uint8_t gran) {
+void GDTSetGate(gdt_entry_t *gdt_entries, int32_t num, uint32_t base,
+                uint32_t limit, uint8_t access, uint8_t gran) {
   gdt_entries[num].base_low = (base & 0xFFFF);
   gdt_entries[num].base_middle = (base >> 16) & 0xFF;
   gdt_entries[num].base_high = (base >> 24) & 0xFF;
@@ -131,7 +147,10 @@ void GDTSetGate(int32_t num, uint32_t base, uint32_t limit, uint8_t access,
   gdt_entries[num].access = access;
 }
 
-void WriteTSS(int32_t num, uint16_t ss0, uint32_t esp0) {
+void WriteTSS(CPUDescriptorTables &tables, int32_t num, uint16_t ss0,
+              uint32_t esp0) {
+  tss_entry_t &tss_entry = tables.tss_entry;
+
   // Firstly, let's compute the base and limit of our entry into the GDT.
   uint32_t base = reinterpret_cast<uint32_t>(&tss_entry);
   uint32_t limit = sizeof(tss_entry);
@@ -161,22 +180,29 @@ void WriteTSS(int32_t num, uint16_t ss0, uint32_t esp0) {
       0x13;
 
   // Now, add our TSS descriptor's address to the GDT.
-  GDTSetGate(num, base, limit, 0xE9, 0x00);
+  GDTSetGate(tables.gdt_entries, num, base, limit, 0xE9, 0x00);
 }
 
 // Internal function prototypes.
-void InitGDT() {
-  gdt_ptr.limit = (sizeof(gdt_entry_t) * kNumGDTEntries) - 1;
-  gdt_ptr.base = reinterpret_cast<uint32_t>(&gdt_entries);
-
-  GDTSetGate(0, 0, 0, 0, 0);                 // Null segment (0x00)
-  GDTSetGate(1, 0, 0xFFFFFFFF, 0x9A, 0xCF);  // Code segment (0x08)
-  GDTSetGate(2, 0, 0xFFFFFFFF, 0x92, 0xCF);  // Data segment (0x10)
-  GDTSetGate(3, 0, 0xFFFFFFFF, 0xFA, 0xCF);  // User mode code segment (0x18)
-  GDTSetGate(4, 0, 0xFFFFFFFF, 0xF2, 0xCF);  // User mode data segment (0x20)
-  WriteTSS(5, 0x10, 0);
-
-  GDTFlush(reinterpret_cast<uint32_t>(&gdt_ptr));
+void InitGDT(size_t cpu) {
+  CPUDescriptorTables &tables = CPUTables[cpu];
+  gdt_entry_t *gdt_entries = tables.gdt_entries;
+  tables.gdt_ptr.limit = (sizeof(gdt_entry_t) * kNumGDTEntries) - 1;
+  tables.gdt_ptr.base = reinterpret_cast<uint32_t>(gdt_entries);
+
+  GDTSetGate(gdt_entries, 0, 0, 0, 0, 0);  // Null segment (0x00)
+  GDTSetGate(gdt_entries, 1, 0, 0xFFFFFFFF, 0x9A, 0xCF);  // Code (0x08)
+  GDTSetGate(gdt_entries, 2, 0, 0xFFFFFFFF, 0x92, 0xCF);  // Data (0x10)
+  GDTSetGate(gdt_entries, 3, 0, 0xFFFFFFFF, 0xFA, 0xCF);  // User code (0x18)
+  GDTSetGate(gdt_entries, 4, 0, 0xFFFFFFFF, 0xF2, 0xCF);  // User data (0x20)
+  WriteTSS(tables, 5, 0x10, 0);
+
+  // A user data segment that is never loaded. Its limit is this CPU's index,
+  // which user tasks read with `lsl` to find their slot in the vDSO.
+  static_assert(VDSO_CPU_SELECTOR == ((6 << 3) | 3));
+  GDTSetGate(gdt_entries, 6, 0, static_cast<uint32_t>(cpu), 0xF2, 0x00);
+
+  GDTFlush(reinterpret_cast<uint32_t>(&tables.gdt_ptr));
   TSSFlush();
 }
 
@@ -258,6 +284,12 @@ void InitIDT() {
   IDTSetGate(46, reinterpret_cast<uint32_t>(irq14), 0x08, 0x8E);
   IDTSetGate(47, reinterpret_cast<uint32_t>(irq15), 0x08, 0x8E);
 
+  // Local APIC interrupts.
+  IDTSetGate(kLAPICTimerInterrupt, reinterpret_cast<uint32_t>(isr48), 0x08,
+             0x8E);
+  IDTSetGate(kLAPICSpuriousInterrupt, reinterpret_cast<uint32_t>(isr255), 0x08,
+             0x8E);
+
   // Set the interrupt gate privilege for 0x80 to 3 so usermode can access it.
   IDTSetGate(128, reinterpret_cast<uint32_t>(isr128), 0x08, 0x8E | kDPLUser);
 
@@ -269,8 +301,29 @@ void InitIDT() {
 // Initialisation routine - zeroes all the interrupt service routines,
 // initialises the GDT and IDT.
 void InitDescriptorTables() {
-  InitGDT();
+  InitGDT(/*cpu=*/0);
   InitIDT();
 }
 
-void set_kernel_stack(uint32_t stack) { tss_entry.esp0 = stack; }
+void InitAPDescriptorTables(size_t cpu) {
+  assert(cpu && cpu < kMaxCPUs);
+  InitGDT(cpu);
+
+  // The IDT is shared by all CPUs.
+  IDTFlush(reinterpret_cast<uint32_t>(&idt_ptr));
+}
+
+const gdt_ptr_t &GetBootGDTPtr() { return CPUTables[0].gdt_ptr; }
+
+void set_kernel_stack(uint32_t stack) {
+  CPUTables[GetCPUIndex()].tss_entry.esp0 = stack;
+}
+
+const uint32_t *GetKernelStackSlot() {
+  // The TSS is packed, but esp0 is 4-byte aligned since the TSS itself is.
+  // Going through offsetof avoids taking the address of a packed member.
+  const auto *tss = reinterpret_cast<const uint8_t *>(
+      &CPUTables[GetCPUIndex()].tss_entry);
+  return reinterpret_cast<const uint32_t *>(tss +
+                                            offsetof(tss_entry_t, esp0));
+}
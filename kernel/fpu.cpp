@@ -0,0 +1,114 @@
+#include <fpu.h>
+#include <isr.h>
+#include <kernel.h>
+#include <kmalloc.h>
+#include <ktask.h>
+#include <panic.h>
+#include <string.h>
+
+namespace {
+
+constexpr uint32_t kCR0MonitorCoprocessor = 1 << 1;  // MP
+constexpr uint32_t kCR0Emulation = 1 << 2;           // EM
+constexpr uint32_t kCR0TaskSwitched = 1 << 3;        // TS
+constexpr uint32_t kCR0NumericError = 1 << 5;        // NE
+constexpr uint32_t kCR4OSFXSR = 1 << 9;
+constexpr uint32_t kCR4OSXMMEXCPT = 1 << 10;
+
+constexpr uint32_t kCPUIDFXSR = 1 << 24;
+constexpr uint32_t kCPUIDSSE = 1 << 25;
+
+// All SSE exceptions masked with round-to-nearest. This is the MXCSR value
+// after reset.
+constexpr uint32_t kDefaultMXCSR = 0x1F80;
+
+constexpr uint8_t kDeviceNotAvailableInterrupt = 7;
+
+// The state every task starts with, taken right after initializing the FPU on
+// the boot CPU.
+FPUState InitialFPUState;
+
+uint32_t ReadCR0() {
+  uint32_t cr0;
+  asm volatile("mov %%cr0, %0" : "=r"(cr0));
+  return cr0;
+}
+
+void WriteCR0(uint32_t cr0) { asm volatile("mov %0, %%cr0" ::"r"(cr0)); }
+
+void SetTaskSwitched() { WriteCR0(ReadCR0() | kCR0TaskSwitched); }
+void ClearTaskSwitched() { asm volatile("clts"); }
+
+void FXSave(FPUState *state) {
+  asm volatile("fxsave (%0)" ::"r"(state) : "memory");
+}
+
+void FXRestore(const FPUState *state) {
+  asm volatile("fxrstor (%0)" ::"r"(state) : "memory");
+}
+
+// Raised by the first FPU or SSE instruction after a task switch.
+void DeviceNotAvailableHandler(X86Registers *) {
+  ClearTaskSwitched();
+
+  Task *task = GetCurrentTask();
+  FPUState *state = task->getFPUState();
+  if (!state) {
+    state = reinterpret_cast<FPUState *>(
+        kmalloc(sizeof(FPUState), alignof(FPUState)));
+    memcpy(state, &InitialFPUState, sizeof(FPUState));
+    task->setFPUState(state);
+  }
+  FXRestore(state);
+}
+
+void EnableFPUOnThisCPU() {
+  uint32_t edx;
+  asm volatile("cpuid" : "=d"(edx) : "a"(1) : "ebx", "ecx");
+  if (!(edx & kCPUIDFXSR) || !(edx & kCPUIDSSE))
+    PANIC("This CPU does not support FXSAVE and SSE.");
+
+  uint32_t cr0 = ReadCR0();
+  cr0 &= ~(kCR0Emulation | kCR0TaskSwitched);
+  cr0 |= kCR0MonitorCoprocessor | kCR0NumericError;
+  WriteCR0(cr0);
+
+  uint32_t cr4;
+  asm volatile("mov %%cr4, %0" : "=r"(cr4));
+  cr4 |= kCR4OSFXSR | kCR4OSXMMEXCPT;
+  asm volatile("mov %0, %%cr4" ::"r"(cr4));
+
+  uint32_t mxcsr = kDefaultMXCSR;
+  asm volatile("fninit; ldmxcsr %0" ::"m"(mxcsr));
+}
+
+}  // namespace
+
+void InitFPU() {
+  EnableFPUOnThisCPU();
+  FXSave(&InitialFPUState);
+  SetTaskSwitched();
+
+  RegisterInterruptHandler(kDeviceNotAvailableInterrupt,
+                           DeviceNotAvailableHandler);
+}
+
+void InitAPFPU() {
+  EnableFPUOnThisCPU();
+  SetTaskSwitched();
+}
+
+void UnloadFPU(Task *task) {
+  assert(!InterruptsAreEnabled() &&
+         "Interrupts should be disabled when switching FPU state.");
+
+  // TS is still set if nothing touched the FPU since the last switch.
+  if (ReadCR0() & kCR0TaskSwitched) return;
+
+  if (task) {
+    assert(task->getFPUState() &&
+           "The FPU was used without going through the #NM handler.");
+    FXSave(task->getFPUState());
+  }
+  SetTaskSwitched();
+}
@@ -0,0 +1,125 @@
+#include <assert.h>
+#include <futex.h>
+#include <kernel.h>
+#include <ktask.h>
+#include <paging.h>
+#include <spinlock.h>
+#include <sys/syscall.h>
+
+namespace {
+
+// This must be a power of 2 so keys can be masked into a bucket.
+constexpr uint32_t kNumFutexBuckets = 64;
+static_assert((kNumFutexBuckets & (kNumFutexBuckets - 1)) == 0);
+
+// Waiters are hashed by key so unrelated futexes rarely share a lock. Each
+// bucket keeps its waiters oldest first.
+struct FutexBucket {
+  Spinlock lock;
+  FutexWaiter *head GUARDED_BY(lock);
+  FutexWaiter *tail GUARDED_BY(lock);
+};
+
+FutexBucket FutexBuckets[kNumFutexBuckets];
+
+// Get the physical address of `addr` in the current address space, or 0 if it
+// cannot be used as a futex.
+uintptr_t GetFutexKey(const uint32_t *addr) {
+  uintptr_t vaddr = reinterpret_cast<uintptr_t>(addr);
+  if (vaddr % alignof(uint32_t)) return 0;
+
+  PageDirectory &pd = GetCurrentTask()->getPageDirectory();
+  void *page = PageAddr4M(PageIndex4M(addr));
+  if (!pd.isVirtualMapped(page)) return 0;
+  return reinterpret_cast<uintptr_t>(pd.GetPhysicalAddr(page)) +
+         vaddr % kPageSize4M;
+}
+
+FutexBucket &GetFutexBucket(uintptr_t key) {
+  // Fibonacci hashing. The low 2 bits of the key are always 0.
+  uint32_t hash = static_cast<uint32_t>(key >> 2) * UINT32_C(0x9E3779B9);
+  return FutexBuckets[hash >> (32 - __builtin_ctz(kNumFutexBuckets))];
+}
+
+}  // namespace
+
+int32_t FutexAddWaiter(FutexWaiter &entry, Waiter &waiter,
+                       const uint32_t *addr, uint32_t expected) {
+  uintptr_t key = GetFutexKey(addr);
+  if (!key) return FUTEX_BAD_ADDR;
+
+  entry = {key, &waiter, /*woken=*/false, /*next=*/nullptr};
+  FutexBucket &bucket = GetFutexBucket(key);
+
+  // Check the value with the bucket locked so a FutexWake() after the value
+  // changed cannot run before this task is queued.
+  IRQSaveLockRAII<Spinlock> lock(bucket.lock);
+  if (__atomic_load_n(addr, __ATOMIC_SEQ_CST) != expected)
+    return FUTEX_WOULD_BLOCK;
+  if (bucket.tail)
+    bucket.tail->next = &entry;
+  else
+    bucket.head = &entry;
+  bucket.tail = &entry;
+  return 0;
+}
+
+bool FutexRemoveWaiter(FutexWaiter &entry) {
+  // FutexWake() wakes the waiter with the bucket locked, so taking the lock
+  // also waits for it to be done with `entry`.
+  FutexBucket &bucket = GetFutexBucket(entry.key);
+  IRQSaveLockRAII<Spinlock> lock(bucket.lock);
+  if (entry.woken) return true;
+
+  FutexWaiter *prev = nullptr;
+  for (FutexWaiter *w = bucket.head; w != &entry; w = w->next) prev = w;
+  if (prev)
+    prev->next = entry.next;
+  else
+    bucket.head = entry.next;
+  if (bucket.tail == &entry) bucket.tail = prev;
+  return false;
+}
+
+int32_t FutexWait(const uint32_t *addr, uint32_t expected,
+                  uint32_t timeout_ticks) {
+  Waiter waiter = {GetCurrentTask(), /*woken=*/false};
+  FutexWaiter entry;
+  if (int32_t res = FutexAddWaiter(entry, waiter, addr, expected)) return res;
+
+  WaitUntilWoken(waiter, timeout_ticks);
+
+  // If this timed out, it is still queued.
+  return FutexRemoveWaiter(entry) ? 0 : FUTEX_TIMED_OUT;
+}
+
+int32_t FutexWake(const uint32_t *addr, uint32_t num) {
+  uintptr_t key = GetFutexKey(addr);
+  if (!key) return FUTEX_BAD_ADDR;
+
+  FutexBucket &bucket = GetFutexBucket(key);
+  IRQSaveLockRAII<Spinlock> lock(bucket.lock);
+  int32_t woken = 0;
+  FutexWaiter *prev = nullptr;
+  FutexWaiter *waiter = bucket.head;
+  while (waiter && static_cast<uint32_t>(woken) < num) {
+    FutexWaiter *next = waiter->next;
+    if (waiter->key != key) {
+      prev = waiter;
+      waiter = next;
+      continue;
+    }
+
+    if (prev)
+      prev->next = next;
+    else
+      bucket.head = next;
+    if (bucket.tail == waiter) bucket.tail = prev;
+
+    waiter->woken = true;
+    WakeWaiter(*waiter->waiter);
+    ++woken;
+    waiter = next;
+  }
+  return woken;
+}
@@ -0,0 +1,195 @@
+#include <assert.h>
+#include <handle.h>
+#include <ktask.h>
+#include <panic.h>
+#include <sys/syscall.h>
+
+namespace {
+
+constexpr uint32_t kHandleIndexBits = 6;
+constexpr uint32_t kHandleIndexMask = (1 << kHandleIndexBits) - 1;
+constexpr uint32_t kMaxHandleGeneration = UINT32_MAX >> kHandleIndexBits;
+static_assert(kMaxHandles == (1 << kHandleIndexBits));
+
+// The next generation of an entry. Generations skip 0 so no handle is 0.
+uint32_t NextGeneration(uint32_t generation, uint32_t max) {
+  return generation == max ? 1 : generation + 1;
+}
+
+constexpr uint32_t kMaxTasks = 1024;
+constexpr uint32_t kTaskIndexBits = 10;
+constexpr uint32_t kTaskIndexMask = (1 << kTaskIndexBits) - 1;
+constexpr uint32_t kMaxTaskGeneration = UINT32_MAX >> kTaskIndexBits;
+static_assert(kMaxTasks == (1 << kTaskIndexBits));
+
+// Free slots are chained through `next_free`. Slots past NumUsedTaskSlots have
+// never been used, so the table needs no setup. A slot whose task was
+// unregistered while it still had users is only freed once the last user
+// releases it, so its reference cannot be reused in the meantime.
+struct TaskSlot {
+  Task *task;  // Null once the task is unregistered.
+  uint32_t generation;
+  uint32_t users;  // Uses from RetainTask() not yet released.
+  Task *waiter;    // Woken once `users` drops to 0.
+  uint32_t next_free;
+};
+
+Spinlock TaskSlotLock("task slots");
+TaskSlot TaskSlots[kMaxTasks] GUARDED_BY(TaskSlotLock);
+uint32_t NumUsedTaskSlots GUARDED_BY(TaskSlotLock);
+uint32_t FreeTaskSlotIndex GUARDED_BY(TaskSlotLock) = kMaxTasks;
+
+TaskSlot *GetTaskSlot(uint32_t ref) REQUIRES(TaskSlotLock) {
+  TaskSlot &slot = TaskSlots[ref & kTaskIndexMask];
+  if (!slot.task || slot.generation != ref >> kTaskIndexBits) return nullptr;
+  return &slot;
+}
+
+void FreeTaskSlot(uint32_t index) REQUIRES(TaskSlotLock) {
+  TaskSlots[index].next_free = FreeTaskSlotIndex;
+  FreeTaskSlotIndex = index;
+}
+
+}  // namespace
+
+HandleTable::HandleTable() : users_(1), entries_() {}
+
+void HandleTable::Retain() {
+  __atomic_fetch_add(&users_, 1, __ATOMIC_RELAXED);
+}
+
+bool HandleTable::Release() {
+  return __atomic_sub_fetch(&users_, 1, __ATOMIC_ACQ_REL) == 0;
+}
+
+HandleTable::Entry *HandleTable::Get(uint32_t handle) {
+  Entry &entry = entries_[handle & kHandleIndexMask];
+  if (entry.type == kHandleFree ||
+      entry.generation != handle >> kHandleIndexBits)
+    return nullptr;
+  return &entry;
+}
+
+uint32_t HandleTable::Install(HandleType type, uint32_t object) {
+  assert(type != kHandleFree);
+  IRQSaveLockRAII<Spinlock> lock(lock_);
+  for (uint32_t i = 0; i < kMaxHandles; ++i) {
+    Entry &entry = entries_[i];
+    if (entry.type != kHandleFree) continue;
+    entry.object = object;
+    entry.type = type;
+    entry.generation =
+        NextGeneration(entry.generation, kMaxHandleGeneration);
+    return (entry.generation << kHandleIndexBits) | i;
+  }
+  return HANDLE_INVALID;
+}
+
+bool HandleTable::InstallAt(uint32_t handle, HandleType type,
+                            uint32_t object) {
+  assert(type != kHandleFree);
+  if (handle == HANDLE_INVALID) return false;
+  IRQSaveLockRAII<Spinlock> lock(lock_);
+  Entry &entry = entries_[handle & kHandleIndexMask];
+  if (entry.type != kHandleFree) return false;
+  entry = {object, handle >> kHandleIndexBits, type};
+  return true;
+}
+
+void HandleTable::Set(uint32_t handle, uint32_t object) {
+  IRQSaveLockRAII<Spinlock> lock(lock_);
+  Entry *entry = Get(handle);
+  assert(entry && "Setting a handle that is not open.");
+  entry->object = object;
+}
+
+bool HandleTable::Lookup(uint32_t handle, HandleType type, uint32_t &object) {
+  IRQSaveLockRAII<Spinlock> lock(lock_);
+  Entry *entry = Get(handle);
+  if (!entry || entry->type != type) return false;
+  object = entry->object;
+  return true;
+}
+
+uint32_t HandleTable::Find(HandleType type, uint32_t object) {
+  IRQSaveLockRAII<Spinlock> lock(lock_);
+  for (uint32_t i = 0; i < kMaxHandles; ++i) {
+    const Entry &entry = entries_[i];
+    if (entry.type == type && entry.object == object)
+      return (entry.generation << kHandleIndexBits) | i;
+  }
+  return HANDLE_INVALID;
+}
+
+bool HandleTable::Remove(uint32_t handle, HandleType type, uint32_t &object) {
+  IRQSaveLockRAII<Spinlock> lock(lock_);
+  Entry *entry = Get(handle);
+  if (!entry || entry->type != type) return false;
+  object = entry->object;
+  entry->type = kHandleFree;
+  return true;
+}
+
+uint32_t RegisterTask(Task &task) {
+  IRQSaveLockRAII<Spinlock> lock(TaskSlotLock);
+  uint32_t index;
+  if (FreeTaskSlotIndex != kMaxTasks) {
+    index = FreeTaskSlotIndex;
+    FreeTaskSlotIndex = TaskSlots[index].next_free;
+  } else if (NumUsedTaskSlots < kMaxTasks) {
+    index = NumUsedTaskSlots++;
+  } else {
+    PANIC("Ran out of task slots.");
+  }
+
+  TaskSlot &slot = TaskSlots[index];
+  slot.task = &task;
+  slot.generation = NextGeneration(slot.generation, kMaxTaskGeneration);
+  return (slot.generation << kTaskIndexBits) | index;
+}
+
+Task *UnregisterTask(uint32_t ref) {
+  IRQSaveLockRAII<Spinlock> lock(TaskSlotLock);
+  TaskSlot *slot = GetTaskSlot(ref);
+  if (!slot) return nullptr;
+  Task *task = slot->task;
+  slot->task = nullptr;
+  if (!slot->users) FreeTaskSlot(ref & kTaskIndexMask);
+  return task;
+}
+
+Task *RetainTask(uint32_t ref) {
+  IRQSaveLockRAII<Spinlock> lock(TaskSlotLock);
+  TaskSlot *slot = GetTaskSlot(ref);
+  if (!slot) return nullptr;
+  ++slot->users;
+  return slot->task;
+}
+
+void ReleaseTask(uint32_t ref) {
+  Task *waiter;
+  {
+    IRQSaveLockRAII<Spinlock> lock(TaskSlotLock);
+    TaskSlot &slot = TaskSlots[ref & kTaskIndexMask];
+    assert(slot.generation == ref >> kTaskIndexBits && slot.users &&
+           "Releasing a task that was not retained.");
+    if (--slot.users) return;
+    if (!slot.task) FreeTaskSlot(ref & kTaskIndexMask);
+    waiter = slot.waiter;
+    slot.waiter = nullptr;
+  }
+  if (waiter) waiter->Wake();
+}
+
+void WaitForTaskUsers(uint32_t ref) {
+  while (true) {
+    PrepareToBlock();
+    {
+      IRQSaveLockRAII<Spinlock> lock(TaskSlotLock);
+      TaskSlot &slot = TaskSlots[ref & kTaskIndexMask];
+      if (slot.generation != ref >> kTaskIndexBits || !slot.users) return;
+      slot.waiter = GetCurrentTask();
+    }
+    BlockCurrentTask();
+  }
+}
@@ -0,0 +1,43 @@
+#ifndef APIC_H_
+#define APIC_H_
+
+#include <stdint.h>
+
+// The architectural default physical address of the local APIC registers. The
+// firmware tables can report a different one which should be preferred.
+constexpr uint32_t kDefaultLAPICAddr = 0xFEE00000;
+
+// Interrupt vectors raised by the local APIC. These come after the remapped PIC
+// IRQs.
+constexpr uint8_t kLAPICTimerInterrupt = 48;
+constexpr uint8_t kLAPICSpuriousInterrupt = 0xFF;
+
+// Map the local APIC registers at `paddr` into APIC_MMIO_START. This must be
+// done before any page directory is cloned from the kernel page directory.
+void MapLAPIC(uint32_t paddr);
+bool LAPICIsMapped();
+
+// Software-enable the local APIC on the current CPU.
+void EnableLAPIC();
+
+uint8_t GetLAPICID();
+void LAPICSendEOI();
+
+// Inter-processor interrupts used for starting up other CPUs.
+void LAPICSendINIT(uint8_t apic_id);
+void LAPICSendStartup(uint8_t apic_id, uint8_t vector);
+
+// Measure how fast the local APIC timer counts against the PIT. This must be
+// run on the BSP with the PIT timer running and interrupts enabled.
+void CalibrateLAPICTimer();
+
+// Start or stop the periodic local APIC timer on the current CPU. The timer
+// fires kLAPICTimerInterrupt once every scheduling quantum.
+void StartLAPICTimer();
+void StopLAPICTimer();
+
+// Busy-wait for roughly `us` microseconds using port I/O. This does not need
+// interrupts or any timer to be set up.
+void IODelay(uint32_t us);
+
+#endif
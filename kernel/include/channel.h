@@ -0,0 +1,22 @@
+#ifndef CHANNEL_H_
+#define CHANNEL_H_
+
+#include <stdint.h>
+
+// Channels are pages laid out as in sys/channel.h that tasks share for passing
+// messages. The kernel only allocates and maps them; tasks send and receive
+// through the page directly and use futexes to sleep.
+//
+// A channel lives as long as some task has its page mapped. Tasks let go of it
+// by unmapping the page or exiting.
+
+// Map a new channel into the current task and return its id, or
+// CHANNEL_NO_SPACE if the channel table or the task's address space is full.
+int32_t CreateChannel(void **addr);
+
+// Map the existing channel `id` into the current task. This returns 0,
+// CHANNEL_NOT_FOUND if no task has the channel mapped anymore, or
+// CHANNEL_NO_SPACE.
+int32_t AttachChannel(uint32_t id, void **addr);
+
+#endif
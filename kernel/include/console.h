@@ -0,0 +1,21 @@
+#ifndef CONSOLE_H_
+#define CONSOLE_H_
+
+#include <waitqueue.h>
+
+// Input typed on the serial console. The serial receive interrupt moves each
+// character into a buffer as it arrives, so readers can sleep until there is
+// input instead of polling the port.
+
+// Start taking serial input. This must be called after the descriptor tables
+// are initialized.
+void InitConsoleInput();
+
+// Take the next buffered character if there is one.
+bool TryReadConsoleInput(char &c);
+
+// Return whether there is buffered input. If there is not and `entry` is not
+// null, link it so `waiter` is woken once more arrives.
+bool PollConsoleInput(WaitQueue::Entry *entry, Waiter &waiter);
+
+#endif
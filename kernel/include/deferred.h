@@ -0,0 +1,33 @@
+#ifndef DEFERRED_H_
+#define DEFERRED_H_
+
+#include <stdint.h>
+
+// Work that interrupt handlers hand off to run later with interrupts enabled.
+// Handlers should only do what must happen while the interrupt is being
+// serviced (like reading the device) and defer the rest, since every other
+// interrupt on the CPU (including the scheduler tick) waits while a handler
+// runs.
+//
+// Deferred work is queued on a fixed-size lock-free ring, so it can be queued
+// from any CPU in any context without taking locks or allocating. A kernel
+// worker task drains it, and sleeps while it is empty.
+using DeferredFunc = void (*)(uint32_t arg);
+
+// Queue `func(arg)` to run on the worker task. This returns false without
+// queuing anything if the ring is full.
+bool DeferWork(DeferredFunc func, uint32_t arg = 0);
+
+// Run all work queued so far on the current task. This returns whether any work
+// was run.
+bool RunDeferredWork();
+
+// Start the worker task. This must be called after the scheduler is
+// initialized.
+void InitDeferredWork();
+
+// Run any remaining work and stop the worker task. This must be called before
+// the scheduler is destroyed.
+void StopDeferredWork();
+
+#endif
@@ -1,6 +1,7 @@
 #ifndef DESCRIPTOR_TABLES_H_
 #define DESCRIPTOR_TABLES_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
 // This structure contains the value of one GDT entry.
@@ -24,6 +25,14 @@ struct gdt_ptr_t {
 // Initialisation function is publicly accessible.
 void InitDescriptorTables();
 
+// Load a fresh GDT and TSS for an application processor along with the shared
+// IDT. This is called on the AP itself.
+void InitAPDescriptorTables(size_t cpu);
+
+// The GDT pointer of the boot CPU. APs use this GDT temporarily to get into
+// protected mode.
+const gdt_ptr_t &GetBootGDTPtr();
+
 // A struct describing an interrupt gate.
 struct idt_entry_t {
   uint16_t base_lo;  // The lower 16 bits of the address to jump to when this
@@ -43,4 +52,9 @@ struct idt_ptr_t {
 
 void set_kernel_stack(uint32_t stack);
 
+// The address of the esp0 field in the current CPU's TSS. The SYSENTER path
+// reads the kernel stack from here since SYSENTER itself can only load a fixed
+// stack pointer per CPU.
+const uint32_t *GetKernelStackSlot();
+
 #endif
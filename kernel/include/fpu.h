@@ -0,0 +1,34 @@
+#ifndef FPU_H_
+#define FPU_H_
+
+#include <stdint.h>
+
+class Task;
+
+// The x87/MMX/SSE register state as written by FXSAVE.
+struct alignas(16) FPUState {
+  uint8_t fxsave_area[512];
+};
+static_assert(sizeof(FPUState) == 512);
+
+// FPU state is switched lazily. The scheduler sets CR0.TS on every switch so
+// the first FPU or SSE instruction a task runs raises #NM, and only then is the
+// task's state loaded. Tasks that never touch these registers never pay for
+// saving or restoring them.
+//
+// The kernel itself is built without SSE or MMX, so kernel code never clobbers
+// user FPU state.
+
+// Enable the FPU and SSE on the boot CPU and install the #NM handler.
+void InitFPU();
+
+// Enable the FPU and SSE on the AP this is called on.
+void InitAPFPU();
+
+// Called by the scheduler before switching away from the current task on this
+// CPU. If `task` used the FPU since it was switched in, its registers are saved
+// so it can be resumed on any CPU. Pass null for a task that is exiting and
+// whose state can be dropped.
+void UnloadFPU(Task *task);
+
+#endif
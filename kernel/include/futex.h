@@ -0,0 +1,46 @@
+#ifndef FUTEX_H_
+#define FUTEX_H_
+
+#include <stdint.h>
+#include <waitqueue.h>
+
+// Futexes let tasks wait on a 32-bit word until another task wakes them. Waits
+// are keyed by the physical address of the word, so tasks with different
+// address spaces that share the page (see Task::MapPageFromTask()) wait on the
+// same futex.
+//
+// These return the results below from sys/syscall.h.
+
+constexpr uint32_t kFutexNoTimeout = kWaitNoTimeout;
+
+// A wait on a futex. This lives on the waiting task's stack and is only linked
+// into the futex's bucket until it is woken or removed.
+struct FutexWaiter {
+  uintptr_t key;
+  Waiter *waiter;
+  bool woken;  // Set once FutexWake() unlinks this.
+  FutexWaiter *next;
+};
+
+// Block on `addr` if it still holds `expected`. This returns 0 once woken,
+// FUTEX_WOULD_BLOCK if `addr` holds something else, FUTEX_TIMED_OUT if nothing
+// woke this task within `timeout_ticks`, or FUTEX_BAD_ADDR if `addr` is
+// misaligned or not mapped.
+int32_t FutexWait(const uint32_t *addr, uint32_t expected,
+                  uint32_t timeout_ticks = kFutexNoTimeout);
+
+// Queue `entry` so a FutexWake() on `addr` wakes `waiter`, if `addr` still
+// holds `expected`. This lets a task wait on a futex and other things at once.
+// This returns 0, FUTEX_WOULD_BLOCK or FUTEX_BAD_ADDR, and only queues `entry`
+// if it returns 0.
+int32_t FutexAddWaiter(FutexWaiter &entry, Waiter &waiter,
+                       const uint32_t *addr, uint32_t expected);
+
+// Unqueue `entry` if FutexWake() has not already, and return whether it had.
+bool FutexRemoveWaiter(FutexWaiter &entry);
+
+// Wake up to `num` tasks waiting on `addr`, oldest first, and return how many
+// were woken or FUTEX_BAD_ADDR.
+int32_t FutexWake(const uint32_t *addr, uint32_t num);
+
+#endif
@@ -0,0 +1,102 @@
+#ifndef HANDLE_H_
+#define HANDLE_H_
+
+#include <spinlock.h>
+#include <stdint.h>
+
+// Handles are how user tasks name kernel objects. Each address space has a
+// table of the objects its tasks were given, and a handle is an index into it
+// with the entry's generation above it. Closing a handle bumps the generation,
+// so an old handle is not mistaken for a later one reusing the same entry, and
+// a value a task was never given does not resolve to anything.
+//
+// Entries refer to objects by a reference of their own kind rather than by
+// pointer, so a handle to an object that has since been destroyed is caught
+// instead of dangling. Handles are never 0, which is HANDLE_INVALID.
+
+class Task;
+
+enum HandleType : uint8_t {
+  kHandleFree,
+  kHandleTask,  // The object is a task reference from RegisterTask().
+};
+
+constexpr uint32_t kMaxHandles = 64;
+
+class HandleTable {
+ public:
+  // A table starts out empty, with one user.
+  HandleTable();
+
+  // Every task sharing the table (the threads of an address space) holds a
+  // use of it. Release() returns true once the last use is dropped, and the
+  // caller then deletes the table.
+  void Retain();
+  bool Release();
+
+  // Add an entry for `object` and return its handle, or HANDLE_INVALID if the
+  // table is full.
+  uint32_t Install(HandleType type, uint32_t object);
+
+  // Add an entry for `object` with exactly the value `handle`. This is for
+  // giving a new task a handle with the same value as its creator's, and
+  // returns false if that entry is already in use.
+  bool InstallAt(uint32_t handle, HandleType type, uint32_t object);
+
+  // Point the open `handle` at `object` instead.
+  void Set(uint32_t handle, uint32_t object);
+
+  // Get the object `handle` refers to if it is open and of `type`.
+  bool Lookup(uint32_t handle, HandleType type, uint32_t &object);
+
+  // Return a handle already open for `object`, or HANDLE_INVALID. This checks
+  // every entry, so it is only for when no handle is at hand.
+  uint32_t Find(HandleType type, uint32_t object);
+
+  // Close `handle` if it is open and of `type`, and return the object it
+  // referred to.
+  bool Remove(uint32_t handle, HandleType type, uint32_t &object);
+
+ private:
+  struct Entry {
+    uint32_t object;
+    uint32_t generation;
+    HandleType type;
+  };
+
+  // The entry `handle` names if it is open, or null.
+  Entry *Get(uint32_t handle) REQUIRES(lock_);
+
+  Spinlock lock_;
+  uint32_t users_;
+  Entry entries_[kMaxHandles] GUARDED_BY(lock_);
+};
+
+// Tasks are referred to through a slot in a global table while they exist.
+// A slot's generation changes once its task is gone, so references to it stop
+// resolving. References are never 0.
+//
+// Anything that uses a task found through its reference, like a syscall given
+// a handle, retains it for as long as it uses it. A task is only freed once it
+// is unregistered and every use of it is released.
+
+// Give `task` a slot and return its reference.
+uint32_t RegisterTask(Task &task);
+
+// Free the slot of `ref` if it still refers to a task, and return that task.
+// Only one caller gets the task, so this also decides who destroys it.
+Task *UnregisterTask(uint32_t ref);
+
+// The task `ref` refers to, or null if it is gone. A task returned is not
+// freed until ReleaseTask(ref) is called, though it can still exit.
+Task *RetainTask(uint32_t ref);
+
+// Drop a use of the task from RetainTask(ref).
+void ReleaseTask(uint32_t ref);
+
+// Block until every use of the task `ref` referred to is released. This is
+// called once the task is unregistered, before it is freed, and must be called
+// with interrupts enabled.
+void WaitForTaskUsers(uint32_t ref);
+
+#endif
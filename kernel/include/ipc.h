@@ -0,0 +1,39 @@
+#ifndef IPC_H_
+#define IPC_H_
+
+#include <stdint.h>
+#include <sys/syscall.h>
+
+class Task;
+
+// Synchronous rendezvous IPC. A client calls a server task with a few words
+// and blocks until the server replies with a few words. A server loops
+// replying to its last caller and then waiting in IPCWait() for the next call.
+// When the other side is already waiting, the CPU is handed straight
+// to it rather than going through the scheduler.
+//
+// These return the results below from sys/syscall.h.
+
+// Send `words` to `server` and wait for its reply, which replaces `words`. This
+// returns 0 once replied to, IPC_INVALID if `server` is the current task, or
+// IPC_PEER_GONE if `server` exits or is destroyed before it replies.
+int32_t IPCCall(Task &server, uint32_t words[IPC_MSG_WORDS]);
+
+// Wait for the next call to the current task. Its words replace `words` and
+// its caller is stored in `caller`. This returns 0. `handoff` is a client just
+// replied to, which is run in the current task's place if it is still ready
+// on this CPU. It is only compared against runnable tasks, so it may already
+// be gone.
+int32_t IPCWait(const Task *handoff, uint32_t words[IPC_MSG_WORDS],
+                Task *&caller);
+
+// Reply to `client` with `words` without waiting for another call. This
+// returns 0 or IPC_INVALID if `client` is not waiting for a reply from the
+// current task.
+int32_t IPCReply(const Task &client, const uint32_t words[IPC_MSG_WORDS]);
+
+// Fail every call to `task` that it has not replied to. This is called when
+// `task` is destroyed.
+void CancelIPC(const Task &task);
+
+#endif
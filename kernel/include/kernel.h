@@ -27,7 +27,8 @@ inline bool InterruptsAreEnabled() {
 
 /**
  * RAII for disabling interrupts in a scope, then re-enabling them after exiting
- * the scope only if they were already enabled at the start.
+ * the scope only if they were already enabled at the start. This only affects
+ * the current CPU. Data shared between CPUs needs a lock from spinlock.h.
  */
 class DisableInterruptsRAII {
  public:
@@ -3,11 +3,17 @@
 
 #include <allocator.h>
 #include <assert.h>
+#include <fpu.h>
+#include <handle.h>
 #include <isr.h>
 #include <kmalloc.h>
 #include <paging.h>
+#include <pipe.h>
+#include <spinlock.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <sys/taskstats.h>
+#include <waitqueue.h>
 
 #define DEFAULT_THREAD_STACK_SIZE 2048  // Use a 2kB kernel stack.
 
@@ -22,6 +28,9 @@ class Task;
 const Task *GetMainKernelTask();
 Task *GetCurrentTask();
 
+// Woken whenever any task starts exiting. Waiters check Task::Exiting().
+WaitQueue &GetTaskExitQueue();
+
 // Accept any argument and return void.
 using TaskFunc = void (*)(void *);
 
@@ -32,6 +41,35 @@ constexpr const uint32_t kUserCodeSegment = 0x1b;
 
 class KernelTask;
 class UserTask;
+struct TaskNode;
+struct SyscallRing;
+
+// Why the current task is being switched out.
+enum SwitchReason {
+  kPreempted,  // The timer interrupted it.
+  kYielding,   // It gave up the CPU but is still ready to run.
+  kBlocking,   // It is waiting until something calls Task::Wake().
+  kExiting,
+};
+
+// The scheduling classes. A CPU only runs a round-robin task when no task in
+// the deadline class is ready on it.
+enum SchedPolicy : uint8_t {
+  kSchedRoundRobin,
+  kSchedDeadline,  // Earliest deadline first. See SetDeadlineParams().
+};
+
+// The state of a task in the deadline class, all in timer ticks. Every period,
+// the task may run for `runtime` ticks, due `deadline` ticks after the period
+// starts.
+struct DeadlineState {
+  uint32_t runtime, deadline, period;
+  uint32_t bandwidth;  // runtime / deadline, in units of 2^-20 of a CPU.
+
+  uint32_t abs_deadline;  // When the runtime of this period is due.
+  uint32_t next_period;   // When a task that used up its runtime gets more.
+  uint32_t budget;        // The runtime left in this period.
+};
 
 // A task represents all the info necessary about the current context that we
 // are runnning in. This includes saved registers (when switching from another
@@ -79,6 +117,9 @@ class Task {
   X86TaskRegs &getRegs() { return regs_; }
   uint32_t getID() const { return id_; }
 
+  // This task's reference in the global task table. See handle.h.
+  uint32_t getRef() const { return ref_; }
+
   PageDirectory &getPageDirectory() const { return pd_allocation_; }
 
   // The child class should define this.
@@ -99,18 +140,80 @@ class Task {
   bool OnFirstRun() const { return state_ == READY; }
   bool Finished() const { return state_ == COMPLETED; }
 
+  // Whether this task has started exiting. It may still be switching off its
+  // CPU until Finished(), which Join() waits for.
+  bool Exiting() const { return exiting_; }
+
+  // Whether this task is running on (or still being switched out of) a CPU.
+  bool isOnCPU() const { return on_cpu_; }
+
+  // Pinned tasks only run on the CPU that created them.
+  bool isPinned() const { return pinned_; }
+
+  SchedPolicy getSchedPolicy() const { return sched_policy_; }
+
+  // Only used for tasks in the deadline class. This is only touched by the CPU
+  // with this task on its queue, or by Wake() while the task is on no queue.
+  DeadlineState &getDeadlineState() { return deadline_; }
+
+  // Make this task runnable again if it is blocked in BlockCurrentTask() or
+  // about to block after PrepareToBlock(). This can be called from any CPU,
+  // including from interrupt handlers.
+  void Wake();
+
+  // The FPU registers saved when this task was last switched out. This is null
+  // until the task first uses the FPU.
+  FPUState *getFPUState() const { return fpu_state_; }
+  void setFPUState(FPUState *state) { fpu_state_ = state; }
+
+  // Scheduler accounting for this task. These are only written by the CPU
+  // running (or switching out) this task, so other CPUs reading them may see
+  // slightly stale values.
+  struct Stats {
+    uint64_t runtime;        // TSC cycles spent running.
+    uint64_t runqueue_wait;  // TSC cycles spent ready but not running.
+    uint64_t last_switch;    // When this task last started running or waiting.
+    uint32_t ticks;
+    uint32_t voluntary_switches;
+    uint32_t involuntary_switches;
+    uint32_t syscalls;
+  };
+  const Stats &getStats() const { return stats_; }
+  void AccountSyscall() { ++stats_.syscalls; }
+  void AccountTicks(uint32_t ticks) {
+    stats_.ticks += ticks;
+    if (sched_policy_ == kSchedDeadline)
+      deadline_.budget -= ticks < deadline_.budget ? ticks : deadline_.budget;
+  }
+
   // This will be run right before the context switch into the next task.
   virtual void SetupBeforeTaskRun() {}
 
   // Copy data from a virtual address in the current task's address space to a
   // virtual address in this tasks's address space. If the current task is the
-  // same as this task, this just performs a memcpy().
-  void Write(void *this_dst, const void *current_src, size_t size);
+  // same as this task, this just performs a memcpy(). The copy can span any
+  // number of pages, but stops at the first page this task does not have
+  // mapped. This returns how many bytes were copied.
+  size_t Write(void *this_dst, const void *current_src, size_t size);
 
   // Copy data from a virtual address in this task's address space to a virtual
-  // address in the current task's address space. If the current task is the
-  // same as this task, this just performs a memcpy().
-  void Read(void *current_dst, const void *this_dst, size_t size);
+  // address in the current task's address space. This works like Write().
+  size_t Read(void *current_dst, const void *this_dst, size_t size);
+
+  // The pipe ends this task has open. See pipe.h.
+  TaskFiles &getFiles() { return files_; }
+
+  // The syscall ring this task set up, at its address in this task's address
+  // space, or null if it has none. See sys/ring.h.
+  SyscallRing *getRing() const { return ring_; }
+  void setRing(SyscallRing *ring) { ring_ = ring; }
+
+  // The handle table of this task's address space, shared by its threads.
+  // Kernel tasks have none.
+  HandleTable *getHandles() const { return handles_; }
+
+  // The handle this task has to itself in its handle table.
+  uint32_t getSelfHandle() const { return self_handle_; }
 
   // Map one page from another task's virtual address space to this task's
   // address space. Both tasks will share the same physical address.
@@ -137,24 +240,69 @@ class Task {
   void AddChildTask(Task &task);
   void RemoveChildTask(Task &task);
 
+  // These are set by the UserTask constructors and released by ~Task().
+  HandleTable *handles_;
+  uint32_t self_handle_;
+
  private:
   friend void exit_this_task();
-  friend void schedule(const X86Registers *);
+  friend void SwitchTasks(const X86Registers *, SwitchReason, const Task *);
+  friend void PrepareToBlock();
+  friend int32_t SetDeadlineParams(uint32_t, uint32_t, uint32_t);
+  friend uint32_t GetTaskStats(TaskStats *, uint32_t);
+
+  void AddToTaskList();
+  void RemoveFromTaskList();
 
   const uint32_t id_;  // Task ID.
+  const uint32_t ref_;
 
   // This is volatile so we can access it each time in Join().
   volatile TaskState state_;
 
+  // Set once the task calls exit_this_task().
+  volatile bool exiting_;
+
+  // This is set by the scheduler when a CPU picks this task and cleared by the
+  // switch code once that CPU is off this task's stack. Other CPUs will not
+  // steal the task while this is set.
+  volatile uint32_t on_cpu_;
+
+  // Whether this task is running, about to block (PrepareToBlock() was called),
+  // or blocked. Wake() moves it back to running.
+  volatile uint32_t wake_state_;
+
+  // The run queue node of a blocked task. Wake() puts it on a queue again.
+  TaskNode *blocked_node_;
+
+  // Boot tasks (the main kernel task and each AP's idle task) run on the stack
+  // their CPU booted with, so they can never move to another CPU.
+  const bool pinned_;
+
+  SchedPolicy sched_policy_;
+  DeadlineState deadline_;
+
   X86TaskRegs regs_;
+  FPUState *fpu_state_;
+  Stats stats_;
+  TaskFiles files_;
+  SyscallRing *ring_;
+  // Links in the list of all tasks, protected by TaskListLock in task.cpp.
+  Task *prev_task_;
+  Task *next_task_;
   PageDirectory &pd_allocation_;
 
   // FIXME: This is only meaningful for user tasks, not all tasks in general.
   // This should be removed.
   bool user_in_kernel_space_;
 
-  Task *parent_task_;  // This will be null for the main kernel task.
-  std::vector<Task *> child_tasks_;
+  // Set when this task gave up the CPU through Yield(). It is then resumed by
+  // returning from switch_voluntary rather than through an iret frame.
+  bool saved_voluntarily_;
+
+  Task *parent_task_;  // This will be null for boot tasks.
+  Spinlock children_lock_;
+  std::vector<Task *> child_tasks_ GUARDED_BY(children_lock_);
 };
 
 class KernelTask : public Task {
@@ -177,11 +325,12 @@ class KernelTask : public Task {
 
  private:
   friend void InitScheduler();
+  friend void InitAPScheduler();
 
-  // This is used for making the main kernel task.
+  // This is used for making the main kernel task and the AP idle tasks.
   KernelTask();
 
-  // These should be null for the main kernel task.
+  // These should be null for boot tasks.
   uint32_t *stack_allocation_;
 };
 
@@ -206,10 +355,25 @@ class UserTask : public Task {
     return arg;
   }
 
+  // The task gets a new handle table, or `handles` if that is given, which it
+  // then takes the use of.
   UserTask(TaskFunc func, size_t codesize, void *arg = nullptr,
-           CopyArgFunc copyfunc = CopyArgDefault, size_t entry_offset = 0);
+           CopyArgFunc copyfunc = CopyArgDefault, size_t entry_offset = 0,
+           HandleTable *handles = nullptr);
   ~UserTask();
 
+  // Create a thread that shares the address space of the current user task. It
+  // starts at the user address `entry` with `arg` as its only argument and
+  // runs on its own 4MB stack page, and shares the current task's handle table
+  // where it refers to itself by `self_handle`, which the caller opened for it.
+  // This returns null if there is no free virtual page left for the stack.
+  //
+  // A thread is a child of the task that created it, so it has to be joined
+  // with destroy_user_task() before that task exits. The address space is only
+  // released once every task sharing it is destroyed.
+  static UserTask *CreateThread(uint32_t entry, void *arg,
+                                uint32_t self_handle);
+
   bool isUserTask() const override { return true; }
 
   void SetupBeforeTaskRun() override;
@@ -239,12 +403,21 @@ class UserTask : public Task {
 
  protected:
   uint32_t *getStackPointerImpl() const override {
+    if (thread_stack_)
+      return reinterpret_cast<uint32_t *>(thread_stack_ + kPageSize4M);
     return reinterpret_cast<uint32_t *>(USER_SHARED_SPACE_END);
   }
 
  private:
+  UserTask(uint8_t *thread_stack, uint32_t entry, void *arg,
+           uint32_t self_handle);
+
   uint8_t *esp0_allocation_;
 
+  // The user stack page of a thread made by CreateThread(). Other user tasks
+  // start on the shared user space page instead, so this is null for them.
+  uint8_t *thread_stack_;
+
   // Used for loading external user programs.
   TaskFunc userfunc_;
   size_t usercode_size_;
@@ -254,7 +427,56 @@ class UserTask : public Task {
 void exit_this_task();
 
 void InitScheduler();
+
+// Create the idle task for the AP this is called on and start scheduling on it.
+// This is called by each AP during startup with interrupts disabled.
+void InitAPScheduler();
+
 void schedule(const X86Registers *regs);
 void DestroyScheduler();
 
+// Give up the CPU to another ready task if there is one. This returns once this
+// task is picked to run again, possibly on another CPU.
+void Yield();
+
+// Wait until another task or an interrupt handler calls Wake() on the current
+// task. To not miss a wake that races with checking what is being waited for,
+// wait like this:
+//
+//   while (true) {
+//     PrepareToBlock();
+//     if (condition) break;
+//     BlockCurrentTask();
+//   }
+//
+// BlockCurrentTask() returns right away if the task was woken since
+// PrepareToBlock(), and can also return without being woken, so the condition
+// must always be checked again. Boot tasks cannot move off their CPU, so they
+// only yield here.
+void PrepareToBlock();
+void BlockCurrentTask();
+
+// Like BlockCurrentTask(), but run `next` right away if it is ready on this
+// CPU, rather than going through the scheduling classes. This hands the CPU to
+// a task the current one just woke and is about to wait on, as in synchronous
+// IPC.
+void BlockCurrentTaskFor(const Task &next);
+
+// Move the current task into the deadline class, so it gets `runtime_ms` of
+// CPU time every `period_ms`, done within `deadline_ms` of the period starting.
+// A runtime of 0 moves it back to round robin. Times are rounded up to timer
+// ticks. This returns 0, DEADLINE_INVALID unless 0 < runtime <= deadline <=
+// period (or for boot tasks, which must always be able to run), or
+// DEADLINE_OVERLOADED if admitting the task would let deadline tasks use more
+// CPU time than can be guaranteed.
+int32_t SetDeadlineParams(uint32_t runtime_ms, uint32_t deadline_ms,
+                          uint32_t period_ms);
+
+// Charge timer ticks to whichever task is running on this CPU.
+void AccountTimerTicks(uint32_t ticks);
+
+// Write a snapshot of up to `max` tasks into `stats` and return how many tasks
+// exist, which can be more than `max`.
+uint32_t GetTaskStats(TaskStats *stats, uint32_t max);
+
 #endif
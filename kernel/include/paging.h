@@ -4,6 +4,7 @@
 #include <MathUtils.h>
 #include <bitarray.h>
 #include <panic.h>
+#include <spinlock.h>
 #include <stdint.h>
 
 #include <string>
@@ -16,6 +17,8 @@
 // [12MB  - 16MB)   Shared space with user
 // [16MB  - 20MB)   GFX_MEMORY (To be deprecated)
 // [20MB  - 24MB)   Temporary shared process memory
+// [24MB  - 28MB)   Local APIC registers
+// [28MB  - 32MB)   vDSO data, read-only for user tasks
 // [32MB  - 1GB)    KERNEL_HEAP
 // [1GB   - 4GB)    USER_START
 #define KERNEL_START 0x400000
@@ -41,6 +44,17 @@
 #define TMP_SHARED_TASK_MEM_START 0x1400000  // 20 MB
 #define TMP_SHARED_TASK_MEM_END 0x1800000    // 24 MB
 
+// The local APIC registers of every CPU are memory mapped at the same physical
+// address. The 4MB frame containing them is mapped here in every address space
+// so any CPU can acknowledge interrupts regardless of the task it's running.
+#define APIC_MMIO_START 0x1800000  // 24 MB
+#define APIC_MMIO_END 0x1C00000    // 28 MB
+
+// The clock and current task records from sys/vdso.h. This is mapped read-only
+// in every address space so user tasks can read it without a syscall.
+#define VDSO_START 0x1C00000  // 28 MB
+#define VDSO_END 0x2000000    // 32 MB
+
 #define KERN_HEAP_BEGIN 0x02000000       // 32 MB
 #define KERN_HEAP_END 0x40000000         // 1 GB
 #define USER_START UINT32_C(0x40000000)  // 1GB
@@ -51,6 +65,8 @@
 #define PG_PRESENT 0x00000001   // page directory / table
 #define PG_WRITE 0x00000002     // page is writable
 #define PG_USER 0x00000004      // page can be accessed by user (et. all)
+#define PG_WRITE_THROUGH 0x00000008  // writes are not cached
+#define PG_CACHE_DISABLE 0x00000010  // page is not cached (for MMIO)
 #define PG_4MB 0x00000080       // pages are 4MB
 
 inline bool IsKernelCode(void *addr) {
@@ -63,6 +79,12 @@ inline bool IsPageDirRegion(void *addr) {
 inline bool IsKernelHeap(void *addr) {
   return KERN_HEAP_BEGIN <= (uintptr_t)addr && (uintptr_t)addr < KERN_HEAP_END;
 }
+inline bool IsAPICRegion(void *addr) {
+  return APIC_MMIO_START <= (uintptr_t)addr && (uintptr_t)addr < APIC_MMIO_END;
+}
+inline bool IsVDSORegion(void *addr) {
+  return VDSO_START <= (uintptr_t)addr && (uintptr_t)addr < VDSO_END;
+}
 inline bool IsUserCode(void *addr) { return USER_START <= (uintptr_t)addr; }
 
 constexpr const uint32_t kPageMask4M = ~UINT32_C(0x3FFFFF);
@@ -117,19 +139,28 @@ void InitializePaging(uint32_t high_mem, bool pages_4K);
 // eventually switch to using the mmap_* fields which should be able to map
 // all memory regions
 // (https://wiki.osdev.org/Detecting_Memory_(x86)#Memory_Map_Via_GRUB).
+//
+// Each operation takes the frame lock, so the bitmap is consistent when read
+// from any CPU. Finding a free frame and then mapping it is not atomic though,
+// so use PageDirectory::AddNextFreePage() for that.
 class PhysicalBitmap4M : public toy::BitArray<kRamAs4MPages> {
  public:
   void setPageFrameUsed(size_t page_index) {
-    Ref(page_index);
+    IRQSaveLockRAII<Spinlock> lock(lock_);
+    RefLocked(page_index);
     setOne(page_index);
   }
 
   void setPageFrameFree(size_t page_index) {
-    Unref(page_index);
+    IRQSaveLockRAII<Spinlock> lock(lock_);
+    UnrefLocked(page_index);
     if (refs_[page_index] == 0) setZero(page_index);
   }
 
-  bool isPageFrameUsed(size_t page_index) const { return isSet(page_index); }
+  bool isPageFrameUsed(size_t page_index) const {
+    IRQSaveLockRAII<Spinlock> lock(lock_);
+    return isSet(page_index);
+  }
 
   /**
    * Specify the number of pages of physical memory available.
@@ -140,23 +171,30 @@ class PhysicalBitmap4M : public toy::BitArray<kRamAs4MPages> {
   }
 
   uint8_t *NextFreePhysicalPage(size_t start = 0) const {
+    IRQSaveLockRAII<Spinlock> lock(lock_);
     size_t page_4MB;
     assert(GetFirstZero(page_4MB, start) && "Memory is full!");
     return reinterpret_cast<uint8_t *>(page_4MB * kPageSize4M);
   }
 
-  void Ref(size_t page_index) { ++(refs_[page_index]); }
+  void Ref(size_t page_index) {
+    IRQSaveLockRAII<Spinlock> lock(lock_);
+    RefLocked(page_index);
+  }
 
   void Unref(size_t page_index) {
-    auto &ref = refs_[page_index];
-    assert(ref && "Attempting to unref a page that has no references");
-    --ref;
+    IRQSaveLockRAII<Spinlock> lock(lock_);
+    UnrefLocked(page_index);
   }
 
-  auto getRefs(size_t page_index) const { return refs_[page_index]; }
+  auto getRefs(size_t page_index) const {
+    IRQSaveLockRAII<Spinlock> lock(lock_);
+    return refs_[page_index];
+  }
 
   // TODO: We can move this into BitArray and rename it to `NumZeros`.
   size_t NumFreePages() const {
+    IRQSaveLockRAII<Spinlock> lock(lock_);
     size_t num = 0;
     for (size_t i = 0; i < kRamAs4MPages; ++i) {
       if (!isSet(i)) ++num;
@@ -165,6 +203,17 @@ class PhysicalBitmap4M : public toy::BitArray<kRamAs4MPages> {
   }
 
  private:
+  void RefLocked(size_t page_index) REQUIRES(lock_) { ++(refs_[page_index]); }
+
+  void UnrefLocked(size_t page_index) REQUIRES(lock_) {
+    auto &ref = refs_[page_index];
+    assert(ref && "Attempting to unref a page that has no references");
+    --ref;
+  }
+
+  // This is a leaf lock. Nothing else is taken while holding it.
+  mutable Spinlock lock_{"physical frames"};
+
   // Whenever we clone a page directory, we also duplicate references to page
   // indexes for physical memory. If we destroy a page directory that was the
   // forst to map a specific physical page, that phsyical page should be made
@@ -184,7 +233,7 @@ class PhysicalBitmap4M : public toy::BitArray<kRamAs4MPages> {
   // The number of refs we have should be the number of 4MB pages we have.
   //
   // FIXME: Should this be atomic?
-  uint16_t refs_[kRamAs4MPages];
+  uint16_t refs_[kRamAs4MPages] GUARDED_BY(lock_);
   static_assert(
       utils::ipow2<uint32_t>(sizeof(*refs_) * CHAR_BIT) >= kRamAs4MPages,
       "Expected to fit at least one reference for each possible 4MB page.");
@@ -201,10 +250,42 @@ class PageDirectory {
   // allow_physical_reuse: If false, this function will only allow a mapping if
   //   both the virtual and physical pages are unmapped. If true, this allows
   //   an existing mapped physical page to be mapped to a new virtual page.
+  //
+  // writable: If false, the page is mapped read-only. This only restricts user
+  //   tasks since the kernel does not set CR0.WP.
   void AddPage(void *v_addr, const void *p_addr, uint8_t flags,
-               bool allow_physical_reuse = false);
+               bool allow_physical_reuse = false, bool writable = true);
 
   void RemovePage(void *vaddr);
+
+  // Map `v_addr` to the first free physical page at or after page index
+  // `start` and return that physical address. Unlike calling
+  // NextFreePhysicalPage() then AddPage(), no other CPU can take the same
+  // physical page in between.
+  void *AddNextFreePage(void *v_addr, uint8_t flags, size_t start = 0,
+                        bool writable = true);
+
+  // Map the first unmapped page in the user memory region to the first free
+  // physical page at or after page index `start` and return the virtual
+  // address, or null if the user region is full. Tasks sharing this page
+  // directory cannot pick the same virtual page in between.
+  void *AddNextFreeUserPage(uint8_t flags, size_t start = 0);
+
+  // Like AddNextFreeUserPage(), but map the already allocated physical page
+  // `p_addr`, which gains a reference.
+  void *MapNextFreeUserPage(const void *p_addr, uint8_t flags);
+
+  // Map `num` consecutive user pages from `v_addr` to free physical pages, or
+  // the first run of that many unmapped user pages if `v_addr` is null. This
+  // returns the virtual address, or null if the pages are not all unmapped or
+  // there is not enough free physical memory.
+  void *AddUserPages(void *v_addr, size_t num, uint8_t flags);
+
+  // Like AddUserPages(), but map the already allocated physical pages in
+  // `p_addrs`, which each gain a reference.
+  void *MapUserPages(void *v_addr, const void *const *p_addrs, size_t num,
+                     uint8_t flags);
+
   void *GetPhysicalAddr(const void *vaddr) const;
 
   void Clear() { memset(pd_impl_, 0, sizeof(pd_impl_)); }
@@ -215,10 +296,22 @@ class PageDirectory {
   static bool isPhysicalFree(uint32_t page_index);
   bool isVirtualMapped(void *v_addr) const;
 
+  // Whether the page holding `v_addr` is mapped and user tasks can access it.
+  bool isUserMapped(void *v_addr) const;
+
   // Get the next virtual address available in the user memory region.
   void *GetNextFreeVirtualUser() const;
 
  private:
+  // Check that the `num` pages from `v_addr` are unmapped user pages, or find
+  // the first such run if `v_addr` is null. This returns the start of the run,
+  // or null. The page directory lock must be held.
+  void *FindFreeUserRange(void *v_addr, size_t num) const;
+
+  // AddPage() with the page directory lock already held.
+  void AddPageLocked(void *v_addr, const void *p_addr, uint8_t flags,
+                     bool allow_physical_reuse, bool writable = true);
+
   alignas(kPageDirAlignment) uint32_t pd_impl_[kNumPageDirEntries];
 };
 
@@ -228,6 +321,25 @@ static_assert(alignof(PageDirectory) == kPageDirAlignment,
               "The page directory must be 4KB aligned");
 
 PageDirectory &GetKernelPageDirectory();
+
+// Get a page directory for a new address space. This is equivalent to cloning
+// the kernel page directory, but reuses one returned through
+// ReleaseUserPageDirectory() if there is one, which skips copying and
+// refcounting every kernel mapping.
+PageDirectory *AcquireUserPageDirectory();
+
+// Add another task sharing `pd`, such as a new thread of the same program. Each
+// call must be paired with a ReleaseUserPageDirectory().
+void RetainUserPageDirectory(PageDirectory &pd);
+
+// Drop one task's reference to `pd`. Once the last task sharing it releases
+// it, unmap everything mapped into `pd` and keep it for the next
+// AcquireUserPageDirectory(). If the pool is full, the page directory region is
+// reclaimed like ReclaimPageDirRegion().
+void ReleaseUserPageDirectory(PageDirectory &pd);
+
+// Reclaim every pooled page directory.
+void DrainPageDirectoryPool();
 PhysicalBitmap4M &GetPhysicalBitmap4M();
 void SwitchPageDirectory(PageDirectory &pd);
 
@@ -0,0 +1,67 @@
+#ifndef PIPE_H_
+#define PIPE_H_
+
+#include <stdint.h>
+#include <waitqueue.h>
+
+// Anonymous pipes. A pipe is a byte buffer with a read end and a write end.
+// Tasks refer to the ends they have open by file descriptor. Descriptors 0 and
+// 1 are the task's stdin and stdout, which read from and write to serial while
+// they are not open, so tasks that never touch pipes keep using the console.
+//
+// These return the results below from sys/syscall.h.
+
+struct Pipe;
+
+constexpr uint32_t kMaxTaskFiles = 8;
+
+// The pipe ends a task has open, indexed by descriptor. This is only touched by
+// the task it belongs to, or by the task creating it before it is queued.
+struct TaskFiles {
+  struct File {
+    Pipe *pipe;  // Null if the descriptor is not open.
+    bool write_end;
+  };
+  File files[kMaxTaskFiles];
+
+  // The descriptors of this task that tasks it creates get as stdin and
+  // stdout. See SetSpawnStdio().
+  uint32_t spawn_stdin, spawn_stdout;
+};
+
+// Set up the files of a new task. It gets `parent`'s spawn stdin and stdout as
+// its stdin and stdout, if they are open. Boot tasks have no parent.
+void InitTaskFiles(TaskFiles &files, TaskFiles *parent);
+
+// Close every descriptor in `files`.
+void CloseTaskFiles(TaskFiles &files);
+
+// Create a pipe and open its read and write ends in the current task at
+// `fds[0]` and `fds[1]`. This returns 0 or PIPE_NO_SPACE.
+int32_t CreatePipe(uint32_t fds[2]);
+
+// Read up to `size` bytes from `fd`, waiting until at least one is available.
+// This returns how many bytes were read, 0 once the pipe is empty and every
+// write end is closed, or FD_INVALID.
+int32_t ReadFile(uint32_t fd, void *buf, uint32_t size);
+
+// Write all `size` bytes to `fd`, waiting whenever the pipe is full. This
+// returns `size`, or PIPE_BROKEN if every read end is closed before all of it
+// was written, or FD_INVALID.
+int32_t WriteFile(uint32_t fd, const void *buf, uint32_t size);
+
+// This returns 0 or FD_INVALID.
+int32_t CloseFile(uint32_t fd);
+
+// Return which of POLL_HUP and the POLL_IN and POLL_OUT bits in `events` (see
+// sys/poll.h) are ready for `fd`, or FD_INVALID. If none are and `entry` is not
+// null, link it so `waiter` is woken once that may have changed.
+int32_t PollFile(uint32_t fd, uint32_t events, WaitQueue::Entry *entry,
+                 Waiter &waiter);
+
+// Choose which of the current task's descriptors tasks it creates from now on
+// get as their stdin and stdout. `in` must be 0 or a read end and `out` must
+// be 1 or a write end. This returns 0 or FD_INVALID.
+int32_t SetSpawnStdio(uint32_t in, uint32_t out);
+
+#endif
@@ -7,6 +7,10 @@ namespace serial {
 // https://wiki.osdev.org/Serial_Ports#Initialization
 void Initialize();
 
+// Raise IRQ4 whenever a character is received. Reading every received
+// character clears the interrupt.
+void EnableReceiveInterrupt();
+
 // Attempt to read a character from serial. If we were successfully able to read
 // a character, return true and store the character in `c`.
 bool TryRead(char &c);
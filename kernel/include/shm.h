@@ -0,0 +1,24 @@
+#ifndef SHM_H_
+#define SHM_H_
+
+#include <stdint.h>
+
+// Named shared memory objects. An object is created with a name and a size in
+// bytes, and any task can map it by name. The physical pages are refcounted,
+// so an object is freed once no task has any of it mapped, however long the
+// task that created it lives.
+//
+// These return the results below from sys/syscall.h.
+
+// Create an object called `name` of `size` bytes and map it in the current
+// task at `*addr`, or at the first free range if `*addr` is null. The address
+// it is mapped at is stored in `*addr`. This returns 0, SHM_INVALID,
+// SHM_EXISTS or SHM_NO_SPACE.
+int32_t CreateShm(const char *name, uint32_t size, void **addr);
+
+// Map the object called `name` in the current task like CreateShm() and store
+// its size in `*size`. This returns 0, SHM_INVALID, SHM_NOT_FOUND or
+// SHM_NO_SPACE.
+int32_t MapShm(const char *name, void **addr, uint32_t *size);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef SMP_H_
+#define SMP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The maximum number of CPUs we will bring up. Any extra CPUs reported by the
+// firmware are left halted.
+constexpr size_t kMaxCPUs = 8;
+
+// Find the other CPUs through the ACPI MADT (or the MP tables if there is no
+// ACPI), then start each application processor (AP) with INIT-SIPI-SIPI. Each
+// AP loads its own GDT/TSS, starts its local APIC timer, and begins pulling
+// tasks from its own run queue. This must be called after the scheduler is
+// initialized.
+void InitSMP();
+
+// Park all APs so the kernel can be torn down from the BSP.
+void StopAPs();
+
+// The number of CPUs that are running, including the BSP.
+size_t GetNumCPUs();
+
+// The index of the CPU this is called on in [0, GetNumCPUs()). The BSP is
+// always 0. The result can be stale if the caller can be preempted and moved to
+// another CPU, so interrupts should be disabled if this matters.
+size_t GetCPUIndex();
+
+#endif
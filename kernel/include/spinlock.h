@@ -0,0 +1,183 @@
+#ifndef SPINLOCK_H_
+#define SPINLOCK_H_
+
+#include <kernel.h>
+#include <stdint.h>
+
+// Clang thread safety annotations. These let -Wthread-safety check that data
+// marked GUARDED_BY() is only touched with its lock held.
+// https://clang.llvm.org/docs/ThreadSafetyAnalysis.html
+#ifdef __clang__
+#define THREAD_ANNOTATION(x) __attribute__((x))
+#else
+#define THREAD_ANNOTATION(x)
+#endif
+
+#define CAPABILITY(x) THREAD_ANNOTATION(capability(x))
+#define SCOPED_CAPABILITY THREAD_ANNOTATION(scoped_lockable)
+#define GUARDED_BY(x) THREAD_ANNOTATION(guarded_by(x))
+#define PT_GUARDED_BY(x) THREAD_ANNOTATION(pt_guarded_by(x))
+#define REQUIRES(...) THREAD_ANNOTATION(requires_capability(__VA_ARGS__))
+#define EXCLUDES(...) THREAD_ANNOTATION(locks_excluded(__VA_ARGS__))
+#define ACQUIRE(...) THREAD_ANNOTATION(acquire_capability(__VA_ARGS__))
+#define RELEASE(...) THREAD_ANNOTATION(release_capability(__VA_ARGS__))
+#define TRY_ACQUIRE(...) THREAD_ANNOTATION(try_acquire_capability(__VA_ARGS__))
+#define NO_THREAD_SAFETY_ANALYSIS THREAD_ANNOTATION(no_thread_safety_analysis)
+
+inline uint64_t ReadTimestampCounter() {
+  uint32_t low, high;
+  asm volatile("rdtsc" : "=a"(low), "=d"(high));
+  return (static_cast<uint64_t>(high) << 32) | low;
+}
+
+// Counters kept by every lock for finding contended or long held locks. Named
+// locks add themselves to a global list the first time they are taken so
+// DumpLockStats() can print them.
+struct LockStats {
+  const char *name = nullptr;
+  uint32_t acquisitions = 0;
+  uint32_t contentions = 0;  // Acquisitions that had to spin.
+  uint64_t total_hold_cycles = 0;
+  uint64_t max_hold_cycles = 0;
+  uint64_t acquired_at = 0;  // Timestamp of the current holder's acquisition.
+  bool registered = false;
+
+  void OnAcquire(bool contended) {
+    acquired_at = ReadTimestampCounter();
+    ++acquisitions;
+    if (contended) ++contentions;
+    if (name && !registered) Register();
+  }
+
+  void OnRelease() {
+    uint64_t held = ReadTimestampCounter() - acquired_at;
+    total_hold_cycles += held;
+    if (held > max_hold_cycles) max_hold_cycles = held;
+  }
+
+ private:
+  void Register();
+};
+
+// Print the stats for every named lock taken so far.
+void DumpLockStats();
+
+// A test-and-test-and-set lock for short critical sections. This does not
+// touch the interrupt flag, so callers that can also be entered from an
+// interrupt handler on the same CPU must disable interrupts before taking it
+// (see IRQSaveLockRAII).
+class CAPABILITY("mutex") Spinlock {
+ public:
+  constexpr Spinlock(const char *name = nullptr) : stats_{name} {}
+
+  void Lock() ACQUIRE() {
+    bool contended = false;
+    while (__atomic_exchange_n(&locked_, 1, __ATOMIC_ACQUIRE)) {
+      contended = true;
+      while (__atomic_load_n(&locked_, __ATOMIC_RELAXED)) asm volatile("pause");
+    }
+    stats_.OnAcquire(contended);
+  }
+
+  bool TryLock() TRY_ACQUIRE(true) {
+    if (__atomic_load_n(&locked_, __ATOMIC_RELAXED) ||
+        __atomic_exchange_n(&locked_, 1, __ATOMIC_ACQUIRE))
+      return false;
+    stats_.OnAcquire(/*contended=*/false);
+    return true;
+  }
+
+  void Unlock() RELEASE() {
+    stats_.OnRelease();
+    __atomic_store_n(&locked_, 0, __ATOMIC_RELEASE);
+  }
+
+  bool isLocked() const { return __atomic_load_n(&locked_, __ATOMIC_RELAXED); }
+  const LockStats &getStats() const { return stats_; }
+
+ private:
+  uint32_t locked_ = 0;
+  LockStats stats_;
+};
+
+// A FIFO spinlock. Each CPU takes a ticket and waits for it to be served, so
+// a CPU cannot be starved by others that keep retaking the lock. Prefer this
+// for locks that are hot across CPUs.
+class CAPABILITY("mutex") TicketLock {
+ public:
+  constexpr TicketLock(const char *name = nullptr) : stats_{name} {}
+
+  void Lock() ACQUIRE() {
+    uint32_t ticket = __atomic_fetch_add(&next_, 1, __ATOMIC_RELAXED);
+    bool contended = false;
+    while (__atomic_load_n(&serving_, __ATOMIC_ACQUIRE) != ticket) {
+      contended = true;
+      asm volatile("pause");
+    }
+    stats_.OnAcquire(contended);
+  }
+
+  bool TryLock() TRY_ACQUIRE(true) {
+    uint32_t ticket = __atomic_load_n(&serving_, __ATOMIC_RELAXED);
+    uint32_t expected = ticket;
+    if (!__atomic_compare_exchange_n(&next_, &expected, ticket + 1,
+                                     /*weak=*/false, __ATOMIC_ACQUIRE,
+                                     __ATOMIC_RELAXED))
+      return false;
+    stats_.OnAcquire(/*contended=*/false);
+    return true;
+  }
+
+  void Unlock() RELEASE() {
+    stats_.OnRelease();
+    // Only the holder writes `serving_`, so this does not need an atomic
+    // increment.
+    __atomic_store_n(&serving_, serving_ + 1, __ATOMIC_RELEASE);
+  }
+
+  bool isLocked() const {
+    return __atomic_load_n(&next_, __ATOMIC_RELAXED) !=
+           __atomic_load_n(&serving_, __ATOMIC_RELAXED);
+  }
+  const LockStats &getStats() const { return stats_; }
+
+ private:
+  uint32_t next_ = 0;
+  uint32_t serving_ = 0;
+  LockStats stats_;
+};
+
+// Hold a lock for the duration of a scope.
+template <typename LockTy>
+class SCOPED_CAPABILITY LockRAII {
+ public:
+  LockRAII(LockTy &lock) ACQUIRE(lock) : lock_(lock) { lock_.Lock(); }
+  ~LockRAII() RELEASE() { lock_.Unlock(); }
+
+ private:
+  LockTy &lock_;
+};
+
+// Disable interrupts on this CPU, then hold a lock for the duration of a scope.
+// Interrupts are re-enabled after unlocking only if they were enabled at the
+// start. Use this for any lock that can also be taken from an interrupt
+// handler, or one CPU could deadlock against itself.
+template <typename LockTy>
+class SCOPED_CAPABILITY IRQSaveLockRAII {
+ public:
+  IRQSaveLockRAII(LockTy &lock) ACQUIRE(lock)
+      : lock_(lock), interrupts_enabled_(InterruptsAreEnabled()) {
+    DisableInterrupts();
+    lock_.Lock();
+  }
+  ~IRQSaveLockRAII() RELEASE() {
+    lock_.Unlock();
+    if (interrupts_enabled_) EnableInterrupts();
+  }
+
+ private:
+  LockTy &lock_;
+  bool interrupts_enabled_;
+};
+
+#endif
@@ -1,6 +1,14 @@
 #ifndef SYSCALL_H_
 #define SYSCALL_H_
 
+// Set up int 0x80 and, if the CPU supports it, the SYSENTER fast path on the
+// boot CPU.
 void InitializeSyscalls();
 
+// Set up the SYSENTER fast path on the AP this is called on.
+void InitAPSyscalls();
+
+// Print how many times each syscall was made.
+void DumpSyscallStats();
+
 #endif
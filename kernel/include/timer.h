@@ -3,6 +3,52 @@
 
 #include <stdint.h>
 
+// Ensure a task runs for at least this many ticks before switching.
+constexpr uint32_t kQuanta = 2;
+
 void InitTimer(uint32_t frequency);
 
+// The number of PIT ticks since the timer was initialized.
+uint32_t GetTicks();
+
+// Whether the tick count has reached `tick`. This handles the count wrapping
+// around as long as `tick` is within 2^31 ticks of it.
+inline bool TickReached(uint32_t tick) {
+  return static_cast<int32_t>(GetTicks() - tick) >= 0;
+}
+
+// Convert between milliseconds and PIT ticks. Milliseconds round up to whole
+// ticks.
+uint32_t MsToTicks(uint32_t ms);
+uint32_t TicksToMs(uint32_t ticks);
+
+// Runs `callback(arg)` from the timer interrupt once the tick count reaches
+// `expires`. Callbacks run with the timer lock held and interrupts disabled,
+// so they should only do something short like waking a task.
+//
+// Pending timers are kept in a hierarchical timer wheel, so adding, cancelling
+// and expiring a timer take constant time however many are pending.
+struct Timer {
+  using Callback = void (*)(void *arg);
+
+  Callback callback;
+  void *arg;
+  uint32_t expires;
+
+  // The wheel slot this is linked into while pending, or null.
+  Timer **slot;
+  Timer *prev, *next;
+};
+
+// Start `timer`, which must not already be pending. Its callback, arg and
+// expiry must be set.
+void AddTimer(Timer &timer);
+
+// Stop `timer` if it is still pending and return whether it was. Once this
+// returns, the callback is not running and will not run.
+bool CancelTimer(Timer &timer);
+
+// Block the current task until the tick count reaches `tick`.
+void SleepUntil(uint32_t tick);
+
 #endif
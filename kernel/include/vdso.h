@@ -0,0 +1,20 @@
+#ifndef VDSO_H_
+#define VDSO_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+class Task;
+
+// Map the page holding the VDSOData from sys/vdso.h into every address space.
+// This must be called after paging is initialized and before the timer starts.
+void InitVDSO();
+
+// Publish the new tick count. This is only called by the timer interrupt.
+void UpdateVDSOClock(uint32_t ticks, uint32_t ticks_per_second);
+
+// Publish the task that `cpu` is about to run. This is only called by `cpu`
+// with interrupts disabled.
+void SetVDSOCurrentTask(size_t cpu, const Task &task);
+
+#endif
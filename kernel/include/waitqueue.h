@@ -0,0 +1,62 @@
+#ifndef WAITQUEUE_H_
+#define WAITQUEUE_H_
+
+#include <spinlock.h>
+#include <stdint.h>
+
+class Task;
+
+constexpr uint32_t kWaitNoTimeout = UINT32_MAX;
+
+// A task waiting for something to happen. A task can wait for any of several
+// things at once by linking an entry for each into the wait queue of that
+// thing, all pointing at the same waiter. This lives on the waiting task's
+// stack.
+struct Waiter {
+  Task *task;
+  bool woken;
+};
+
+// Mark `waiter` as woken and wake its task. This can be called from interrupt
+// handlers.
+void WakeWaiter(Waiter &waiter);
+
+// Block until `waiter` is woken or `timeout_ticks` pass, and return whether it
+// was woken. The waiter must be unlinked from everything that can wake it
+// before its task is done with it.
+bool WaitUntilWoken(Waiter &waiter, uint32_t timeout_ticks = kWaitNoTimeout);
+
+// Tasks waiting for the state of something to change, such as a pipe getting
+// data. Whatever changes the state wakes every waiter with WakeAll(), and each
+// checks again whether it can go on. Waiters stay linked until they remove
+// themselves, so a waiter can always tell which queues it is still on.
+//
+// Wakers call WakeAll() after changing the state, and waiters link themselves
+// before checking it, so a change cannot be missed between the check and the
+// wait.
+class WaitQueue {
+ public:
+  struct Entry {
+    Waiter *waiter;
+    WaitQueue *queue;  // Null while not linked.
+    Entry *prev, *next;
+  };
+
+  // Link `entry` so WakeAll() wakes `waiter`.
+  void Add(Entry &entry, Waiter &waiter);
+
+  // Wake every linked waiter.
+  void WakeAll();
+
+ private:
+  friend void RemoveWait(Entry &entry);
+
+  Spinlock lock_;
+  Entry *head_ GUARDED_BY(lock_);
+};
+
+// Unlink `entry` from the queue it was added to, if any. Once this returns,
+// that queue is done waking its waiter.
+void RemoveWait(WaitQueue::Entry &entry);
+
+#endif
@@ -0,0 +1,200 @@
+#include <assert.h>
+#include <ipc.h>
+#include <ktask.h>
+#include <spinlock.h>
+#include <string.h>
+
+namespace {
+
+// A call from a client to a server. This lives on the client's stack and is
+// linked into the server's bucket until the server replies to it.
+struct IPCCallRecord {
+  Task *client;
+  const Task *server;
+  uint32_t words[IPC_MSG_WORDS];
+  int32_t result;
+  bool received;  // The server took the words and owes a reply.
+  bool done;      // The server replied or is gone.
+  IPCCallRecord *next;
+};
+
+// A server waiting for a call. This lives on the server's stack and is linked
+// into its bucket until a client hands it a call.
+struct IPCReceiver {
+  const Task *server;
+  IPCCallRecord *call;
+  IPCReceiver *next;
+};
+
+// This must be a power of 2 so servers can be masked into a bucket.
+constexpr uint32_t kNumIPCBuckets = 64;
+static_assert((kNumIPCBuckets & (kNumIPCBuckets - 1)) == 0);
+
+// Calls and receivers are hashed by server so unrelated servers rarely share a
+// lock. Each bucket keeps its calls oldest first.
+struct IPCBucket {
+  Spinlock lock;
+  IPCCallRecord *head GUARDED_BY(lock);
+  IPCCallRecord *tail GUARDED_BY(lock);
+  IPCReceiver *receivers GUARDED_BY(lock);
+};
+
+IPCBucket IPCBuckets[kNumIPCBuckets];
+
+IPCBucket &GetIPCBucket(const Task &server) {
+  // Fibonacci hashing. Tasks are heap allocated, so the low bits are 0.
+  auto key = reinterpret_cast<uintptr_t>(&server);
+  uint32_t hash = static_cast<uint32_t>(key >> 4) * UINT32_C(0x9E3779B9);
+  return IPCBuckets[hash >> (32 - __builtin_ctz(kNumIPCBuckets))];
+}
+
+void Unlink(IPCBucket &bucket, IPCCallRecord *call) REQUIRES(bucket.lock) {
+  IPCCallRecord *prev = nullptr;
+  for (IPCCallRecord *c = bucket.head; c != call; c = c->next) prev = c;
+  if (prev)
+    prev->next = call->next;
+  else
+    bucket.head = call->next;
+  if (bucket.tail == call) bucket.tail = prev;
+}
+
+// Mark `call` done and wake its client. The client takes the bucket lock before
+// returning, so `call` stays valid while this is locked.
+void FinishCall(IPCBucket &bucket, IPCCallRecord *call, int32_t result)
+    REQUIRES(bucket.lock) {
+  Unlink(bucket, call);
+  call->result = result;
+  __atomic_store_n(&call->done, true, __ATOMIC_RELEASE);
+  call->client->Wake();
+}
+
+// Reply to `client` if it is waiting for a reply from `server`.
+int32_t Reply(IPCBucket &bucket, const Task *server, const Task *client,
+              const uint32_t words[IPC_MSG_WORDS]) REQUIRES(bucket.lock) {
+  IPCCallRecord *call = bucket.head;
+  while (call &&
+         !(call->server == server && call->client == client && call->received))
+    call = call->next;
+  if (!call) return IPC_INVALID;
+  memcpy(call->words, words, sizeof(call->words));
+  FinishCall(bucket, call, /*result=*/0);
+  return 0;
+}
+
+}  // namespace
+
+int32_t IPCCall(Task &server, uint32_t words[IPC_MSG_WORDS]) {
+  Task *self = GetCurrentTask();
+  if (&server == self) return IPC_INVALID;
+
+  IPCCallRecord call = {};
+  call.client = self;
+  call.server = &server;
+  memcpy(call.words, words, sizeof(call.words));
+
+  IPCBucket &bucket = GetIPCBucket(server);
+  bool handoff = false;
+  {
+    IRQSaveLockRAII<Spinlock> lock(bucket.lock);
+
+    // CancelIPC() runs only after the server exits, so a call queued after
+    // that would never finish.
+    if (server.Exiting()) return IPC_PEER_GONE;
+
+    if (bucket.tail)
+      bucket.tail->next = &call;
+    else
+      bucket.head = &call;
+    bucket.tail = &call;
+
+    // If the server is waiting, give it this call directly.
+    IPCReceiver *prev = nullptr;
+    for (IPCReceiver *r = bucket.receivers; r; prev = r, r = r->next) {
+      if (r->server != &server) continue;
+      if (prev)
+        prev->next = r->next;
+      else
+        bucket.receivers = r->next;
+      call.received = true;
+      __atomic_store_n(&r->call, &call, __ATOMIC_RELEASE);
+      server.Wake();
+      handoff = true;
+      break;
+    }
+  }
+
+  while (true) {
+    PrepareToBlock();
+    if (__atomic_load_n(&call.done, __ATOMIC_ACQUIRE)) break;
+    if (handoff) {
+      // The server was just woken on this CPU, so run it in this task's place.
+      BlockCurrentTaskFor(server);
+      handoff = false;
+    } else {
+      BlockCurrentTask();
+    }
+  }
+
+  // Wait for FinishCall() to be done with `call`.
+  IRQSaveLockRAII<Spinlock> lock(bucket.lock);
+  memcpy(words, call.words, sizeof(call.words));
+  return call.result;
+}
+
+int32_t IPCWait(const Task *handoff, uint32_t words[IPC_MSG_WORDS],
+                Task *&caller) {
+  Task *self = GetCurrentTask();
+  IPCBucket &bucket = GetIPCBucket(*self);
+  IPCReceiver receiver = {self, /*call=*/nullptr, /*next=*/nullptr};
+  {
+    IRQSaveLockRAII<Spinlock> lock(bucket.lock);
+
+    // Take the oldest call that is already waiting without blocking.
+    for (IPCCallRecord *call = bucket.head; call; call = call->next) {
+      if (call->server != self || call->received) continue;
+      call->received = true;
+      memcpy(words, call->words, sizeof(call->words));
+      caller = call->client;
+      return 0;
+    }
+
+    receiver.next = bucket.receivers;
+    bucket.receivers = &receiver;
+  }
+
+  while (true) {
+    PrepareToBlock();
+    if (__atomic_load_n(&receiver.call, __ATOMIC_ACQUIRE)) break;
+    if (handoff) {
+      // The client was just woken on this CPU, so run it in this task's place.
+      BlockCurrentTaskFor(*handoff);
+      handoff = nullptr;
+    } else {
+      BlockCurrentTask();
+    }
+  }
+
+  // The client stays blocked until this replies, so its call stays valid.
+  IRQSaveLockRAII<Spinlock> lock(bucket.lock);
+  memcpy(words, receiver.call->words, sizeof(receiver.call->words));
+  caller = receiver.call->client;
+  return 0;
+}
+
+int32_t IPCReply(const Task &client, const uint32_t words[IPC_MSG_WORDS]) {
+  Task *self = GetCurrentTask();
+  IPCBucket &bucket = GetIPCBucket(*self);
+  IRQSaveLockRAII<Spinlock> lock(bucket.lock);
+  return Reply(bucket, self, &client, words);
+}
+
+void CancelIPC(const Task &task) {
+  IPCBucket &bucket = GetIPCBucket(task);
+  IRQSaveLockRAII<Spinlock> lock(bucket.lock);
+  IPCCallRecord *call = bucket.head;
+  while (call) {
+    IPCCallRecord *next = call->next;
+    if (call->server == &task) FinishCall(bucket, call, IPC_PEER_GONE);
+    call = next;
+  }
+}
@@ -1,16 +1,22 @@
 #include <assert.h>
+#include <deferred.h>
 #include <descriptortables.h>
+#include <fpu.h>
 #include <io.h>
 #include <kernel.h>
 #include <kmalloc.h>
 #include <ktask.h>
+#include <console.h>
 #include <ktests.h>
 #include <multiboot.h>
 #include <paging.h>
 #include <panic.h>
 #include <serial.h>
+#include <smp.h>
+#include <spinlock.h>
 #include <syscall.h>
 #include <timer.h>
+#include <vdso.h>
 
 using print::Hex;
 
@@ -68,12 +74,22 @@ void KernelSetup(const Multiboot *multiboot, size_t *num_mods,
   DebugPrint("Paging initialized.\n");
   InitializeKernelHeap();
   DebugPrint("Heap initialized.\n");
+  InitVDSO();
+  DebugPrint("vDSO initialized.\n");
   InitTimer(50);
   DebugPrint("Timer initialized.\n");
   InitScheduler();
   DebugPrint("Scheduler initialized.\n");
+  InitFPU();
+  DebugPrint("FPU initialized.\n");
   InitializeSyscalls();
   DebugPrint("Syscalls initialized.\n");
+  InitSMP();
+  DebugPrint("SMP initialized.\n");
+  InitDeferredWork();
+  DebugPrint("Deferred work initialized.\n");
+  InitConsoleInput();
+  DebugPrint("Console input initialized.\n");
 
   if (*num_mods) {
     // NOTE: After we initialize paging, we may not be able to access all data
@@ -139,7 +155,10 @@ void KernelJumpToUserEntry(uint8_t *vfs_data, size_t vfs_data_size) {
 }
 
 void KernelEnd() {
+  StopDeferredWork();
   DestroyScheduler();
+  DumpLockStats();
+  DumpSyscallStats();
 
   // Make sure all allocated memory was freed.
   DebugPrint("Kernel memory still in use: {} B\n", GetKernelHeapUsed());
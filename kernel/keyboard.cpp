@@ -3,6 +3,7 @@
  */
 
 #include <assert.h>
+#include <deferred.h>
 #include <io.h>
 #include <isr.h>
 #include <kernel.h>
@@ -103,6 +104,20 @@ char ShiftedKey(char pressed_key) {
   return pressed_key;
 }
 
+// Echoing can busy-wait on the serial port, so it is done outside the handler.
+void EchoKey(uint32_t c) { serial::AtomicPut(static_cast<char>(c)); }
+
+void WarnUnmappedScancode(uint32_t scancode) {
+  DebugPrint(
+      "WARNING: Found an unmapped scancode that doesn't have an ascii "
+      "character: {}\n",
+      print::Hex(scancode));
+}
+
+void WarnUnhandledScancode(uint32_t scancode) {
+  DebugPrint("WARNING: Unhandled scancode {}\n", print::Hex(scancode));
+}
+
 void KeyboardCallback([[maybe_unused]] X86Registers *regs) {
   uint8_t scancode = Read8(0x60);
 
@@ -111,7 +126,7 @@ void KeyboardCallback([[maybe_unused]] X86Registers *regs) {
     // Key was pressed.
     switch (scancode) {
       case ENTER:
-        serial::AtomicPut('\n');
+        DeferWork(EchoKey, '\n');
         PreviousAction = NOACTION;
         return;
       case LCTRL:
@@ -123,13 +138,12 @@ void KeyboardCallback([[maybe_unused]] X86Registers *regs) {
     }
 
     char pressed_key = kKeyPresses[scancode];
-    if (pressed_key == NOCHAR[0])
+    if (pressed_key == NOCHAR[0]) {
       // TODO: Once we actually implement mappings for all scancodes, this
       // should be replaced with an assert.
-      return DebugPrint(
-          "WARNING: Found an unmapped scancode that doesn't have an ascii "
-          "character: {}\n",
-          print::Hex(scancode));
+      DeferWork(WarnUnmappedScancode, scancode);
+      return;
+    }
 
     switch (PreviousAction) {
       case NOACTION:
@@ -145,7 +159,8 @@ void KeyboardCallback([[maybe_unused]] X86Registers *regs) {
     }
     PreviousAction = NOACTION;
 
-    return serial::AtomicPut(pressed_key);
+    DeferWork(EchoKey, static_cast<uint8_t>(pressed_key));
+    return;
   } else if (scancode < 0xE0) {
     // Key was released.
     return;
@@ -153,7 +168,7 @@ void KeyboardCallback([[maybe_unused]] X86Registers *regs) {
 
   // TODO: Once we actually implement mappings for all scancodes, this
   // should be replaced with an assert.
-  DebugPrint("WARNING: Unhandled scancode {}\n", print::Hex(scancode));
+  DeferWork(WarnUnhandledScancode, scancode);
 }
 
 }  // namespace
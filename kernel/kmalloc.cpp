@@ -3,6 +3,7 @@
 #include <kmalloc.h>
 #include <paging.h>
 #include <panic.h>
+#include <spinlock.h>
 
 namespace {
 
@@ -19,11 +20,10 @@ void *ksbrk_page(size_t n, void *heap) {
     // that multiboot inserted in the first 4MB page. Starting from 0 here could
     // lead to overwriting that multiboot data. We should probably copy that
     // data somewhere else after paging is enabled.
-    uint8_t *p_addr = GetPhysicalBitmap4M().NextFreePhysicalPage(/*start=*/1);
+    void *p_addr = GetKernelPageDirectory().AddNextFreePage(
+        heap_bytes, /*flags=*/0, /*start=*/1);
     assert(p_addr && "No free page frames available!");
 
-    GetKernelPageDirectory().AddPage(heap_bytes, p_addr, /*flags=*/0);
-
     heap_bytes += kPageSize4M;
   }
 
@@ -42,37 +42,44 @@ void *ksbrk(size_t bytes, void *heap) {
   return ksbrk_page(bytes / kPageSize4M + 1, heap);
 }
 
-utils::Allocator KernelAllocator;
+// Allocations can happen in interrupt handlers (such as the scheduler), so this
+// is always taken with interrupts disabled.
+TicketLock KernelHeapLock("kernel heap");
+utils::Allocator KernelAllocator GUARDED_BY(KernelHeapLock);
 
 }  // namespace
 
 void InitializeKernelHeap() {
+  IRQSaveLockRAII<TicketLock> lock(KernelHeapLock);
   KernelAllocator.Init((void *)KERN_HEAP_BEGIN, ksbrk, (void *)KERN_HEAP_END);
 }
 
 void *kmalloc(size_t size) {
-  DisableInterruptsRAII disable_interrupts_raii;
+  IRQSaveLockRAII<TicketLock> lock(KernelHeapLock);
   return KernelAllocator.Malloc(size);
 }
 
 void *kmalloc(size_t size, uint32_t alignment) {
-  DisableInterruptsRAII disable_interrupts_raii;
+  IRQSaveLockRAII<TicketLock> lock(KernelHeapLock);
   return KernelAllocator.Malloc(size, alignment);
 }
 
 void kfree(void *ptr) {
-  DisableInterruptsRAII disable_interrupts_raii;
+  IRQSaveLockRAII<TicketLock> lock(KernelHeapLock);
   return KernelAllocator.Free(ptr);
 }
 
 void *krealloc(void *ptr, size_t size) {
-  DisableInterruptsRAII disable_interrupts_raii;
+  IRQSaveLockRAII<TicketLock> lock(KernelHeapLock);
   return KernelAllocator.Realloc(ptr, size);
 }
 
 void *kcalloc(size_t num, size_t size) {
-  DisableInterruptsRAII disable_interrupts_raii;
+  IRQSaveLockRAII<TicketLock> lock(KernelHeapLock);
   return KernelAllocator.Calloc(num, size);
 }
 
-size_t GetKernelHeapUsed() { return KernelAllocator.getHeapUsed(); }
+size_t GetKernelHeapUsed() {
+  IRQSaveLockRAII<TicketLock> lock(KernelHeapLock);
+  return KernelAllocator.getHeapUsed();
+}
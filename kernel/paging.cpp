@@ -3,6 +3,7 @@
 #include <ktask.h>
 #include <paging.h>
 #include <print.h>
+#include <spinlock.h>
 #include <stacktrace.h>
 
 #include <new>
@@ -80,8 +81,39 @@ class PageDirRegionBitmap : public toy::BitArray<kNumPageDirs> {
   }
 };
 
+// This protects the page directory region and the entries of every page
+// directory. Changes to the kernel page directory are copied into every other
+// page directory, so one lock covers all of them. This can be taken from the
+// scheduler, so it is always taken with interrupts disabled. It is taken before
+// the physical frame lock.
+TicketLock PageDirLock("page directories");
 PageDirRegionBitmap PageDirRegion;
 
+// Mappings in these regions of the kernel page directory are copied into every
+// other page directory.
+bool IsSharedKernelMapping(void *vaddr) {
+  return IsKernelCode(vaddr) || IsKernelHeap(vaddr) || IsPageDirRegion(vaddr) ||
+         IsAPICRegion(vaddr) || IsVDSORegion(vaddr);
+}
+
+// Page directories of exited tasks, kept for reuse by new tasks. These keep
+// their bit in PageDirRegion, so kernel mappings still propagate to them, but
+// everything else in them is unmapped.
+constexpr size_t kMaxPooledPageDirs = 8;
+PageDirectory *PooledPageDirs[kMaxPooledPageDirs] GUARDED_BY(PageDirLock);
+size_t NumPooledPageDirs GUARDED_BY(PageDirLock) = 0;
+
+// How many tasks share each user page directory, indexed by its position in the
+// page directory region. Threads of the same program share one page directory,
+// which is only released once the last of them exits.
+uint16_t PageDirRefs[kNumPageDirs] GUARDED_BY(PageDirLock);
+
+uint16_t &PageDirRefsLocked(const PageDirectory &pd) REQUIRES(PageDirLock) {
+  size_t offset = reinterpret_cast<size_t>(&pd) - PAGE_DIRECTORY_REGION_START;
+  assert(offset % kPageDirSize == 0 && offset / kPageDirSize < kNumPageDirs);
+  return PageDirRefs[offset / kPageDirSize];
+}
+
 }  // namespace
 
 void InitializePaging(uint32_t high_mem_KB, [[maybe_unused]] bool pages_4K) {
@@ -146,7 +178,7 @@ PageDirectory &GetKernelPageDirectory() { return KernelPageDir; }
 PhysicalBitmap4M &GetPhysicalBitmap4M() { return PhysicalBitmap; }
 
 void PageDirectory::RemovePage(void *vaddr) {
-  DisableInterruptsRAII disable_interrupts_raii;
+  IRQSaveLockRAII<TicketLock> lock(PageDirLock);
 
   assert(reinterpret_cast<uintptr_t>(vaddr) % kPageSize4M == 0 &&
          "Address is not 4MB aligned");
@@ -158,8 +190,7 @@ void PageDirectory::RemovePage(void *vaddr) {
   uint32_t paddr_int = pde & kPageMask4M;
   PhysicalBitmap.setPageFrameFree(PageIndex4M(paddr_int));
 
-  if (isKernelPageDir() &&
-      (IsKernelCode(vaddr) || IsKernelHeap(vaddr) || IsPageDirRegion(vaddr))) {
+  if (isKernelPageDir() && IsSharedKernelMapping(vaddr)) {
     // We have updated the kernel page directory. Make sure all changes to this
     // page directory also propagate to all other page directories.
     for (size_t bit = 0; bit < PageDirRegion.size(); ++bit) {
@@ -189,8 +220,23 @@ IdentityMapRAII::~IdentityMapRAII() {
 
 // Map unmapped virtual memory to available physical memory.
 void PageDirectory::AddPage(void *v_addr, const void *p_addr, uint8_t flags,
-                            bool allow_physical_reuse) {
-  DisableInterruptsRAII disable_interrupts_raii;
+                            bool allow_physical_reuse, bool writable) {
+  IRQSaveLockRAII<TicketLock> lock(PageDirLock);
+  AddPageLocked(v_addr, p_addr, flags, allow_physical_reuse, writable);
+}
+
+void *PageDirectory::AddNextFreePage(void *v_addr, uint8_t flags, size_t start,
+                                     bool writable) {
+  IRQSaveLockRAII<TicketLock> lock(PageDirLock);
+  void *p_addr = PhysicalBitmap.NextFreePhysicalPage(start);
+  AddPageLocked(v_addr, p_addr, flags, /*allow_physical_reuse=*/false,
+                writable);
+  return p_addr;
+}
+
+void PageDirectory::AddPageLocked(void *v_addr, const void *p_addr,
+                                  uint8_t flags, bool allow_physical_reuse,
+                                  bool writable) {
 
   // With 4MB pages, bits 31 through 12 are reserved, so the the physical
   // address must be 4MB aligned.
@@ -213,15 +259,15 @@ void PageDirectory::AddPage(void *v_addr, const void *p_addr, uint8_t flags,
       !(pde & PG_PRESENT) &&
       "The page directory entry for this virtual address is already assigned.");
 
-  pde = (paddr_int & kPageMask4M) | (PG_PRESENT | PG_4MB | PG_WRITE | flags);
+  pde = (paddr_int & kPageMask4M) | (PG_PRESENT | PG_4MB | flags);
+  if (writable) pde |= PG_WRITE;
 
   PhysicalBitmap.setPageFrameUsed(PageIndex4M(paddr_int));
 
   // Invalidate page in TLB.
   asm volatile("invlpg %0" ::"m"(v_addr));
 
-  if (isKernelPageDir() && (IsKernelCode(v_addr) || IsKernelHeap(v_addr) ||
-                            IsPageDirRegion(v_addr))) {
+  if (isKernelPageDir() && IsSharedKernelMapping(v_addr)) {
     // We have updated the kernel page directory. Make sure all changes to this
     // page directory also propagate to all other page directories.
     for (size_t bit = 0; bit < PageDirRegion.size(); ++bit) {
@@ -265,6 +311,8 @@ void SwitchPageDirectory(PageDirectory &pd) {
 }
 
 PageDirectory *PageDirectory::Clone() const {
+  IRQSaveLockRAII<TicketLock> lock(PageDirLock);
+
   // Note that page directories created this way never need to be explicitly
   // deleted.
   auto *pd = new (PageDirRegion.getAndUseNextFreeRegion()) PageDirectory(*this);
@@ -282,6 +330,8 @@ PageDirectory *PageDirectory::Clone() const {
 }
 
 void PageDirectory::ReclaimPageDirRegion() const {
+  IRQSaveLockRAII<TicketLock> lock(PageDirLock);
+
   // Reclaim all physical pages allocated by this page directory.
   for (const uint32_t *pde = pd_impl_, *pd_end = pd_impl_ + kNumPageDirEntries;
        pde != pd_end; ++pde) {
@@ -293,6 +343,66 @@ void PageDirectory::ReclaimPageDirRegion() const {
   PageDirRegion.Reclaim(this);
 }
 
+PageDirectory *AcquireUserPageDirectory() {
+  PageDirectory *pd = nullptr;
+  {
+    IRQSaveLockRAII<TicketLock> lock(PageDirLock);
+    if (NumPooledPageDirs) pd = PooledPageDirs[--NumPooledPageDirs];
+  }
+  if (!pd) pd = GetKernelPageDirectory().Clone();
+
+  IRQSaveLockRAII<TicketLock> lock(PageDirLock);
+  PageDirRefsLocked(*pd) = 1;
+  return pd;
+}
+
+void RetainUserPageDirectory(PageDirectory &pd) {
+  assert(!pd.isKernelPageDir());
+  IRQSaveLockRAII<TicketLock> lock(PageDirLock);
+  uint16_t &refs = PageDirRefsLocked(pd);
+  assert(refs && "Retaining a page directory that was already released.");
+  assert(refs < UINT16_MAX && "Too many tasks sharing one page directory.");
+  ++refs;
+}
+
+void ReleaseUserPageDirectory(PageDirectory &pd) {
+  assert(!pd.isKernelPageDir());
+  {
+    IRQSaveLockRAII<TicketLock> lock(PageDirLock);
+    uint16_t &refs = PageDirRefsLocked(pd);
+    assert(refs && "Releasing a page directory that was already released.");
+    if (--refs) return;
+
+    if (NumPooledPageDirs < kMaxPooledPageDirs) {
+      // Drop everything this task mapped while keeping the kernel mappings, so
+      // the page directory looks freshly cloned to the next task.
+      uint32_t *pd_impl = pd.get();
+      for (uint32_t index = 0; index < kNumPageDirEntries; ++index) {
+        uint32_t &pde = pd_impl[index];
+        if (!(pde & PG_PRESENT) || IsSharedKernelMapping(PageAddr4M(index)))
+          continue;
+        PhysicalBitmap.setPageFrameFree(PageIndex4M(pde));
+        pde = 0;
+      }
+      PooledPageDirs[NumPooledPageDirs++] = &pd;
+      return;
+    }
+  }
+  pd.ReclaimPageDirRegion();
+}
+
+void DrainPageDirectoryPool() {
+  while (true) {
+    PageDirectory *pd;
+    {
+      IRQSaveLockRAII<TicketLock> lock(PageDirLock);
+      if (!NumPooledPageDirs) return;
+      pd = PooledPageDirs[--NumPooledPageDirs];
+    }
+    pd->ReclaimPageDirRegion();
+  }
+}
+
 bool PageDirectory::isKernelPageDir() const { return this == &KernelPageDir; }
 
 bool PageDirectory::isVirtualMapped(void *v_addr) const {
@@ -301,6 +411,73 @@ bool PageDirectory::isVirtualMapped(void *v_addr) const {
   return pde & PG_PRESENT;
 }
 
+bool PageDirectory::isUserMapped(void *v_addr) const {
+  const uint32_t &pde = pd_impl_[PageIndex4M(v_addr)];
+  return (pde & PG_PRESENT) && (pde & PG_USER);
+}
+
+void *PageDirectory::AddNextFreeUserPage(uint8_t flags, size_t start) {
+  IRQSaveLockRAII<TicketLock> lock(PageDirLock);
+  void *v_addr = GetNextFreeVirtualUser();
+  if (!v_addr) return nullptr;
+  void *p_addr = PhysicalBitmap.NextFreePhysicalPage(start);
+  AddPageLocked(v_addr, p_addr, flags, /*allow_physical_reuse=*/false);
+  return v_addr;
+}
+
+void *PageDirectory::MapNextFreeUserPage(const void *p_addr, uint8_t flags) {
+  IRQSaveLockRAII<TicketLock> lock(PageDirLock);
+  void *v_addr = GetNextFreeVirtualUser();
+  if (!v_addr) return nullptr;
+  AddPageLocked(v_addr, p_addr, flags, /*allow_physical_reuse=*/true);
+  return v_addr;
+}
+
+void *PageDirectory::FindFreeUserRange(void *v_addr, size_t num) const {
+  uint32_t user_start = PageIndex4M(USER_START);
+  uint32_t user_end = PageIndex4M(USER_END);
+  if (!num || num > user_end - user_start) return nullptr;
+
+  auto is_free = [&](uint32_t first) {
+    for (uint32_t index = first; index < first + num; ++index)
+      if (pd_impl_[index] & PG_PRESENT) return false;
+    return true;
+  };
+
+  if (v_addr) {
+    if (!Is4MPageAligned(v_addr)) return nullptr;
+    uint32_t first = PageIndex4M(v_addr);
+    if (first < user_start || first > user_end - num) return nullptr;
+    return is_free(first) ? v_addr : nullptr;
+  }
+
+  for (uint32_t first = user_start; first <= user_end - num; ++first)
+    if (is_free(first)) return PageAddr4M(first);
+  return nullptr;
+}
+
+void *PageDirectory::AddUserPages(void *v_addr, size_t num, uint8_t flags) {
+  IRQSaveLockRAII<TicketLock> lock(PageDirLock);
+  v_addr = FindFreeUserRange(v_addr, num);
+  if (!v_addr || PhysicalBitmap.NumFreePages() < num) return nullptr;
+  auto *page = static_cast<uint8_t *>(v_addr);
+  for (size_t i = 0; i < num; ++i, page += kPageSize4M)
+    AddPageLocked(page, PhysicalBitmap.NextFreePhysicalPage(), flags,
+                  /*allow_physical_reuse=*/false);
+  return v_addr;
+}
+
+void *PageDirectory::MapUserPages(void *v_addr, const void *const *p_addrs,
+                                  size_t num, uint8_t flags) {
+  IRQSaveLockRAII<TicketLock> lock(PageDirLock);
+  v_addr = FindFreeUserRange(v_addr, num);
+  if (!v_addr) return nullptr;
+  auto *page = static_cast<uint8_t *>(v_addr);
+  for (size_t i = 0; i < num; ++i, page += kPageSize4M)
+    AddPageLocked(page, p_addrs[i], flags, /*allow_physical_reuse=*/true);
+  return v_addr;
+}
+
 void *PageDirectory::GetNextFreeVirtualUser() const {
   for (uint32_t index = PageIndex4M(USER_START), end = PageIndex4M(USER_END);
        index < end; ++index) {
@@ -0,0 +1,256 @@
+#include <assert.h>
+#include <console.h>
+#include <ktask.h>
+#include <pipe.h>
+#include <serial.h>
+#include <spinlock.h>
+#include <string.h>
+#include <sys/poll.h>
+#include <sys/syscall.h>
+
+constexpr uint32_t kPipeSize = 4096;
+
+struct Pipe {
+  Spinlock lock;
+  uint32_t head GUARDED_BY(lock);  // Where the next read starts.
+  uint32_t size GUARDED_BY(lock);  // How many bytes are buffered.
+  uint32_t readers GUARDED_BY(lock);  // Open read ends.
+  uint32_t writers GUARDED_BY(lock);  // Open write ends.
+
+  // Everything a reader or writer waits for changes with the lock held, so
+  // every waiter is woken to check again.
+  WaitQueue waiters;
+  uint8_t buffer[kPipeSize] GUARDED_BY(lock);
+};
+
+namespace {
+
+// Typing this on the console reads as the end of input.
+constexpr char kConsoleEOF = 4;  // Ctrl-D
+
+TaskFiles::File *GetFile(uint32_t fd) {
+  if (fd >= kMaxTaskFiles) return nullptr;
+  TaskFiles::File &file = GetCurrentTask()->getFiles().files[fd];
+  return file.pipe ? &file : nullptr;
+}
+
+uint32_t TakeBytes(Pipe &pipe, uint8_t *dst, uint32_t size)
+    REQUIRES(pipe.lock) {
+  if (size > pipe.size) size = pipe.size;
+  uint32_t first = kPipeSize - pipe.head;
+  if (first > size) first = size;
+  memcpy(dst, pipe.buffer + pipe.head, first);
+  memcpy(dst + first, pipe.buffer, size - first);
+  pipe.head = (pipe.head + size) % kPipeSize;
+  pipe.size -= size;
+  return size;
+}
+
+uint32_t PutBytes(Pipe &pipe, const uint8_t *src, uint32_t size)
+    REQUIRES(pipe.lock) {
+  if (size > kPipeSize - pipe.size) size = kPipeSize - pipe.size;
+  uint32_t tail = (pipe.head + pipe.size) % kPipeSize;
+  uint32_t first = kPipeSize - tail;
+  if (first > size) first = size;
+  memcpy(pipe.buffer + tail, src, first);
+  memcpy(pipe.buffer, src + first, size - first);
+  pipe.size += size;
+  return size;
+}
+
+// Take another reference to the end of the pipe `file` refers to.
+void Retain(const TaskFiles::File &file) {
+  IRQSaveLockRAII<Spinlock> lock(file.pipe->lock);
+  if (file.write_end)
+    ++file.pipe->writers;
+  else
+    ++file.pipe->readers;
+}
+
+// Close `file`, and free its pipe once neither end is open anywhere.
+void Release(TaskFiles::File &file) {
+  Pipe *pipe = file.pipe;
+  file.pipe = nullptr;
+  bool unused;
+  {
+    IRQSaveLockRAII<Spinlock> lock(pipe->lock);
+    if (file.write_end)
+      --pipe->writers;
+    else
+      --pipe->readers;
+
+    // Readers wait for EOF and writers for a reader to go away too.
+    pipe->waiters.WakeAll();
+    unused = !pipe->readers && !pipe->writers;
+  }
+  if (unused) delete pipe;
+}
+
+void Inherit(TaskFiles::File &file, const TaskFiles::File &from,
+             bool write_end) {
+  // The spawn descriptor may have been closed or reused since it was set.
+  if (!from.pipe || from.write_end != write_end) return;
+  file = from;
+  Retain(file);
+}
+
+// Read what has been typed on the console, waiting for at least one character.
+int32_t ReadConsole(char *dst, uint32_t size) {
+  uint32_t read = 0;
+  while (read < size) {
+    char c;
+    if (!TryReadConsoleInput(c)) {
+      if (read) break;
+      Waiter waiter = {GetCurrentTask(), /*woken=*/false};
+      WaitQueue::Entry entry = {};
+      if (!PollConsoleInput(&entry, waiter)) WaitUntilWoken(waiter);
+      RemoveWait(entry);
+      continue;
+    }
+    if (c == kConsoleEOF) break;
+    dst[read++] = c;
+  }
+  return static_cast<int32_t>(read);
+}
+
+int32_t WriteConsole(const char *src, uint32_t size) {
+  for (uint32_t i = 0; i < size; ++i) serial::AtomicPut(src[i]);
+  return static_cast<int32_t>(size);
+}
+
+}  // namespace
+
+void InitTaskFiles(TaskFiles &files, TaskFiles *parent) {
+  memset(&files, 0, sizeof(files));
+  files.spawn_stdin = STDIN_FD;
+  files.spawn_stdout = STDOUT_FD;
+  if (!parent) return;
+  Inherit(files.files[STDIN_FD], parent->files[parent->spawn_stdin],
+          /*write_end=*/false);
+  Inherit(files.files[STDOUT_FD], parent->files[parent->spawn_stdout],
+          /*write_end=*/true);
+}
+
+void CloseTaskFiles(TaskFiles &files) {
+  for (TaskFiles::File &file : files.files)
+    if (file.pipe) Release(file);
+}
+
+int32_t CreatePipe(uint32_t fds[2]) {
+  // Stdin and stdout are only ever opened by inheriting them.
+  TaskFiles &files = GetCurrentTask()->getFiles();
+  uint32_t found = 0;
+  uint32_t new_fds[2];
+  for (uint32_t fd = STDOUT_FD + 1; fd < kMaxTaskFiles && found < 2; ++fd)
+    if (!files.files[fd].pipe) new_fds[found++] = fd;
+  if (found < 2) return PIPE_NO_SPACE;
+
+  auto *pipe = new Pipe();
+  {
+    IRQSaveLockRAII<Spinlock> lock(pipe->lock);
+    pipe->readers = 1;
+    pipe->writers = 1;
+  }
+  files.files[new_fds[0]] = {pipe, /*write_end=*/false};
+  files.files[new_fds[1]] = {pipe, /*write_end=*/true};
+  fds[0] = new_fds[0];
+  fds[1] = new_fds[1];
+  return 0;
+}
+
+int32_t ReadFile(uint32_t fd, void *buf, uint32_t size) {
+  TaskFiles::File *file = GetFile(fd);
+  if (!file && fd == STDIN_FD)
+    return ReadConsole(static_cast<char *>(buf), size);
+  if (!file || file->write_end) return FD_INVALID;
+
+  Pipe &pipe = *file->pipe;
+  while (true) {
+    Waiter waiter = {GetCurrentTask(), /*woken=*/false};
+    WaitQueue::Entry entry = {};
+    {
+      IRQSaveLockRAII<Spinlock> lock(pipe.lock);
+      if (pipe.size || !pipe.writers || !size) {
+        uint32_t read = TakeBytes(pipe, static_cast<uint8_t *>(buf), size);
+        if (read) pipe.waiters.WakeAll();
+        return static_cast<int32_t>(read);
+      }
+      pipe.waiters.Add(entry, waiter);
+    }
+    WaitUntilWoken(waiter);
+    RemoveWait(entry);
+  }
+}
+
+int32_t WriteFile(uint32_t fd, const void *buf, uint32_t size) {
+  TaskFiles::File *file = GetFile(fd);
+  if (!file && fd == STDOUT_FD)
+    return WriteConsole(static_cast<const char *>(buf), size);
+  if (!file || !file->write_end) return FD_INVALID;
+
+  Pipe &pipe = *file->pipe;
+  const auto *src = static_cast<const uint8_t *>(buf);
+  uint32_t written = 0;
+  while (true) {
+    Waiter waiter = {GetCurrentTask(), /*woken=*/false};
+    WaitQueue::Entry entry = {};
+    {
+      IRQSaveLockRAII<Spinlock> lock(pipe.lock);
+      if (!pipe.readers) return PIPE_BROKEN;
+      uint32_t put = PutBytes(pipe, src + written, size - written);
+      if (put) {
+        written += put;
+        pipe.waiters.WakeAll();
+      }
+      if (written == size) return static_cast<int32_t>(size);
+      pipe.waiters.Add(entry, waiter);
+    }
+    WaitUntilWoken(waiter);
+    RemoveWait(entry);
+  }
+}
+
+int32_t CloseFile(uint32_t fd) {
+  TaskFiles::File *file = GetFile(fd);
+  if (!file) return FD_INVALID;
+  Release(*file);
+  return 0;
+}
+
+int32_t SetSpawnStdio(uint32_t in, uint32_t out) {
+  TaskFiles::File *in_file = GetFile(in);
+  TaskFiles::File *out_file = GetFile(out);
+  if (in != STDIN_FD && (!in_file || in_file->write_end)) return FD_INVALID;
+  if (out != STDOUT_FD && (!out_file || !out_file->write_end))
+    return FD_INVALID;
+
+  TaskFiles &files = GetCurrentTask()->getFiles();
+  files.spawn_stdin = in;
+  files.spawn_stdout = out;
+  return 0;
+}
+
+int32_t PollFile(uint32_t fd, uint32_t events, WaitQueue::Entry *entry,
+                 Waiter &waiter) {
+  TaskFiles::File *file = GetFile(fd);
+  if (!file && fd == STDIN_FD)
+    return (events & POLL_IN) && PollConsoleInput(entry, waiter) ? POLL_IN : 0;
+  if (!file && fd == STDOUT_FD) return events & POLL_OUT;
+  if (!file) return FD_INVALID;
+
+  Pipe &pipe = *file->pipe;
+  IRQSaveLockRAII<Spinlock> lock(pipe.lock);
+  int32_t ready = 0;
+  if (file->write_end) {
+    if (!pipe.readers)
+      ready |= POLL_HUP;
+    else if (pipe.size < kPipeSize)
+      ready |= POLL_OUT;
+  } else {
+    if (pipe.size) ready |= POLL_IN;
+    if (!pipe.writers) ready |= POLL_HUP;
+  }
+  ready &= events | POLL_HUP;
+  if (!ready && entry) pipe.waiters.Add(*entry, waiter);
+  return ready;
+}
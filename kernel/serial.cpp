@@ -24,6 +24,10 @@ void Initialize() {
   Write8(kCOM1 + 4, 0x0B);  // IRQs enabled, RTS/DSR set
 }
 
+void EnableReceiveInterrupt() {
+  Write8(kCOM1 + 1, 0x01);  // Interrupt when data is received
+}
+
 bool TryRead(char &c) {
   if (Received()) {
     c = static_cast<char>(Read8(kCOM1));
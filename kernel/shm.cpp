@@ -0,0 +1,114 @@
+#include <assert.h>
+#include <ktask.h>
+#include <paging.h>
+#include <shm.h>
+#include <spinlock.h>
+#include <string.h>
+#include <sys/syscall.h>
+
+namespace {
+
+constexpr uint32_t kMaxShmObjects = 64;
+constexpr uint32_t kMaxShmPages = SHM_MAX_SIZE / kPageSize4M;
+static_assert(SHM_MAX_SIZE % kPageSize4M == 0);
+
+struct ShmObject {
+  char name[SHM_NAME_MAX];  // Empty if this entry is unused.
+  uint32_t size;
+  uint32_t num_pages;
+  const void *frames[kMaxShmPages];
+};
+
+// Taken before the page directory lock.
+Spinlock ShmLock("shared memory");
+ShmObject ShmObjects[kMaxShmObjects] GUARDED_BY(ShmLock);
+
+// The table holds a reference to each frame of an object, so an object is dead
+// once none of its frames have any other reference.
+bool ShmIsLive(const ShmObject &obj) {
+  for (uint32_t i = 0; i < obj.num_pages; ++i)
+    if (GetPhysicalBitmap4M().getRefs(PageIndex4M(obj.frames[i])) > 1)
+      return true;
+  return false;
+}
+
+void FreeShm(ShmObject &obj) {
+  for (uint32_t i = 0; i < obj.num_pages; ++i)
+    GetPhysicalBitmap4M().setPageFrameFree(PageIndex4M(obj.frames[i]));
+  obj.name[0] = 0;
+}
+
+// Find the live object called `name`. Dead objects found on the way are freed
+// and the first free entry is stored in `free_obj`.
+ShmObject *FindShm(const char *name, ShmObject *&free_obj)
+    REQUIRES(ShmLock) {
+  free_obj = nullptr;
+  for (ShmObject &obj : ShmObjects) {
+    if (obj.name[0] && !ShmIsLive(obj)) FreeShm(obj);
+    if (!obj.name[0]) {
+      if (!free_obj) free_obj = &obj;
+      continue;
+    }
+    if (strcmp(obj.name, name) == 0) return &obj;
+  }
+  return nullptr;
+}
+
+// Copy a name from the current task. This returns false if it is empty or
+// does not fit.
+bool CopyName(const char *user_name, char (&name)[SHM_NAME_MAX]) {
+  for (uint32_t i = 0; i < SHM_NAME_MAX; ++i) {
+    name[i] = user_name[i];
+    if (!name[i]) return i > 0;
+  }
+  return false;
+}
+
+}  // namespace
+
+int32_t CreateShm(const char *user_name, uint32_t size, void **addr) {
+  char name[SHM_NAME_MAX];
+  if (!CopyName(user_name, name) || !size || size > SHM_MAX_SIZE ||
+      (*addr && !Is4MPageAligned(*addr)))
+    return SHM_INVALID;
+
+  IRQSaveLockRAII<Spinlock> lock(ShmLock);
+  ShmObject *obj;
+  if (FindShm(name, obj)) return SHM_EXISTS;
+  if (!obj) return SHM_NO_SPACE;
+
+  uint32_t num_pages = (size + kPageSize4M - 1) / kPageSize4M;
+  PageDirectory &pd = GetCurrentTask()->getPageDirectory();
+  void *vaddr = pd.AddUserPages(*addr, num_pages, PG_USER);
+  if (!vaddr) return SHM_NO_SPACE;
+
+  auto *page = static_cast<uint8_t *>(vaddr);
+  for (uint32_t i = 0; i < num_pages; ++i, page += kPageSize4M) {
+    obj->frames[i] = pd.GetPhysicalAddr(page);
+    GetPhysicalBitmap4M().Ref(PageIndex4M(obj->frames[i]));
+  }
+  memcpy(obj->name, name, sizeof(name));
+  obj->size = size;
+  obj->num_pages = num_pages;
+
+  *addr = vaddr;
+  return 0;
+}
+
+int32_t MapShm(const char *user_name, void **addr, uint32_t *size) {
+  char name[SHM_NAME_MAX];
+  if (!CopyName(user_name, name) || (*addr && !Is4MPageAligned(*addr)))
+    return SHM_INVALID;
+
+  IRQSaveLockRAII<Spinlock> lock(ShmLock);
+  ShmObject *free_obj;
+  ShmObject *obj = FindShm(name, free_obj);
+  if (!obj) return SHM_NOT_FOUND;
+
+  void *vaddr = GetCurrentTask()->getPageDirectory().MapUserPages(
+      *addr, obj->frames, obj->num_pages, PG_USER);
+  if (!vaddr) return SHM_NO_SPACE;
+  *addr = vaddr;
+  *size = obj->size;
+  return 0;
+}
@@ -0,0 +1,323 @@
+#include <apic.h>
+#include <assert.h>
+#include <descriptortables.h>
+#include <fpu.h>
+#include <kernel.h>
+#include <ktask.h>
+#include <paging.h>
+#include <smp.h>
+#include <string.h>
+#include <syscall.h>
+
+using print::Hex;
+
+extern "C" uint8_t ap_trampoline_start, ap_trampoline_end,
+    ap_trampoline_gdt_ptr;
+extern "C" uint32_t ap_boot_cr3, ap_boot_stack;
+
+namespace {
+
+// Where the AP startup code is copied to. This must be a 4KB aligned address in
+// the first 1MB. The startup IPI vector is the page number of this address.
+constexpr uint32_t kAPTrampolineAddr = 0x8000;
+constexpr uint8_t kAPStartupVector = kAPTrampolineAddr >> 12;
+
+constexpr size_t kAPStackSize = 16384;  // Same as the BSP boot stack.
+alignas(16) uint8_t APStacks[kMaxCPUs][kAPStackSize];
+
+size_t NumCPUs = 1;
+uint8_t CPUAPICIDs[kMaxCPUs];
+uint8_t APICIDToCPU[256];
+
+// Set by each AP once it no longer needs the boot variables, so the BSP can
+// start the next one.
+volatile uint32_t APStarted;
+volatile uint32_t NumAPsStopped;
+volatile bool StopRequested;
+
+// Temporarily map the 4MB physical frame containing a firmware table so it can
+// be read. Only one of these can be alive at a time since they share the same
+// virtual window.
+class FirmwareMapRAII {
+ public:
+  FirmwareMapRAII(uint32_t paddr) : frame_(paddr & kPageMask4M) {
+    GetKernelPageDirectory().AddPage(kWindow, reinterpret_cast<void *>(frame_),
+                                     /*flags=*/0,
+                                     /*allow_physical_reuse=*/true);
+  }
+  ~FirmwareMapRAII() { GetKernelPageDirectory().RemovePage(kWindow); }
+
+  // Get a pointer to `size` bytes at physical address `paddr`. The range must
+  // be within the mapped frame.
+  const uint8_t *get(uint32_t paddr, size_t size = 1) const {
+    assert((paddr & kPageMask4M) == frame_ &&
+           ((paddr + size - 1) & kPageMask4M) == frame_ &&
+           "Firmware table crosses a 4MB page boundary.");
+    return reinterpret_cast<const uint8_t *>(kWindow) + (paddr - frame_);
+  }
+
+ private:
+  static inline void *const kWindow =
+      reinterpret_cast<void *>(TMP_SHARED_TASK_MEM_START);
+  uint32_t frame_;
+};
+
+bool ChecksumIsValid(const uint8_t *data, size_t size) {
+  uint8_t sum = 0;
+  for (size_t i = 0; i < size; ++i) sum = static_cast<uint8_t>(sum + data[i]);
+  return sum == 0;
+}
+
+// Search [start, start + size) on 16 byte boundaries for a structure starting
+// with `sig` whose first `checksum_size` bytes sum to zero. Return its physical
+// address or 0 if none was found. The range must be in the first 4MB.
+uint32_t FindLowMemStruct(const FirmwareMapRAII &low_mem, uint32_t start,
+                          uint32_t size, const char *sig,
+                          size_t checksum_size) {
+  size_t sig_len = strlen(sig);
+  for (uint32_t addr = start; addr + checksum_size <= start + size;
+       addr += 16) {
+    const uint8_t *data = low_mem.get(addr, checksum_size);
+    if (memcmp(data, sig, sig_len) == 0 &&
+        ChecksumIsValid(data, checksum_size))
+      return addr;
+  }
+  return 0;
+}
+
+// Search the places the BIOS can put the ACPI RSDP or MP floating pointer: the
+// first 1KB of the EBDA, the last 1KB of base memory, and the BIOS ROM.
+uint32_t FindBIOSStruct(const FirmwareMapRAII &low_mem, const char *sig,
+                        size_t checksum_size) {
+  uint16_t ebda_segment;
+  memcpy(&ebda_segment, low_mem.get(0x40E, sizeof(ebda_segment)),
+         sizeof(ebda_segment));
+  if (uint32_t ebda = static_cast<uint32_t>(ebda_segment) << 4) {
+    if (uint32_t addr =
+            FindLowMemStruct(low_mem, ebda, 1024, sig, checksum_size))
+      return addr;
+  }
+  if (uint32_t addr =
+          FindLowMemStruct(low_mem, 0x9FC00, 1024, sig, checksum_size))
+    return addr;
+  return FindLowMemStruct(low_mem, 0xE0000, 0x20000, sig, checksum_size);
+}
+
+template <typename T>
+T ReadAt(const uint8_t *data, size_t offset) {
+  T val;
+  memcpy(&val, data + offset, sizeof(T));
+  return val;
+}
+
+void AddCPU(uint8_t apic_id) {
+  for (size_t i = 0; i < NumCPUs; ++i) {
+    if (CPUAPICIDs[i] == apic_id) return;  // The BSP or a duplicate entry.
+  }
+  if (NumCPUs == kMaxCPUs) {
+    DebugPrint("Ignoring CPU with APIC ID {} past the CPU limit\n", apic_id);
+    return;
+  }
+  CPUAPICIDs[NumCPUs++] = apic_id;
+}
+
+// Parse the ACPI MADT for enabled local APICs. Return false if there's no ACPI
+// or no MADT.
+//
+// https://wiki.osdev.org/MADT
+bool ParseACPI(uint32_t &lapic_addr) {
+  uint32_t rsdt_addr;
+  {
+    FirmwareMapRAII low_mem(0);
+    uint32_t rsdp = FindBIOSStruct(low_mem, "RSD PTR ", /*checksum_size=*/20);
+    if (!rsdp) return false;
+    rsdt_addr = ReadAt<uint32_t>(low_mem.get(rsdp, 20), 16);
+  }
+
+  constexpr size_t kSDTHeaderSize = 36;
+  constexpr size_t kMaxTables = 32;
+  uint32_t tables[kMaxTables];
+  size_t num_tables;
+  {
+    FirmwareMapRAII map(rsdt_addr);
+    const uint8_t *rsdt = map.get(rsdt_addr, kSDTHeaderSize);
+    if (memcmp(rsdt, "RSDT", 4) != 0) return false;
+    uint32_t length = ReadAt<uint32_t>(rsdt, 4);
+    rsdt = map.get(rsdt_addr, length);
+    num_tables = (length - kSDTHeaderSize) / sizeof(uint32_t);
+    if (num_tables > kMaxTables) num_tables = kMaxTables;
+    memcpy(tables, rsdt + kSDTHeaderSize, num_tables * sizeof(uint32_t));
+  }
+
+  for (size_t i = 0; i < num_tables; ++i) {
+    FirmwareMapRAII map(tables[i]);
+    const uint8_t *madt = map.get(tables[i], kSDTHeaderSize);
+    if (memcmp(madt, "APIC", 4) != 0) continue;
+    uint32_t length = ReadAt<uint32_t>(madt, 4);
+    madt = map.get(tables[i], length);
+
+    lapic_addr = ReadAt<uint32_t>(madt, kSDTHeaderSize);
+    for (size_t offset = kSDTHeaderSize + 8; offset + 2 <= length;) {
+      uint8_t type = madt[offset];
+      uint8_t entry_len = madt[offset + 1];
+      if (entry_len < 2) break;
+
+      constexpr uint8_t kProcessorLocalAPIC = 0;
+      constexpr uint8_t kLAPICAddrOverride = 5;
+      if (type == kProcessorLocalAPIC) {
+        uint8_t apic_id = madt[offset + 3];
+        uint32_t flags = ReadAt<uint32_t>(madt, offset + 4);
+        if (flags & 1) AddCPU(apic_id);  // Processor enabled.
+      } else if (type == kLAPICAddrOverride) {
+        uint64_t addr = ReadAt<uint64_t>(madt, offset + 4);
+        if (addr <= UINT32_MAX) lapic_addr = static_cast<uint32_t>(addr);
+      }
+      offset += entry_len;
+    }
+    return true;
+  }
+  return false;
+}
+
+// Parse the Intel MultiProcessor tables for enabled processors. This is only
+// used if there is no ACPI.
+//
+// https://wiki.osdev.org/Symmetric_Multiprocessing#Finding_information_using_MP_Table
+bool ParseMPTables(uint32_t &lapic_addr) {
+  uint32_t config_addr;
+  {
+    FirmwareMapRAII low_mem(0);
+    uint32_t mpfp = FindBIOSStruct(low_mem, "_MP_", /*checksum_size=*/16);
+    if (!mpfp) return false;
+    config_addr = ReadAt<uint32_t>(low_mem.get(mpfp, 16), 4);
+  }
+  if (!config_addr) return false;  // Uses a default configuration.
+
+  FirmwareMapRAII map(config_addr);
+  constexpr size_t kConfigHeaderSize = 44;
+  const uint8_t *config = map.get(config_addr, kConfigHeaderSize);
+  if (memcmp(config, "PCMP", 4) != 0) return false;
+  uint16_t length = ReadAt<uint16_t>(config, 4);
+  uint16_t entry_count = ReadAt<uint16_t>(config, 34);
+  lapic_addr = ReadAt<uint32_t>(config, 36);
+  config = map.get(config_addr, length);
+
+  size_t offset = kConfigHeaderSize;
+  for (uint16_t i = 0; i < entry_count && offset < length; ++i) {
+    constexpr uint8_t kProcessorEntry = 0;
+    if (config[offset] == kProcessorEntry) {
+      uint8_t apic_id = config[offset + 1];
+      uint8_t flags = config[offset + 3];
+      if (flags & 1) AddCPU(apic_id);  // Processor enabled.
+      offset += 20;
+    } else {
+      offset += 8;
+    }
+  }
+  return true;
+}
+
+void StartAP(size_t cpu) {
+  uint8_t apic_id = CPUAPICIDs[cpu];
+  APStarted = 0;
+  ap_boot_stack = reinterpret_cast<uint32_t>(APStacks[cpu] + kAPStackSize);
+
+  // INIT-SIPI-SIPI.
+  // https://wiki.osdev.org/Symmetric_Multiprocessing#AP_startup
+  LAPICSendINIT(apic_id);
+  IODelay(10000);
+  for (int i = 0; i < 2 && !APStarted; ++i) {
+    LAPICSendStartup(apic_id, kAPStartupVector);
+    IODelay(200);
+  }
+
+  // Give the AP up to a second to check in.
+  for (int i = 0; i < 1000 && !APStarted; ++i) IODelay(1000);
+  if (!APStarted) PANIC("An application processor failed to start.");
+}
+
+}  // namespace
+
+extern "C" [[noreturn]] void ap_main() {
+  size_t cpu = GetCPUIndex();
+  InitAPDescriptorTables(cpu);
+  EnableLAPIC();
+  InitAPFPU();
+  InitAPSyscalls();
+  InitAPScheduler();
+
+  // We're now running on this CPU's idle task, so the boot variables can be
+  // reused for the next AP.
+  APStarted = 1;
+
+  StartLAPICTimer();
+  EnableInterrupts();
+
+  while (!StopRequested) asm volatile("hlt");
+
+  // Nothing else will run here. The idle task is left for DestroyScheduler()
+  // to clean up.
+  DisableInterrupts();
+  StopLAPICTimer();
+  __atomic_add_fetch(&NumAPsStopped, 1, __ATOMIC_RELEASE);
+  while (1) asm volatile("hlt");
+}
+
+void InitSMP() {
+  uint32_t lapic_addr = kDefaultLAPICAddr;
+  if (!ParseACPI(lapic_addr) && !ParseMPTables(lapic_addr)) {
+    DebugPrint("No ACPI or MP tables found. Running on one CPU.\n");
+    return;
+  }
+
+  MapLAPIC(lapic_addr);
+  EnableLAPIC();
+
+  // The firmware tables list the BSP too, so put it first regardless of where
+  // it was listed.
+  uint8_t bsp_id = GetLAPICID();
+  for (size_t i = 0; i < NumCPUs; ++i) {
+    if (CPUAPICIDs[i] != bsp_id) continue;
+    CPUAPICIDs[i] = CPUAPICIDs[0];
+    CPUAPICIDs[0] = bsp_id;
+    break;
+  }
+  memset(APICIDToCPU, 0, sizeof(APICIDToCPU));
+  for (size_t i = 0; i < NumCPUs; ++i)
+    APICIDToCPU[CPUAPICIDs[i]] = static_cast<uint8_t>(i);
+  DebugPrint("Found {} CPU(s). Local APIC at {}\n", NumCPUs, Hex(lapic_addr));
+
+  if (NumCPUs == 1) return;
+
+  CalibrateLAPICTimer();
+
+  // The startup code is only needed in low memory while the APs boot.
+  GetKernelPageDirectory().AddPage(nullptr, nullptr, /*flags=*/0,
+                                   /*allow_physical_reuse=*/true);
+  uint8_t *trampoline = reinterpret_cast<uint8_t *>(kAPTrampolineAddr);
+  size_t trampoline_size =
+      static_cast<size_t>(&ap_trampoline_end - &ap_trampoline_start);
+  memcpy(trampoline, &ap_trampoline_start, trampoline_size);
+  memcpy(trampoline + (&ap_trampoline_gdt_ptr - &ap_trampoline_start),
+         &GetBootGDTPtr(), sizeof(gdt_ptr_t));
+  ap_boot_cr3 = reinterpret_cast<uint32_t>(GetKernelPageDirectory().get());
+
+  for (size_t cpu = 1; cpu < NumCPUs; ++cpu) {
+    StartAP(cpu);
+    DebugPrint("Started CPU {} (APIC ID {})\n", cpu, CPUAPICIDs[cpu]);
+  }
+
+  GetKernelPageDirectory().RemovePage(nullptr);
+}
+
+void StopAPs() {
+  StopRequested = true;
+  while (__atomic_load_n(&NumAPsStopped, __ATOMIC_ACQUIRE) != NumCPUs - 1) {}
+}
+
+size_t GetNumCPUs() { return NumCPUs; }
+
+size_t GetCPUIndex() {
+  if (!LAPICIsMapped()) return 0;
+  return APICIDToCPU[GetLAPICID()];
+}
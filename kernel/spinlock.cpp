@@ -0,0 +1,36 @@
+#include <kernel.h>
+#include <spinlock.h>
+
+namespace {
+
+constexpr size_t kMaxRegisteredLocks = 32;
+LockStats *RegisteredLocks[kMaxRegisteredLocks];
+uint32_t NumRegisteredLocks = 0;
+
+}  // namespace
+
+void LockStats::Register() {
+  // The lock is held here, so only one CPU can register it.
+  registered = true;
+  uint32_t slot = __atomic_fetch_add(&NumRegisteredLocks, 1, __ATOMIC_RELAXED);
+  if (slot < kMaxRegisteredLocks)
+    __atomic_store_n(&RegisteredLocks[slot], this, __ATOMIC_RELEASE);
+}
+
+void DumpLockStats() {
+  uint32_t num_locks = __atomic_load_n(&NumRegisteredLocks, __ATOMIC_RELAXED);
+  if (num_locks > kMaxRegisteredLocks) num_locks = kMaxRegisteredLocks;
+
+  DebugPrint("Lock stats (hold times in TSC cycles):\n");
+  for (uint32_t i = 0; i < num_locks; ++i) {
+    const LockStats *stats =
+        __atomic_load_n(&RegisteredLocks[i], __ATOMIC_ACQUIRE);
+    if (!stats) continue;
+    uint64_t avg_hold = stats->acquisitions
+                            ? stats->total_hold_cycles / stats->acquisitions
+                            : 0;
+    DebugPrint("  {}: {} taken, {} contended, avg hold {}, max hold {}\n",
+               stats->name, stats->acquisitions, stats->contentions, avg_hold,
+               stats->max_hold_cycles);
+  }
+}
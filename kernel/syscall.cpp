@@ -1,11 +1,41 @@
 #include <assert.h>
+#include <channel.h>
+#include <console.h>
+#include <descriptortables.h>
+#include <futex.h>
+#include <handle.h>
+#include <ipc.h>
 #include <kernel.h>
 #include <ktask.h>
+#include <pipe.h>
+#include <shm.h>
+#include <sys/multicall.h>
+#include <sys/poll.h>
+#include <sys/ring.h>
+#include <sys/startup.h>
+#include <sys/syscall.h>
+#include <sys/taskstats.h>
+#include <sys/uio.h>
 #include <syscall.h>
+#include <timer.h>
+#include <type_traits.h>
 
 #define SYSCALL_INT "0x80"
 #define RET_TYPE int32_t
 
+extern "C" void sysenter_entry();
+
+// The argument registers of a syscall in the order they are passed. sysenter.S
+// pushes these in reverse so they form this struct on the stack. Both entry
+// paths load these back into the registers on return, so SYSCALL_MSG syscalls
+// can return a message in them.
+struct SyscallArgs {
+  uint32_t ebx, ecx, edx, esi, edi;
+};
+
+extern "C" RET_TYPE DispatchSyscall(uint32_t num, SyscallArgs *args);
+extern "C" RET_TYPE DispatchSysenter(uint32_t num, SyscallArgs *args);
+
 namespace {
 
 constexpr uint8_t kSyscallInterrupt = 0x80;
@@ -16,57 +46,650 @@ RET_TYPE debug_write(const char *str) {
 }
 
 RET_TYPE exit_user_task() {
+  // Close pipe ends now rather than when the task is destroyed, so readers see
+  // EOF as soon as the writers exit.
+  CloseTaskFiles(GetCurrentTask()->getFiles());
   exit_this_task();
   return 0;
 }
 
 RET_TYPE debug_read(char *c) {
-  if (serial::TryRead(*c)) return 0;
+  if (TryReadConsoleInput(*c)) return 0;
   return 1;
 }
 
+HandleTable &CurrentHandles() { return *GetCurrentTask()->getHandles(); }
+
+// Open a handle for a task that is about to be created, so running out of
+// handles is caught before there is a task to clean up. It refers to no task
+// until it is Set().
+uint32_t ReserveHandle() { return CurrentHandles().Install(kHandleTask, 0); }
+
+void CloseHandle(uint32_t handle) {
+  uint32_t ref;
+  CurrentHandles().Remove(handle, kHandleTask, ref);
+}
+
 RET_TYPE create_user_task(void *entry, uint32_t codesize, void *arg,
                           uint32_t *handle, uint32_t entry_offset) {
-  // FIXME: This is a raw pointer passed to userspace that will remain free
-  // unless the user explicitly makes a syscall that frees this. This should not
-  // be the case. We should provide some way to free it and retain ownership in
-  // kernel space.
+  uint32_t child_handle = ReserveHandle();
+  if (child_handle == HANDLE_INVALID) return SYSCALL_EMFILE;
   auto *child = new UserTask(reinterpret_cast<TaskFunc>(entry), codesize, arg,
                              /*copyfunc=*/UserTask::CopyArgDefault,
                              /*entry_offset=*/entry_offset);
-  *handle = reinterpret_cast<uint32_t>(child);
+  CurrentHandles().Set(child_handle, child->getRef());
+  *handle = child_handle;
   return 0;
 }
 
-RET_TYPE destroy_user_task(uint32_t handle) {
-  // We can safely cast to a UserTask here because this pointer originally was
-  // created as a UserTask.
-  auto *task = reinterpret_cast<UserTask *>(handle);
+// Copy the startup block `arg` from the current task to the start of the new
+// task's shared user space, far below its initial stack at the end, and give
+// the task that copy.
+void *CopyStartupBlock(void *arg, void *dst_start, void *) {
+  const auto *startup = static_cast<const StartupBlock *>(arg);
+  uint32_t size = startup->size;
+  if (size > STARTUP_MAX_SIZE) size = STARTUP_MAX_SIZE;
+  memcpy(dst_start, startup, size);
+  return dst_start;
+}
+
+// Like create_user_task, but the new task gets a copy of `startup` instead of
+// a pointer into this task, so this task does not have to keep anything alive
+// for it.
+RET_TYPE spawn_program(void *entry, uint32_t codesize, uint32_t entry_offset,
+                       const StartupBlock *startup, uint32_t *handle) {
+  if (startup->size < sizeof(StartupBlock) ||
+      startup->size > STARTUP_MAX_SIZE)
+    return STARTUP_INVALID;
+  uint32_t child_handle = ReserveHandle();
+  if (child_handle == HANDLE_INVALID) return SYSCALL_EMFILE;
+
+  // The program reaches the initrd through the same handle value as this task,
+  // so the block can be passed on as is.
+  auto *child_handles = new HandleTable;
+  uint32_t vfs_ref;
+  if (CurrentHandles().Lookup(startup->vfs_owner, kHandleTask, vfs_ref))
+    child_handles->InstallAt(startup->vfs_owner, kHandleTask, vfs_ref);
+
+  auto *child = new UserTask(reinterpret_cast<TaskFunc>(entry), codesize,
+                             const_cast<StartupBlock *>(startup),
+                             /*copyfunc=*/CopyStartupBlock,
+                             /*entry_offset=*/entry_offset,
+                             /*handles=*/child_handles);
+  CurrentHandles().Set(child_handle, child->getRef());
+  *handle = child_handle;
+  return 0;
+}
+
+// Start a thread at `entry` in this task's address space. This returns 0 and
+// writes the handle for the thread, or THREAD_NO_STACK if there is no room
+// left for its stack. The thread shares this task's handle table, where it
+// also gets a handle to itself.
+RET_TYPE create_thread(void *entry, void *arg, uint32_t *handle) {
+  uint32_t thread_handle = ReserveHandle();
+  if (thread_handle == HANDLE_INVALID) return SYSCALL_EMFILE;
+  uint32_t self_handle = ReserveHandle();
+  if (self_handle == HANDLE_INVALID) {
+    CloseHandle(thread_handle);
+    return SYSCALL_EMFILE;
+  }
+
+  auto *thread = UserTask::CreateThread(reinterpret_cast<uint32_t>(entry), arg,
+                                        self_handle);
+  if (!thread) {
+    CloseHandle(thread_handle);
+    CloseHandle(self_handle);
+    return THREAD_NO_STACK;
+  }
+  CurrentHandles().Set(thread_handle, thread->getRef());
+  *handle = thread_handle;
+  return 0;
+}
+
+// Convert a timeout in milliseconds to at least that many ticks from now. A
+// partial tick may have already passed, so this adds one.
+uint32_t TimeoutToTicks(uint32_t timeout_ms) {
+  if (timeout_ms == TIMEOUT_INFINITE) return kFutexNoTimeout;
+  if (!timeout_ms) return 0;
+  return MsToTicks(timeout_ms) + 1;
+}
+
+RET_TYPE futex_wait(const uint32_t *addr, uint32_t expected,
+                    uint32_t timeout_ms) {
+  return FutexWait(addr, expected, TimeoutToTicks(timeout_ms));
+}
+
+RET_TYPE futex_wake(const uint32_t *addr, uint32_t num) {
+  return FutexWake(addr, num);
+}
+
+// The longest single SleepUntil(). Deadlines must stay under 2^31 ticks ahead
+// for TickReached() to tell them from ones in the past.
+constexpr uint32_t kMaxSleepTicks = UINT32_C(1) << 30;
+
+// Sleep for at least `ms`, in chunks if that is too long for one deadline. A
+// sleep of TIMEOUT_INFINITE never returns.
+RET_TYPE sleep(uint32_t ms) {
+  if (ms == TIMEOUT_INFINITE) {
+    // There is nothing to wait for, so any wake just blocks again.
+    while (true) {
+      PrepareToBlock();
+      BlockCurrentTask();
+    }
+  }
+
+  uint32_t ticks = TimeoutToTicks(ms);
+  while (ticks) {
+    uint32_t chunk = ticks < kMaxSleepTicks ? ticks : kMaxSleepTicks;
+    SleepUntil(GetTicks() + chunk);
+    ticks -= chunk;
+  }
+  return 0;
+}
+
+RET_TYPE sleep_until(uint32_t uptime_ms) {
+  SleepUntil(MsToTicks(uptime_ms));
+  return 0;
+}
+
+RET_TYPE get_uptime(uint32_t *uptime_ms) {
+  *uptime_ms = TicksToMs(GetTicks());
+  return 0;
+}
+
+RET_TYPE set_deadline(uint32_t runtime_ms, uint32_t deadline_ms,
+                      uint32_t period_ms) {
+  return SetDeadlineParams(runtime_ms, deadline_ms, period_ms);
+}
+
+RET_TYPE channel_create(void **addr) { return CreateChannel(addr); }
+
+RET_TYPE channel_attach(uint32_t id, void **addr) {
+  return AttachChannel(id, addr);
+}
+
+RET_TYPE shm_create(const char *name, uint32_t size, void **addr) {
+  return CreateShm(name, size, addr);
+}
+
+RET_TYPE shm_map(const char *name, void **addr, uint32_t *size) {
+  return MapShm(name, addr, size);
+}
+
+RET_TYPE pipe(uint32_t *fds) { return CreatePipe(fds); }
+
+RET_TYPE read(uint32_t fd, void *buf, uint32_t size) {
+  return ReadFile(fd, buf, size);
+}
+
+RET_TYPE write(uint32_t fd, const void *buf, uint32_t size) {
+  return WriteFile(fd, buf, size);
+}
+
+RET_TYPE close(uint32_t fd) { return CloseFile(fd); }
+
+RET_TYPE set_spawn_stdio(uint32_t in, uint32_t out) {
+  return SetSpawnStdio(in, out);
+}
+
+// Map a syscall ring for the current task, and store where in `addr`.
+RET_TYPE ring_setup(void **addr) {
+  Task *task = GetCurrentTask();
+  if (task->getRing()) return RING_EXISTS;
+  void *page = task->getPageDirectory().AddNextFreeUserPage(PG_USER,
+                                                            /*start=*/1);
+  if (!page) return RING_NO_SPACE;
+  auto *ring = static_cast<SyscallRing *>(page);
+  memset(ring, 0, sizeof(*ring));
+  task->setRing(ring);
+  *addr = ring;
+  return 0;
+}
+
+// The syscalls a ring or a multicall can run. These all return to the task that
+// made them and take no message, unlike exit_user_task or the IPC syscalls.
+bool IsBatchableOp(uint32_t num) {
+  switch (num) {
+    case SYS_debug_write:
+    case SYS_write:
+    case SYS_map_page:
+    case SYS_unmap_page:
+    case SYS_share_page:
+    case SYS_create_user_task:
+    case SYS_destroy_user_task:
+    case SYS_copy_from_task:
+    case SYS_copy_to_task:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Run up to `to_submit` queued submissions of the current task's ring in
+// order, posting a completion for each. This stops early once the completion
+// ring is full and returns how many submissions it ran.
+RET_TYPE ring_enter(uint32_t to_submit) {
+  SyscallRing *ring = GetCurrentTask()->getRing();
+  if (!ring) return RING_NOT_SET_UP;
+
+  uint32_t sq_head = ring->sq_head;
+  uint32_t cq_tail = ring->cq_tail;
+  uint32_t sq_tail = __atomic_load_n(&ring->sq_tail, __ATOMIC_ACQUIRE);
+  uint32_t ran = 0;
+  while (ran < to_submit && sq_head != sq_tail) {
+    uint32_t cq_head = __atomic_load_n(&ring->cq_head, __ATOMIC_ACQUIRE);
+    if (cq_tail - cq_head == RING_ENTRIES) break;
+
+    // The task can rewrite the slot at any time, so work from a copy.
+    RingSubmission sub = ring->sq[sq_head % RING_ENTRIES];
+    RET_TYPE result = SYSCALL_ENOSYS;
+    if (IsBatchableOp(sub.opcode)) {
+      SyscallArgs args = {sub.args[0], sub.args[1], sub.args[2], sub.args[3],
+                          sub.args[4]};
+      result = DispatchSyscall(sub.opcode, &args);
+    }
+
+    ring->cq[cq_tail % RING_ENTRIES] = {sub.user_data, result};
+    __atomic_store_n(&ring->cq_tail, ++cq_tail, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->sq_head, ++sq_head, __ATOMIC_RELEASE);
+    ++ran;
+  }
+  return static_cast<RET_TYPE>(ran);
+}
+
+// Make the `num` calls in `calls` in order and store each result. With
+// MULTICALL_STOP_ON_ERROR, this stops after the first negative result. This
+// returns how many calls were made.
+RET_TYPE multicall(MultiCall *calls, uint32_t num, uint32_t flags) {
+  if (num > MULTICALL_MAX) return MULTICALL_TOO_MANY;
+
+  uint32_t made = 0;
+  while (made < num) {
+    // The task can rewrite the call at any time, so work from a copy.
+    MultiCall call = calls[made];
+    RET_TYPE result = SYSCALL_ENOSYS;
+    if (IsBatchableOp(call.num)) {
+      SyscallArgs args = {call.args[0], call.args[1], call.args[2],
+                          call.args[3], call.args[4]};
+      result = DispatchSyscall(call.num, &args);
+    }
+    calls[made++].result = result;
+    if (result < 0 && (flags & MULTICALL_STOP_ON_ERROR)) break;
+  }
+  return static_cast<RET_TYPE>(made);
+}
+
+// The task `handle` refers to in the current task's handle table, retained
+// until this goes out of scope so another task cannot destroy it while a
+// syscall uses it. get() is null if the handle is not open or its task was
+// destroyed.
+class TaskFromHandle {
+ public:
+  TaskFromHandle(uint32_t handle) : ref_(0), task_(nullptr) {
+    if (CurrentHandles().Lookup(handle, kHandleTask, ref_))
+      task_ = RetainTask(ref_);
+  }
+  ~TaskFromHandle() {
+    if (task_) ReleaseTask(ref_);
+  }
+
+  Task *get() const { return task_; }
+
+  // The task if it is a user task, or null.
+  UserTask *getUserTask() const {
+    if (!task_ || !task_->isUserTask()) return nullptr;
+    return static_cast<UserTask *>(task_);
+  }
+
+ private:
+  uint32_t ref_;
+  Task *task_;
+};
+
+// Close `handle` and destroy its task once it exits. A task cannot destroy
+// itself.
+RET_TYPE DestroyTaskHandle(uint32_t handle) {
+  uint32_t ref;
+  if (!CurrentHandles().Lookup(handle, kHandleTask, ref) ||
+      ref == GetCurrentTask()->getRef() ||
+      !CurrentHandles().Remove(handle, kHandleTask, ref))
+    return SYSCALL_EBADF;
+
+  // Other handles to the task may have destroyed it already. Only user tasks
+  // are ever given out.
+  Task *task = UnregisterTask(ref);
+  if (!task) return SYSCALL_EBADF;
   assert(task->isUserTask());
 
-  // Temporarily enable tasks here to allow for the destructor to call Join.
+  // Temporarily enable tasks here to allow for the destructor to call Join and
+  // wait for syscalls still using the task.
   // FIXME: This should not be explicitly set here.
   EnableInterrupts();
   delete task;
   DisableInterrupts();
+  return 0;
+}
+
+// The current task's handle to `task`: its own handle if it shares the table,
+// one already open for it, or else `reserved`. `reserved` is closed if it is
+// not used.
+uint32_t HandleForTask(const Task &task, uint32_t reserved) {
+  HandleTable &handles = CurrentHandles();
+  uint32_t handle = task.getHandles() == &handles
+                        ? task.getSelfHandle()
+                        : handles.Find(kHandleTask, task.getRef());
+  if (handle == HANDLE_INVALID) {
+    handles.Set(reserved, task.getRef());
+    return reserved;
+  }
+  CloseHandle(reserved);
+  return handle;
+}
+
+// The message words of a SYSCALL_MSG syscall follow the task handle in EBX.
+void ReadMessage(const SyscallArgs &args, uint32_t words[IPC_MSG_WORDS]) {
+  words[0] = args.ecx;
+  words[1] = args.edx;
+  words[2] = args.esi;
+  words[3] = args.edi;
+}
+
+void WriteMessage(SyscallArgs &args, uint32_t handle,
+                  const uint32_t words[IPC_MSG_WORDS]) {
+  args.ebx = handle;
+  args.ecx = words[0];
+  args.edx = words[1];
+  args.esi = words[2];
+  args.edi = words[3];
+}
 
+// Call the server in EBX with the message words and return its reply in them.
+RET_TYPE ipc_call(SyscallArgs &args) {
+  TaskFromHandle handle(args.ebx);
+  UserTask *server = handle.getUserTask();
+  if (!server) return SYSCALL_EBADF;
+  uint32_t words[IPC_MSG_WORDS];
+  ReadMessage(args, words);
+  RET_TYPE res = IPCCall(*server, words);
+  if (res == 0) WriteMessage(args, args.ebx, words);
+  return res;
+}
+
+// Reply to the client in EBX (unless it is 0) with the message words, then
+// return the next call to this task with its client in EBX.
+RET_TYPE ipc_reply_and_wait(SyscallArgs &args) {
+  uint32_t words[IPC_MSG_WORDS];
+  ReadMessage(args, words);
+
+  // The client is only retained while replying. Waiting for the next call can
+  // take arbitrarily long, and holding it would keep it from being destroyed.
+  const Task *handoff = nullptr;
+  uint32_t reserved;
+  {
+    TaskFromHandle handle(args.ebx);
+    UserTask *client = handle.getUserTask();
+    if (args.ebx != HANDLE_INVALID && !client) return SYSCALL_EBADF;
+
+    // Make room for the next caller's handle first, so a call is never taken
+    // that this task cannot be told about.
+    reserved = ReserveHandle();
+    if (reserved == HANDLE_INVALID) return SYSCALL_EMFILE;
+
+    if (client) {
+      RET_TYPE res = IPCReply(*client, words);
+      if (res != 0) {
+        CloseHandle(reserved);
+        return res;
+      }
+      handoff = client;
+    }
+  }
+
+  // A caller stays blocked until it is replied to, so it cannot be destroyed
+  // while this uses it.
+  Task *caller;
+  IPCWait(handoff, words, caller);
+  WriteMessage(args, HandleForTask(*caller, reserved), words);
   return 0;
 }
 
+// Reply to the client in EBX with the message words without waiting.
+RET_TYPE ipc_reply(SyscallArgs &args) {
+  TaskFromHandle handle(args.ebx);
+  UserTask *client = handle.getUserTask();
+  if (!client) return SYSCALL_EBADF;
+  uint32_t words[IPC_MSG_WORDS];
+  ReadMessage(args, words);
+  return IPCReply(*client, words);
+}
+
+RET_TYPE destroy_user_task(uint32_t handle) {
+  return DestroyTaskHandle(handle);
+}
+
+// Open another handle to the task `handle` in the table of the task `task`, or
+// in the current task's own table if `task` is 0.
+RET_TYPE dup_handle(uint32_t handle, uint32_t task, uint32_t *new_handle) {
+  uint32_t ref;
+  if (!CurrentHandles().Lookup(handle, kHandleTask, ref)) return SYSCALL_EBADF;
+  HandleTable *handles = &CurrentHandles();
+  TaskFromHandle owner_handle(task);
+  if (task != HANDLE_INVALID) {
+    UserTask *owner = owner_handle.getUserTask();
+    if (!owner) return SYSCALL_EBADF;
+    handles = owner->getHandles();
+  }
+  uint32_t dup = handles->Install(kHandleTask, ref);
+  if (dup == HANDLE_INVALID) return SYSCALL_EMFILE;
+  *new_handle = dup;
+  return 0;
+}
+
+// Close `handle` without destroying its task. The handle a task reports for
+// itself stays open.
+RET_TYPE close_handle(uint32_t handle) {
+  uint32_t ref;
+  if (handle == GetCurrentTask()->getSelfHandle() ||
+      !CurrentHandles().Remove(handle, kHandleTask, ref))
+    return SYSCALL_EBADF;
+  return 0;
+}
+
+// The ticks left until `deadline`, or kWaitNoTimeout if the wait is not timed.
+uint32_t TicksUntil(uint32_t deadline, bool timed) {
+  if (!timed) return kWaitNoTimeout;
+  if (TickReached(deadline)) return 0;
+  return deadline - GetTicks();
+}
+
+// Wait for any of `num` tasks to exit, destroy it, and return its index in
+// `handles`.
+RET_TYPE wait_any_task(const uint32_t *handles, uint32_t num, uint32_t flags,
+                       uint32_t timeout_ms) {
+  bool timed = timeout_ms != TIMEOUT_INFINITE;
+  uint32_t deadline = GetTicks() + TimeoutToTicks(timeout_ms);
+  while (true) {
+    // Wait on exits before checking so one in between still wakes this task.
+    Waiter waiter = {GetCurrentTask(), /*woken=*/false};
+    WaitQueue::Entry entry = {};
+    GetTaskExitQueue().Add(entry, waiter);
+
+    RET_TYPE exited = WAIT_NONE_EXITED;
+    for (uint32_t i = 0; i < num && exited == WAIT_NONE_EXITED; ++i) {
+      // This must not be retained past the loop since destroying the task
+      // waits for it to be released.
+      TaskFromHandle handle(handles[i]);
+      Task *task = handle.get();
+      if (!task)
+        exited = SYSCALL_EBADF;
+      else if (task->Exiting())
+        exited = static_cast<RET_TYPE>(i);
+    }
+    uint32_t timeout_ticks = TicksUntil(deadline, timed);
+    bool wait = exited == WAIT_NONE_EXITED && !(flags & WAIT_NOHANG) && num &&
+                timeout_ticks;
+    if (wait) WaitUntilWoken(waiter, timeout_ticks);
+    RemoveWait(entry);
+
+    if (exited >= 0) {
+      RET_TYPE res = DestroyTaskHandle(handles[exited]);
+      return res < 0 ? res : exited;
+    }
+    if (!wait) return exited;
+  }
+}
+
+// Where one poll entry waits. Only futex words have their own queues.
+struct PollWait {
+  bool futex;
+  union {
+    WaitQueue::Entry entry;
+    FutexWaiter futex_entry;
+  };
+};
+
+// Return which bits of `entry` are ready, and link `wait` so `waiter` is woken
+// once that may have changed.
+uint32_t CheckPollEntry(const PollEntry &entry, Waiter &waiter,
+                        PollWait &wait) {
+  switch (entry.type) {
+    case POLL_FD: {
+      int32_t ready = PollFile(entry.id, entry.events, &wait.entry, waiter);
+      return ready < 0 ? POLL_INVALID : static_cast<uint32_t>(ready);
+    }
+    case POLL_TASK: {
+      TaskFromHandle handle(entry.id);
+      Task *task = handle.get();
+      if (!task) return POLL_INVALID;
+      GetTaskExitQueue().Add(wait.entry, waiter);
+      return task->Exiting() ? POLL_EXITED : 0;
+    }
+    case POLL_FUTEX: {
+      const auto *addr = reinterpret_cast<const uint32_t *>(entry.id);
+      int32_t res =
+          FutexAddWaiter(wait.futex_entry, waiter, addr, entry.value);
+      if (!res) {
+        wait.futex = true;
+        return 0;
+      }
+      wait.entry = {};  // Nothing to unlink.
+      return res == FUTEX_WOULD_BLOCK ? POLL_CHANGED : POLL_INVALID;
+    }
+    default:
+      return POLL_INVALID;
+  }
+}
+
+// Wait until any of `num` entries is ready or `timeout_ms` pass, set which
+// bits of each are ready, and return how many are ready at all. Waiting is
+// driven by the things polled, so nothing is checked again until one changes.
+RET_TYPE poll(PollEntry *entries, uint32_t num, uint32_t timeout_ms) {
+  if (num > POLL_MAX) return POLL_TOO_MANY;
+
+  bool timed = timeout_ms != TIMEOUT_INFINITE;
+  uint32_t deadline = GetTicks() + TimeoutToTicks(timeout_ms);
+  while (true) {
+    Waiter waiter = {GetCurrentTask(), /*woken=*/false};
+    PollWait waits[POLL_MAX];
+    int32_t ready = 0;
+    for (uint32_t i = 0; i < num; ++i) {
+      waits[i].futex = false;
+      waits[i].entry = {};
+      entries[i].revents = CheckPollEntry(entries[i], waiter, waits[i]);
+      if (entries[i].revents) ++ready;
+    }
+
+    uint32_t timeout_ticks = TicksUntil(deadline, timed);
+    bool woken =
+        !ready && timeout_ticks && WaitUntilWoken(waiter, timeout_ticks);
+    for (uint32_t i = 0; i < num; ++i) {
+      if (waits[i].futex)
+        FutexRemoveWaiter(waits[i].futex_entry);
+      else
+        RemoveWait(waits[i].entry);
+    }
+    if (!woken) return ready;
+  }
+}
+
 RET_TYPE copy_from_task(uint32_t handle, void *dst, const void *src,
                         size_t size) {
-  auto *task = reinterpret_cast<UserTask *>(handle);
-  assert(task->isUserTask());
-  task->Read(dst, src, size);
-  return 0;
+  TaskFromHandle task_handle(handle);
+  UserTask *task = task_handle.getUserTask();
+  if (!task) return SYSCALL_EBADF;
+  return static_cast<RET_TYPE>(task->Read(dst, src, size));
+}
+
+RET_TYPE copy_to_task(uint32_t handle, void *dst, const void *src,
+                      size_t size) {
+  TaskFromHandle task_handle(handle);
+  UserTask *task = task_handle.getUserTask();
+  if (!task) return SYSCALL_EBADF;
+  return static_cast<RET_TYPE>(task->Write(dst, src, size));
+}
+
+// Copy between the fragments of `local` in this task and `remote` in the task
+// `handle`, in order, until either list runs out or a remote page is not
+// mapped. This returns how many bytes were copied.
+template <typename CopyFunc>
+RET_TYPE CopyVectors(uint32_t handle, const iovec *local, uint32_t num_local,
+                     const iovec *remote, uint32_t num_remote, CopyFunc copy) {
+  TaskFromHandle task_handle(handle);
+  UserTask *task = task_handle.getUserTask();
+  if (!task) return SYSCALL_EBADF;
+  size_t copied = 0;
+  uint32_t l = 0, r = 0;
+  size_t l_off = 0, r_off = 0;
+  while (l < num_local && r < num_remote) {
+    size_t chunk = local[l].iov_len - l_off;
+    if (chunk > remote[r].iov_len - r_off) chunk = remote[r].iov_len - r_off;
+
+    auto *local_addr = static_cast<uint8_t *>(local[l].iov_base) + l_off;
+    auto *remote_addr = static_cast<uint8_t *>(remote[r].iov_base) + r_off;
+    size_t done = copy(*task, local_addr, remote_addr, chunk);
+    copied += done;
+    if (done < chunk) break;
+
+    l_off += chunk;
+    r_off += chunk;
+    if (l_off == local[l].iov_len) {
+      ++l;
+      l_off = 0;
+    }
+    if (r_off == remote[r].iov_len) {
+      ++r;
+      r_off = 0;
+    }
+  }
+  return static_cast<RET_TYPE>(copied);
+}
+
+RET_TYPE copy_from_task_v(uint32_t handle, const iovec *local,
+                          uint32_t num_local, const iovec *remote,
+                          uint32_t num_remote) {
+  return CopyVectors(handle, local, num_local, remote, num_remote,
+                     [](UserTask &task, uint8_t *local_addr,
+                        uint8_t *remote_addr, size_t size) {
+                       return task.Read(local_addr, remote_addr, size);
+                     });
+}
+
+RET_TYPE copy_to_task_v(uint32_t handle, const iovec *local,
+                        uint32_t num_local, const iovec *remote,
+                        uint32_t num_remote) {
+  return CopyVectors(handle, local, num_local, remote, num_remote,
+                     [](UserTask &task, uint8_t *local_addr,
+                        uint8_t *remote_addr, size_t size) {
+                       return task.Write(remote_addr, local_addr, size);
+                     });
 }
 
 // Map one page of memory from another task's address space to this task's
 // address space.
 RET_TYPE share_page(uint32_t handle, void **dst, const void *src) {
-  auto *task = reinterpret_cast<UserTask *>(handle);
-  assert(task->isUserTask());
-  assert(task != GetCurrentTask());
+  TaskFromHandle task_handle(handle);
+  UserTask *task = task_handle.getUserTask();
+  if (!task || task == GetCurrentTask()) return SYSCALL_EBADF;
   void *next_free_vpage =
       GetCurrentTask()->getPageDirectory().GetNextFreeVirtualUser();
   assert(next_free_vpage);
@@ -81,7 +704,11 @@ RET_TYPE unmap_page(void *dst) {
 }
 
 RET_TYPE get_parent_task(uint32_t *handle) {
-  *handle = reinterpret_cast<uint32_t>(GetCurrentTask()->getParent());
+  const Task *parent = GetCurrentTask()->getParent();
+  if (!parent->isUserTask()) return SYSCALL_EBADF;
+  uint32_t reserved = ReserveHandle();
+  if (reserved == HANDLE_INVALID) return SYSCALL_EMFILE;
+  *handle = HandleForTask(*parent, reserved);
   return 0;
 }
 
@@ -91,10 +718,14 @@ RET_TYPE get_parent_task_id(uint32_t *id) {
 }
 
 RET_TYPE get_current_task(uint32_t *handle) {
-  *handle = reinterpret_cast<uint32_t>(GetCurrentTask());
+  *handle = GetCurrentTask()->getSelfHandle();
   return 0;
 }
 
+RET_TYPE get_task_stats(TaskStats *stats, uint32_t max) {
+  return static_cast<RET_TYPE>(GetTaskStats(stats, max));
+}
+
 #define MAP_SUCCESS (0)
 #define MAP_UNALIGNED_ADDR (-1)
 #define MAP_ALREADY_MAPPED (-2)
@@ -114,61 +745,205 @@ RET_TYPE map_page(void *vaddr) {
   // FIXME: Note that if we allow the zero-th page, we will be returning NULL
   // from here effectively. We should have a separate way of returning a failure
   // state separate from the pointer returned.
-  uint8_t *paddr = GetPhysicalBitmap4M().NextFreePhysicalPage(/*start=*/1);
+  void *paddr = pd.AddNextFreePage(vaddr, /*flags=*/PG_USER, /*start=*/1);
   if (!paddr) return MAP_OOM;  // No physical addr available.
-
-  pd.AddPage(vaddr, paddr, /*flags=*/PG_USER);
   return MAP_SUCCESS;
 }
 
-void *kSyscalls[] = {
-    reinterpret_cast<void *>(debug_write),         // 0
-    reinterpret_cast<void *>(exit_user_task),      // 1
-    reinterpret_cast<void *>(debug_read),          // 2
-    reinterpret_cast<void *>(create_user_task),    // 3
-    reinterpret_cast<void *>(destroy_user_task),   // 4
-    reinterpret_cast<void *>(copy_from_task),      // 5
-    reinterpret_cast<void *>(get_parent_task),     // 6
-    reinterpret_cast<void *>(get_parent_task_id),  // 7
-    reinterpret_cast<void *>(map_page),            // 8
-    reinterpret_cast<void *>(share_page),          // 9
-    reinterpret_cast<void *>(unmap_page),          // 10
-    reinterpret_cast<void *>(get_current_task),    // 11
+template <typename T>
+T FromReg(uint32_t reg) {
+  if constexpr (std::is_pointer<T>::value) {
+    return reinterpret_cast<T>(reg);
+  } else {
+    return static_cast<T>(reg);
+  }
+}
+
+#define CHECK_SIGNATURE(name, ...)                                     \
+  static_assert(                                                       \
+      std::is_same<decltype(&name), RET_TYPE (*)(__VA_ARGS__)>::value, \
+      "The signature of " #name " does not match syscalls.def.");
+
+// Generate a trampoline for each syscall that only unpacks the arguments it
+// takes.
+#define SYSCALL0(name, num)   \
+  CHECK_SIGNATURE(name, void) \
+  RET_TYPE name##_trampoline(SyscallArgs &) { return name(); }
+#define SYSCALL1(name, num, T1)                   \
+  CHECK_SIGNATURE(name, T1)                       \
+  RET_TYPE name##_trampoline(SyscallArgs &args) { \
+    return name(FromReg<T1>(args.ebx));           \
+  }
+#define SYSCALL2(name, num, T1, T2)                            \
+  CHECK_SIGNATURE(name, T1, T2)                                \
+  RET_TYPE name##_trampoline(SyscallArgs &args) {              \
+    return name(FromReg<T1>(args.ebx), FromReg<T2>(args.ecx)); \
+  }
+#define SYSCALL3(name, num, T1, T2, T3)                       \
+  CHECK_SIGNATURE(name, T1, T2, T3)                           \
+  RET_TYPE name##_trampoline(SyscallArgs &args) {             \
+    return name(FromReg<T1>(args.ebx), FromReg<T2>(args.ecx), \
+                FromReg<T3>(args.edx));                       \
+  }
+#define SYSCALL4(name, num, T1, T2, T3, T4)                    \
+  CHECK_SIGNATURE(name, T1, T2, T3, T4)                        \
+  RET_TYPE name##_trampoline(SyscallArgs &args) {              \
+    return name(FromReg<T1>(args.ebx), FromReg<T2>(args.ecx),  \
+                FromReg<T3>(args.edx), FromReg<T4>(args.esi)); \
+  }
+#define SYSCALL5(name, num, T1, T2, T3, T4, T5)               \
+  CHECK_SIGNATURE(name, T1, T2, T3, T4, T5)                   \
+  RET_TYPE name##_trampoline(SyscallArgs &args) {             \
+    return name(FromReg<T1>(args.ebx), FromReg<T2>(args.ecx), \
+                FromReg<T3>(args.edx), FromReg<T4>(args.esi), \
+                FromReg<T5>(args.edi));                       \
+  }
+#define SYSCALL_MSG(name, num)         \
+  CHECK_SIGNATURE(name, SyscallArgs &) \
+  RET_TYPE name##_trampoline(SyscallArgs &args) { return name(args); }
+#include <syscalls.def>
+#undef CHECK_SIGNATURE
+
+struct SyscallEntry {
+  uint32_t num;
+  const char *name;
+  RET_TYPE (*trampoline)(SyscallArgs &);
 };
-constexpr size_t kNumSyscalls = sizeof(kSyscalls) / sizeof(*kSyscalls);
+
+constexpr SyscallEntry kSyscalls[] = {
+#define SYSCALL0(name, num) {num, #name, name##_trampoline},
+#define SYSCALL1(name, num, ...) {num, #name, name##_trampoline},
+#define SYSCALL2(name, num, ...) {num, #name, name##_trampoline},
+#define SYSCALL3(name, num, ...) {num, #name, name##_trampoline},
+#define SYSCALL4(name, num, ...) {num, #name, name##_trampoline},
+#define SYSCALL5(name, num, ...) {num, #name, name##_trampoline},
+#define SYSCALL_MSG(name, num) {num, #name, name##_trampoline},
+#include <syscalls.def>
+};
+constexpr uint32_t kNumSyscalls = sizeof(kSyscalls) / sizeof(*kSyscalls);
+
+constexpr bool SyscallsAreInOrder() {
+  for (uint32_t i = 0; i < kNumSyscalls; ++i)
+    if (kSyscalls[i].num != i) return false;
+  return true;
+}
+static_assert(SyscallsAreInOrder(),
+              "syscalls.def must be numbered in order with no gaps.");
+
+// How many times each syscall was made, across all CPUs.
+uint32_t SyscallCounts[kNumSyscalls];
 
 void SyscallHandler(X86Registers *regs) {
   assert(GetCurrentTask()->isUserTask() &&
          "Should not call syscalls from a kernel task.");
-  auto syscall_num = regs->eax;
-  assert(syscall_num < kNumSyscalls && "Invalid syscall!");
-  void *syscall = kSyscalls[syscall_num];
-
-  // We don't know how many parameters the function wants, so we just push them
-  // all to the stack in the correct order. The function will use all the
-  // parameters it wants and we can pop them all back off afterwards.
-  RET_TYPE ret = 0;
-  asm volatile(
-      "\
-    push %1 \n \
-    push %2 \n \
-    push %3 \n \
-    push %4 \n \
-    push %5 \n \
-    call *%6 \n \
-    pop %%ebx \n \
-    pop %%ebx \n \
-    pop %%ebx \n \
-    pop %%ebx \n \
-    pop %%ebx"
-      : "=a"(ret)
-      : "r"(regs->edi), "r"(regs->esi), "r"(regs->edx), "r"(regs->ecx),
-        "r"(regs->ebx), "r"(syscall));
-  regs->eax = static_cast<uint32_t>(ret);
+  SyscallArgs args = {regs->ebx, regs->ecx, regs->edx, regs->esi, regs->edi};
+  regs->eax = static_cast<uint32_t>(DispatchSyscall(regs->eax, &args));
+
+  // The interrupt stub restores these from `regs` on return.
+  regs->ebx = args.ebx;
+  regs->ecx = args.ecx;
+  regs->edx = args.edx;
+  regs->esi = args.esi;
+  regs->edi = args.edi;
+}
+
+constexpr uint32_t kSysenterCSMSR = 0x174;
+constexpr uint32_t kSysenterESPMSR = 0x175;
+constexpr uint32_t kSysenterEIPMSR = 0x176;
+constexpr uint32_t kCPUIDSEP = 1 << 11;
+
+void WriteMSR(uint32_t msr, uint32_t val) {
+  asm volatile("wrmsr" ::"c"(msr), "a"(val), "d"(0));
+}
+
+// Set up the SYSENTER MSRs on the current CPU. SYSENTER loads CS from the MSR
+// and SS from the next GDT entry, and SYSEXIT loads the user CS and SS from the
+// two entries after that, which matches our GDT layout.
+void EnableSysenter() {
+  static_assert(kKernelDataSegment == kKernelCodeSegment + 8);
+  static_assert(kUserCodeSegment == (kKernelCodeSegment + 16) + 3);
+  static_assert(kUserDataSegment == (kKernelCodeSegment + 24) + 3);
+
+  uint32_t edx;
+  asm volatile("cpuid" : "=d"(edx) : "a"(1) : "ebx", "ecx");
+  if (!(edx & kCPUIDSEP)) {
+    // libc checks the same bit and falls back to int 0x80.
+    DebugPrint("SYSENTER is not supported on this CPU.\n");
+    return;
+  }
+
+  WriteMSR(kSysenterCSMSR, kKernelCodeSegment);
+  WriteMSR(kSysenterESPMSR, reinterpret_cast<uint32_t>(GetKernelStackSlot()));
+  WriteMSR(kSysenterEIPMSR, reinterpret_cast<uint32_t>(sysenter_entry));
+}
+
+}  // namespace
+
+// This is called from both SyscallHandler() and DispatchSysenter() with
+// interrupts disabled.
+extern "C" RET_TYPE DispatchSyscall(uint32_t num, SyscallArgs *args) {
+  if (num >= kNumSyscalls) {
+    DebugPrint("Task {} made an invalid syscall {}\n",
+               GetCurrentTask()->getID(), num);
+    return SYSCALL_ENOSYS;
+  }
+  __atomic_add_fetch(&SyscallCounts[num], 1, __ATOMIC_RELAXED);
+  GetCurrentTask()->AccountSyscall();
+  return kSyscalls[num].trampoline(*args);
+}
+
+namespace {
+
+// The user frame sysenter.S returns through: the resume EIP and ESP it reads
+// and the saved EDX and ECX it writes.
+constexpr uint32_t kSysenterFrameSize = 16;
+
+// Whether the whole SYSENTER frame at `frame` is in memory the task can access.
+// This goes by the page flags rather than an address range since a main
+// thread's stack is in the shared user space below USER_START.
+bool IsSysenterFrameValid(uint32_t frame) {
+  if (frame > UINT32_MAX - (kSysenterFrameSize - 1)) return false;
+  PageDirectory &pd = GetCurrentTask()->getPageDirectory();
+  return pd.isUserMapped(reinterpret_cast<void *>(frame)) &&
+         pd.isUserMapped(
+             reinterpret_cast<void *>(frame + kSysenterFrameSize - 1));
+}
+
+// A task with no valid frame has nowhere to be returned to, so the syscall
+// fails by ending the task, like a fault in user code would.
+void CheckSysenterFrame(uint32_t frame) {
+  if (IsSysenterFrameValid(frame)) return;
+  DebugPrint("Task {} made a syscall through SYSENTER with a bad frame {}\n",
+             GetCurrentTask()->getID(), print::Hex(frame));
+  exit_this_task();
 }
 
 }  // namespace
 
+// This is called from sysenter.S with interrupts disabled. The stub pushes the
+// user's EBP, which points at the frame it returns through, right above the
+// SyscallArgs. The frame is checked before the syscall, and again after since
+// the syscall could have unmapped it.
+extern "C" RET_TYPE DispatchSysenter(uint32_t num, SyscallArgs *args) {
+  uint32_t frame = *reinterpret_cast<const uint32_t *>(args + 1);
+  CheckSysenterFrame(frame);
+  RET_TYPE res = DispatchSyscall(num, args);
+  CheckSysenterFrame(frame);
+  return res;
+}
+
+void DumpSyscallStats() {
+  DebugPrint("Syscall counts:\n");
+  for (const SyscallEntry &entry : kSyscalls) {
+    uint32_t count =
+        __atomic_load_n(&SyscallCounts[entry.num], __ATOMIC_RELAXED);
+    if (count) DebugPrint("  {}: {}\n", entry.name, count);
+  }
+}
+
 void InitializeSyscalls() {
   RegisterInterruptHandler(kSyscallInterrupt, SyscallHandler);
+  EnableSysenter();
 }
+
+void InitAPSyscalls() { EnableSysenter(); }
@@ -1,28 +1,264 @@
+#include <apic.h>
 #include <assert.h>
 #include <descriptortables.h>
+#include <ipc.h>
 #include <isr.h>
 #include <kernel.h>
 #include <kmalloc.h>
 #include <ktask.h>
 #include <paging.h>
 #include <panic.h>
+#include <smp.h>
+#include <spinlock.h>
 #include <string.h>
 #include <syscall.h>
+#include <sys/syscall.h>
+#include <timer.h>
+#include <vdso.h>
 
 namespace {
 
-Task *CurrentTask = nullptr;
-
 uint32_t next_tid = 0;
 
+}  // namespace
+
 struct TaskNode {
   Task *task;
   TaskNode *next;
 };
 
-TaskNode *ReadyQueue = nullptr;
+namespace {
+
+// Values of Task::wake_state_.
+enum WakeState : uint32_t {
+  kAwake,
+  kAboutToBlock,  // PrepareToBlock() was called.
+  kBlocked,       // Off the run queue until Wake() is called.
+};
+
+// Each CPU runs tasks from its own ready queue. The queue includes the task
+// currently running on that CPU. The lock only protects the queue, so it can be
+// taken by other CPUs looking for work to steal.
+struct CPUScheduler {
+  Task *current = nullptr;
+  TaskNode *queue = nullptr;
+  Spinlock lock{"run queue"};
+};
+
+CPUScheduler CPUSchedulers[kMaxCPUs];
 Task *kMainKernelTask = nullptr;
 
+// Held while TMP_SHARED_TASK_MEM_START is mapped for copying between tasks.
+// Kernel tasks on different CPUs share the kernel page directory, so they would
+// otherwise map over each other. This can be taken from the scheduler.
+TicketLock TmpSharedMemLock("tmp shared task memory");
+
+// Woken whenever a task starts exiting.
+WaitQueue TaskExits;
+
+// Maps a physical page at TMP_SHARED_TASK_MEM_START in the current address
+// space for the lifetime of this object. TmpSharedMemLock must be held.
+class TmpSharedMapping {
+ public:
+  TmpSharedMapping(const void *paddr)
+      : pd_(GetCurrentTask()->getPageDirectory()) {
+    pd_.AddPage(get(), paddr, /*flags=*/0, /*allow_physical_reuse=*/true);
+  }
+  ~TmpSharedMapping() { pd_.RemovePage(get()); }
+
+  uint8_t *get() const {
+    return reinterpret_cast<uint8_t *>(TMP_SHARED_TASK_MEM_START);
+  }
+
+ private:
+  PageDirectory &pd_;
+};
+
+// Kernel stacks of exited tasks, kept so spawning a task usually does not need
+// the heap. Nothing on a stack is read before it is written, so these are
+// reused as is.
+constexpr size_t kMaxPooledStacks = 16;
+Spinlock StackPoolLock("kernel stack pool");
+void *PooledStacks[kMaxPooledStacks] GUARDED_BY(StackPoolLock);
+size_t NumPooledStacks GUARDED_BY(StackPoolLock) = 0;
+
+template <typename T>
+T *AllocKernelStack() {
+  {
+    IRQSaveLockRAII<Spinlock> lock(StackPoolLock);
+    if (NumPooledStacks)
+      return static_cast<T *>(PooledStacks[--NumPooledStacks]);
+  }
+  return static_cast<T *>(kmalloc(DEFAULT_THREAD_STACK_SIZE));
+}
+
+void FreeKernelStack(void *stack) {
+  {
+    IRQSaveLockRAII<Spinlock> lock(StackPoolLock);
+    if (NumPooledStacks < kMaxPooledStacks) {
+      PooledStacks[NumPooledStacks++] = stack;
+      return;
+    }
+  }
+  kfree(stack);
+}
+
+void DrainStackPool() {
+  while (true) {
+    void *stack;
+    {
+      IRQSaveLockRAII<Spinlock> lock(StackPoolLock);
+      if (!NumPooledStacks) return;
+      stack = PooledStacks[--NumPooledStacks];
+    }
+    kfree(stack);
+  }
+}
+
+// Every live task, for taking snapshots of all of them. This is a leaf lock.
+Spinlock TaskListLock("task list");
+Task *AllTasks GUARDED_BY(TaskListLock) = nullptr;
+uint32_t NumTasks GUARDED_BY(TaskListLock) = 0;
+
+CPUScheduler &GetCPUScheduler() {
+  assert(!InterruptsAreEnabled() &&
+         "Interrupts should be disabled so we are not moved to another CPU.");
+  return CPUSchedulers[GetCPUIndex()];
+}
+
+// Move a task that can run here from another CPU's queue to the front of this
+// CPU's queue. This CPU's queue lock must be held. Other queues are only
+// try-locked so two CPUs stealing from each other cannot deadlock.
+bool StealTask(size_t this_cpu) {
+  CPUScheduler &sched = CPUSchedulers[this_cpu];
+  size_t num_cpus = GetNumCPUs();
+  for (size_t i = 1; i < num_cpus; ++i) {
+    CPUScheduler &victim = CPUSchedulers[(this_cpu + i) % num_cpus];
+    if (!victim.queue) continue;
+    if (!victim.lock.TryLock()) continue;
+
+    TaskNode *prev = nullptr;
+    for (TaskNode *node = victim.queue; node; prev = node, node = node->next) {
+      const Task *task = node->task;
+      if (task->isPinned() || task->isOnCPU()) continue;
+
+      if (prev)
+        prev->next = node->next;
+      else
+        victim.queue = node->next;
+      victim.lock.Unlock();
+
+      node->next = sched.queue;
+      sched.queue = node;
+      return true;
+    }
+    victim.lock.Unlock();
+  }
+  return false;
+}
+
+// Deadline tasks together may use up to this much of one CPU, leaving the rest
+// for round-robin tasks. Keeping the total within one CPU means every CPU can
+// meet the deadlines of the tasks it is given wherever they end up. The period
+// is capped so bandwidths fit in 32 bits.
+constexpr uint32_t kDeadlineBandwidthOne = 1 << 20;
+constexpr uint32_t kMaxDeadlineBandwidth = kDeadlineBandwidthOne / 100 * 95;
+constexpr uint32_t kMaxDeadlinePeriod = 1 << 11;
+
+Spinlock DeadlineBandwidthLock("deadline bandwidth");
+uint32_t TotalDeadlineBandwidth GUARDED_BY(DeadlineBandwidthLock) = 0;
+
+void ReleaseDeadlineBandwidth(uint32_t bandwidth) {
+  IRQSaveLockRAII<Spinlock> lock(DeadlineBandwidthLock);
+  TotalDeadlineBandwidth -= bandwidth;
+}
+
+void StartDeadlinePeriod(DeadlineState &dl) {
+  uint32_t now = GetTicks();
+  dl.abs_deadline = now + dl.deadline;
+  dl.next_period = now + dl.period;
+  dl.budget = dl.runtime;
+}
+
+// Whether a deadline task can run now. A task that used up its runtime waits
+// for its next period, and one that missed its deadline starts a new period.
+bool DeadlineTaskReady(DeadlineState &dl) {
+  if (!dl.budget) {
+    if (!TickReached(dl.next_period)) return false;
+    StartDeadlinePeriod(dl);
+  } else if (TickReached(dl.abs_deadline)) {
+    StartDeadlinePeriod(dl);
+  }
+  return true;
+}
+
+// A woken task keeps its deadline only if running out its budget by then stays
+// within its bandwidth. Otherwise it could take time from other deadline tasks,
+// so it starts a new period instead.
+void WakeDeadlineTask(DeadlineState &dl) {
+  if (!dl.budget) return;
+  uint32_t left = dl.abs_deadline - GetTicks();
+  if (TickReached(dl.abs_deadline) ||
+      static_cast<uint64_t>(dl.budget) * dl.deadline >
+          static_cast<uint64_t>(left) * dl.runtime)
+    StartDeadlinePeriod(dl);
+}
+
+// The deadline class runs the ready task with the earliest deadline.
+TaskNode *PickDeadlineTask(CPUScheduler &sched) REQUIRES(sched.lock) {
+  TaskNode *earliest = nullptr;
+  uint32_t earliest_deadline = 0;
+  for (TaskNode *node = sched.queue; node; node = node->next) {
+    Task *task = node->task;
+    if (task->getSchedPolicy() != kSchedDeadline) continue;
+    DeadlineState &dl = task->getDeadlineState();
+    if (!DeadlineTaskReady(dl)) continue;
+    if (earliest &&
+        static_cast<int32_t>(dl.abs_deadline - earliest_deadline) >= 0)
+      continue;
+    earliest = node;
+    earliest_deadline = dl.abs_deadline;
+  }
+  return earliest;
+}
+
+// Picked tasks move to the end of the queue, so the first round-robin task is
+// the one that has waited longest.
+TaskNode *PickRoundRobinTask(CPUScheduler &sched) REQUIRES(sched.lock) {
+  for (TaskNode *node = sched.queue; node; node = node->next)
+    if (node->task->getSchedPolicy() == kSchedRoundRobin) return node;
+  return nullptr;
+}
+
+// Each scheduling class picks which of its tasks on a queue runs next, or
+// returns null if none of them are ready. Classes are asked in this order, so a
+// ready task in an earlier class always runs before one in a later class.
+using PickNextFunc = TaskNode *(*)(CPUScheduler &sched);
+constexpr PickNextFunc kSchedClasses[] = {PickDeadlineTask, PickRoundRobinTask};
+
+TaskNode *PickNextTask(CPUScheduler &sched) REQUIRES(sched.lock) {
+  for (PickNextFunc pick_next : kSchedClasses)
+    if (TaskNode *node = pick_next(sched)) return node;
+  PANIC("Every CPU should have a round-robin boot task to run.");
+}
+
+// Find the node of `target` if it is waiting on this queue, so a blocking task
+// can hand the CPU straight to it. A ready deadline task still runs before a
+// round-robin target. `target` is only compared against tasks on the queue, so
+// it may already be gone.
+TaskNode *PickHandoffTask(CPUScheduler &sched, const Task *target)
+    REQUIRES(sched.lock) {
+  for (TaskNode *node = sched.queue; node; node = node->next) {
+    Task *task = node->task;
+    if (task != target) continue;
+    if (task == sched.current || task->isOnCPU()) return nullptr;
+    if (task->getSchedPolicy() == kSchedRoundRobin && PickDeadlineTask(sched))
+      return nullptr;
+    return node;
+  }
+  return nullptr;
+}
+
 enum Direction {
   // Copy from the current task to another task.
   CurrentToOther,
@@ -31,72 +267,153 @@ enum Direction {
   OtherToCurrent,
 };
 
+// How much is copied through the temporary mapping per hold of
+// TmpSharedMemLock. The lock disables interrupts, so copying a whole 4MB page
+// in one hold would stall the timer tick.
+constexpr size_t kTmpCopyChunk = 64 * 1024;
+
+// Copy `size` bytes between `buf` in the current address space and the
+// physical page `paddr`, starting `offset` bytes into it. The page is mapped
+// again for each chunk so interrupts can be taken in between.
 template <Direction Dir>
-void TaskMemcpy(Task &task, Task &other_task, void *dst, const void *src,
-                size_t size) {
-  DisableInterruptsRAII raii;
+void CopyPhysical(void *paddr, size_t offset, uint8_t *buf, size_t size) {
+  size_t done = 0;
+  while (done < size) {
+    size_t chunk = size - done;
+    if (chunk > kTmpCopyChunk) chunk = kTmpCopyChunk;
+
+    IRQSaveLockRAII<TicketLock> lock(TmpSharedMemLock);
+    TmpSharedMapping mapping(paddr);
+    uint8_t *mapped = mapping.get() + offset + done;
+    if (Dir == CurrentToOther)
+      memcpy(mapped, buf + done, chunk);
+    else
+      memcpy(buf + done, mapped, chunk);
+    done += chunk;
+  }
+}
 
-  if (!size) return;
+// Copy `size` bytes between the current task and `task`, one page of `task` at
+// a time through the temporary mapping. This stops early at a page `task` does
+// not have mapped and returns how much was copied.
+template <Direction Dir>
+size_t TaskMemcpy(Task &task, Task &other_task, void *dst, const void *src,
+                  size_t size) {
+  if (!size) return 0;
 
   if (&other_task == &task) {
     memcpy(dst, src, size);
-    return;
+    return size;
   }
 
-  const void *vaddr_page;
-  size_t vaddr_offset;
-  const void *task_vaddr = Dir == CurrentToOther ? dst : src;
-  if (reinterpret_cast<uint32_t>(task_vaddr) % kPageSize4M == 0) {
-    vaddr_page = task_vaddr;
-    vaddr_offset = 0;
-  } else {
-    vaddr_page = PageAddr4M(PageIndex4M(task_vaddr));
-    assert(task_vaddr > vaddr_page);
-    vaddr_offset =
-        static_cast<size_t>(reinterpret_cast<const uint8_t *>(task_vaddr) -
-                            reinterpret_cast<const uint8_t *>(vaddr_page));
+  assert(&other_task == GetCurrentTask());
+  PageDirectory &pd = task.getPageDirectory();
+  auto task_addr =
+      reinterpret_cast<uintptr_t>(Dir == CurrentToOther ? dst : src);
+  auto *current_addr = static_cast<uint8_t *>(
+      Dir == CurrentToOther ? const_cast<void *>(src) : dst);
+
+  size_t copied = 0;
+  while (copied < size) {
+    uintptr_t addr = task_addr + copied;
+    void *page = PageAddr4M(PageIndex4M(addr));
+    if (!pd.isVirtualMapped(page)) break;
+
+    size_t offset = addr % kPageSize4M;
+    size_t chunk = kPageSize4M - offset;
+    if (chunk > size - copied) chunk = size - copied;
+
+    CopyPhysical<Dir>(pd.GetPhysicalAddr(page), offset, current_addr + copied,
+                      chunk);
+    copied += chunk;
   }
-
-  void *paddr = task.getPageDirectory().GetPhysicalAddr(vaddr_page);
-  uint8_t *shared_mem = (uint8_t *)TMP_SHARED_TASK_MEM_START;
-  other_task.getPageDirectory().AddPage(shared_mem, paddr, /*flags=*/0,
-                                        /*allow_physical_reuse=*/true);
-
-  const void *adj_src =
-      Dir == CurrentToOther ? src : (shared_mem + vaddr_offset);
-  void *adj_dst = Dir == CurrentToOther ? (shared_mem + vaddr_offset) : dst;
-  memcpy(adj_dst, adj_src, size);
-
-  other_task.getPageDirectory().RemovePage(shared_mem);
+  return copied;
 }
 
 }  // namespace
 
-// This is used for constructing the main kernel task.
+// This is used for constructing boot tasks.
 Task::Task()
-    : id_(next_tid++),
+    : handles_(nullptr),
+      self_handle_(HANDLE_INVALID),
+      id_(__atomic_fetch_add(&next_tid, 1, __ATOMIC_RELAXED)),
+      ref_(RegisterTask(*this)),
       state_(RUNNING),
+      exiting_(false),
+      on_cpu_(1),
+      wake_state_(kAwake),
+      blocked_node_(nullptr),
+      pinned_(true),
+      sched_policy_(kSchedRoundRobin),
+      deadline_(),
+      fpu_state_(nullptr),
+      ring_(nullptr),
       pd_allocation_(GetKernelPageDirectory()),
+      saved_voluntarily_(false),
       parent_task_(nullptr) {
   memset(&regs_, 0, sizeof(regs_));
+  InitTaskFiles(files_, /*parent=*/nullptr);
+  AddToTaskList();
 }
 
-KernelTask::KernelTask() : Task() {}
+KernelTask::KernelTask() : Task(), stack_allocation_(nullptr) {}
 
 Task::Task(PageDirectory &pd_allocation)
-    : id_(next_tid++),
+    : handles_(nullptr),
+      self_handle_(HANDLE_INVALID),
+      id_(__atomic_fetch_add(&next_tid, 1, __ATOMIC_RELAXED)),
+      ref_(RegisterTask(*this)),
       state_(READY),
+      exiting_(false),
+      on_cpu_(0),
+      wake_state_(kAwake),
+      blocked_node_(nullptr),
+      pinned_(false),
+      sched_policy_(kSchedRoundRobin),
+      deadline_(),
+      fpu_state_(nullptr),
+      ring_(nullptr),
       pd_allocation_(pd_allocation),
+      saved_voluntarily_(false),
       parent_task_(GetCurrentTask()) {
   memset(&regs_, 0, sizeof(regs_));
-  assert(ReadyQueue && "Scheduling has not yet been initialized.");
+  assert(CPUSchedulers[0].queue && "Scheduling has not yet been initialized.");
+  InitTaskFiles(files_, &parent_task_->files_);
 
   parent_task_->AddChildTask(*this);
+  AddToTaskList();
 }
 
-void Task::AddChildTask(Task &task) { child_tasks_.push_back(&task); }
+void Task::AddToTaskList() {
+  // Boot tasks start out running and other tasks start out waiting to run.
+  memset(&stats_, 0, sizeof(stats_));
+  stats_.last_switch = ReadTimestampCounter();
+
+  IRQSaveLockRAII<Spinlock> lock(TaskListLock);
+  prev_task_ = nullptr;
+  next_task_ = AllTasks;
+  if (AllTasks) AllTasks->prev_task_ = this;
+  AllTasks = this;
+  ++NumTasks;
+}
+
+void Task::RemoveFromTaskList() {
+  IRQSaveLockRAII<Spinlock> lock(TaskListLock);
+  if (prev_task_)
+    prev_task_->next_task_ = next_task_;
+  else
+    AllTasks = next_task_;
+  if (next_task_) next_task_->prev_task_ = prev_task_;
+  --NumTasks;
+}
+
+void Task::AddChildTask(Task &task) {
+  LockRAII<Spinlock> lock(children_lock_);
+  child_tasks_.push_back(&task);
+}
 
 void Task::RemoveChildTask(Task &task) {
+  LockRAII<Spinlock> lock(children_lock_);
   auto task_iter = child_tasks_.find(&task);
   assert(task_iter != child_tasks_.end() && "Child task does not exist.");
   child_tasks_.erase(task_iter);
@@ -104,8 +421,7 @@ void Task::RemoveChildTask(Task &task) {
 
 KernelTask::KernelTask(TaskFunc func, void *arg)
     : Task(GetKernelPageDirectory()),
-      stack_allocation_(
-          reinterpret_cast<uint32_t *>(kmalloc(DEFAULT_THREAD_STACK_SIZE))) {
+      stack_allocation_(AllocKernelStack<uint32_t>()) {
   // Setup the initial stack which will be used when jumping into this task for
   // the first time.
   uint32_t *stack_bottom = getStackPointer();
@@ -128,80 +444,173 @@ KernelTask::KernelTask(TaskFunc func, void *arg)
 }
 
 UserTask::UserTask(TaskFunc func, size_t codesize, void *arg,
-                   CopyArgFunc copyfunc, size_t entry_offset)
-    : Task(*GetKernelPageDirectory().Clone()),
-      esp0_allocation_(toy::kmalloc<uint8_t>(DEFAULT_THREAD_STACK_SIZE)),
+                   CopyArgFunc copyfunc, size_t entry_offset,
+                   HandleTable *handles)
+    : Task(*AcquireUserPageDirectory()),
+      esp0_allocation_(AllocKernelStack<uint8_t>()),
+      thread_stack_(nullptr),
       userfunc_(func),
       usercode_size_(codesize),
       entry_offset_(entry_offset) {
-  void *paddr = GetPhysicalBitmap4M().NextFreePhysicalPage(/*start=*/1);
-
   void *user_shared = (void *)USER_SHARED_SPACE_START;
+  void *user_start = (void *)USER_START;
+  PageDirectory &pd = getPageDirectory();
 
-  // Allocate the shared user space.
-  assert(!getPageDirectory().isVirtualMapped(user_shared) &&
+  // Allocate the shared user space and the page for the user code.
+  assert(!pd.isVirtualMapped(user_shared) &&
          "The page directory for this user task should not have previously "
          "reserves the shared user space page.");
-  getPageDirectory().AddPage(user_shared, paddr, PG_USER);
-
-  // Temporarily use the same physical address for this page directory. Writes
-  // to this will also be written to the shared space in the user PD.
-  GetKernelPageDirectory().AddPage(user_shared, paddr, /*flags=*/0,
-                                   /*allow_physical_reuse=*/true);
-  void *stack_arg = copyfunc(arg, user_shared, (void *)USER_SHARED_SPACE_END);
-
-  // Setup the initial stack which will be used when jumping into this task for
-  // the first time.
-  uint32_t *stack_bottom = getStackPointer();
-  Write(--stack_bottom, &stack_arg, sizeof(stack_arg));
+  void *shared_paddr = pd.AddNextFreePage(user_shared, PG_USER, /*start=*/1);
+
+  {
+    // The shared page is filled through the temporary mapping in the current
+    // address space. It is at most one small startup block plus a stack frame,
+    // so it is written in a single hold of the lock.
+    IRQSaveLockRAII<TicketLock> lock(TmpSharedMemLock);
+    TmpSharedMapping shared(shared_paddr);
+    uint8_t *shared_start = shared.get();
+    uint8_t *shared_end =
+        shared_start + (USER_SHARED_SPACE_END - USER_SHARED_SPACE_START);
+
+    // `copyfunc` writes through the temporary mapping, so translate any
+    // pointer it returns into that mapping to where this task will see it.
+    auto *stack_arg =
+        static_cast<uint8_t *>(copyfunc(arg, shared_start, shared_end));
+    if (shared_start <= stack_arg && stack_arg < shared_end)
+      stack_arg = reinterpret_cast<uint8_t *>(user_shared) +
+                  (stack_arg - shared_start);
+
+    // Setup the initial stack which will be used when jumping into this task
+    // for the first time. This is the frame iret pops, followed by the
+    // argument for the entry point.
+    uint32_t *stack_bottom = getStackPointer();
+    uint32_t frame[] = {
+        static_cast<uint32_t>(USER_START + entry_offset),  // eip
+        kUserCodeSegment,                                  // cs
+        UINT32_C(0x202),  // eflags (interrupts enabled)
+        reinterpret_cast<uint32_t>(stack_bottom - 1),  // esp
+        kUserDataSegment,                              // ss
+        reinterpret_cast<uint32_t>(stack_arg),
+    };
+    stack_bottom -= sizeof(frame) / sizeof(*frame);
+    memcpy(shared_start + (reinterpret_cast<uint32_t>(stack_bottom) -
+                           USER_SHARED_SPACE_START),
+           frame, sizeof(frame));
+    getRegs().esp = reinterpret_cast<uint32_t>(stack_bottom);
+    getRegs().ds = kUserDataSegment;
+    getRegs().cs = kUserCodeSegment;
+  }
 
-  auto current_stack_bottom = reinterpret_cast<uint32_t>(stack_bottom);
-  Write(--stack_bottom, &kUserDataSegment, sizeof(uint32_t));
-  Write(--stack_bottom, &current_stack_bottom, sizeof(uint32_t));
-  getRegs().ds = kUserDataSegment;
+  // Copy the function code from the parent (current) task into this task's
+  // address space. Code over 4MB takes consecutive pages from USER_START.
+  auto *code = reinterpret_cast<uint8_t *>(userfunc_);
+  void *code_paddr = shared_paddr;
+  size_t num_code_pages =
+      usercode_size_ ? (usercode_size_ + kPageSize4M - 1) / kPageSize4M : 1;
+  for (size_t i = 0; i < num_code_pages; ++i) {
+    auto *vaddr = static_cast<uint8_t *>(user_start) + i * kPageSize4M;
+    code_paddr =
+        pd.AddNextFreePage(vaddr, PG_USER, PageIndex4M(code_paddr) + 1);
+    assert(code_paddr && "No physical page left for the user code.");
+
+    size_t offset = i * kPageSize4M;
+    size_t chunk = usercode_size_ - offset;
+    if (chunk > kPageSize4M) chunk = kPageSize4M;
+    CopyPhysical<CurrentToOther>(code_paddr, /*offset=*/0, code + offset,
+                                 chunk);
+  }
 
-  auto src = UINT32_C(0x202);  // Interrupts enabled.
-  Write(--stack_bottom, &src, sizeof(src));
+  // A new table always has room for the task's handle to itself.
+  handles_ = handles ? handles : new HandleTable;
+  self_handle_ = handles_->Install(kHandleTask, getRef());
+  assert(self_handle_ != HANDLE_INVALID);
 
-  Write(--stack_bottom, &kUserCodeSegment, sizeof(uint32_t));
-  getRegs().cs = kUserCodeSegment;
+  // Only queue the task once its code is in place since another CPU can pick
+  // it up right away.
+  AddToQueue();
+}
 
-  src = USER_START + entry_offset;
-  Write(--stack_bottom, &src, sizeof(src));
+UserTask *UserTask::CreateThread(uint32_t entry, void *arg,
+                                 uint32_t self_handle) {
+  assert(GetCurrentTask()->isUserTask() &&
+         "Threads can only be created from a user task.");
+  void *stack = GetCurrentTask()->getPageDirectory().AddNextFreeUserPage(
+      PG_USER, /*start=*/1);
+  if (!stack) return nullptr;
+  return new UserTask(static_cast<uint8_t *>(stack), entry, arg, self_handle);
+}
 
+UserTask::UserTask(uint8_t *thread_stack, uint32_t entry, void *arg,
+                   uint32_t self_handle)
+    : Task(GetCurrentTask()->getPageDirectory()),
+      esp0_allocation_(AllocKernelStack<uint8_t>()),
+      thread_stack_(thread_stack),
+      userfunc_(reinterpret_cast<TaskFunc>(entry)),
+      usercode_size_(0),
+      entry_offset_(entry - USER_START) {
+  RetainUserPageDirectory(getPageDirectory());
+  handles_ = GetCurrentTask()->getHandles();
+  handles_->Retain();
+  self_handle_ = self_handle;
+  handles_->Set(self_handle_, getRef());
+
+  // The new stack is mapped in the current address space, so the initial frame
+  // can be written to it directly. This is the frame iret pops, followed by a
+  // null return address and the argument for the entry point. The entry point
+  // sees the stack 16 byte aligned like after a normal call.
+  uint32_t *stack_bottom = getStackPointer() - 5;
+  uint32_t frame[] = {
+      entry,                                     // eip
+      kUserCodeSegment,                          // cs
+      UINT32_C(0x202),                           // eflags
+      reinterpret_cast<uint32_t>(stack_bottom),  // esp
+      kUserDataSegment,                          // ss
+      0,                                         // return address
+      reinterpret_cast<uint32_t>(arg),
+  };
+  stack_bottom -= 5;
+  memcpy(stack_bottom, frame, sizeof(frame));
   getRegs().esp = reinterpret_cast<uint32_t>(stack_bottom);
-  // End setting up the stack.
-
-  // We don't need to access the stack anymore after this.
-  GetKernelPageDirectory().RemovePage(user_shared);
+  getRegs().ds = kUserDataSegment;
+  getRegs().cs = kUserCodeSegment;
 
   AddToQueue();
-
-  // Copy the function code from the parent (current) task into this task's
-  // address space.
-  void *userstart_paddr = GetPhysicalBitmap4M().NextFreePhysicalPage();
-  getPageDirectory().AddPage((void *)USER_START, userstart_paddr, PG_USER);
-  assert(getPageDirectory().GetPhysicalAddr((void *)USER_START) ==
-         userstart_paddr);
-  Write((void *)USER_START, (void *)userfunc_, usercode_size_);
 }
 
 void Task::AddToQueue() {
+  // Allocate before taking the queue lock so the heap lock is never taken while
+  // holding a run queue lock.
   TaskNode *item = toy::kmalloc<TaskNode>(1);
   item->task = this;
-  item->next = ReadyQueue;
-  ReadyQueue = item;
+
+  DisableInterruptsRAII raii;
+  CPUScheduler &sched = GetCPUScheduler();
+  LockRAII<Spinlock> lock(sched.lock);
+  item->next = sched.queue;
+  sched.queue = item;
 }
 
 KernelTask::~KernelTask() {
-  if (this != GetMainKernelTask()) Join();
-  kfree(stack_allocation_);
+  // Boot tasks never exit, so there is nothing to wait for.
+  if (stack_allocation_) {
+    Join();
+    FreeKernelStack(stack_allocation_);
+  }
 }
 
 UserTask::~UserTask() {
   Join();
-  getPageDirectory().ReclaimPageDirRegion();
-  kfree(esp0_allocation_);
+
+  // Syscalls in other tasks may still be using this one through its handles.
+  // Stop new uses, fail calls still waiting on it so their clients release
+  // it, then wait for the rest to finish before freeing anything they touch.
+  UnregisterTask(getRef());
+  CancelIPC(*this);
+  WaitForTaskUsers(getRef());
+
+  if (thread_stack_) getPageDirectory().RemovePage(thread_stack_);
+  ReleaseUserPageDirectory(getPageDirectory());
+  FreeKernelStack(esp0_allocation_);
 }
 
 __attribute__((always_inline)) inline void DumpRegs() {
@@ -234,63 +643,193 @@ __attribute__((always_inline)) inline void DumpRegs() {
 
 void Task::Join() {
   assert(InterruptsAreEnabled());
-  while (this->state_ != COMPLETED) {}
+  while (this->state_ != COMPLETED) Yield();
 }
 
 void exit_this_task() {
   DisableInterrupts();
 
-  CurrentTask->state_ = COMPLETED;
+  // Tasks waiting on this one can only see Exiting() for now, since it is
+  // marked as completed only once we are off its stack.
+  Task *current = GetCurrentTask();
+  __atomic_store_n(&current->exiting_, true, __ATOMIC_RELEASE);
+  TaskExits.WakeAll();
 
-  // Remove this task then switch to another.
+  // Remove this task then switch to another. The task is marked as completed
+  // only after we are off its stack.
   schedule(nullptr);
   PANIC("Should have jumped to the next task");
 }
 
 const Task *GetMainKernelTask() { return kMainKernelTask; }
-Task *GetCurrentTask() { return CurrentTask; }
 
-extern "C" void switch_kernel_task_run(Task::X86TaskRegs *);
-extern "C" void switch_first_kernel_task_run(Task::X86TaskRegs *);
-extern "C" void switch_first_user_task_run(Task::X86TaskRegs *);
-extern "C" void switch_user_task_run(Task::X86TaskRegs *);
+WaitQueue &GetTaskExitQueue() { return TaskExits; }
+
+Task *GetCurrentTask() {
+  // Don't get moved to another CPU between finding our CPU and reading its
+  // current task.
+  bool interrupts_enabled = InterruptsAreEnabled();
+  DisableInterrupts();
+  Task *task = CPUSchedulers[GetCPUIndex()].current;
+  if (interrupts_enabled) EnableInterrupts();
+  return task;
+}
+
+// Each of these switches to the task whose registers are passed, then stores
+// `release_val` into `release_addr` once it is off the previous task's stack.
+// This is what lets another CPU pick up (or free) the previous task.
+extern "C" void switch_kernel_task_run(Task::X86TaskRegs *,
+                                       volatile uint32_t *release_addr,
+                                       uint32_t release_val);
+extern "C" void switch_first_kernel_task_run(Task::X86TaskRegs *,
+                                             volatile uint32_t *release_addr,
+                                             uint32_t release_val);
+extern "C" void switch_first_user_task_run(Task::X86TaskRegs *,
+                                           volatile uint32_t *release_addr,
+                                           uint32_t release_val);
+extern "C" void switch_user_task_run(Task::X86TaskRegs *,
+                                     volatile uint32_t *release_addr,
+                                     uint32_t release_val);
+extern "C" void switch_voluntary_task_run(Task::X86TaskRegs *,
+                                          volatile uint32_t *release_addr,
+                                          uint32_t release_val);
+
+using SwitchFunc = void (*)(Task::X86TaskRegs *, volatile uint32_t *, uint32_t);
+
+// Save only what the C calling convention needs to resume the current task,
+// then switch with `resume`. This returns when the current task is resumed
+// through switch_voluntary_task_run.
+extern "C" void switch_voluntary(uint32_t *save_esp, Task::X86TaskRegs *next,
+                                 volatile uint32_t *release_addr,
+                                 uint32_t release_val, SwitchFunc resume);
 
 void InitScheduler() {
-  assert(!ReadyQueue && !CurrentTask && !kMainKernelTask &&
+  CPUScheduler &sched = CPUSchedulers[0];
+  assert(!sched.queue && !sched.current && !kMainKernelTask &&
          "This function should not be called twice.");
-  CurrentTask = new KernelTask();
-  kMainKernelTask = CurrentTask;
+  sched.current = new KernelTask();
+  kMainKernelTask = sched.current;
 
-  ReadyQueue = toy::kmalloc<TaskNode>(1);
-  ReadyQueue->task = CurrentTask;
-  ReadyQueue->next = nullptr;
+  sched.queue = toy::kmalloc<TaskNode>(1);
+  sched.queue->task = sched.current;
+  sched.queue->next = nullptr;
 }
 
-void schedule(const X86Registers *regs) {
-  // The queue does not have any items and is not ready yet.
-  if (!ReadyQueue) return;
+void InitAPScheduler() {
+  assert(!InterruptsAreEnabled());
+  Task *idle = new KernelTask();
+  TaskNode *node = toy::kmalloc<TaskNode>(1);
+  node->task = idle;
+  node->next = nullptr;
+
+  CPUScheduler &sched = GetCPUScheduler();
+  assert(!sched.queue && !sched.current &&
+         "This function should not be called twice.");
+  LockRAII<Spinlock> lock(sched.lock);
+  sched.current = idle;
+  sched.queue = node;
+}
+
+// Take the node for `task` off the queue and return it.
+TaskNode *RemoveFromQueue(CPUScheduler &sched, const Task *task)
+    REQUIRES(sched.lock) {
+  TaskNode *node = sched.queue;
+  TaskNode *prev = nullptr;
+  while (node && node->task != task) {
+    prev = node;
+    node = node->next;
+  }
+  assert(node && "Could not find this task.");
+
+  if (prev) {
+    prev->next = node->next;
+  } else {
+    // This is the front of the queue.
+    assert(node == sched.queue);
+    sched.queue = sched.queue->next;
+  }
+  assert(sched.queue && "Every CPU should have a boot task left to run.");
+  return node;
+}
 
-  // Only one task is on the queue, so we don't need to change (fast path).
-  if (!ReadyQueue->next) return;
+// Switch to the next task on this CPU's queue. `regs` is the interrupt frame if
+// the current task is being preempted. If `handoff` is ready on this queue, it
+// runs next instead of the task the scheduling classes would pick.
+void SwitchTasks(const X86Registers *regs, SwitchReason reason,
+                 const Task *handoff) {
   assert(!InterruptsAreEnabled() &&
          "Interupts should not be enabled at this point.");
+  assert((reason == kPreempted) == (regs != nullptr));
+  size_t cpu = GetCPUIndex();
+  CPUScheduler &sched = CPUSchedulers[cpu];
+
+  // The queue does not have any items and is not ready yet.
+  if (!sched.queue) return;
 
-  // Iterate through the ready queue to the end.
-  TaskNode *last_node = ReadyQueue;
-  while (last_node->next) last_node = last_node->next;
+  Task *current = sched.current;
+  TaskNode *exited_node = nullptr;
+  bool exiting = reason == kExiting;
+
+  // Boot tasks cannot be woken on another CPU, so they only yield.
+  if (reason == kBlocking && current->isPinned()) reason = kYielding;
+
+  sched.lock.Lock();
+  if (exiting) {
+    assert(current != kMainKernelTask &&
+           "We should not manually be quitting the main kernel task.");
 
-  // Get the next task and move its node to the end of the queue.
-  TaskNode *task_node = ReadyQueue;
-  if (last_node != ReadyQueue) {
-    // Only cycle through nodes if there is more than 1 node in the queue.
-    ReadyQueue = ReadyQueue->next;
+    // Delete the current task since we got here from a task exit.
+    exited_node = RemoveFromQueue(sched, current);
+  } else if (reason == kBlocking) {
+    // Only block if nothing woke this task since PrepareToBlock(). Once this is
+    // set, a Wake() waits until this CPU is off the task's stack before putting
+    // it back on a queue.
+    uint32_t state = kAboutToBlock;
+    if (!__atomic_compare_exchange_n(&current->wake_state_, &state, kBlocked,
+                                     /*weak=*/false, __ATOMIC_ACQ_REL,
+                                     __ATOMIC_ACQUIRE)) {
+      sched.lock.Unlock();
+      return;
+    }
+    current->blocked_node_ = RemoveFromQueue(sched, current);
+  } else if (!sched.queue->next && !StealTask(cpu)) {
+    // Only the current task is on the queue and no other CPU has spare work,
+    // so we don't need to change (fast path).
+    sched.lock.Unlock();
+    return;
+  }
+
+  TaskNode *task_node = handoff ? PickHandoffTask(sched, handoff) : nullptr;
+  if (!task_node) task_node = PickNextTask(sched);
+  Task *task = task_node->task;
+  if (task == current) {
+    // Nothing should run before the current task, so keep running it.
+    assert(!exiting && reason != kBlocking);
+    sched.lock.Unlock();
+    return;
+  }
+
+  // Move the picked node to the end of the queue.
+  if (task_node->next) {
+    TaskNode **link = &sched.queue;
+    while (*link != task_node) link = &(*link)->next;
+    *link = task_node->next;
+
+    TaskNode *last_node = task_node->next;
+    while (last_node->next) last_node = last_node->next;
     last_node->next = task_node;
     task_node->next = nullptr;
   }
 
-  Task *task = task_node->task;
+  // Claim the task before unlocking so no other CPU steals it.
+  task->on_cpu_ = 1;
+  sched.lock.Unlock();
+
+  // Like AddToQueue(), don't take the heap lock with the queue locked.
+  kfree(exited_node);
+
   bool jump_to_user = task->isUserTask();
-  CurrentTask->user_in_kernel_space_ = false;
+  current->user_in_kernel_space_ = false;
 
   if (task->user_in_kernel_space_) {
     // Although we are switching to a user task, the interrupt for the switch
@@ -320,12 +859,12 @@ void schedule(const X86Registers *regs) {
     //   esp[6]: ds/ss
     //
     uint32_t *esp = reinterpret_cast<uint32_t *>(regs->esp);
-    assert(esp[0] == IRQ0 &&
+    assert((esp[0] == IRQ0 || esp[0] == kLAPICTimerInterrupt) &&
            "Expected this to only be called from a timer interrupt.");
     assert(
         esp[1] == 0 &&
         "No error code should be provided from the timer interrupt handler.");
-    if (CurrentTask->isKernelTask()) {
+    if (current->isKernelTask()) {
       // If we came from a kernel task, we can just discard the values added to
       // the stack by the IRQ handler and the interrupt.
       adjusted_esp = regs->esp + 20;
@@ -352,81 +891,216 @@ void schedule(const X86Registers *regs) {
         // just the esp value before pushing all interrupt-related values,
         // similar to the handling of a kernel task.
         adjusted_esp = regs->esp + 20;
-        CurrentTask->user_in_kernel_space_ = true;
+        current->user_in_kernel_space_ = true;
       }
     }
 
-    CurrentTask->getRegs().esp = adjusted_esp;
-    CurrentTask->getRegs().ebp = regs->ebp;
-
-    CurrentTask->getRegs().eax = regs->eax;
-    CurrentTask->getRegs().ebx = regs->ebx;
-    CurrentTask->getRegs().ecx = regs->ecx;
-    CurrentTask->getRegs().edx = regs->edx;
+    current->getRegs().esp = adjusted_esp;
+    current->getRegs().ebp = regs->ebp;
 
-    CurrentTask->getRegs().esi = regs->esi;
-    CurrentTask->getRegs().edi = regs->edi;
+    current->getRegs().eax = regs->eax;
+    current->getRegs().ebx = regs->ebx;
+    current->getRegs().ecx = regs->ecx;
+    current->getRegs().edx = regs->edx;
 
-    CurrentTask->getRegs().eip = regs->eip;
-    CurrentTask->getRegs().eflags = regs->eflags;
+    current->getRegs().esi = regs->esi;
+    current->getRegs().edi = regs->edi;
 
-    CurrentTask->getRegs().cs = static_cast<uint16_t>(regs->cs);
-    CurrentTask->getRegs().ds = static_cast<uint16_t>(regs->ds);
-    CurrentTask->getRegs().es = static_cast<uint16_t>(regs->ds);
-    CurrentTask->getRegs().fs = static_cast<uint16_t>(regs->ds);
-    CurrentTask->getRegs().gs = static_cast<uint16_t>(regs->ds);
-  } else {
-    assert(CurrentTask != kMainKernelTask &&
-           "We should not manually be quitting the main kernel task.");
+    current->getRegs().eip = regs->eip;
+    current->getRegs().eflags = regs->eflags;
 
-    // Delete the current task since we got here from a task exit.
-    // Find the node.
-    TaskNode *node = ReadyQueue;
-    TaskNode *prev = nullptr;
-    while (node && node->task != CurrentTask) {
-      prev = node;
-      node = node->next;
-    }
-    assert(node && "Could not find this task.");
+    current->getRegs().cs = static_cast<uint16_t>(regs->cs);
+    current->getRegs().ds = static_cast<uint16_t>(regs->ds);
+    current->getRegs().es = static_cast<uint16_t>(regs->ds);
+    current->getRegs().fs = static_cast<uint16_t>(regs->ds);
+    current->getRegs().gs = static_cast<uint16_t>(regs->ds);
+  }
 
-    if (prev) {
-      prev->next = node->next;
-    } else {
-      // This is the front of the queue.
-      assert(node == ReadyQueue);
-      ReadyQueue = ReadyQueue->next;
-    }
+  // An exiting task's FPU state can just be dropped.
+  UnloadFPU(exiting ? nullptr : current);
 
-    kfree(node);
-  }
+  uint64_t now = ReadTimestampCounter();
+  current->stats_.runtime += now - current->stats_.last_switch;
+  current->stats_.last_switch = now;
+  if (regs)
+    ++current->stats_.involuntary_switches;
+  else
+    ++current->stats_.voluntary_switches;
+  task->stats_.runqueue_wait += now - task->stats_.last_switch;
+  task->stats_.last_switch = now;
 
   task->SetupBeforeTaskRun();
   SwitchPageDirectory(task->getPageDirectory());
 
   bool first_task_run = task->OnFirstRun();
   task->state_ = RUNNING;
+  SetVDSOCurrentTask(cpu, *task);
 
   assert(
-      (first_task_run || task->getRegs().eip) &&
+      (first_task_run || task->saved_voluntarily_ || task->getRegs().eip) &&
       "Expected either for this to be the first time this task is run or to "
       "have been switched from prior, and eip would point to a valid address.");
 
   Task::X86TaskRegs *task_regs = &task->getRegs();
 
-  // Switch to the new task.
-  CurrentTask = task;
-  if (first_task_run && !jump_to_user) {
-    switch_first_kernel_task_run(task_regs);
+  // The previous task can be run elsewhere once we are off its stack. An exited
+  // task can instead be destroyed by whoever joins it.
+  static_assert(sizeof(TaskState) == sizeof(uint32_t));
+  volatile uint32_t *release_addr =
+      exiting ? reinterpret_cast<volatile uint32_t *>(&current->state_)
+              : &current->on_cpu_;
+  uint32_t release_val = exiting ? COMPLETED : 0;
+
+  SwitchFunc resume;
+  if (task->saved_voluntarily_) {
+    task->saved_voluntarily_ = false;
+    resume = switch_voluntary_task_run;
+  } else if (first_task_run && !jump_to_user) {
+    resume = switch_first_kernel_task_run;
   } else if (first_task_run && jump_to_user) {
-    switch_first_user_task_run(task_regs);
+    resume = switch_first_user_task_run;
   } else if (!first_task_run && jump_to_user) {
-    switch_user_task_run(task_regs);
+    resume = switch_user_task_run;
   } else {
-    switch_kernel_task_run(task_regs);
+    resume = switch_kernel_task_run;
+  }
+
+  // Switch to the new task.
+  sched.current = task;
+  if (reason == kYielding || reason == kBlocking) {
+    current->saved_voluntarily_ = true;
+    switch_voluntary(&current->getRegs().esp, task_regs, release_addr,
+                     release_val, resume);
+    return;
   }
+  resume(task_regs, release_addr, release_val);
   PANIC("Should've switched to a different task");
 }
 
+void schedule(const X86Registers *regs) {
+  SwitchTasks(regs, regs ? kPreempted : kExiting, /*handoff=*/nullptr);
+}
+
+void Yield() {
+  DisableInterruptsRAII raii;
+  SwitchTasks(/*regs=*/nullptr, kYielding, /*handoff=*/nullptr);
+}
+
+void PrepareToBlock() {
+  __atomic_store_n(&GetCurrentTask()->wake_state_, kAboutToBlock,
+                   __ATOMIC_SEQ_CST);
+}
+
+void BlockCurrentTask() {
+  DisableInterruptsRAII raii;
+  SwitchTasks(/*regs=*/nullptr, kBlocking, /*handoff=*/nullptr);
+}
+
+void BlockCurrentTaskFor(const Task &next) {
+  DisableInterruptsRAII raii;
+  SwitchTasks(/*regs=*/nullptr, kBlocking, &next);
+}
+
+void Task::Wake() {
+  if (__atomic_exchange_n(&wake_state_, kAwake, __ATOMIC_ACQ_REL) != kBlocked)
+    return;
+
+  // The task is off its queue, but its CPU may still be switching away from it.
+  while (__atomic_load_n(&on_cpu_, __ATOMIC_ACQUIRE)) asm volatile("pause");
+
+  TaskNode *node = blocked_node_;
+  blocked_node_ = nullptr;
+
+  if (sched_policy_ == kSchedDeadline) WakeDeadlineTask(deadline_);
+
+  // Time spent blocked is not time spent waiting to run.
+  stats_.last_switch = ReadTimestampCounter();
+
+  DisableInterruptsRAII raii;
+  CPUScheduler &sched = GetCPUScheduler();
+  LockRAII<Spinlock> lock(sched.lock);
+  node->next = sched.queue;
+  sched.queue = node;
+}
+
+void AccountTimerTicks(uint32_t ticks) {
+  assert(!InterruptsAreEnabled());
+
+  // The timer starts before the scheduler.
+  if (Task *current = CPUSchedulers[GetCPUIndex()].current)
+    current->AccountTicks(ticks);
+}
+
+int32_t SetDeadlineParams(uint32_t runtime_ms, uint32_t deadline_ms,
+                          uint32_t period_ms) {
+  Task *task = GetCurrentTask();
+  if (task->isPinned()) return DEADLINE_INVALID;
+
+  uint32_t runtime = 0, deadline = 0, period = 0, bandwidth = 0;
+  if (runtime_ms) {
+    if (runtime_ms > deadline_ms || deadline_ms > period_ms)
+      return DEADLINE_INVALID;
+    runtime = MsToTicks(runtime_ms);
+    deadline = MsToTicks(deadline_ms);
+    period = MsToTicks(period_ms);
+    if (period > kMaxDeadlinePeriod) return DEADLINE_INVALID;
+    bandwidth = runtime * kDeadlineBandwidthOne / deadline;
+  }
+
+  {
+    IRQSaveLockRAII<Spinlock> lock(DeadlineBandwidthLock);
+    uint32_t total = TotalDeadlineBandwidth + bandwidth;
+    if (task->sched_policy_ == kSchedDeadline)
+      total -= task->deadline_.bandwidth;
+    if (total > kMaxDeadlineBandwidth) return DEADLINE_OVERLOADED;
+    TotalDeadlineBandwidth = total;
+  }
+
+  // The timer charges the budget of whichever task is running here.
+  DisableInterruptsRAII raii;
+  DeadlineState &dl = task->deadline_;
+  dl.runtime = runtime;
+  dl.deadline = deadline;
+  dl.period = period;
+  dl.bandwidth = bandwidth;
+  if (runtime) StartDeadlinePeriod(dl);
+  task->sched_policy_ = runtime ? kSchedDeadline : kSchedRoundRobin;
+  return 0;
+}
+
+uint32_t GetTaskStats(TaskStats *stats, uint32_t max) {
+  uint64_t now = ReadTimestampCounter();
+  IRQSaveLockRAII<Spinlock> lock(TaskListLock);
+  uint32_t i = 0;
+  for (Task *task = AllTasks; task && i < max; task = task->next_task_, ++i) {
+    const Task::Stats &task_stats = task->stats_;
+    TaskStats &out = stats[i];
+    out.id = task->getID();
+    out.parent_id = task->parent_task_ ? task->parent_task_->getID()
+                                       : TASK_STATS_NO_PARENT;
+    out.flags = task->isUserTask() ? TASK_STATS_USER : 0;
+    out.ticks = task_stats.ticks;
+    out.runtime = task_stats.runtime;
+    out.runqueue_wait = task_stats.runqueue_wait;
+    out.voluntary_switches = task_stats.voluntary_switches;
+    out.involuntary_switches = task_stats.involuntary_switches;
+    out.syscalls = task_stats.syscalls;
+
+    // Include the time since the last switch. A finished task is still marked
+    // as on a CPU, but it is no longer running or waiting. A blocked task is
+    // not waiting to run either.
+    if (task->Finished() || task->wake_state_ == kBlocked) continue;
+    uint64_t since_switch = now - task_stats.last_switch;
+    if (task->isOnCPU()) {
+      out.flags |= TASK_STATS_ON_CPU;
+      out.runtime += since_switch;
+    } else {
+      out.runqueue_wait += since_switch;
+    }
+  }
+  return NumTasks;
+}
+
 void Task::X86TaskRegs::Dump() const {
   DebugPrint(
       "esp: {}\n"
@@ -462,18 +1136,30 @@ void UserTask::SetupBeforeTaskRun() {
 }
 
 void DestroyScheduler() {
-  assert(ReadyQueue && !ReadyQueue->next &&
-         "Expected only the main task to be left.");
-  delete ReadyQueue->task;
-  kfree(ReadyQueue);
+  StopAPs();
+  for (size_t cpu = 1; cpu < GetNumCPUs(); ++cpu) {
+    CPUScheduler &sched = CPUSchedulers[cpu];
+    assert(sched.queue && !sched.queue->next &&
+           "Expected only the idle task to be left.");
+    delete sched.queue->task;
+    kfree(sched.queue);
+  }
+
+  TaskNode *queue = CPUSchedulers[0].queue;
+  assert(queue && !queue->next && "Expected only the main task to be left.");
+  delete queue->task;
+  kfree(queue);
+
+  DrainStackPool();
+  DrainPageDirectoryPool();
 }
 
-void Task::Write(void *this_dst, const void *current_src, size_t size) {
+size_t Task::Write(void *this_dst, const void *current_src, size_t size) {
   return TaskMemcpy<CurrentToOther>(*this, *GetCurrentTask(), this_dst,
                                     current_src, size);
 }
 
-void Task::Read(void *current_dst, const void *task_src, size_t size) {
+size_t Task::Read(void *current_dst, const void *task_src, size_t size) {
   return TaskMemcpy<OtherToCurrent>(*this, *GetCurrentTask(), current_dst,
                                     task_src, size);
 }
@@ -499,8 +1185,22 @@ void Task::UnmapPage(void *vaddr) {
 
 Task::~Task() {
   assert(child_tasks_.empty());
+  RemoveFromTaskList();
+  kfree(fpu_state_);
+  if (sched_policy_ == kSchedDeadline)
+    ReleaseDeadlineBandwidth(deadline_.bandwidth);
+  CancelIPC(*this);
+  CloseTaskFiles(files_);
+  UnregisterTask(ref_);
+
+  if (handles_) {
+    // Other threads of the address space may still be using the table.
+    uint32_t ref;
+    handles_->Remove(self_handle_, kHandleTask, ref);
+    if (handles_->Release()) delete handles_;
+  }
 
-  // This will only be false for the main kernel task.
+  // This will only be false for boot tasks.
   // TODO: Wrap this with an `unlikely`.
   if (parent_task_) parent_task_->RemoveChildTask(*this);
 }
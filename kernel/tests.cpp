@@ -1,5 +1,10 @@
+#include <deferred.h>
+#include <futex.h>
 #include <ktask.h>
 #include <ktests.h>
+#include <spinlock.h>
+#include <sys/syscall.h>
+#include <timer.h>
 
 #include <cassert>
 
@@ -21,7 +26,29 @@ TEST(HandleInterrupt) {
   RegisterInterruptHandler(interrupt, old_handler);
 }
 
-TEST_SUITE(Interrupts) { RUN_TEST(HandleInterrupt); }
+volatile uint32_t DeferredSum;
+void AddToDeferredSum(uint32_t val) { DeferredSum += val; }
+void DeferringHandler(X86Registers *regs) {
+  DeferWork(AddToDeferredSum, regs->int_no);
+}
+
+TEST(DeferWorkFromInterrupt) {
+  DeferredSum = 0;
+  uint8_t interrupt = 3;
+  isr_t old_handler = GetInterruptHandler(interrupt);
+  RegisterInterruptHandler(interrupt, DeferringHandler);
+  asm volatile("int $0x3");
+  asm volatile("int $0x3");
+  RegisterInterruptHandler(interrupt, old_handler);
+
+  // The worker task runs these.
+  while (DeferredSum != 6) Yield();
+}
+
+TEST_SUITE(Interrupts) {
+  RUN_TEST(HandleInterrupt);
+  RUN_TEST(DeferWorkFromInterrupt);
+}
 
 void func(void *arg) {
   // Ensure that we increment x 100 times instead of just adding 100.
@@ -93,11 +120,64 @@ TEST(JoinOnDestructor) {
   ASSERT_EQ(val3, 300);
 }
 
+void PingPong(void *arg) {
+  volatile auto *turn = static_cast<uint32_t *>(arg);
+  for (uint32_t i = 1; i < 20; i += 2) {
+    while (*turn != i) Yield();
+    ++(*turn);
+  }
+}
+
+// The main task and another task take turns, so each must be switched back to
+// after giving up the CPU.
+TEST(YieldAlternatesTasks) {
+  volatile uint32_t turn = 0;
+  KernelTask t(PingPong, const_cast<uint32_t *>(&turn));
+  for (uint32_t i = 0; i < 20; i += 2) {
+    while (turn != i) Yield();
+    ++turn;
+  }
+  t.Join();
+  ASSERT_EQ(turn, 20);
+}
+
+void TryDeadlineParams(void *arg) {
+  auto *results = static_cast<int32_t *>(arg);
+  results[0] = SetDeadlineParams(/*runtime_ms=*/40, /*deadline_ms=*/200,
+                                 /*period_ms=*/400);
+  results[1] = SetDeadlineParams(100, 50, 200);
+  results[2] = SetDeadlineParams(100, 100, 100);  // All of a CPU.
+  results[3] = SetDeadlineParams(80, 100, 100);
+  results[4] = GetCurrentTask()->getSchedPolicy();
+  results[5] = SetDeadlineParams(0, 0, 0);
+  results[6] = GetCurrentTask()->getSchedPolicy();
+}
+
+TEST(DeadlineAdmission) {
+  int32_t results[7] = {};
+  KernelTask t(TryDeadlineParams, results);
+  t.Join();
+  ASSERT_EQ(results[0], 0);
+  ASSERT_EQ(results[1], DEADLINE_INVALID);
+  ASSERT_EQ(results[2], DEADLINE_OVERLOADED);
+
+  // Changing the parameters replaces the bandwidth the task had before.
+  ASSERT_EQ(results[3], 0);
+  ASSERT_EQ(results[4], kSchedDeadline);
+  ASSERT_EQ(results[5], 0);
+  ASSERT_EQ(results[6], kSchedRoundRobin);
+
+  // Boot tasks have to stay runnable.
+  ASSERT_EQ(SetDeadlineParams(20, 100, 100), DEADLINE_INVALID);
+}
+
 TEST_SUITE(Tasking) {
   RUN_TEST(TaskIDs);
   RUN_TEST(SimpleTasks);
   RUN_TEST(TaskExit);
   RUN_TEST(JoinOnDestructor);
+  RUN_TEST(YieldAlternatesTasks);
+  RUN_TEST(DeadlineAdmission);
 
   // TODO: Add test to assert user tasks get different address spaces.
 }
@@ -206,12 +286,239 @@ TEST(PageFault) {
   RegisterInterruptHandler(kPageFaultInterrupt, old_handler);
 }
 
+TEST(PageDirectoryPool) {
+  void *user_addr = reinterpret_cast<void *>(USER_START);
+  size_t free_pages = GetPhysicalBitmap4M().NumFreePages();
+
+  PageDirectory *pd = AcquireUserPageDirectory();
+  pd->AddNextFreePage(user_addr, PG_USER);
+  ReleaseUserPageDirectory(*pd);
+  ASSERT_EQ(GetPhysicalBitmap4M().NumFreePages(), free_pages);
+
+  // The released page directory is reused with only the kernel mappings left.
+  PageDirectory *pd2 = AcquireUserPageDirectory();
+  ASSERT_EQ(pd2, pd);
+  ASSERT_FALSE(pd2->isVirtualMapped(user_addr));
+  ASSERT_TRUE(pd2->isVirtualMapped(reinterpret_cast<void *>(KERNEL_START)));
+  ReleaseUserPageDirectory(*pd2);
+}
+
 TEST_SUITE(Paging) {
   RUN_TEST(PageFunctions);
   RUN_TEST(PagingTest);
   RUN_TEST(PageFault);
+  RUN_TEST(PageDirectoryPool);
+}
+
+// The thread safety analysis cannot follow locks held across the early returns
+// in the ASSERT macros, so these tests lock and unlock through these.
+template <typename LockTy>
+bool TryLockUnchecked(LockTy &lock) NO_THREAD_SAFETY_ANALYSIS {
+  return lock.TryLock();
+}
+
+template <typename LockTy>
+void LockUnchecked(LockTy &lock) NO_THREAD_SAFETY_ANALYSIS {
+  lock.Lock();
+}
+
+template <typename LockTy>
+void UnlockUnchecked(LockTy &lock) NO_THREAD_SAFETY_ANALYSIS {
+  lock.Unlock();
+}
+
+TEST(SpinlockTryLock) {
+  Spinlock lock;
+  ASSERT_FALSE(lock.isLocked());
+  ASSERT_TRUE(TryLockUnchecked(lock));
+  ASSERT_TRUE(lock.isLocked());
+  ASSERT_FALSE(TryLockUnchecked(lock));
+  UnlockUnchecked(lock);
+  ASSERT_FALSE(lock.isLocked());
+  ASSERT_EQ(lock.getStats().acquisitions, 1);
+}
+
+TEST(TicketLockTryLock) {
+  TicketLock lock;
+  ASSERT_TRUE(TryLockUnchecked(lock));
+  ASSERT_FALSE(TryLockUnchecked(lock));
+  UnlockUnchecked(lock);
+  LockUnchecked(lock);
+  ASSERT_TRUE(lock.isLocked());
+  UnlockUnchecked(lock);
+  ASSERT_FALSE(lock.isLocked());
+  ASSERT_EQ(lock.getStats().acquisitions, 2);
+}
+
+TEST(IRQSaveRestoresInterrupts) {
+  Spinlock lock;
+  ASSERT_TRUE(InterruptsAreEnabled());
+  {
+    IRQSaveLockRAII<Spinlock> raii(lock);
+    ASSERT_FALSE(InterruptsAreEnabled());
+    ASSERT_TRUE(lock.isLocked());
+  }
+  ASSERT_TRUE(InterruptsAreEnabled());
+  ASSERT_FALSE(lock.isLocked());
+}
+
+struct LockedCounter {
+  TicketLock lock;
+  uint32_t count;
+};
+
+void IncrementLockedCounter(void *arg) {
+  auto *counter = static_cast<LockedCounter *>(arg);
+  for (int i = 0; i < 1000; ++i) {
+    LockRAII<TicketLock> lock(counter->lock);
+    // Split the read and write so an unlocked race would lose increments.
+    uint32_t count = counter->count;
+    counter->count = count + 1;
+  }
+}
+
+TEST(LockedCounterAcrossTasks) {
+  LockedCounter counter{};
+  {
+    KernelTask t(IncrementLockedCounter, &counter);
+    KernelTask t2(IncrementLockedCounter, &counter);
+  }
+  ASSERT_EQ(counter.count, 2000);
+}
+
+uint32_t FutexWord;
+
+void WaitOnFutexWord(void *arg) {
+  *static_cast<int32_t *>(arg) = FutexWait(&FutexWord, 0);
+}
+
+TEST(FutexWakeWaiter) {
+  FutexWord = 1;
+  ASSERT_EQ(FutexWait(&FutexWord, 0), FUTEX_WOULD_BLOCK);
+  ASSERT_EQ(FutexWake(&FutexWord, 1), 0);
+
+  FutexWord = 0;
+  int32_t result = 1;
+  KernelTask t(WaitOnFutexWord, &result);
+
+  // Keep waking until the task has started waiting.
+  while (FutexWake(&FutexWord, 1) == 0) Yield();
+  t.Join();
+  ASSERT_EQ(result, 0);
+}
+
+TEST(FutexWaitTimesOut) {
+  FutexWord = 0;
+  ASSERT_EQ(FutexWait(&FutexWord, 0, /*timeout_ticks=*/2), FUTEX_TIMED_OUT);
+}
+
+TEST_SUITE(Locking) {
+  RUN_TEST(SpinlockTryLock);
+  RUN_TEST(TicketLockTryLock);
+  RUN_TEST(IRQSaveRestoresInterrupts);
+  RUN_TEST(LockedCounterAcrossTasks);
+  RUN_TEST(FutexWakeWaiter);
+  RUN_TEST(FutexWaitTimesOut);
 }
 
+void CountTimer(void *arg) { ++*static_cast<uint32_t *>(arg); }
+
+TEST(TimersExpireInOrder) {
+  uint32_t fired = 0;
+  Timer near = {}, far = {};
+  near.callback = far.callback = CountTimer;
+  near.arg = far.arg = &fired;
+  near.expires = GetTicks() + 1;
+
+  // This is past the first level of the wheel, so it has to be cascaded.
+  far.expires = GetTicks() + 70;
+  AddTimer(far);
+  AddTimer(near);
+
+  SleepUntil(near.expires);
+  ASSERT_EQ(fired, 1);
+  SleepUntil(far.expires);
+  ASSERT_EQ(fired, 2);
+  ASSERT_FALSE(CancelTimer(far));
+
+  near.expires = GetTicks() + 1000;
+  AddTimer(near);
+  ASSERT_TRUE(CancelTimer(near));
+  ASSERT_EQ(fired, 2);
+}
+
+void SleepTwoTicks(void *arg) {
+  uint32_t start = GetTicks();
+  SleepUntil(start + 2);
+  *static_cast<uint32_t *>(arg) = GetTicks() - start;
+}
+
+TEST(BlockedTaskSleeps) {
+  uint32_t slept = 0;
+  KernelTask t(SleepTwoTicks, &slept);
+  t.Join();
+  ASSERT_GE(slept, 2);
+}
+
+TEST_SUITE(Timers) {
+  RUN_TEST(TimersExpireInOrder);
+  RUN_TEST(BlockedTaskSleeps);
+}
+
+// The kernel is built without SSE, so the XMM registers are only ever touched
+// through these.
+void SetXMM0(uint32_t val) { asm volatile("movd %0, %%xmm0" ::"r"(val)); }
+
+uint32_t GetXMM0() {
+  uint32_t val;
+  asm volatile("movd %%xmm0, %0" : "=r"(val));
+  return val;
+}
+
+struct FPUTaskArgs {
+  uint32_t val;
+  volatile uint32_t *num_loaded;
+  bool had_state_before_use;
+  bool has_state_after_use;
+  uint32_t result;
+};
+
+void UseXMM0(void *arg) {
+  auto *args = static_cast<FPUTaskArgs *>(arg);
+  args->had_state_before_use = GetCurrentTask()->getFPUState();
+  SetXMM0(args->val);
+  args->has_state_after_use = GetCurrentTask()->getFPUState();
+
+  // Wait until the other task has also loaded its value, so at least one
+  // switch happens between setting and reading our register.
+  __atomic_add_fetch(args->num_loaded, 1, __ATOMIC_RELEASE);
+  while (__atomic_load_n(args->num_loaded, __ATOMIC_ACQUIRE) < 2) {}
+
+  args->result = GetXMM0();
+}
+
+TEST(FPUStateSavedAcrossSwitches) {
+  volatile uint32_t num_loaded = 0;
+  FPUTaskArgs args1{}, args2{};
+  args1.val = 0x12345678;
+  args1.num_loaded = &num_loaded;
+  args2.val = 0x9abcdef0;
+  args2.num_loaded = &num_loaded;
+  {
+    KernelTask t(UseXMM0, &args1);
+    KernelTask t2(UseXMM0, &args2);
+  }
+
+  ASSERT_FALSE(args1.had_state_before_use);
+  ASSERT_TRUE(args1.has_state_after_use);
+  ASSERT_FALSE(args2.had_state_before_use);
+  ASSERT_TRUE(args2.has_state_after_use);
+  ASSERT_EQ(args1.result, args1.val);
+  ASSERT_EQ(args2.result, args2.val);
+}
+
+TEST_SUITE(FPU) { RUN_TEST(FPUStateSavedAcrossSwitches); }
+
 }  // namespace
 
 void RunTests() {
@@ -219,4 +526,7 @@ void RunTests() {
   tests.RunSuite(Interrupts);
   tests.RunSuite(Tasking);
   tests.RunSuite(Paging);
+  tests.RunSuite(Locking);
+  tests.RunSuite(Timers);
+  tests.RunSuite(FPU);
 }
@@ -2,18 +2,108 @@
 #include <isr.h>
 #include <kernel.h>
 #include <ktask.h>
+#include <spinlock.h>
 #include <stdint.h>
 #include <timer.h>
-
-// Ensure a task runs for at least this many ticks before switching.
-constexpr uint32_t kQuanta = 2;
+#include <vdso.h>
 
 namespace {
 
-uint32_t tick = 0;
+// This is volatile since it's polled while calibrating the local APIC timer.
+volatile uint32_t tick = 0;
+
+uint32_t TicksPerSecond = 0;
+
+// The timer wheel has a level of slots for each range of expiry times. Level 0
+// has a slot for each of the next 64 ticks, level 1 has a slot for each of the
+// next 64 spans of 64 ticks, and so on. Every 64 ticks, the timers in the next
+// slot of level 1 move down to level 0, and likewise for higher levels.
+constexpr uint32_t kWheelBits = 6;
+constexpr uint32_t kWheelSlots = 1 << kWheelBits;
+constexpr uint32_t kWheelMask = kWheelSlots - 1;
+constexpr uint32_t kWheelLevels = 4;
+
+// Timers further out than this are kept in the top level until they get
+// closer.
+constexpr uint32_t kMaxWheelDelta = (1 << (kWheelBits * kWheelLevels)) - 1;
+
+// Timer callbacks run with this held. Timers can be added from any CPU, but
+// they only expire on the CPU taking PIT interrupts.
+Spinlock TimerWheelLock("timer wheel");
+Timer *TimerWheel[kWheelLevels][kWheelSlots] GUARDED_BY(TimerWheelLock);
+
+// The next tick to run the expired timers for.
+uint32_t WheelTick GUARDED_BY(TimerWheelLock) = 0;
+
+void LinkTimer(Timer &timer) REQUIRES(TimerWheelLock) {
+  uint32_t delta = timer.expires - WheelTick;
+  Timer **slot;
+  if (static_cast<int32_t>(delta) < 0) {
+    // This is already due, so run it on the next tick.
+    slot = &TimerWheel[0][WheelTick & kWheelMask];
+  } else {
+    uint32_t expires = timer.expires;
+    if (delta > kMaxWheelDelta) {
+      delta = kMaxWheelDelta;
+      expires = WheelTick + kMaxWheelDelta;
+    }
+    uint32_t level = 0;
+    while (delta >> (kWheelBits * (level + 1))) ++level;
+    slot = &TimerWheel[level][(expires >> (kWheelBits * level)) & kWheelMask];
+  }
+
+  timer.slot = slot;
+  timer.prev = nullptr;
+  timer.next = *slot;
+  if (*slot) (*slot)->prev = &timer;
+  *slot = &timer;
+}
+
+void UnlinkTimer(Timer &timer) REQUIRES(TimerWheelLock) {
+  if (timer.prev)
+    timer.prev->next = timer.next;
+  else
+    *timer.slot = timer.next;
+  if (timer.next) timer.next->prev = timer.prev;
+  timer.slot = nullptr;
+}
+
+// Move the timers in slot `index` of `level` to the levels below it and return
+// `index`.
+uint32_t Cascade(uint32_t level, uint32_t index) REQUIRES(TimerWheelLock) {
+  Timer *timer = TimerWheel[level][index];
+  TimerWheel[level][index] = nullptr;
+  while (timer) {
+    Timer *next = timer->next;
+    LinkTimer(*timer);
+    timer = next;
+  }
+  return index;
+}
+
+// Run every timer that expired up to tick `now`.
+void RunTimers(uint32_t now) {
+  LockRAII<Spinlock> lock(TimerWheelLock);
+  while (static_cast<int32_t>(now - WheelTick) >= 0) {
+    // Refill level 0 from the higher levels each time it wraps around.
+    uint32_t index = WheelTick & kWheelMask;
+    for (uint32_t level = 1; !index && level < kWheelLevels; ++level)
+      index = Cascade(level, (WheelTick >> (kWheelBits * level)) & kWheelMask);
+
+    Timer *&slot = TimerWheel[0][WheelTick & kWheelMask];
+    ++WheelTick;
+    while (Timer *timer = slot) {
+      UnlinkTimer(*timer);
+      timer->callback(timer->arg);
+    }
+  }
+}
 
 void TimerCallback(X86Registers *regs) {
   ++tick;
+  UpdateVDSOClock(tick, TicksPerSecond);
+  AccountTimerTicks(1);
+  RunTimers(tick);
 
   // NOTE: If it turns out the schedule() function takes longer than it does for
   // the PIT to tick once more, then it's possible for us to be stuck at a given
@@ -30,6 +120,8 @@ void TimerCallback(X86Registers *regs) {
 }  // namespace
 
 void InitTimer(uint32_t frequency) {
+  TicksPerSecond = frequency;
+
   // Register our timer callback.
   RegisterInterruptHandler(IRQ0, &TimerCallback);
 
@@ -52,3 +144,44 @@ void InitTimer(uint32_t frequency) {
 
   EnableInterrupts();
 }
+
+uint32_t GetTicks() { return tick; }
+
+uint32_t MsToTicks(uint32_t ms) {
+  // Split off whole seconds so this does not overflow.
+  return ms / 1000 * TicksPerSecond +
+         ((ms % 1000) * TicksPerSecond + 999) / 1000;
+}
+
+uint32_t TicksToMs(uint32_t ticks) {
+  return ticks / TicksPerSecond * 1000 +
+         (ticks % TicksPerSecond) * 1000 / TicksPerSecond;
+}
+
+void AddTimer(Timer &timer) {
+  assert(timer.callback && "Expected a callback for the timer.");
+  IRQSaveLockRAII<Spinlock> lock(TimerWheelLock);
+  LinkTimer(timer);
+}
+
+bool CancelTimer(Timer &timer) {
+  IRQSaveLockRAII<Spinlock> lock(TimerWheelLock);
+  if (!timer.slot) return false;
+  UnlinkTimer(timer);
+  return true;
+}
+
+void SleepUntil(uint32_t tick) {
+  Timer timer = {};
+  timer.callback = [](void *task) { static_cast<Task *>(task)->Wake(); };
+  timer.arg = GetCurrentTask();
+  timer.expires = tick;
+  AddTimer(timer);
+
+  while (true) {
+    PrepareToBlock();
+    if (TickReached(tick)) break;
+    BlockCurrentTask();
+  }
+  CancelTimer(timer);
+}
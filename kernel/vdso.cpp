@@ -0,0 +1,73 @@
+#include <assert.h>
+#include <ktask.h>
+#include <paging.h>
+#include <smp.h>
+#include <spinlock.h>
+#include <string.h>
+#include <sys/vdso.h>
+#include <vdso.h>
+
+static_assert(VDSO_ADDR == VDSO_START,
+              "libc and the kernel disagree on where the vDSO is mapped.");
+static_assert(VDSO_MAX_CPUS >= kMaxCPUs,
+              "The vDSO needs a slot for every CPU we bring up.");
+static_assert(sizeof(VDSOData) <= kPageSize4M);
+
+namespace {
+
+VDSOData &GetVDSO() { return *reinterpret_cast<VDSOData *>(VDSO_START); }
+
+// Each record has a single writer, so these only need to order the writes
+// against the sequence count that readers check.
+void BeginWrite(uint32_t &seq) {
+  __atomic_store_n(&seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void EndWrite(uint32_t &seq) {
+  __atomic_store_n(&seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+}  // namespace
+
+void InitVDSO() {
+  // The mapping is read-only for user tasks. The kernel can still write to it
+  // since CR0.WP is not set. Frame 0 holds low memory (the IVT, BIOS data, the
+  // AP trampoline and VGA memory), so start after it.
+  GetKernelPageDirectory().AddNextFreePage(reinterpret_cast<void *>(VDSO_START),
+                                           PG_USER, /*start=*/1,
+                                           /*writable=*/false);
+  memset(&GetVDSO(), 0, sizeof(VDSOData));
+}
+
+void UpdateVDSOClock(uint32_t ticks, uint32_t ticks_per_second) {
+  VDSOData &vdso = GetVDSO();
+  uint64_t now = ReadTimestampCounter();
+
+  // Average over the last several ticks so one late interrupt does not throw
+  // off interpolation for a whole tick. Shifts avoid 64-bit division.
+  uint64_t tsc_per_tick = vdso.tsc_per_tick;
+  if (vdso.tick_tsc) {
+    uint64_t delta = now - vdso.tick_tsc;
+    if (tsc_per_tick)
+      tsc_per_tick += (delta >> 3) - (tsc_per_tick >> 3);
+    else
+      tsc_per_tick = delta;
+  }
+
+  BeginWrite(vdso.clock_seq);
+  vdso.ticks = ticks;
+  vdso.ticks_per_second = ticks_per_second;
+  vdso.tick_tsc = now;
+  vdso.tsc_per_tick = tsc_per_tick;
+  EndWrite(vdso.clock_seq);
+}
+
+void SetVDSOCurrentTask(size_t cpu, const Task &task) {
+  assert(cpu < VDSO_MAX_CPUS);
+  VDSOCPU &slot = GetVDSO().cpus[cpu];
+  BeginWrite(slot.seq);
+  slot.task_id = task.getID();
+  slot.task_handle = task.getSelfHandle();
+  EndWrite(slot.seq);
+}
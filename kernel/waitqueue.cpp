@@ -0,0 +1,61 @@
+#include <assert.h>
+#include <ktask.h>
+#include <timer.h>
+#include <waitqueue.h>
+
+void WakeWaiter(Waiter &waiter) {
+  __atomic_store_n(&waiter.woken, true, __ATOMIC_RELEASE);
+  waiter.task->Wake();
+}
+
+bool WaitUntilWoken(Waiter &waiter, uint32_t timeout_ticks) {
+  bool timed = timeout_ticks != kWaitNoTimeout;
+  Timer timer = {};
+  if (timed) {
+    timer.callback = [](void *task) { static_cast<Task *>(task)->Wake(); };
+    timer.arg = waiter.task;
+    timer.expires = GetTicks() + timeout_ticks;
+    AddTimer(timer);
+  }
+
+  bool woken;
+  while (true) {
+    PrepareToBlock();
+    woken = __atomic_load_n(&waiter.woken, __ATOMIC_ACQUIRE);
+    if (woken) break;
+    if (timed && TickReached(timer.expires)) break;
+    BlockCurrentTask();
+  }
+  if (timed) CancelTimer(timer);
+  return woken;
+}
+
+void WaitQueue::Add(Entry &entry, Waiter &waiter) {
+  assert(!entry.queue && "This entry is already waiting.");
+  IRQSaveLockRAII<Spinlock> lock(lock_);
+  entry.waiter = &waiter;
+  entry.queue = this;
+  entry.prev = nullptr;
+  entry.next = head_;
+  if (head_) head_->prev = &entry;
+  head_ = &entry;
+}
+
+void WaitQueue::WakeAll() {
+  IRQSaveLockRAII<Spinlock> lock(lock_);
+  for (Entry *entry = head_; entry; entry = entry->next)
+    WakeWaiter(*entry->waiter);
+}
+
+void RemoveWait(WaitQueue::Entry &entry) {
+  WaitQueue *queue = entry.queue;
+  if (!queue) return;
+
+  IRQSaveLockRAII<Spinlock> lock(queue->lock_);
+  if (entry.prev)
+    entry.prev->next = entry.next;
+  else
+    queue->head_ = entry.next;
+  if (entry.next) entry.next->prev = entry.prev;
+  entry.queue = nullptr;
+}
@@ -1,75 +1,280 @@
 #include <_syscalls.h>
+#include <sys/syscall.h>
 
-#define INTERRUPT "$0x80"
+// Defined in _syscall_entry.S.
+extern "C" uint32_t __syscall_use_sysenter;
+
+#define SYSCALL "call __syscall_entry"
 #define RET_TYPE int32_t
 
-int32_t sys_debug_print(const char *str) {
-  RET_TYPE a;
-  asm volatile("int " INTERRUPT : "=a"(a) : "0"(0), "b"((uint32_t)str));
-  return a;
+void InitSyscallEntry() {
+  uint32_t eax, edx;
+  asm volatile("cpuid" : "=a"(eax), "=d"(edx) : "0"(1) : "ebx", "ecx");
+
+  // Some early Pentium Pros report SEP without actually supporting SYSENTER.
+  uint32_t family = (eax >> 8) & 0xf;
+  uint32_t model = (eax >> 4) & 0xf;
+  uint32_t stepping = eax & 0xf;
+  bool has_sep = edx & (1 << 11);
+  if (family == 6 && model < 3 && stepping < 3) has_sep = false;
+
+  __syscall_use_sysenter = has_sep;
 }
 
+namespace {
+namespace raw {
+
+// Generate a stub for each syscall that loads exactly the argument registers it
+// takes. The "memory" clobber is needed since many syscalls write through
+// pointer arguments.
+#define SYSCALL0(name, num)                                  \
+  RET_TYPE name() {                                          \
+    RET_TYPE ret;                                            \
+    asm volatile(SYSCALL : "=a"(ret) : "0"(num) : "memory"); \
+    return ret;                                              \
+  }
+#define SYSCALL1(name, num, T1)                                       \
+  RET_TYPE name(T1 a1) {                                              \
+    RET_TYPE ret;                                                     \
+    asm volatile(SYSCALL : "=a"(ret) : "0"(num), "b"(a1) : "memory"); \
+    return ret;                                                       \
+  }
+#define SYSCALL2(name, num, T1, T2)           \
+  RET_TYPE name(T1 a1, T2 a2) {               \
+    RET_TYPE ret;                             \
+    asm volatile(SYSCALL                      \
+                 : "=a"(ret)                  \
+                 : "0"(num), "b"(a1), "c"(a2) \
+                 : "memory");                 \
+    return ret;                               \
+  }
+#define SYSCALL3(name, num, T1, T2, T3)                \
+  RET_TYPE name(T1 a1, T2 a2, T3 a3) {                 \
+    RET_TYPE ret;                                      \
+    asm volatile(SYSCALL                               \
+                 : "=a"(ret)                           \
+                 : "0"(num), "b"(a1), "c"(a2), "d"(a3) \
+                 : "memory");                          \
+    return ret;                                        \
+  }
+#define SYSCALL4(name, num, T1, T2, T3, T4)                     \
+  RET_TYPE name(T1 a1, T2 a2, T3 a3, T4 a4) {                   \
+    RET_TYPE ret;                                               \
+    asm volatile(SYSCALL                                        \
+                 : "=a"(ret)                                    \
+                 : "0"(num), "b"(a1), "c"(a2), "d"(a3), "S"(a4) \
+                 : "memory");                                   \
+    return ret;                                                 \
+  }
+#define SYSCALL5(name, num, T1, T2, T3, T4, T5)                          \
+  RET_TYPE name(T1 a1, T2 a2, T3 a3, T4 a4, T5 a5) {                     \
+    RET_TYPE ret;                                                        \
+    asm volatile(SYSCALL                                                 \
+                 : "=a"(ret)                                             \
+                 : "0"(num), "b"(a1), "c"(a2), "d"(a3), "S"(a4), "D"(a5) \
+                 : "memory");                                            \
+    return ret;                                                          \
+  }
+#define SYSCALL_MSG(name, num)                                         \
+  RET_TYPE name(IPCMessage &msg) {                                     \
+    RET_TYPE ret;                                                      \
+    asm volatile(SYSCALL                                               \
+                 : "=a"(ret), "+b"(msg.task), "+c"(msg.words[0]),      \
+                   "+d"(msg.words[1]), "+S"(msg.words[2]),             \
+                   "+D"(msg.words[3])                                  \
+                 : "0"(num)                                            \
+                 : "memory");                                          \
+    return ret;                                                        \
+  }
+#include <syscalls.def>
+
+}  // namespace raw
+}  // namespace
+
+int32_t sys_debug_print(const char *str) { return raw::debug_write(str); }
+
 bool sys_debug_put(char c) {
   char str[2] = {c, 0};
   return sys_debug_print(str) == 0;
 }
 
-void sys_exit_task() { asm volatile("int " INTERRUPT ::"a"(1)); }
+void sys_exit_task() { raw::exit_user_task(); }
 
-bool sys_debug_read(char *c) {
-  RET_TYPE a;
-  asm volatile("int " INTERRUPT : "=a"(a) : "0"(2), "b"((uint32_t)c));
-  return a == 0;
-}
+bool sys_debug_read(char *c) { return raw::debug_read(c) == 0; }
 
 Handle sys_create_task(const void *entry, uint32_t codesize, void *arg,
                        size_t entry_offset) {
   Handle handle;
-  asm volatile("int " INTERRUPT ::"a"(3), "b"((uint32_t)entry),
-               "c"((uint32_t)codesize), "d"((uint32_t)arg),
-               "S"((uint32_t)&handle), "D"((uint32_t)entry_offset));
+  if (raw::create_user_task(const_cast<void *>(entry), codesize, arg, &handle,
+                            entry_offset))
+    return HANDLE_INVALID;
+  return handle;
+}
+
+Handle sys_spawn_program(const void *entry, uint32_t codesize,
+                         size_t entry_offset, const StartupBlock *startup) {
+  Handle handle;
+  if (raw::spawn_program(const_cast<void *>(entry), codesize, entry_offset,
+                         startup, &handle))
+    return HANDLE_INVALID;
+  return handle;
+}
+
+int32_t sys_destroy_task(Handle handle) {
+  return raw::destroy_user_task(handle);
+}
+
+int32_t sys_dup_handle(Handle handle, Handle task, Handle *new_handle) {
+  return raw::dup_handle(handle, task, new_handle);
+}
+
+int32_t sys_close_handle(Handle handle) { return raw::close_handle(handle); }
+
+int32_t sys_wait_any_task(const Handle *handles, uint32_t num,
+                          uint32_t flags) {
+  return raw::wait_any_task(handles, num, flags, TIMEOUT_INFINITE);
+}
+
+int32_t sys_wait_any_task_timeout(const Handle *handles, uint32_t num,
+                                  uint32_t timeout_ms) {
+  return raw::wait_any_task(handles, num, /*flags=*/0, timeout_ms);
+}
+
+Handle sys_create_thread(void (*entry)(void *), void *arg) {
+  Handle handle;
+  if (raw::create_thread(reinterpret_cast<void *>(entry), arg, &handle))
+    return HANDLE_INVALID;
   return handle;
 }
 
-void sys_destroy_task(Handle handle) {
-  asm volatile("int " INTERRUPT ::"a"(4), "b"((uint32_t)handle));
+int32_t sys_futex_wait(const uint32_t *addr, uint32_t expected) {
+  return raw::futex_wait(addr, expected, TIMEOUT_INFINITE);
+}
+
+int32_t sys_futex_wait_timeout(const uint32_t *addr, uint32_t expected,
+                               uint32_t timeout_ms) {
+  return raw::futex_wait(addr, expected, timeout_ms);
+}
+
+int32_t sys_futex_wake(const uint32_t *addr, uint32_t num) {
+  return raw::futex_wake(addr, num);
 }
 
 void sys_copy_from_task(Handle handle, void *dst, const void *src,
                         size_t size) {
-  asm volatile("int " INTERRUPT ::"a"(5), "b"(handle), "c"((uint32_t)dst),
-               "d"((uint32_t)src), "S"((uint32_t)size));
+  raw::copy_from_task(handle, dst, src, size);
+}
+
+void sys_copy_to_task(Handle handle, void *dst, const void *src, size_t size) {
+  raw::copy_to_task(handle, dst, src, size);
+}
+
+int32_t sys_copy_from_task_v(Handle handle, const iovec *local,
+                             uint32_t num_local, const iovec *remote,
+                             uint32_t num_remote) {
+  return raw::copy_from_task_v(handle, local, num_local, remote, num_remote);
+}
+
+int32_t sys_copy_to_task_v(Handle handle, const iovec *local,
+                           uint32_t num_local, const iovec *remote,
+                           uint32_t num_remote) {
+  return raw::copy_to_task_v(handle, local, num_local, remote, num_remote);
 }
 
 Handle sys_get_parent_task() {
   Handle handle;
-  asm volatile("int " INTERRUPT ::"a"(6), "b"((uint32_t)&handle));
+  if (raw::get_parent_task(&handle)) return HANDLE_INVALID;
   return handle;
 }
 
 uint32_t sys_get_parent_task_id() {
   uint32_t id;
-  asm volatile("int " INTERRUPT ::"a"(7), "b"((uint32_t)&id));
+  raw::get_parent_task_id(&id);
   return id;
 }
 
-int32_t sys_map_page(void *addr) {
-  RET_TYPE ret;
-  asm volatile("int " INTERRUPT : "=a"(ret) : "0"(8), "b"((uint32_t)addr));
-  return ret;
-}
+int32_t sys_map_page(void *addr) { return raw::map_page(addr); }
 
 void sys_share_page(Handle handle, void **dst, const void *src) {
-  asm volatile("int " INTERRUPT ::"a"(9), "b"(handle), "c"((uint32_t)dst),
-               "d"((uint32_t)src));
+  raw::share_page(handle, dst, src);
 }
 
-void sys_unmap_page(void *dst) {
-  asm volatile("int " INTERRUPT ::"a"(10), "b"((uint32_t)dst));
+void sys_unmap_page(void *dst) { raw::unmap_page(dst); }
+
+uint32_t sys_get_task_stats(TaskStats *stats, uint32_t max) {
+  return static_cast<uint32_t>(raw::get_task_stats(stats, max));
 }
 
-Handle sys_get_current_task() {
-  Handle handle;
-  asm volatile("int " INTERRUPT ::"a"(11), "b"((uint32_t)&handle));
-  return handle;
+void sys_sleep(uint32_t ms) { raw::sleep(ms); }
+
+void sys_sleep_until(uint32_t uptime_ms) { raw::sleep_until(uptime_ms); }
+
+uint32_t sys_get_uptime() {
+  uint32_t uptime_ms;
+  raw::get_uptime(&uptime_ms);
+  return uptime_ms;
+}
+
+int32_t sys_set_deadline(uint32_t runtime_ms, uint32_t deadline_ms,
+                         uint32_t period_ms) {
+  return raw::set_deadline(runtime_ms, deadline_ms, period_ms);
+}
+
+int32_t sys_channel_create(void **addr) { return raw::channel_create(addr); }
+
+int32_t sys_channel_attach(uint32_t id, void **addr) {
+  return raw::channel_attach(id, addr);
+}
+
+int32_t sys_shm_create(const char *name, uint32_t size, void **addr) {
+  return raw::shm_create(name, size, addr);
+}
+
+int32_t sys_shm_map(const char *name, void **addr, uint32_t *size) {
+  return raw::shm_map(name, addr, size);
 }
+
+void sys_shm_unmap(void *addr, uint32_t size) {
+  constexpr uint32_t kPageSize = UINT32_C(1) << 22;
+  auto *page = static_cast<uint8_t *>(addr);
+  for (uint32_t unmapped = 0; unmapped < size; unmapped += kPageSize)
+    raw::unmap_page(page + unmapped);
+}
+
+int32_t sys_pipe(uint32_t fds[2]) { return raw::pipe(fds); }
+
+int32_t sys_read(uint32_t fd, void *buf, uint32_t size) {
+  return raw::read(fd, buf, size);
+}
+
+int32_t sys_write(uint32_t fd, const void *buf, uint32_t size) {
+  return raw::write(fd, buf, size);
+}
+
+int32_t sys_close(uint32_t fd) { return raw::close(fd); }
+
+int32_t sys_set_spawn_stdio(uint32_t in, uint32_t out) {
+  return raw::set_spawn_stdio(in, out);
+}
+
+int32_t sys_poll(PollEntry *entries, uint32_t num, uint32_t timeout_ms) {
+  return raw::poll(entries, num, timeout_ms);
+}
+
+int32_t sys_ring_setup(void **addr) { return raw::ring_setup(addr); }
+
+int32_t sys_ring_enter(uint32_t to_submit) {
+  return raw::ring_enter(to_submit);
+}
+
+int32_t sys_multicall(MultiCall *calls, uint32_t num, uint32_t flags) {
+  return raw::multicall(calls, num, flags);
+}
+
+int32_t sys_ipc_call(IPCMessage *msg) { return raw::ipc_call(*msg); }
+
+int32_t sys_ipc_reply_and_wait(IPCMessage *msg) {
+  return raw::ipc_reply_and_wait(*msg);
+}
+
+int32_t sys_ipc_reply(IPCMessage *msg) { return raw::ipc_reply(*msg); }
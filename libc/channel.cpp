@@ -0,0 +1,136 @@
+#include <_syscalls.h>
+#include <channel.h>
+#include <string.h>
+
+namespace {
+
+constexpr uint32_t kSlotMask = CHANNEL_SLOTS - 1;
+static_assert((CHANNEL_SLOTS & kSlotMask) == 0);
+
+ChannelRing &SendRing(channel_t *chan) {
+  return chan->page->rings[chan->side];
+}
+
+ChannelRing &RecvRing(channel_t *chan) {
+  return chan->page->rings[chan->side ^ 1];
+}
+
+// Bump `counter` and wake one task sleeping on it, if any might be.
+void Notify(uint32_t &counter, const uint32_t &waiters) {
+  __atomic_fetch_add(&counter, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&waiters, __ATOMIC_SEQ_CST)) sys_futex_wake(&counter, 1);
+}
+
+// Sleep until `counter` moves on from `seen`. Count this waiter before the
+// kernel checks the counter, so a task that bumps it without seeing the count
+// did so before the check, and this returns right away.
+void WaitFor(const uint32_t &counter, uint32_t seen, uint32_t &waiters) {
+  __atomic_fetch_add(&waiters, 1, __ATOMIC_SEQ_CST);
+  sys_futex_wait(&counter, seen);
+  __atomic_fetch_sub(&waiters, 1, __ATOMIC_RELAXED);
+}
+
+}  // namespace
+
+int32_t channel_create(channel_t *chan) {
+  void *page;
+  int32_t id = sys_channel_create(&page);
+  if (id < 0) return id;
+  chan->page = static_cast<ChannelPage *>(page);
+  chan->side = 0;
+  return id;
+}
+
+int32_t channel_attach(channel_t *chan, uint32_t id) {
+  void *page;
+  int32_t res = sys_channel_attach(id, &page);
+  if (res < 0) return res;
+  chan->page = static_cast<ChannelPage *>(page);
+  chan->side = 1;
+  return 0;
+}
+
+void channel_close(channel_t *chan) {
+  sys_unmap_page(chan->page);
+  chan->page = nullptr;
+}
+
+int32_t channel_try_send(channel_t *chan, const void *msg, uint32_t len) {
+  if (len > CHANNEL_MAX_MESSAGE) return CHANNEL_MSG_TOO_BIG;
+  ChannelRing &ring = SendRing(chan);
+
+  // Claim the slot at the tail once it is free.
+  uint32_t pos = __atomic_load_n(&ring.tail, __ATOMIC_RELAXED);
+  ChannelSlot *slot;
+  while (true) {
+    slot = &ring.slots[pos & kSlotMask];
+    uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    auto diff = static_cast<int32_t>(seq - pos);
+    if (diff < 0) return CHANNEL_FULL;
+    if (diff > 0) {
+      // Another sender took this position.
+      pos = __atomic_load_n(&ring.tail, __ATOMIC_RELAXED);
+      continue;
+    }
+    if (__atomic_compare_exchange_n(&ring.tail, &pos, pos + 1, /*weak=*/true,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      break;
+  }
+
+  memcpy(slot->data, msg, len);
+  slot->len = len;
+  __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+  Notify(ring.sent, ring.recv_waiters);
+  return 0;
+}
+
+int32_t channel_try_recv(channel_t *chan, void *buf, uint32_t max) {
+  ChannelRing &ring = RecvRing(chan);
+
+  // Claim the slot at the head once it holds a message.
+  uint32_t pos = __atomic_load_n(&ring.head, __ATOMIC_RELAXED);
+  ChannelSlot *slot;
+  while (true) {
+    slot = &ring.slots[pos & kSlotMask];
+    uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    auto diff = static_cast<int32_t>(seq - (pos + 1));
+    if (diff < 0) return CHANNEL_EMPTY;
+    if (diff > 0) {
+      // Another receiver took this position.
+      pos = __atomic_load_n(&ring.head, __ATOMIC_RELAXED);
+      continue;
+    }
+    if (slot->len > max) return CHANNEL_MSG_TOO_BIG;
+    if (__atomic_compare_exchange_n(&ring.head, &pos, pos + 1, /*weak=*/true,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      break;
+  }
+
+  uint32_t len = slot->len;
+  memcpy(buf, slot->data, len);
+
+  // Hand the slot back to senders for the next lap around the ring.
+  __atomic_store_n(&slot->seq, pos + CHANNEL_SLOTS, __ATOMIC_RELEASE);
+  Notify(ring.received, ring.send_waiters);
+  return static_cast<int32_t>(len);
+}
+
+int32_t channel_send(channel_t *chan, const void *msg, uint32_t len) {
+  ChannelRing &ring = SendRing(chan);
+  while (true) {
+    uint32_t received = __atomic_load_n(&ring.received, __ATOMIC_SEQ_CST);
+    int32_t res = channel_try_send(chan, msg, len);
+    if (res != CHANNEL_FULL) return res;
+    WaitFor(ring.received, received, ring.send_waiters);
+  }
+}
+
+int32_t channel_recv(channel_t *chan, void *buf, uint32_t max) {
+  ChannelRing &ring = RecvRing(chan);
+  while (true) {
+    uint32_t sent = __atomic_load_n(&ring.sent, __ATOMIC_SEQ_CST);
+    int32_t res = channel_try_recv(chan, buf, max);
+    if (res != CHANNEL_EMPTY) return res;
+    WaitFor(ring.sent, sent, ring.recv_waiters);
+  }
+}
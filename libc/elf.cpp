@@ -109,8 +109,8 @@ class ElfHelper {
 
 }  // namespace
 
-void LoadElfProgram(const uint8_t *elf_data, const GlobalEnvInfo *env_info,
-                    size_t argc, const char **argv, const char *pwd) {
+Handle SpawnElfProgram(const uint8_t *elf_data, const GlobalEnvInfo *env_info,
+                       size_t argc, const char **argv, const char *pwd) {
   const auto *hdr = reinterpret_cast<const Elf32_Ehdr *>(elf_data);
   assert(IsValidElf(hdr) && "Invalid elf program");
 
@@ -307,34 +307,45 @@ void LoadElfProgram(const uint8_t *elf_data, const GlobalEnvInfo *env_info,
     memset(program.get() + bss_offset, 0, section_size);
   }
 
-  ArgInfo arginfo = {
-      .env_info = *env_info,
-  };
-  if (argc) {
-    size_t packed_argv_size = 0;
-    for (size_t i = 0; i < argc; ++i) {
-      packed_argv_size += strlen(argv[i]) + 1;
-    }
-    arginfo.packed_argv_size = packed_argv_size;
-  } else {
-    arginfo.packed_argv_size = 0;
+  // The kernel copies the startup block into the program before it runs, so
+  // it can be freed as soon as the program is created.
+  size_t argv_size = 0;
+  for (size_t i = 0; i < argc; ++i) argv_size += strlen(argv[i]) + 1;
+  size_t pwd_size = pwd ? strlen(pwd) + 1 : 0;
+  size_t block_size = sizeof(StartupBlock) + argv_size + pwd_size;
+
+  auto *startup = static_cast<StartupBlock *>(malloc(block_size));
+  startup->size = block_size;
+  startup->vfs_owner = env_info->raw_vfs_data_owner;
+  startup->vfs_data = reinterpret_cast<uint32_t>(env_info->raw_vfs_data);
+  startup->argv_offset = sizeof(StartupBlock);
+  startup->argv_size = argv_size;
+  auto *strings = reinterpret_cast<char *>(startup + 1);
+  PackArgv(argc, argv, argv_size, strings);
+  startup->pwd_offset = 0;
+  if (pwd) {
+    startup->pwd_offset = startup->argv_offset + argv_size;
+    memcpy(strings + argv_size, pwd, pwd_size);
   }
 
-  // Ensure that we have at least a non-zero vla.
-  char packed_argv[arginfo.packed_argv_size ? arginfo.packed_argv_size : 1];
+  Handle handle = sys_spawn_program(
+      program.get(), loadable_segment_span,
+      /*entry_offset=*/program_entry_point - first_loadable_segment->p_vaddr,
+      startup);
+  free(startup);
+  return handle;
+}
 
-  if (argc) {
-    PackArgv(argc, argv, arginfo.packed_argv_size, packed_argv);
-    arginfo.packed_argv = packed_argv;
-  } else {
-    arginfo.packed_argv = nullptr;
-  }
+int WaitAnyProgram(const Handle *handles, size_t num, bool block) {
+  int32_t index = sys::WaitAnyTask(handles, num, block);
+  if (index == WAIT_NONE_EXITED) return -1;
+  return index;
+}
 
-  arginfo.pwd = pwd;
+void WaitProgram(Handle handle) { WaitAnyProgram(&handle, 1); }
 
-  sys::Handle handle = sys::CreateTask(
-      program.get(), loadable_segment_span,
-      /*arg=*/&arginfo,
-      /*entry_offset=*/program_entry_point - first_loadable_segment->p_vaddr);
-  sys::DestroyTask(handle);
+void LoadElfProgram(const uint8_t *elf_data, const GlobalEnvInfo *env_info,
+                    size_t argc, const char **argv, const char *pwd) {
+  Handle handle = SpawnElfProgram(elf_data, env_info, argc, argv, pwd);
+  if (handle != HANDLE_INVALID) WaitProgram(handle);
 }
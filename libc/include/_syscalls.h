@@ -3,24 +3,114 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <sys/multicall.h>
+#include <sys/poll.h>
+#include <sys/startup.h>
+#include <sys/syscall.h>
+#include <sys/taskstats.h>
+#include <sys/uio.h>
 
 __BEGIN_CDECLS
 
+// Use the SYSENTER fast path for syscalls if the CPU supports it. This is
+// called once at startup before main().
+void InitSyscallEntry();
+
 bool sys_debug_read(char *c);
 int32_t sys_debug_print(const char *str);
 bool sys_debug_put(char);
 void sys_exit_task();
 
+// Tasks are named by handles in a table the kernel keeps for each address
+// space, so a handle only means something to the threads that share it. Once
+// a task is destroyed or its handle closed, the handle is rejected with
+// SYSCALL_EBADF rather than reaching another task.
 typedef uint32_t Handle;
-#define HANDLE_INVALID 0
+
+// Start a task running the `codesize` bytes of code at `entry` and return its
+// handle, or HANDLE_INVALID if this task's handle table is full.
 Handle sys_create_task(const void *entry, uint32_t codesize, void *arg,
                        size_t entry_offset);
-void sys_destroy_task(Handle handle);
+
+// Wait for the task `handle` to exit, destroy it, and close the handle. This
+// returns 0 or SYSCALL_EBADF.
+int32_t sys_destroy_task(Handle handle);
+
+// Open another handle to the task `handle` in the handle table of the task
+// `task`, or in this task's own table if `task` is HANDLE_INVALID, and store
+// it in `new_handle`. Either handle can destroy the task, but only once. This
+// returns 0, SYSCALL_EBADF or SYSCALL_EMFILE.
+int32_t sys_dup_handle(Handle handle, Handle task, Handle *new_handle);
+
+// Close `handle` without destroying its task. This returns 0 or SYSCALL_EBADF.
+int32_t sys_close_handle(Handle handle);
+
+// Start a program like sys_create_task(), but copy `startup` into the new task
+// before it runs and pass it the address of the copy. Nothing in this task
+// needs to stay alive for the program once this returns. This returns
+// HANDLE_INVALID if the size of the block is invalid. See sys/startup.h.
+Handle sys_spawn_program(const void *entry, uint32_t codesize,
+                         size_t entry_offset,
+                         const struct StartupBlock *startup);
+
+// Wait for any of the `num` tasks in `handles` to exit, destroy it, and return
+// its index in `handles`. With WAIT_NOHANG in `flags`, this returns
+// WAIT_NONE_EXITED instead of waiting if none of them have exited.
+int32_t sys_wait_any_task(const Handle *handles, uint32_t num, uint32_t flags);
+
+// Like sys_wait_any_task(), but return WAIT_NONE_EXITED if none of the tasks
+// exit within `timeout_ms` milliseconds.
+int32_t sys_wait_any_task_timeout(const Handle *handles, uint32_t num,
+                                  uint32_t timeout_ms);
+
+// Copy `size` bytes from `src` in the task `handle` to `dst` in this task, or
+// the other way for sys_copy_to_task(). Copies may cross pages, but stop at
+// the first page the other task does not have mapped.
 void sys_copy_from_task(Handle handle, void *dst, const void *src, size_t size);
+void sys_copy_to_task(Handle handle, void *dst, const void *src, size_t size);
+
+// Copy from the fragments `remote` in the task `handle` to the fragments
+// `local` in this task, or the other way for sys_copy_to_task_v(). Fragments
+// are filled in order, so either side can be split differently. This returns
+// how many bytes were copied, which is less than asked for if a remote page is
+// not mapped.
+int32_t sys_copy_from_task_v(Handle handle, const struct iovec *local,
+                             uint32_t num_local, const struct iovec *remote,
+                             uint32_t num_remote);
+int32_t sys_copy_to_task_v(Handle handle, const struct iovec *local,
+                           uint32_t num_local, const struct iovec *remote,
+                           uint32_t num_remote);
+
+// Start a thread running `entry(arg)` in this task's address space and return
+// its handle, or HANDLE_INVALID if there is no room for its stack. `entry` must
+// not return; it ends with sys_exit_task(). The thread is joined like any other
+// task and must be joined before the task that created it exits.
+Handle sys_create_thread(void (*entry)(void *), void *arg);
+
+// Sleep until woken by sys_futex_wake() on `addr`, but only if `addr` still
+// holds `expected`. Futexes are keyed by physical address, so this works
+// across tasks sharing the page. This returns 0 once woken, FUTEX_WOULD_BLOCK
+// if the value changed, or FUTEX_BAD_ADDR.
+int32_t sys_futex_wait(const uint32_t *addr, uint32_t expected);
+
+// Like sys_futex_wait(), but return FUTEX_TIMED_OUT if not woken within
+// `timeout_ms` milliseconds.
+int32_t sys_futex_wait_timeout(const uint32_t *addr, uint32_t expected,
+                               uint32_t timeout_ms);
+
+// Wake up to `num` tasks waiting on `addr` and return how many were woken.
+int32_t sys_futex_wake(const uint32_t *addr, uint32_t num);
+
+// A handle to the task that created this one, opened in this task's handle
+// table the first time it is asked for. This returns HANDLE_INVALID if the
+// table is full or the parent is not a user task.
 Handle sys_get_parent_task();
-Handle sys_get_current_task();
 uint32_t sys_get_parent_task_id();
 
+// These read the vDSO rather than making a syscall.
+Handle sys_get_current_task();
+uint32_t GetCurrentTaskId();
+
 #define MAP_SUCCESS (0)
 #define MAP_UNALIGNED_ADDR (-1)
 #define MAP_ALREADY_MAPPED (-2)
@@ -30,6 +120,120 @@ int32_t sys_map_page(void *addr);
 void sys_share_page(Handle handle, void **dst, const void *src);
 void sys_unmap_page(void *dst);
 
+// Sleep for at least `ms` milliseconds without using the CPU. A sleep of
+// TIMEOUT_INFINITE never returns.
+void sys_sleep(uint32_t ms);
+
+// Sleep until sys_get_uptime() reaches `uptime_ms`.
+void sys_sleep_until(uint32_t uptime_ms);
+
+// The milliseconds since the kernel started its timer. This advances once per
+// timer tick, so it is only as precise as the tick.
+uint32_t sys_get_uptime();
+
+// Guarantee the calling task `runtime_ms` of CPU time every `period_ms`,
+// finished within `deadline_ms` of each period starting. Ready tasks with a
+// deadline run before all other tasks, earliest deadline first, but only for
+// their runtime each period. A runtime of 0 drops the guarantee. This returns
+// 0, DEADLINE_INVALID or DEADLINE_OVERLOADED.
+int32_t sys_set_deadline(uint32_t runtime_ms, uint32_t deadline_ms,
+                         uint32_t period_ms);
+
+// Create a channel page, map it, and store where in `addr`. This returns the
+// channel's id or CHANNEL_NO_SPACE. See channel.h for the API built on this.
+int32_t sys_channel_create(void **addr);
+
+// Map the page of the channel with `id` and store where in `addr`. This
+// returns 0, CHANNEL_NOT_FOUND or CHANNEL_NO_SPACE.
+int32_t sys_channel_attach(uint32_t id, void **addr);
+
+// Create a shared memory object called `name` of `size` bytes, which lives
+// until no task has it mapped. It is mapped in whole 4MB pages at `*addr`, or
+// wherever there is room if `*addr` is null, and where is stored in `*addr`.
+// This returns 0, SHM_INVALID, SHM_EXISTS or SHM_NO_SPACE.
+int32_t sys_shm_create(const char *name, uint32_t size, void **addr);
+
+// Map the shared memory object called `name` like sys_shm_create() and store
+// its size in `*size`. This returns 0, SHM_INVALID, SHM_NOT_FOUND or
+// SHM_NO_SPACE.
+int32_t sys_shm_map(const char *name, void **addr, uint32_t *size);
+
+// Unmap `size` bytes of a shared memory object mapped at `addr`.
+void sys_shm_unmap(void *addr, uint32_t size);
+
+// Create a pipe and store the descriptors of its read and write ends in
+// `fds[0]` and `fds[1]`. This returns 0 or PIPE_NO_SPACE.
+int32_t sys_pipe(uint32_t fds[2]);
+
+// Read up to `size` bytes from `fd`, waiting until there is at least one. This
+// returns how many bytes were read, 0 at the end of input, or FD_INVALID. An
+// unopened STDIN_FD reads the console, where Ctrl-D ends input.
+int32_t sys_read(uint32_t fd, void *buf, uint32_t size);
+
+// Write all `size` bytes to `fd`, waiting while the pipe is full. This returns
+// `size`, PIPE_BROKEN if no task has the read end open, or FD_INVALID. An
+// unopened STDOUT_FD writes to the console.
+int32_t sys_write(uint32_t fd, const void *buf, uint32_t size);
+
+// Close `fd`. A pipe is freed once neither of its ends is open in any task.
+// This returns 0 or FD_INVALID.
+int32_t sys_close(uint32_t fd);
+
+// Give tasks created by this task from now on `in` as their STDIN_FD and `out`
+// as their STDOUT_FD. Each gets its own reference to the pipe ends, so this
+// task can close them once they are created. `in` must be STDIN_FD or a read
+// end, and `out` must be STDOUT_FD or a write end. This returns 0 or
+// FD_INVALID.
+int32_t sys_set_spawn_stdio(uint32_t in, uint32_t out);
+
+// Wait until any of the `num` entries is ready or `timeout_ms` pass, and set
+// the `revents` of each. A timeout of 0 only checks, and TIMEOUT_INFINITE waits
+// for as long as it takes. This returns how many entries are ready, so 0 on a
+// timeout, or POLL_TOO_MANY. See sys/poll.h.
+int32_t sys_poll(struct PollEntry *entries, uint32_t num, uint32_t timeout_ms);
+
+// Map a syscall ring for this task and store where in `addr`. This returns 0,
+// RING_EXISTS or RING_NO_SPACE. See ring.h for the API built on this.
+int32_t sys_ring_setup(void **addr);
+
+// Run up to `to_submit` queued submissions of this task's ring and return how
+// many ran, or RING_NOT_SET_UP.
+int32_t sys_ring_enter(uint32_t to_submit);
+
+// Make the `num` syscalls in `calls` in one kernel entry, in order, and set the
+// `result` of each. With MULTICALL_STOP_ON_ERROR in `flags`, this stops after
+// the first call that returns a negative result. This returns how many calls
+// were made, or MULTICALL_TOO_MANY. See sys/multicall.h.
+int32_t sys_multicall(struct MultiCall *calls, uint32_t num, uint32_t flags);
+
+// A message for synchronous IPC, passed in registers both ways. `task` is the
+// server or client on the other end.
+typedef struct {
+  Handle task;
+  uint32_t words[IPC_MSG_WORDS];
+} IPCMessage;
+
+// Send `msg->words` to the server task `msg->task` and wait for its reply,
+// which replaces them. If the server is already waiting for a call, this runs
+// it right away on this CPU. This returns 0, IPC_INVALID or IPC_PEER_GONE.
+int32_t sys_ipc_call(IPCMessage *msg);
+
+// Reply to the client `msg->task` with `msg->words`, unless it is
+// HANDLE_INVALID, then wait for the next call to this task. The call's client
+// and words replace `msg`, with a handle to the client opened in this task's
+// table if it has none. This returns 0, SYSCALL_EBADF, IPC_INVALID if the
+// client is not waiting for a reply from this task, or SYSCALL_EMFILE if there
+// would be no room for the next client's handle. Nothing is sent on an error.
+int32_t sys_ipc_reply_and_wait(IPCMessage *msg);
+
+// Reply like sys_ipc_reply_and_wait(), but return without waiting for another
+// call. A server uses this for its last reply before it stops.
+int32_t sys_ipc_reply(IPCMessage *msg);
+
+// Fill `stats` with up to `max` task snapshots. This returns the number of
+// tasks that exist, which can be more than `max`.
+uint32_t sys_get_task_stats(struct TaskStats *stats, uint32_t max);
+
 __END_CDECLS
 
 // Provide a nice C++ API if available.
@@ -46,7 +250,11 @@ inline Handle CreateTask(const void *entry, uint32_t codesize,
                          void *arg = nullptr, size_t entry_offset = 0) {
   return sys_create_task(entry, codesize, arg, entry_offset);
 }
-inline void DestroyTask(Handle handle) { return sys_destroy_task(handle); }
+inline int32_t DestroyTask(Handle handle) { return sys_destroy_task(handle); }
+inline int32_t WaitAnyTask(const Handle *handles, uint32_t num,
+                           bool block = true) {
+  return sys_wait_any_task(handles, num, block ? 0 : WAIT_NOHANG);
+}
 
 }  // namespace sys
 #endif
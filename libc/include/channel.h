@@ -0,0 +1,53 @@
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include <_internals.h>
+#include <stdint.h>
+#include <sys/channel.h>
+#include <sys/syscall.h>
+
+__BEGIN_CDECLS
+
+// Results of sending and receiving. These do not overlap with message lengths
+// or the errors of channel_create() and channel_attach().
+#define CHANNEL_EMPTY (-3)        // Nothing to receive right now.
+#define CHANNEL_FULL (-4)         // No free slot to send to right now.
+#define CHANNEL_MSG_TOO_BIG (-5)  // The message does not fit.
+
+// One end of a message channel between tasks. Messages are copied straight
+// through a page shared with the other end, so sending and receiving only make
+// a syscall to sleep when the channel is full or empty, or to wake the other
+// end if it is sleeping.
+typedef struct {
+  struct ChannelPage *page;
+  uint32_t side;  // 0 for the creator and 1 for tasks that attach.
+} channel_t;
+
+// Create a channel and return its id, which other tasks can pass to
+// channel_attach() to talk to this one. Returns CHANNEL_NO_SPACE on failure.
+int32_t channel_create(channel_t *chan);
+
+// Attach to the channel with `id`. Returns 0, CHANNEL_NOT_FOUND or
+// CHANNEL_NO_SPACE.
+int32_t channel_attach(channel_t *chan, uint32_t id);
+
+// Unmap the channel. It is freed once every task using it closes it or exits.
+void channel_close(channel_t *chan);
+
+// Send `len` bytes to the other end, waiting for a free slot if the channel is
+// full. Returns 0 or CHANNEL_MSG_TOO_BIG if `len` is over CHANNEL_MAX_MESSAGE.
+int32_t channel_send(channel_t *chan, const void *msg, uint32_t len);
+
+// Receive the next message into `buf`, waiting for one if the channel is
+// empty, and return its length. If it is longer than `max`, it is left in the
+// channel and this returns CHANNEL_MSG_TOO_BIG.
+int32_t channel_recv(channel_t *chan, void *buf, uint32_t max);
+
+// Like channel_send() and channel_recv(), but return CHANNEL_FULL or
+// CHANNEL_EMPTY instead of waiting.
+int32_t channel_try_send(channel_t *chan, const void *msg, uint32_t len);
+int32_t channel_try_recv(channel_t *chan, void *buf, uint32_t max);
+
+__END_CDECLS
+
+#endif
@@ -226,17 +226,6 @@ struct GlobalEnvInfo {
   Handle raw_vfs_data_owner;
 };
 
-// Arginfo contains information on a per-process basis. Stuff like argument info
-// or the directory this process is launched from goes here.
-struct ArgInfo {
-  GlobalEnvInfo env_info;
-
-  // This buffer is packed/unpacked according to PackArgv and UnpackArgv.
-  const char *packed_argv;
-  size_t packed_argv_size;
-  const char *pwd;
-};
-
 constexpr uint32_t kPageSize4M = 0x00400000;
 
 extern "C" {
@@ -247,10 +236,32 @@ const void *GetRawVFSData();
 
 }  // extern "C"
 
+// Run a program and wait for it to exit.
 void LoadElfProgram(const uint8_t *elf_data, const GlobalEnvInfo *env_info,
                     size_t argc = 0, const char *argv[ARG_MAX] = nullptr,
                     const char *pwd = nullptr);
 
+// Start a program without waiting for it. The program must be reaped with
+// WaitProgram() or WaitAnyProgram(). This returns HANDLE_INVALID if the
+// arguments and `pwd` do not fit in STARTUP_MAX_SIZE.
+Handle SpawnElfProgram(const uint8_t *elf_data, const GlobalEnvInfo *env_info,
+                       size_t argc = 0, const char *argv[ARG_MAX] = nullptr,
+                       const char *pwd = nullptr);
+
+// Wait for any of the `num` programs in `handles` to exit, reap it, and return
+// its index in `handles`. If `block` is false, this returns -1 instead of
+// waiting if none of them have exited.
+int WaitAnyProgram(const Handle *handles, size_t num, bool block = true);
+void WaitProgram(Handle handle);
+
+// The most programs system() and SpawnPipeline() run for one command.
+constexpr size_t kMaxPipelineStages = 8;
+
+// Like system(), but start the programs of the pipeline without waiting for
+// them. Their handles are stored in `handles` and the number started is
+// returned.
+size_t SpawnPipeline(const char *cmd, Handle handles[kMaxPipelineStages]);
+
 // NOTE: This should always have the same value as USER_START in the kernel's
 // paging.h.
 #define USER_START UINT32_C(0x40000000)  // 1GB
@@ -0,0 +1,66 @@
+#ifndef PTHREAD_H
+#define PTHREAD_H
+
+#include <stdint.h>
+
+__BEGIN_CDECLS
+
+// A minimal subset of POSIX threads on top of sys_create_thread(). Every thread
+// shares the heap and globals of the program, but runs on its own 4MB stack.
+//
+// Unlike POSIX, a thread must be joined by the thread that created it, and
+// before that thread exits.
+
+// Opaque to callers. This holds the task handle and the start routine.
+typedef struct __pthread *pthread_t;
+
+// Attributes are not supported, so this must always be null.
+typedef struct __pthread_attr pthread_attr_t;
+
+// Returns 0 on success or nonzero if the thread could not be started.
+int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+                   void *(*start_routine)(void *), void *arg);
+
+// Wait for `thread` to exit and free it. If `retval` is not null, this writes
+// the value returned by its start routine there.
+int pthread_join(pthread_t thread, void **retval);
+
+// Mutexes and condition variables are futex-backed. Taking a free mutex or
+// signaling a condition variable nobody waits on makes no syscalls. Both also
+// work across tasks if placed in a page shared with sys_share_page().
+//
+// As with threads, attributes are not supported and must be null.
+typedef struct {
+  // 0 when unlocked, 1 when locked, and 2 when locked with possible waiters.
+  uint32_t state;
+} pthread_mutex_t;
+typedef struct __pthread_mutexattr pthread_mutexattr_t;
+
+#define PTHREAD_MUTEX_INITIALIZER {0}
+
+int pthread_mutex_init(pthread_mutex_t *mutex,
+                       const pthread_mutexattr_t *attr);
+int pthread_mutex_destroy(pthread_mutex_t *mutex);
+int pthread_mutex_lock(pthread_mutex_t *mutex);
+
+// Returns 0 if the mutex was taken or nonzero if it is already locked.
+int pthread_mutex_trylock(pthread_mutex_t *mutex);
+int pthread_mutex_unlock(pthread_mutex_t *mutex);
+
+typedef struct {
+  uint32_t seq;      // Bumped by every signal so waiters notice missed wakes.
+  uint32_t waiters;  // Waiters that may be sleeping on `seq`.
+} pthread_cond_t;
+typedef struct __pthread_condattr pthread_condattr_t;
+
+#define PTHREAD_COND_INITIALIZER {0, 0}
+
+int pthread_cond_init(pthread_cond_t *cond, const pthread_condattr_t *attr);
+int pthread_cond_destroy(pthread_cond_t *cond);
+int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex);
+int pthread_cond_signal(pthread_cond_t *cond);
+int pthread_cond_broadcast(pthread_cond_t *cond);
+
+__END_CDECLS
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef RING_H
+#define RING_H
+
+#include <_internals.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/ring.h>
+#include <sys/syscall.h>
+
+__BEGIN_CDECLS
+
+// Batched syscalls through a ring shared with the kernel. Queue any number of
+// submissions, run them all with one ring_submit(), then reap a completion for
+// each. See sys/ring.h for which syscalls can be queued.
+
+// Map the syscall ring for this task and store it in `ring`. A task only has
+// one ring. This returns 0, RING_EXISTS or RING_NO_SPACE.
+int32_t ring_create(struct SyscallRing **ring);
+
+// Queue `sub` to run on the next ring_submit(). This returns false if the
+// submission ring is full.
+bool ring_queue(struct SyscallRing *ring, const struct RingSubmission *sub);
+
+// Run every queued submission in order with one syscall and return how many
+// ran. Fewer run if the completion ring fills up, and the rest stay queued.
+int32_t ring_submit(struct SyscallRing *ring);
+
+// Take the oldest completion. This returns false if there is none.
+bool ring_reap(struct SyscallRing *ring, struct RingCompletion *completion);
+
+__END_CDECLS
+
+#endif
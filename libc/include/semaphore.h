@@ -0,0 +1,27 @@
+#ifndef SEMAPHORE_H
+#define SEMAPHORE_H
+
+#include <stdint.h>
+
+__BEGIN_CDECLS
+
+// A futex-backed counting semaphore. Posting with nobody waiting and waiting
+// on a positive count make no syscalls. Unlike POSIX, `pshared` is ignored:
+// every semaphore works across tasks if placed in a page shared with
+// sys_share_page().
+typedef struct {
+  uint32_t value;
+  uint32_t waiters;  // Waiters that may be sleeping on `value`.
+} sem_t;
+
+int sem_init(sem_t *sem, int pshared, unsigned value);
+int sem_destroy(sem_t *sem);
+int sem_wait(sem_t *sem);
+
+// Returns 0 if the count was decremented or nonzero if it is 0.
+int sem_trywait(sem_t *sem);
+int sem_post(sem_t *sem);
+
+__END_CDECLS
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef __SYS_CHANNEL_H
+#define __SYS_CHANNEL_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The layout of a channel page, which the kernel maps into every task that
+// creates or attaches to the channel. A channel has a ring for each direction.
+// The creator sends on ring 0 and receives on ring 1, and every task that
+// attaches does the opposite.
+//
+// Each ring is a bounded queue of fixed-size slots that any number of tasks can
+// send to and receive from without a syscall. A slot's `seq` says whose turn it
+// is: it equals the send position once the slot is free to fill, and the send
+// position + 1 once it holds a message. Tasks only enter the kernel to sleep on
+// `sent` or `received` when the ring is empty or full.
+
+#define CHANNEL_SLOTS 256  // Must be a power of 2.
+#define CHANNEL_SLOT_SIZE 4096
+#define CHANNEL_MAX_MESSAGE (CHANNEL_SLOT_SIZE - 8)
+
+struct ChannelSlot {
+  uint32_t seq;
+  uint32_t len;
+  uint8_t data[CHANNEL_MAX_MESSAGE];
+};
+
+// The receiving and sending sides are kept on separate cache lines.
+struct ChannelRing {
+  uint32_t head;          // The next position to receive from.
+  uint32_t received;      // Bumped after each receive.
+  uint32_t send_waiters;  // Senders that may be sleeping on `received`.
+  uint32_t recv_pad[13];
+
+  uint32_t tail;          // The next position to send to.
+  uint32_t sent;          // Bumped after each send.
+  uint32_t recv_waiters;  // Receivers that may be sleeping on `sent`.
+  uint32_t send_pad[13];
+
+  struct ChannelSlot slots[CHANNEL_SLOTS];
+};
+
+struct ChannelPage {
+  struct ChannelRing rings[2];
+};
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif
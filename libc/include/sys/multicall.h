@@ -0,0 +1,31 @@
+#ifndef __SYS_MULTICALL_H
+#define __SYS_MULTICALL_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The calls the multicall syscall makes one after the other in a single kernel
+// entry. Each call is a syscall number with its arguments as they would be
+// passed in registers. Only the syscalls a syscall ring can run are allowed
+// (see sys/ring.h); others get SYSCALL_ENOSYS. Calls cannot use the results of
+// earlier calls in the same batch, so only independent calls can be batched.
+
+#define MULTICALL_MAX 64  // The most calls one multicall can make.
+
+// Flags for multicall.
+#define MULTICALL_STOP_ON_ERROR (1 << 0)  // Stop after a negative result.
+
+struct MultiCall {
+  uint32_t num;
+  uint32_t args[5];
+  int32_t result;  // What the syscall returned, set by multicall.
+};
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef __SYS_POLL_H
+#define __SYS_POLL_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The entries the poll syscall waits on. Poll reports the current state of each
+// entry rather than what changed, so anything still ready is reported again by
+// the next poll.
+
+#define POLL_MAX 16  // The most entries one poll can wait on.
+
+// What `id` of an entry refers to.
+#define POLL_FD 0     // A descriptor, as passed to read and write.
+#define POLL_TASK 1   // A task handle.
+#define POLL_FUTEX 2  // The address of a futex word, such as a channel counter.
+
+// Readiness bits. `events` selects which of POLL_IN and POLL_OUT to wait for on
+// a descriptor. The others are always reported.
+#define POLL_IN (1 << 0)       // Reading would not wait.
+#define POLL_OUT (1 << 1)      // Writing would not wait.
+#define POLL_HUP (1 << 2)      // The other end of the pipe is all closed.
+#define POLL_EXITED (1 << 3)   // The task has exited and can be destroyed.
+#define POLL_CHANGED (1 << 4)  // The futex word no longer holds `value`.
+#define POLL_INVALID (1 << 5)  // The entry cannot be waited on.
+
+struct PollEntry {
+  uint32_t type;
+  uint32_t id;
+  uint32_t events;
+  uint32_t value;    // The value a POLL_FUTEX word is expected to hold.
+  uint32_t revents;  // Which bits are ready, set by poll.
+};
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif
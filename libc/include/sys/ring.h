@@ -0,0 +1,60 @@
+#ifndef __SYS_RING_H
+#define __SYS_RING_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The layout of a syscall ring page, which the kernel maps into a task with
+// ring_setup. The task queues syscalls on the submission ring and makes one
+// ring_enter syscall to run a batch of them, in order. The kernel posts a
+// completion for each with the syscall's result and the submission's
+// `user_data`.
+//
+// Each side only advances its own index: the task owns `sq_tail` and
+// `cq_head`, and the kernel owns `sq_head` and `cq_tail`. Indices count up
+// forever and are masked into the rings.
+
+#define RING_ENTRIES 256  // Must be a power of 2.
+
+// The opcode of a submission is the number of the syscall to make, with its
+// arguments in `args` as they would be passed in registers. Only these
+// syscalls can be submitted; others complete with SYSCALL_ENOSYS.
+//
+//   SYS_debug_write, SYS_write, SYS_map_page, SYS_unmap_page, SYS_share_page,
+//   SYS_create_user_task, SYS_destroy_user_task, SYS_copy_from_task,
+//   SYS_copy_to_task
+
+struct RingSubmission {
+  uint32_t opcode;
+  uint32_t args[5];
+  uint32_t user_data;
+  uint32_t pad;
+};
+
+struct RingCompletion {
+  uint32_t user_data;
+  int32_t result;
+};
+
+// The indices each side writes are kept on separate cache lines.
+struct SyscallRing {
+  uint32_t sq_tail;  // The next submission the task fills.
+  uint32_t cq_head;  // The next completion the task reads.
+  uint32_t task_pad[14];
+
+  uint32_t sq_head;  // The next submission the kernel runs.
+  uint32_t cq_tail;  // The next completion the kernel posts.
+  uint32_t kernel_pad[14];
+
+  struct RingSubmission sq[RING_ENTRIES];
+  struct RingCompletion cq[RING_ENTRIES];
+};
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef __SYS_STARTUP_H
+#define __SYS_STARTUP_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The startup block of a program, which spawn_program copies into the new
+// task before it runs. The task's entry point gets the address of its copy.
+// Strings follow the header and are found by their offsets from the start of
+// the block, so the block can be built and copied anywhere.
+
+#define STARTUP_MAX_SIZE (64 * 1024)
+
+struct StartupBlock {
+  uint32_t size;  // The whole block, including the strings.
+
+  // The initrd is at `vfs_data` in the address space of the task `vfs_owner`.
+  // spawn_program opens that handle for the new task under the same value.
+  uint32_t vfs_owner;
+  uint32_t vfs_data;
+
+  // The arguments are packed one after the other, each null-terminated.
+  uint32_t argv_offset;
+  uint32_t argv_size;
+
+  // The null-terminated directory to start in, or 0 for the root.
+  uint32_t pwd_offset;
+};
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif
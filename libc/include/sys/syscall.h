@@ -0,0 +1,129 @@
+#ifndef __SYS_SYSCALL_H
+#define __SYS_SYSCALL_H
+
+// Syscall numbers, generated from syscalls.def.
+enum {
+#define SYSCALL0(name, num) SYS_##name = num,
+#define SYSCALL1(name, num, ...) SYS_##name = num,
+#define SYSCALL2(name, num, ...) SYS_##name = num,
+#define SYSCALL3(name, num, ...) SYS_##name = num,
+#define SYSCALL4(name, num, ...) SYS_##name = num,
+#define SYSCALL5(name, num, ...) SYS_##name = num,
+#define SYSCALL_MSG(name, num) SYS_##name = num,
+#include <syscalls.def>
+};
+
+// Returned in EAX for a syscall number the kernel does not know about.
+#define SYSCALL_ENOSYS (-38)
+
+// Returned by syscalls taking a task handle that is not open in the caller's
+// handle table, or whose task has been destroyed.
+#define SYSCALL_EBADF (-9)
+
+// Returned by syscalls that open a handle if the handle table is full.
+#define SYSCALL_EMFILE (-24)
+
+// Task handles are never 0, so this can mark the lack of one.
+#define HANDLE_INVALID 0
+
+// Passed as the timeout of a wait to wait until it finishes.
+#define TIMEOUT_INFINITE 0xFFFFFFFFu
+
+// Flags for wait_any_task.
+#define WAIT_NOHANG (1 << 0)  // Return right away if no task has exited.
+
+// Returned by wait_any_task if none of the tasks have exited with WAIT_NOHANG
+// or before the timeout.
+#define WAIT_NONE_EXITED (-1)
+
+// Returned by create_thread if there is no free page left for the stack.
+#define THREAD_NO_STACK (-1)
+
+// Returned by futex_wait if the futex no longer holds the expected value.
+#define FUTEX_WOULD_BLOCK (-1)
+
+// Returned by futex_wait and futex_wake for a misaligned or unmapped futex.
+#define FUTEX_BAD_ADDR (-2)
+
+// Returned by futex_wait if nothing woke the task before the timeout.
+#define FUTEX_TIMED_OUT (-3)
+
+// Returned by set_deadline unless 0 < runtime <= deadline <= period, or if the
+// period is too long.
+#define DEADLINE_INVALID (-1)
+
+// Returned by set_deadline if there is not enough CPU time left to guarantee
+// the task its runtime every period.
+#define DEADLINE_OVERLOADED (-2)
+
+// Returned by channel_create and channel_attach if there is no room for another
+// channel or no free page to map it at.
+#define CHANNEL_NO_SPACE (-1)
+
+// Returned by channel_attach if no task has the channel mapped anymore.
+#define CHANNEL_NOT_FOUND (-2)
+
+// The number of words in an IPC message, not counting the task handle that is
+// passed with them.
+#define IPC_MSG_WORDS 4
+
+// Returned by ipc_call for a call to the calling task, and by ipc_reply and
+// ipc_reply_and_wait for a reply to a task that is not waiting for one.
+#define IPC_INVALID (-1)
+
+// Returned by ipc_call if the server is destroyed before it replies.
+#define IPC_PEER_GONE (-2)
+
+// Limits on shared memory objects. Names include the null terminator.
+#define SHM_NAME_MAX 32
+#define SHM_MAX_SIZE (64 * 1024 * 1024)
+
+// Returned by shm_create and shm_map for an empty or overlong name, a size of
+// 0 or over SHM_MAX_SIZE, or an address that is not 4MB aligned.
+#define SHM_INVALID (-1)
+
+// Returned by shm_create if a live object already has the name.
+#define SHM_EXISTS (-2)
+
+// Returned by shm_map if no live object has the name.
+#define SHM_NOT_FOUND (-3)
+
+// Returned by shm_create and shm_map if there is no room for another object,
+// not enough free memory, or the address range asked for is not free.
+#define SHM_NO_SPACE (-4)
+
+// The descriptors every task reads and writes its standard input and output
+// through. They use the console until a pipe is opened on them.
+#define STDIN_FD 0
+#define STDOUT_FD 1
+
+// Returned by read, write, close and set_spawn_stdio for a descriptor that is
+// not open, or is the wrong end of a pipe.
+#define FD_INVALID (-1)
+
+// Returned by pipe if the task has no free descriptors for the ends.
+#define PIPE_NO_SPACE (-2)
+
+// Returned by write if every read end of the pipe is closed.
+#define PIPE_BROKEN (-3)
+
+// Returned by ring_setup if the task already has a syscall ring.
+#define RING_EXISTS (-1)
+
+// Returned by ring_setup if there is no free page to map the ring at.
+#define RING_NO_SPACE (-2)
+
+// Returned by ring_enter if the task has not set up a ring.
+#define RING_NOT_SET_UP (-3)
+
+// Returned by spawn_program if the startup block is smaller than its header or
+// larger than STARTUP_MAX_SIZE.
+#define STARTUP_INVALID (-1)
+
+// Returned by poll if it is given more than POLL_MAX entries.
+#define POLL_TOO_MANY (-1)
+
+// Returned by multicall if it is given more than MULTICALL_MAX calls.
+#define MULTICALL_TOO_MANY (-1)
+
+#endif
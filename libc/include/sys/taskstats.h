@@ -0,0 +1,32 @@
+#ifndef __SYS_TASKSTATS_H
+#define __SYS_TASKSTATS_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TASK_STATS_USER (1 << 0)    // This is a user task.
+#define TASK_STATS_ON_CPU (1 << 1)  // This task is running on some CPU.
+#define TASK_STATS_NO_PARENT UINT32_MAX
+
+// A snapshot of one task's scheduler accounting, filled in by the
+// get_task_stats syscall. Times are in TSC cycles.
+struct TaskStats {
+  uint32_t id;
+  uint32_t parent_id;  // TASK_STATS_NO_PARENT for boot tasks.
+  uint32_t flags;
+  uint32_t ticks;  // Timer ticks that landed while this task was running.
+  uint64_t runtime;
+  uint64_t runqueue_wait;  // Time spent ready to run but waiting for a CPU.
+  uint32_t voluntary_switches;    // Switches where the task gave up the CPU.
+  uint32_t involuntary_switches;  // Switches because the task was preempted.
+  uint32_t syscalls;
+};
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif
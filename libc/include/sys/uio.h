@@ -0,0 +1,20 @@
+#ifndef __SYS_UIO_H
+#define __SYS_UIO_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// One fragment of a scattered buffer, as used by the vectored copy syscalls.
+struct iovec {
+  void *iov_base;
+  size_t iov_len;
+};
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef __SYS_VDSO_H
+#define __SYS_VDSO_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The kernel maps a read-only VDSOData at this address in every address space
+// so user tasks can read the clock and their own task without a syscall. This
+// must match VDSO_START in the kernel's paging.h.
+#define VDSO_ADDR 0x1C00000  // 28 MB
+
+#define VDSO_MAX_CPUS 8
+
+// A user-readable GDT selector whose segment limit is the index of the CPU
+// loading it, so `lsl` finds the CPU a task is on without a syscall.
+#define VDSO_CPU_SELECTOR 0x33
+
+// The task running on one CPU. `seq` is odd while the kernel is switching
+// tasks on that CPU.
+struct VDSOCPU {
+  uint32_t seq;
+  uint32_t task_id;
+  uint32_t task_handle;  // What sys_get_current_task() returns.
+  uint32_t reserved;
+};
+
+// Everything below `clock_seq` is only written by the timer interrupt, which
+// makes `clock_seq` odd while it updates them. Readers retry if `clock_seq` is
+// odd or changed while they were reading.
+struct VDSOData {
+  uint32_t clock_seq;
+  uint32_t ticks;  // PIT ticks since boot.
+  uint32_t ticks_per_second;
+  uint32_t reserved;
+  uint64_t tick_tsc;      // The TSC when `ticks` last changed.
+  uint64_t tsc_per_tick;  // A running average, or 0 until it is measured.
+  struct VDSOCPU cpus[VDSO_MAX_CPUS];
+};
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef TIME_H
+#define TIME_H
+
+#include <_internals.h>
+#include <stdint.h>
+
+__BEGIN_CDECLS
+
+typedef int64_t time_t;
+typedef int32_t clockid_t;
+
+struct timespec {
+  time_t tv_sec;
+  int32_t tv_nsec;
+};
+
+// There is no real-time clock yet, so both clocks count from when the kernel
+// started its timer.
+#define CLOCK_REALTIME 0
+#define CLOCK_MONOTONIC 1
+
+// Read the clock from the vDSO without a syscall. This is interpolated between
+// timer ticks with the TSC, so it has sub-tick resolution. Returns 0, or -1 if
+// `clock_id` is unknown.
+int clock_gettime(clockid_t clock_id, struct timespec *tp);
+
+// The whole seconds of CLOCK_REALTIME, also stored in `tloc` if it is not null.
+time_t time(time_t *tloc);
+
+__END_CDECLS
+
+#endif
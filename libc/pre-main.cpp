@@ -21,9 +21,8 @@ vfs::Directory *CWD;
 uint32_t PageIndex4M(const void *addr) { return (uint32_t)(addr) >> 22; }
 void *PageAddr4M(uint32_t page) { return (void *)(page << 22); }
 
-// Attempt to get the next available page by getting the location of the current
-// binary in memory, then getting the page after it. Note that this only works
-// because binaries right now fit into a 4MB page.
+// Get the page after the one this binary starts in. Binaries over 4MB take the
+// pages after that too, so pre_main() skips past any that are mapped.
 void *NextPage() {
   uint32_t page = PageIndex4M((void *)&NextPage);
   return PageAddr4M(page + 1);
@@ -86,8 +85,12 @@ int UnpackArgv(size_t packed_argv_size, char *packed_argv,
 
 // FIXME: Get rid of the arguments since these aren't used.
 extern "C" int pre_main(void **arg_ptr) {
+  InitSyscallEntry();
+
   void *heap_start = NextPage();
-  auto val = sys_map_page(heap_start);
+  int32_t val;
+  while ((val = sys_map_page(heap_start)) == MAP_ALREADY_MAPPED)
+    heap_start = PageAddr4M(PageIndex4M(heap_start) + 1);
   switch (val) {
     case MAP_UNALIGNED_ADDR:
       ERROR(
@@ -95,10 +98,6 @@ extern "C" int pre_main(void **arg_ptr) {
           "page.\n",
           heap_start);
       return kExitFailure;
-    case MAP_ALREADY_MAPPED:
-      ERROR("Attempting to map virtual address %p which is already mapped.\n",
-            heap_start);
-      return kExitFailure;
     case MAP_OOM:
       ERROR("No more physical memory available!\n");
       return kExitFailure;
@@ -110,52 +109,27 @@ extern "C" int pre_main(void **arg_ptr) {
   uint8_t *heap_top = heap_bottom + kInitHeapSize;
   user::InitializeUserHeap(heap_bottom, heap_top);
 
-  // The argument passed here is the ArgInfo struct prepared in elf.cpp. Because
-  // the arginfo is on the stack of the parent process, we must gain permission
-  // to read from the parent address space.
-  //
-  // NOTE: We can read from the arginfo in this manner because within elf.cpp,
-  // we explicitly do not destroy the parent task that spawned this task, nor do
-  // we finish exiting the function where this task was spawned until this
-  // subtask has finished executing. If we were to do a non-blocking task spawn,
-  // then we would require a different synchonous mechanism for reading from the
-  // parent.
-  ArgInfo arginfo;
-  Handle parent = sys_get_parent_task();
-  {
-    void *arginfo_stack_addr = *arg_ptr;
-    auto arginfo_int = reinterpret_cast<uintptr_t>(arginfo_stack_addr);
-    uint32_t offset = arginfo_int % kPageSize4M;
-    auto arginfo_page = arginfo_int - offset;
-    uint8_t *this_arginfo_page;
-    sys_share_page(parent, reinterpret_cast<void **>(&this_arginfo_page),
-                   reinterpret_cast<void *>(arginfo_page));
-    auto *this_arginfo =
-        reinterpret_cast<ArgInfo *>(this_arginfo_page + offset);
-
-    // Extract the arginfo members.
-    memcpy(&arginfo, this_arginfo, sizeof(arginfo));
-
-    sys_unmap_page(this_arginfo_page);
-  }
-  kGlobalEnvInfo.raw_vfs_data = arginfo.env_info.raw_vfs_data;
-  kGlobalEnvInfo.raw_vfs_data_owner = arginfo.env_info.raw_vfs_data_owner;
+  // The argument passed here is the copy of the startup block from elf.cpp
+  // that the kernel put in our shared user space, so it can be read directly.
+  auto *startup = static_cast<StartupBlock *>(*arg_ptr);
+  auto *block = reinterpret_cast<char *>(startup);
+  kGlobalEnvInfo.raw_vfs_data =
+      reinterpret_cast<const void *>(startup->vfs_data);
+  kGlobalEnvInfo.raw_vfs_data_owner = startup->vfs_owner;
 
   auto root_vfs = ParseUSTARFromRawData();
   kRootVFS = root_vfs.get();
 
   // Get the current working directory.
-  if (!arginfo.pwd) {
+  if (!startup->pwd_offset) {
     CWD = kRootVFS;
   } else {
-    CWD = kRootVFS->getDir(arginfo.pwd);
+    CWD = kRootVFS->getDir(block + startup->pwd_offset);
     assert(CWD && "Could not find pwd.");
   }
 
-  char packed_argv[arginfo.packed_argv_size];
-  sys_copy_from_task(parent, packed_argv, arginfo.packed_argv,
-                     arginfo.packed_argv_size);
   char *argv[ARG_MAX];
-  int argc = UnpackArgv(arginfo.packed_argv_size, packed_argv, argv);
+  int argc =
+      UnpackArgv(startup->argv_size, block + startup->argv_offset, argv);
   return main(argc, argv);
 }
@@ -3,15 +3,18 @@
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
-// FIXME: We will be printing characters with serial for now, but should really
-// implement a filesystem-like structure for more "standard" printing.
+// Output goes to stdout, which is the serial console unless this task was
+// started with a pipe as its stdout.
 
 namespace {
 
-void __system_print(const char *str) { sys::DebugPrint(str); }
+void __system_print(const char *str) {
+  sys_write(STDOUT_FD, str, static_cast<uint32_t>(strlen(str)));
+}
 
-void __system_put(char c) { sys::DebugPut(c); }
+void __system_put(char c) { sys_write(STDOUT_FD, &c, 1); }
 
 }  // namespace
 
@@ -73,12 +76,13 @@ extern "C" int printf(const char *fmt, ...) {
 extern "C" void put(char c) { __system_put(c); }
 
 extern "C" int putchar(int c) {
-  if (sys::DebugPut(static_cast<char>(c))) return c;
+  char ch = static_cast<char>(c);
+  if (sys_write(STDOUT_FD, &ch, 1) == 1) return c;
   return EOF;
 }
 
 extern "C" int getchar() {
   char c;
-  while (!sys::DebugRead(c)) {}
-  return c;
+  if (sys_read(STDIN_FD, &c, 1) != 1) return EOF;
+  return static_cast<unsigned char>(c);
 }
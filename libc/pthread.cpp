@@ -0,0 +1,137 @@
+#include <_syscalls.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+struct __pthread {
+  Handle handle;
+  void *(*start_routine)(void *);
+  void *arg;
+  void *retval;
+};
+
+namespace {
+
+// The kernel starts every thread here. The return value is left in the
+// __pthread for pthread_join() to pick up after the thread exits.
+void ThreadEntry(void *arg) {
+  auto *thread = static_cast<pthread_t>(arg);
+  thread->retval = thread->start_routine(thread->arg);
+  sys_exit_task();
+}
+
+}  // namespace
+
+int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+                   void *(*start_routine)(void *), void *arg) {
+  if (attr) return 1;
+
+  auto *t = static_cast<pthread_t>(malloc(sizeof(__pthread)));
+  if (!t) return 1;
+  t->start_routine = start_routine;
+  t->arg = arg;
+  t->retval = nullptr;
+
+  // Fill in everything the thread reads before it can start running.
+  t->handle = sys_create_thread(ThreadEntry, t);
+  if (t->handle == HANDLE_INVALID) {
+    free(t);
+    return 1;
+  }
+  *thread = t;
+  return 0;
+}
+
+int pthread_join(pthread_t thread, void **retval) {
+  sys_destroy_task(thread->handle);
+  if (retval) *retval = thread->retval;
+  free(thread);
+  return 0;
+}
+
+namespace {
+
+// Take `mutex` marking it as having waiters. This is the slow path of
+// pthread_mutex_lock() and is also used after waking from a condition variable,
+// since other woken waiters may be queued behind this one.
+void LockContended(pthread_mutex_t *mutex, uint32_t state) {
+  if (state != 2)
+    state = __atomic_exchange_n(&mutex->state, 2, __ATOMIC_ACQUIRE);
+  while (state != 0) {
+    sys_futex_wait(&mutex->state, 2);
+    state = __atomic_exchange_n(&mutex->state, 2, __ATOMIC_ACQUIRE);
+  }
+}
+
+}  // namespace
+
+int pthread_mutex_init(pthread_mutex_t *mutex,
+                       const pthread_mutexattr_t *attr) {
+  if (attr) return 1;
+  mutex->state = 0;
+  return 0;
+}
+
+int pthread_mutex_destroy(pthread_mutex_t *) { return 0; }
+
+int pthread_mutex_lock(pthread_mutex_t *mutex) {
+  uint32_t state = 0;
+  if (!__atomic_compare_exchange_n(&mutex->state, &state, 1, /*weak=*/false,
+                                   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    LockContended(mutex, state);
+  return 0;
+}
+
+int pthread_mutex_trylock(pthread_mutex_t *mutex) {
+  uint32_t state = 0;
+  return !__atomic_compare_exchange_n(&mutex->state, &state, 1,
+                                      /*weak=*/false, __ATOMIC_ACQUIRE,
+                                      __ATOMIC_RELAXED);
+}
+
+int pthread_mutex_unlock(pthread_mutex_t *mutex) {
+  // Only wake someone if the mutex was marked as having waiters.
+  if (__atomic_fetch_sub(&mutex->state, 1, __ATOMIC_RELEASE) != 1) {
+    __atomic_store_n(&mutex->state, 0, __ATOMIC_RELEASE);
+    sys_futex_wake(&mutex->state, 1);
+  }
+  return 0;
+}
+
+int pthread_cond_init(pthread_cond_t *cond, const pthread_condattr_t *attr) {
+  if (attr) return 1;
+  cond->seq = 0;
+  cond->waiters = 0;
+  return 0;
+}
+
+int pthread_cond_destroy(pthread_cond_t *) { return 0; }
+
+int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex) {
+  // Count this waiter before reading the sequence. A signal that does not see
+  // the count bumped `seq` before it was read, so it was sent before this
+  // waiter started waiting.
+  __atomic_fetch_add(&cond->waiters, 1, __ATOMIC_SEQ_CST);
+  uint32_t seq = __atomic_load_n(&cond->seq, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(mutex);
+
+  // This returns right away if a signal arrived after unlocking.
+  sys_futex_wait(&cond->seq, seq);
+
+  __atomic_fetch_sub(&cond->waiters, 1, __ATOMIC_RELAXED);
+  LockContended(mutex, /*state=*/1);
+  return 0;
+}
+
+int pthread_cond_signal(pthread_cond_t *cond) {
+  __atomic_fetch_add(&cond->seq, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&cond->waiters, __ATOMIC_SEQ_CST))
+    sys_futex_wake(&cond->seq, 1);
+  return 0;
+}
+
+int pthread_cond_broadcast(pthread_cond_t *cond) {
+  __atomic_fetch_add(&cond->seq, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&cond->waiters, __ATOMIC_SEQ_CST))
+    sys_futex_wake(&cond->seq, UINT32_MAX);
+  return 0;
+}
@@ -0,0 +1,41 @@
+#include <_syscalls.h>
+#include <ring.h>
+
+namespace {
+
+constexpr uint32_t kEntryMask = RING_ENTRIES - 1;
+static_assert((RING_ENTRIES & kEntryMask) == 0);
+
+}  // namespace
+
+int32_t ring_create(SyscallRing **ring) {
+  void *page;
+  int32_t res = sys_ring_setup(&page);
+  if (res < 0) return res;
+  *ring = static_cast<SyscallRing *>(page);
+  return 0;
+}
+
+bool ring_queue(SyscallRing *ring, const RingSubmission *sub) {
+  uint32_t tail = ring->sq_tail;
+  if (tail - __atomic_load_n(&ring->sq_head, __ATOMIC_ACQUIRE) == RING_ENTRIES)
+    return false;
+  ring->sq[tail & kEntryMask] = *sub;
+  __atomic_store_n(&ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+int32_t ring_submit(SyscallRing *ring) {
+  uint32_t queued =
+      ring->sq_tail - __atomic_load_n(&ring->sq_head, __ATOMIC_ACQUIRE);
+  if (!queued) return 0;
+  return sys_ring_enter(queued);
+}
+
+bool ring_reap(SyscallRing *ring, RingCompletion *completion) {
+  uint32_t head = ring->cq_head;
+  if (head == __atomic_load_n(&ring->cq_tail, __ATOMIC_ACQUIRE)) return false;
+  *completion = ring->cq[head & kEntryMask];
+  __atomic_store_n(&ring->cq_head, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
@@ -0,0 +1,40 @@
+#include <_syscalls.h>
+#include <semaphore.h>
+
+int sem_init(sem_t *sem, int, unsigned value) {
+  sem->value = value;
+  sem->waiters = 0;
+  return 0;
+}
+
+int sem_destroy(sem_t *) { return 0; }
+
+int sem_trywait(sem_t *sem) {
+  uint32_t value = __atomic_load_n(&sem->value, __ATOMIC_RELAXED);
+  while (value) {
+    if (__atomic_compare_exchange_n(&sem->value, &value, value - 1,
+                                    /*weak=*/true, __ATOMIC_ACQUIRE,
+                                    __ATOMIC_RELAXED))
+      return 0;
+  }
+  return 1;
+}
+
+int sem_wait(sem_t *sem) {
+  while (sem_trywait(sem)) {
+    // Count this waiter before the kernel checks the value. A post that does
+    // not see the count made the value nonzero first, so the wait returns
+    // right away.
+    __atomic_fetch_add(&sem->waiters, 1, __ATOMIC_SEQ_CST);
+    sys_futex_wait(&sem->value, 0);
+    __atomic_fetch_sub(&sem->waiters, 1, __ATOMIC_RELAXED);
+  }
+  return 0;
+}
+
+int sem_post(sem_t *sem) {
+  __atomic_fetch_add(&sem->value, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&sem->waiters, __ATOMIC_SEQ_CST))
+    sys_futex_wake(&sem->value, 1);
+  return 0;
+}
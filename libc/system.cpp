@@ -3,6 +3,7 @@
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <vfs.h>
 #include <vfs_helpers.h>
 
@@ -38,9 +39,10 @@ void ArgvFromArgString(const char *argstr, size_t argv_buffer_len,
   *argv = nullptr;
 }
 
-}  // namespace
-
-int system(const char *cmd) {
+// Start the program for `cmd` and set `handle` to it. `handle` is
+// HANDLE_INVALID if nothing was started.
+int StartCommand(const char *cmd, Handle &handle) {
+  handle = HANDLE_INVALID;
   size_t cmdlen = strlen(cmd) + 1;
   char *argv[ARG_MAX];
   char argv_buffer[cmdlen];
@@ -53,8 +55,8 @@ int system(const char *cmd) {
   // Note that we can pass `cmd` here because the std::string ctor will parse
   // it as a null-terminated string up to the first argument.
   if (const vfs::File *file = GetRootDir().getFile(argv[0])) {
-    LoadElfProgram(file->getContents().data(), GetGlobalEnvInfo(), argc,
-                   const_cast<const char **>(argv));
+    handle = SpawnElfProgram(file->getContents().data(), GetGlobalEnvInfo(),
+                             argc, const_cast<const char **>(argv));
   } else {
     printf("Unknown command '%s'\n", argv[0]);
     return -1;
@@ -62,3 +64,79 @@ int system(const char *cmd) {
 
   return 0;
 }
+
+// Start each program of a pipeline like `a | b | c`, with the stdout of each
+// piped to the stdin of the next, and store their handles in `handles`. The
+// programs all run at once, so a program reading its stdin sees the end of it
+// once every program before it exits. This returns -1 if any of them could not
+// be started.
+int StartPipeline(const char *cmd, Handle handles[kMaxPipelineStages],
+                  size_t &num) {
+  num = 0;
+  size_t cmdlen = strlen(cmd) + 1;
+  char stages_buffer[cmdlen];
+  memcpy(stages_buffer, cmd, cmdlen);
+
+  char *stages[kMaxPipelineStages];
+  size_t num_stages = 0;
+  char *stage = stages_buffer;
+  while (true) {
+    if (num_stages == kMaxPipelineStages) {
+      printf("A pipeline can have at most %u commands\n",
+             static_cast<unsigned>(kMaxPipelineStages));
+      return -1;
+    }
+    stages[num_stages++] = stage;
+    while (*stage && *stage != '|') ++stage;
+    if (!*stage) break;
+    *(stage++) = 0;
+  }
+
+  int ret = 0;
+  uint32_t in = STDIN_FD;
+  for (size_t i = 0; i < num_stages; ++i) {
+    bool last = i + 1 == num_stages;
+    uint32_t fds[2] = {};
+    if (!last && sys_pipe(fds) != 0) {
+      printf("Could not create a pipe\n");
+      ret = -1;
+      break;
+    }
+    if (num_stages > 1) sys_set_spawn_stdio(in, last ? STDOUT_FD : fds[1]);
+
+    Handle handle;
+    if (StartCommand(stages[i], handle)) ret = -1;
+    if (handle != HANDLE_INVALID) handles[num++] = handle;
+
+    // The program has its own references to the pipe ends now.
+    if (in != STDIN_FD) sys_close(in);
+    in = STDIN_FD;
+    if (!last) {
+      sys_close(fds[1]);
+      in = fds[0];
+    }
+  }
+  if (in != STDIN_FD) sys_close(in);
+  if (num_stages > 1) sys_set_spawn_stdio(STDIN_FD, STDOUT_FD);
+  return ret;
+}
+
+}  // namespace
+
+int system(const char *cmd) {
+  Handle handles[kMaxPipelineStages];
+  size_t num;
+  int ret = StartPipeline(cmd, handles, num);
+  while (num) {
+    // Move the last program into the reaped slot.
+    int index = WaitAnyProgram(handles, num);
+    handles[index] = handles[--num];
+  }
+  return ret;
+}
+
+size_t SpawnPipeline(const char *cmd, Handle handles[kMaxPipelineStages]) {
+  size_t num;
+  StartPipeline(cmd, handles, num);
+  return num;
+}
@@ -1,4 +1,5 @@
 #include <allocator.h>
+#include <pthread.h>
 
 #include <cassert>
 #include <cstdio>
@@ -12,6 +13,15 @@ const uint8_t *kHeapTop, *kHeapBottom;
 
 utils::Allocator UserAllocator;
 
+// Threads share the heap, so every allocator call holds this.
+pthread_mutex_t HeapLock = PTHREAD_MUTEX_INITIALIZER;
+
+class HeapLockRAII {
+ public:
+  HeapLockRAII() { pthread_mutex_lock(&HeapLock); }
+  ~HeapLockRAII() { pthread_mutex_unlock(&HeapLock); }
+};
+
 void *usbrk_chunk(size_t n, void *heap) {
   uint8_t *heap_bytes = reinterpret_cast<uint8_t *>(heap);
   assert(heap_bytes + (n * kChunkSize) <= kHeapTop &&
@@ -40,19 +50,28 @@ void InitializeUserHeap(uint8_t *heap_bottom, uint8_t *heap_top) {
   UserAllocator.Init(heap_bottom, usbrk, heap_top);
 }
 
-void *umalloc(size_t size) { return UserAllocator.Malloc(size); }
+void *umalloc(size_t size) {
+  HeapLockRAII lock;
+  return UserAllocator.Malloc(size);
+}
 
 void *umalloc(size_t size, uint32_t alignment) {
+  HeapLockRAII lock;
   return UserAllocator.Malloc(size, alignment);
 }
 
-void ufree(void *ptr) { return UserAllocator.Free(ptr); }
+void ufree(void *ptr) {
+  HeapLockRAII lock;
+  return UserAllocator.Free(ptr);
+}
 
 void *urealloc(void *ptr, size_t size) {
+  HeapLockRAII lock;
   return UserAllocator.Realloc(ptr, size);
 }
 
 void *ucalloc(size_t num, size_t size) {
+  HeapLockRAII lock;
   return UserAllocator.Calloc(num, size);
 }
 
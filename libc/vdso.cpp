@@ -0,0 +1,108 @@
+#include <_syscalls.h>
+#include <sys/vdso.h>
+#include <time.h>
+
+namespace {
+
+constexpr uint32_t kNsPerSecond = 1000000000;
+
+const volatile VDSOData &GetVDSO() {
+  return *reinterpret_cast<const volatile VDSOData *>(VDSO_ADDR);
+}
+
+uint64_t ReadTSC() {
+  uint32_t low, high;
+  asm volatile("rdtsc" : "=a"(low), "=d"(high));
+  return (static_cast<uint64_t>(high) << 32) | low;
+}
+
+uint32_t ReadCPUIndex() {
+  uint32_t cpu;
+  asm volatile("lsl %1, %0" : "=r"(cpu) : "r"(VDSO_CPU_SELECTOR));
+  return cpu;
+}
+
+// The kernel makes `seq` odd while it writes the record it guards, so a read
+// is only consistent if `seq` was even and unchanged across it.
+uint32_t BeginRead(const volatile uint32_t &seq) {
+  uint32_t start;
+  while ((start = __atomic_load_n(&seq, __ATOMIC_ACQUIRE)) & 1)
+    asm volatile("pause");
+  return start;
+}
+
+bool RetryRead(const volatile uint32_t &seq, uint32_t start) {
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&seq, __ATOMIC_RELAXED) != start;
+}
+
+uint64_t MonotonicNs() {
+  const volatile VDSOData &vdso = GetVDSO();
+  uint32_t seq, ticks, ticks_per_second;
+  uint64_t tick_tsc, tsc_per_tick, now;
+  do {
+    seq = BeginRead(vdso.clock_seq);
+    ticks = vdso.ticks;
+    ticks_per_second = vdso.ticks_per_second;
+    tick_tsc = vdso.tick_tsc;
+    tsc_per_tick = vdso.tsc_per_tick;
+    now = ReadTSC();
+  } while (RetryRead(vdso.clock_seq, seq));
+
+  if (!ticks_per_second) return 0;
+  uint32_t ns_per_tick = kNsPerSecond / ticks_per_second;
+  uint64_t ns = static_cast<uint64_t>(ticks) * ns_per_tick;
+
+  // Interpolate within the current tick, but never past the next one so the
+  // clock cannot go backwards when it arrives. The TSC of the CPU we are on
+  // can lag the one that took the tick, so treat that as no time passed.
+  uint64_t since_tick = now - tick_tsc;
+  if (tsc_per_tick && static_cast<int64_t>(since_tick) > 0) {
+    if (since_tick >= tsc_per_tick) since_tick = tsc_per_tick - 1;
+    ns += since_tick * ns_per_tick / tsc_per_tick;
+  }
+  return ns;
+}
+
+// Read the task this CPU is running, which is the caller.
+void ReadCurrentTask(uint32_t &id, uint32_t &handle) {
+  const volatile VDSOData &vdso = GetVDSO();
+  uint32_t cpu, seq;
+  do {
+    cpu = ReadCPUIndex();
+    const volatile VDSOCPU &slot = vdso.cpus[cpu];
+    seq = BeginRead(slot.seq);
+    id = slot.task_id;
+    handle = slot.task_handle;
+
+    // If we moved to another CPU in between, this may be another task's slot.
+  } while (RetryRead(vdso.cpus[cpu].seq, seq) || ReadCPUIndex() != cpu);
+}
+
+}  // namespace
+
+int clock_gettime(clockid_t clock_id, struct timespec *tp) {
+  if (clock_id != CLOCK_REALTIME && clock_id != CLOCK_MONOTONIC) return -1;
+  uint64_t ns = MonotonicNs();
+  tp->tv_sec = static_cast<time_t>(ns / kNsPerSecond);
+  tp->tv_nsec = static_cast<int32_t>(ns % kNsPerSecond);
+  return 0;
+}
+
+time_t time(time_t *tloc) {
+  time_t now = static_cast<time_t>(MonotonicNs() / kNsPerSecond);
+  if (tloc) *tloc = now;
+  return now;
+}
+
+uint32_t GetCurrentTaskId() {
+  uint32_t id, handle;
+  ReadCurrentTask(id, handle);
+  return id;
+}
+
+Handle sys_get_current_task() {
+  uint32_t id, handle;
+  ReadCurrentTask(id, handle);
+  return handle;
+}
@@ -0,0 +1,11 @@
+#include <_syscalls.h>
+
+// Copy stdin to stdout until the end of input, like at the end of a pipeline
+// such as `ls | cat`.
+int main() {
+  char buffer[256];
+  int32_t read;
+  while ((read = sys_read(STDIN_FD, buffer, sizeof(buffer))) > 0)
+    if (sys_write(STDOUT_FD, buffer, static_cast<uint32_t>(read)) < 0) return 1;
+  return 0;
+}
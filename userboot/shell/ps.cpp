@@ -0,0 +1,38 @@
+#include <_syscalls.h>
+#include <stdio.h>
+#include <sys/taskstats.h>
+
+namespace {
+
+constexpr uint32_t kMaxTasks = 64;
+
+// Times are printed in millions of cycles so they fit in what printf can print.
+unsigned MCycles(uint64_t cycles) {
+  return static_cast<unsigned>(cycles / 1000000);
+}
+
+}  // namespace
+
+int main() {
+  TaskStats stats[kMaxTasks];
+  uint32_t num_tasks = sys_get_task_stats(stats, kMaxTasks);
+  uint32_t num_shown = num_tasks < kMaxTasks ? num_tasks : kMaxTasks;
+
+  printf("ID\tPARENT\tTYPE\tSTATE\tTICKS\tRUN(M)\tWAIT(M)\tVOL\tINVOL\t"
+         "SYSCALLS\n");
+  for (uint32_t i = 0; i < num_shown; ++i) {
+    const TaskStats &task = stats[i];
+    printf("%u\t", task.id);
+    if (task.parent_id == TASK_STATS_NO_PARENT)
+      printf("-\t");
+    else
+      printf("%u\t", task.parent_id);
+    printf("%s\t%s\t", (task.flags & TASK_STATS_USER) ? "user" : "kernel",
+           (task.flags & TASK_STATS_ON_CPU) ? "run" : "ready");
+    printf("%u\t%u\t%u\t%u\t%u\t%u\n", task.ticks, MCycles(task.runtime),
+           MCycles(task.runqueue_wait), task.voluntary_switches,
+           task.involuntary_switches, task.syscalls);
+  }
+  if (num_tasks > num_shown) printf("... and %u more\n", num_tasks - num_shown);
+  return 0;
+}
@@ -18,15 +18,15 @@ constexpr const size_t kCmdBufferSize = 1024;
 constexpr const char CR = 13;  // Carriage return
 
 // Store typed characters into a buffer while also saving the command until the
-// next ENTER.
-void DebugRead(char *buffer) {
+// next ENTER. This returns false at the end of input.
+bool DebugRead(char *buffer) {
   while (1) {
     int c = getchar();
-    assert(c != EOF);
+    if (c == EOF) return false;
     if (c == CR) {
       *buffer = 0;
       putchar('\n');
-      return;
+      return true;
     }
 
     *(buffer++) = static_cast<char>(c);
@@ -34,6 +34,58 @@ void DebugRead(char *buffer) {
   }
 }
 
+// Programs started in the background with `&` that have not been reaped yet.
+// The handles are kept contiguous so they can be waited on together. Every
+// program of a background pipeline gets the same job ID.
+constexpr size_t kMaxJobs = 16;
+Handle JobHandles[kMaxJobs];
+uint32_t JobIDs[kMaxJobs];
+size_t NumJobs = 0;
+uint32_t NextJobID = 1;
+
+bool HasJob(uint32_t id) {
+  for (size_t i = 0; i < NumJobs; ++i)
+    if (JobIDs[i] == id) return true;
+  return false;
+}
+
+// Reap background jobs that finished. If `block` is set, wait for all of them.
+void ReapJobs(bool block) {
+  while (NumJobs) {
+    int index = WaitAnyProgram(JobHandles, NumJobs, block);
+    if (index < 0) return;
+    uint32_t id = JobIDs[index];
+
+    // Move the last job into the reaped slot.
+    --NumJobs;
+    JobHandles[index] = JobHandles[NumJobs];
+    JobIDs[index] = JobIDs[NumJobs];
+    if (!HasJob(id)) printf("[%u] Done\n", id);
+  }
+}
+
+// If the command ends with `&`, remove it and return true.
+bool IsBackgroundCommand(char *cmd) {
+  size_t len = strlen(cmd);
+  while (len && isspace(cmd[len - 1])) --len;
+  if (!len || cmd[len - 1] != '&') return false;
+  cmd[len - 1] = 0;
+  return true;
+}
+
+void RunInBackground(const char *cmd) {
+  if (NumJobs + kMaxPipelineStages > kMaxJobs) {
+    printf("Too many background jobs. Wait for one to finish first.\n");
+    return;
+  }
+
+  size_t num = SpawnPipeline(cmd, JobHandles + NumJobs);
+  if (!num) return;
+  for (size_t i = 0; i < num; ++i) JobIDs[NumJobs + i] = NextJobID;
+  printf("[%u] Started\n", NextJobID++);
+  NumJobs += num;
+}
+
 }  // namespace
 
 int main([[maybe_unused]] int argc, [[maybe_unused]] char **argv) {
@@ -49,12 +101,24 @@ int main([[maybe_unused]] int argc, [[maybe_unused]] char **argv) {
     assert(cwd && "Could not get current working directory.");
     cwd[sizeof(cwd_buf) - 1] = 0;
     printf("%s$ ", cwd_buf);
-    DebugRead(buffer);
+    if (!DebugRead(buffer)) break;
+    ReapJobs(/*block=*/false);
 
     if (strcmp(buffer, "exit") == 0) break;
 
-    system(buffer);
+    // Wait for all background jobs.
+    if (strcmp(buffer, "wait") == 0) {
+      ReapJobs(/*block=*/true);
+      continue;
+    }
+
+    if (IsBackgroundCommand(buffer))
+      RunInBackground(buffer);
+    else
+      system(buffer);
   }
 
+  // Every child must be reaped before we exit.
+  ReapJobs(/*block=*/true);
   return 0;
 }
@@ -15,19 +15,39 @@ namespace {
 using CmdFunc = bool (*)();
 using CmdInfo = std::tuple<const char *, const char *, CmdFunc>;
 
-sys::Handle RunFlatUserBinary(const vfs::Directory &vfs,
-                              const std::string &filename,
-                              void *arg = nullptr) {
+// Start `num` copies of a flat binary and wait for them to finish. All the
+// copies are created with one syscall and destroyed with another.
+void RunFlatUserBinaries(const vfs::Directory &vfs, const std::string &filename,
+                         uint32_t num) {
   const vfs::File *file = vfs.getFile(filename);
   assert(file && "Could not find binary");
+  assert(num <= MULTICALL_MAX);
 
   size_t size = file->getContents().size();
   printf("%s is %u bytes\n", filename.c_str(), size);
 
   // Actually create and run the user tasks.
-  sys::Handle handle = sys::CreateTask(file->getContents().data(), size, arg);
-  printf("Created thread handle %u\n", handle);
-  return handle;
+  auto code = reinterpret_cast<uint32_t>(file->getContents().data());
+  sys::Handle handles[MULTICALL_MAX];
+  MultiCall calls[MULTICALL_MAX];
+  for (uint32_t i = 0; i < num; ++i) {
+    calls[i] = {SYS_create_user_task,
+                {code, size, /*arg=*/0, reinterpret_cast<uint32_t>(&handles[i]),
+                 /*entry_offset=*/0},
+                /*result=*/0};
+  }
+  int32_t made = sys_multicall(calls, num, MULTICALL_STOP_ON_ERROR);
+
+  // Only destroy the tasks that were created.
+  uint32_t created = 0;
+  for (int32_t i = 0; i < made; ++i) {
+    if (calls[i].result) continue;
+    printf("Created task handle %u\n", handles[i]);
+    calls[created++] = {SYS_destroy_user_task,
+                        {handles[i], 0, 0, 0, 0},
+                        /*result=*/0};
+  }
+  sys_multicall(calls, created, /*flags=*/0);
 }
 
 }  // namespace
@@ -42,10 +62,7 @@ int main([[maybe_unused]] int argc, [[maybe_unused]] char **argv) {
   // Check starting a user task via syscall.
   printf("Trying test_user_program.bin ...\n");
   const vfs::Directory &initrd_dir = GetRootDir();
-  auto handle1 = RunFlatUserBinary(initrd_dir, "test_user_program.bin");
-  auto handle2 = RunFlatUserBinary(initrd_dir, "test_user_program.bin");
-  sys::DestroyTask(handle1);
-  sys::DestroyTask(handle2);
+  RunFlatUserBinaries(initrd_dir, "test_user_program.bin", /*num=*/2);
   printf("Finished test_user_program.bin.\n");
 
   if (const vfs::File *file = initrd_dir.getFile("shell")) {
@@ -2,9 +2,16 @@
 #include <MathUtils.h>
 #include <_syscalls.h>
 #include <allocator.h>
+#include <channel.h>
+#include <elf.h>
 #include <iterable.h>
 #include <print.h>
+#include <pthread.h>
+#include <ring.h>
 #include <rtti.h>
+#include <semaphore.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <umalloc.h>
 #include <userboot.h>
 #include <vfs.h>
@@ -1285,13 +1292,1007 @@ TEST(RTTICasts) {
 
 TEST_SUITE(RTTI) { RUN_TEST(RTTICasts); }
 
+// Defined in libc/_syscall_entry.S.
+extern "C" uint32_t __syscall_use_sysenter;
+
+TEST(SyscallEntryPathsAgree) {
+  uint32_t use_sysenter = __syscall_use_sysenter;
+
+  __syscall_use_sysenter = 0;
+  Handle int80_handle = sys_get_parent_task();
+  uint32_t int80_parent = sys_get_parent_task_id();
+
+  __syscall_use_sysenter = use_sysenter;
+  ASSERT_EQ(sys_get_parent_task(), int80_handle);
+  ASSERT_EQ(sys_get_parent_task_id(), int80_parent);
+  ASSERT_EQ(sys_map_page(reinterpret_cast<void *>(1)), MAP_UNALIGNED_ADDR);
+}
+
+// The main thread runs on the stack the kernel sets up in the shared user
+// space below USER_START, unlike threads, whose stacks are pages above it. Its
+// SYSENTER frame has to be accepted there too.
+TEST(SysenterFromMainThreadStack) {
+  uint32_t on_stack = 0;
+  ASSERT_TRUE(reinterpret_cast<uintptr_t>(&on_stack) < USER_START);
+
+  // A bad frame ends the task rather than returning, so reaching the asserts
+  // is the check.
+  uint32_t parent_id = sys_get_parent_task_id();
+  ASSERT_EQ(sys_get_parent_task_id(), parent_id);
+  ASSERT_EQ(sys_map_page(reinterpret_cast<void *>(1)), MAP_UNALIGNED_ADDR);
+}
+
+int32_t MakeInvalidSyscall() {
+  // Well past the last syscall in syscalls.def.
+  constexpr uint32_t kInvalidSyscall = SYS_get_current_task + 1000;
+  int32_t ret;
+  asm volatile("call __syscall_entry" : "=a"(ret) : "0"(kInvalidSyscall));
+  return ret;
+}
+
+TEST(InvalidSyscallNumber) {
+  uint32_t use_sysenter = __syscall_use_sysenter;
+  __syscall_use_sysenter = 0;
+  ASSERT_EQ(MakeInvalidSyscall(), SYSCALL_ENOSYS);
+  __syscall_use_sysenter = use_sysenter;
+  ASSERT_EQ(MakeInvalidSyscall(), SYSCALL_ENOSYS);
+}
+
+// Find this task in a snapshot. This is the running user task whose parent is
+// our parent.
+const TaskStats *FindThisTask(const TaskStats *stats, uint32_t num_tasks) {
+  uint32_t parent_id = sys_get_parent_task_id();
+  const TaskStats *found = nullptr;
+  for (uint32_t i = 0; i < num_tasks; ++i) {
+    const TaskStats &task = stats[i];
+    if (task.parent_id != parent_id || !(task.flags & TASK_STATS_USER) ||
+        !(task.flags & TASK_STATS_ON_CPU))
+      continue;
+    if (found) return nullptr;  // Ambiguous.
+    found = &task;
+  }
+  return found;
+}
+
+TEST(TaskStatsCountSyscalls) {
+  constexpr uint32_t kMaxTasks = 16;
+  constexpr uint32_t kNumSyscalls = 10;
+  TaskStats before[kMaxTasks], after[kMaxTasks];
+
+  uint32_t num_before = sys_get_task_stats(before, kMaxTasks);
+  ASSERT_GE(num_before, 2);
+  if (num_before > kMaxTasks) num_before = kMaxTasks;
+  for (uint32_t i = 0; i < kNumSyscalls; ++i) sys_get_parent_task_id();
+  uint32_t num_after = sys_get_task_stats(after, kMaxTasks);
+  if (num_after > kMaxTasks) num_after = kMaxTasks;
+
+  const TaskStats *this_before = FindThisTask(before, num_before);
+  const TaskStats *this_after = FindThisTask(after, num_after);
+  ASSERT_NE(this_before, nullptr);
+  ASSERT_NE(this_after, nullptr);
+  ASSERT_EQ(this_before->id, this_after->id);
+  ASSERT_GE(this_after->syscalls, this_before->syscalls + kNumSyscalls);
+  ASSERT_TRUE(this_after->runtime > this_before->runtime);
+}
+
+TEST_SUITE(Syscalls) {
+  RUN_TEST(SyscallEntryPathsAgree);
+  RUN_TEST(SysenterFromMainThreadStack);
+  RUN_TEST(InvalidSyscallNumber);
+  RUN_TEST(TaskStatsCountSyscalls);
+}
+
+// The smallest possible user program. It only makes the exit syscall.
+const uint8_t kExitProgram[] = {
+    0xb8, SYS_exit_user_task, 0x00, 0x00, 0x00,  // mov $SYS_exit..., %eax
+    0xcd, 0x80,                                  // int $0x80
+    0xeb, 0xfe,                                  // jmp .
+};
+
+uint64_t ReadTSC() {
+  uint32_t low, high;
+  asm volatile("rdtsc" : "=a"(low), "=d"(high));
+  return (static_cast<uint64_t>(high) << 32) | low;
+}
+
+// Measure how long it takes to create a task and to destroy it. Destroying
+// includes waiting for the task to run and exit.
+TEST(SpawnLatency) {
+  constexpr uint32_t kNumSpawns = 32;
+  uint64_t create_cycles = 0, destroy_cycles = 0;
+  for (uint32_t i = 0; i < kNumSpawns; ++i) {
+    uint64_t start = ReadTSC();
+    Handle task = sys::CreateTask(kExitProgram, sizeof(kExitProgram));
+    uint64_t created = ReadTSC();
+    ASSERT_NE(task, HANDLE_INVALID);
+    sys_destroy_task(task);
+    uint64_t destroyed = ReadTSC();
+
+    create_cycles += created - start;
+    destroy_cycles += destroyed - created;
+  }
+
+  PrintStdout("spawn: create {} cycles, destroy {} cycles (avg of {})\n",
+              static_cast<uint32_t>(create_cycles / kNumSpawns),
+              static_cast<uint32_t>(destroy_cycles / kNumSpawns), kNumSpawns);
+}
+
+// A program that spins for a while before exiting.
+const uint8_t kSlowExitProgram[] = {
+    0xb9, 0x00, 0x00, 0x00, 0x10,                // mov $0x10000000, %ecx
+    0xe2, 0xfe,                                  // 1: loop 1b
+    0xb8, SYS_exit_user_task, 0x00, 0x00, 0x00,  // mov $SYS_exit..., %eax
+    0xcd, 0x80,                                  // int $0x80
+    0xeb, 0xfe,                                  // jmp .
+};
+
+TEST(WaitAnyTask) {
+  Handle handles[] = {
+      sys::CreateTask(kSlowExitProgram, sizeof(kSlowExitProgram)),
+      sys::CreateTask(kExitProgram, sizeof(kExitProgram)),
+      sys::CreateTask(kExitProgram, sizeof(kExitProgram)),
+  };
+
+  // The quick programs should be reaped first. Move the last handle into each
+  // reaped slot so it is not waited on again.
+  uint32_t num_running = 3;
+  for (uint32_t i = 0; i < 2; ++i) {
+    int32_t index = sys::WaitAnyTask(handles, num_running);
+    ASSERT_NE(index, 0);
+    ASSERT_NE(index, WAIT_NONE_EXITED);
+    --num_running;
+    handles[index] = handles[num_running];
+  }
+  ASSERT_EQ(num_running, 1);
+  ASSERT_EQ(sys::WaitAnyTask(handles, num_running, /*block=*/false),
+            WAIT_NONE_EXITED);
+  ASSERT_EQ(sys::WaitAnyTask(handles, num_running), 0);
+}
+
+TEST(WaitAnyTaskTimeout) {
+  Handle handle = sys::CreateTask(kSlowExitProgram, sizeof(kSlowExitProgram));
+  ASSERT_EQ(sys_wait_any_task_timeout(&handle, 1, /*timeout_ms=*/1),
+            WAIT_NONE_EXITED);
+  ASSERT_EQ(sys_wait_any_task_timeout(&handle, 1, TIMEOUT_INFINITE), 0);
+}
+
+TEST(SpawnProgramStartupBlock) {
+  StartupBlock startup = {};
+  startup.size = sizeof(startup) - 1;
+  ASSERT_EQ(sys_spawn_program(kExitProgram, sizeof(kExitProgram),
+                              /*entry_offset=*/0, &startup),
+            HANDLE_INVALID);
+  startup.size = STARTUP_MAX_SIZE + 1;
+  ASSERT_EQ(sys_spawn_program(kExitProgram, sizeof(kExitProgram),
+                              /*entry_offset=*/0, &startup),
+            HANDLE_INVALID);
+
+  // The program gets its own copy, so the block can change right away.
+  startup.size = sizeof(startup);
+  Handle handle = sys_spawn_program(kExitProgram, sizeof(kExitProgram),
+                                    /*entry_offset=*/0, &startup);
+  ASSERT_NE(handle, HANDLE_INVALID);
+  memset(&startup, 0xff, sizeof(startup));
+  ASSERT_EQ(sys_wait_any_task(&handle, 1, /*flags=*/0), 0);
+}
+
+TEST_SUITE(Spawn) {
+  RUN_TEST(SpawnLatency);
+  RUN_TEST(WaitAnyTask);
+  RUN_TEST(WaitAnyTaskTimeout);
+  RUN_TEST(SpawnProgramStartupBlock);
+}
+
+TEST(SleepLastsAtLeastTimeout) {
+  uint32_t start = sys_get_uptime();
+  sys_sleep(100);
+  ASSERT_GE(sys_get_uptime() - start, 100);
+
+  start = sys_get_uptime();
+  sys_sleep_until(start + 50);
+  ASSERT_GE(sys_get_uptime(), start + 50);
+}
+
+TEST(FutexWaitTimeout) {
+  uint32_t word = 0;
+  ASSERT_EQ(sys_futex_wait_timeout(&word, 1, /*timeout_ms=*/10),
+            FUTEX_WOULD_BLOCK);
+
+  uint32_t start = sys_get_uptime();
+  ASSERT_EQ(sys_futex_wait_timeout(&word, 0, /*timeout_ms=*/50),
+            FUTEX_TIMED_OUT);
+  ASSERT_GE(sys_get_uptime() - start, 50);
+}
+
+volatile bool StopSpinning;
+
+void *Spin(void *) {
+  while (!StopSpinning) {}
+  return nullptr;
+}
+
+struct PeriodicRun {
+  int32_t admitted;
+  uint32_t max_lateness_ms;
+};
+
+void *RunPeriodically(void *arg) {
+  auto *run = static_cast<PeriodicRun *>(arg);
+  run->admitted = sys_set_deadline(/*runtime_ms=*/20, /*deadline_ms=*/100,
+                                   /*period_ms=*/100);
+  uint32_t next = sys_get_uptime();
+  for (uint32_t i = 0; i < 10; ++i) {
+    next += 100;
+    sys_sleep_until(next);
+    uint32_t lateness = sys_get_uptime() - next;
+    if (lateness > run->max_lateness_ms) run->max_lateness_ms = lateness;
+  }
+  sys_set_deadline(0, 0, 0);
+  return nullptr;
+}
+
+// With round robin, a task woken behind this many spinning tasks could wait
+// several quanta before running.
+TEST(DeadlineTaskRunsOnTime) {
+  ASSERT_EQ(sys_set_deadline(50, 20, 100), DEADLINE_INVALID);
+  ASSERT_EQ(sys_set_deadline(100, 100, 100), DEADLINE_OVERLOADED);
+
+  constexpr uint32_t kNumSpinners = 6;
+  StopSpinning = false;
+  pthread_t spinners[kNumSpinners];
+  for (uint32_t i = 0; i < kNumSpinners; ++i)
+    ASSERT_EQ(pthread_create(&spinners[i], nullptr, Spin, nullptr), 0);
+
+  PeriodicRun run = {};
+  pthread_t periodic;
+  ASSERT_EQ(pthread_create(&periodic, nullptr, RunPeriodically, &run), 0);
+  ASSERT_EQ(pthread_join(periodic, nullptr), 0);
+
+  StopSpinning = true;
+  for (uint32_t i = 0; i < kNumSpinners; ++i)
+    ASSERT_EQ(pthread_join(spinners[i], nullptr), 0);
+
+  ASSERT_EQ(run.admitted, 0);
+  ASSERT_TRUE(run.max_lateness_ms < 100);
+}
+
+TEST_SUITE(Scheduling) { RUN_TEST(DeadlineTaskRunsOnTime); }
+
+TEST_SUITE(Sleep) {
+  RUN_TEST(SleepLastsAtLeastTimeout);
+  RUN_TEST(FutexWaitTimeout);
+}
+
+uint32_t SharedCounter;
+
+// Bump the shared counter from several threads at once, allocating on the
+// shared heap along the way, and return the argument doubled.
+void *CountUp(void *arg) {
+  for (uint32_t i = 0; i < 1000; ++i) {
+    void *ptr = malloc(16);
+    __atomic_fetch_add(&SharedCounter, 1, __ATOMIC_RELAXED);
+    free(ptr);
+  }
+  return reinterpret_cast<void *>(reinterpret_cast<uintptr_t>(arg) * 2);
+}
+
+TEST(ThreadsShareAddressSpace) {
+  constexpr uint32_t kNumThreads = 4;
+  SharedCounter = 0;
+  pthread_t threads[kNumThreads];
+  for (uint32_t i = 0; i < kNumThreads; ++i) {
+    ASSERT_EQ(pthread_create(&threads[i], nullptr, CountUp,
+                             reinterpret_cast<void *>(i + 1)),
+              0);
+  }
+
+  for (uint32_t i = 0; i < kNumThreads; ++i) {
+    void *retval;
+    ASSERT_EQ(pthread_join(threads[i], &retval), 0);
+    ASSERT_EQ(reinterpret_cast<uintptr_t>(retval), (i + 1) * 2);
+  }
+  ASSERT_EQ(SharedCounter, kNumThreads * 1000);
+}
+
+struct MutexCounter {
+  pthread_mutex_t mutex;
+  uint32_t count;
+};
+
+void *IncrementWithMutex(void *arg) {
+  auto *counter = static_cast<MutexCounter *>(arg);
+  for (uint32_t i = 0; i < 1000; ++i) {
+    pthread_mutex_lock(&counter->mutex);
+    // Split the read and write so an unlocked race would lose increments.
+    uint32_t count = counter->count;
+    counter->count = count + 1;
+    pthread_mutex_unlock(&counter->mutex);
+  }
+  return nullptr;
+}
+
+TEST(MutexAcrossThreads) {
+  MutexCounter counter = {PTHREAD_MUTEX_INITIALIZER, 0};
+  ASSERT_EQ(pthread_mutex_trylock(&counter.mutex), 0);
+  ASSERT_NE(pthread_mutex_trylock(&counter.mutex), 0);
+  pthread_mutex_unlock(&counter.mutex);
+
+  pthread_t threads[3];
+  for (pthread_t &thread : threads)
+    ASSERT_EQ(pthread_create(&thread, nullptr, IncrementWithMutex, &counter),
+              0);
+  for (pthread_t &thread : threads) pthread_join(thread, nullptr);
+  ASSERT_EQ(counter.count, 3000);
+}
+
+// A one slot mailbox handed between a producer and a consumer.
+struct Mailbox {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  bool full;
+  uint32_t value;
+  sem_t done;
+};
+
+void *Consume(void *arg) {
+  auto *box = static_cast<Mailbox *>(arg);
+  uint32_t sum = 0;
+  for (uint32_t i = 0; i < 100; ++i) {
+    pthread_mutex_lock(&box->mutex);
+    while (!box->full) pthread_cond_wait(&box->cond, &box->mutex);
+    sum += box->value;
+    box->full = false;
+    pthread_cond_signal(&box->cond);
+    pthread_mutex_unlock(&box->mutex);
+  }
+  sem_post(&box->done);
+  return reinterpret_cast<void *>(sum);
+}
+
+TEST(CondVarAndSemaphore) {
+  Mailbox box = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, false,
+                 0, {}};
+  sem_init(&box.done, 0, 0);
+  ASSERT_NE(sem_trywait(&box.done), 0);
+
+  pthread_t consumer;
+  ASSERT_EQ(pthread_create(&consumer, nullptr, Consume, &box), 0);
+  for (uint32_t i = 1; i <= 100; ++i) {
+    pthread_mutex_lock(&box.mutex);
+    while (box.full) pthread_cond_wait(&box.cond, &box.mutex);
+    box.value = i;
+    box.full = true;
+    pthread_cond_signal(&box.cond);
+    pthread_mutex_unlock(&box.mutex);
+  }
+
+  sem_wait(&box.done);
+  void *sum;
+  pthread_join(consumer, &sum);
+  ASSERT_EQ(reinterpret_cast<uintptr_t>(sum), 5050);
+}
+
+TEST_SUITE(Threads) {
+  RUN_TEST(ThreadsShareAddressSpace);
+  RUN_TEST(MutexAcrossThreads);
+  RUN_TEST(CondVarAndSemaphore);
+}
+
+uint64_t ClockNs() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 +
+         static_cast<uint64_t>(ts.tv_nsec);
+}
+
+TEST(ClockIsMonotonic) {
+  timespec ts;
+  ASSERT_EQ(clock_gettime(CLOCK_MONOTONIC, &ts), 0);
+  ASSERT_TRUE(ts.tv_nsec >= 0 && ts.tv_nsec < 1000000000);
+  ASSERT_EQ(clock_gettime(/*clock_id=*/-1, &ts), -1);
+
+  uint64_t prev = ClockNs();
+  for (uint32_t i = 0; i < 10000; ++i) {
+    uint64_t now = ClockNs();
+    ASSERT_GE(now, prev);
+    prev = now;
+  }
+}
+
+TEST(ClockTracksUptime) {
+  uint64_t start = ClockNs();
+  uint32_t uptime = sys_get_uptime();
+  ASSERT_GE(start / 1000000, uptime - 20);
+
+  sys_sleep(100);
+  uint64_t end = ClockNs();
+  ASSERT_GE((end - start) / 1000000, 100);
+  ASSERT_GE(static_cast<uint64_t>(time(nullptr)), end / 1000000000);
+}
+
+// Make the get_current_task syscall that libc now answers from the vDSO.
+Handle GetCurrentTaskSyscall() {
+  Handle handle;
+  int32_t ret;
+  asm volatile("call __syscall_entry"
+               : "=a"(ret)
+               : "0"(SYS_get_current_task), "b"(&handle)
+               : "memory");
+  return ret == 0 ? handle : HANDLE_INVALID;
+}
+
+void *RecordCurrentTask(void *arg) {
+  static_cast<Handle *>(arg)[0] = sys_get_current_task();
+  static_cast<Handle *>(arg)[1] = GetCurrentTaskSyscall();
+  return nullptr;
+}
+
+TEST(VDSOCurrentTask) {
+  ASSERT_EQ(sys_get_current_task(), GetCurrentTaskSyscall());
+
+  constexpr uint32_t kMaxTasks = 16;
+  TaskStats stats[kMaxTasks];
+  uint32_t num_tasks = sys_get_task_stats(stats, kMaxTasks);
+  if (num_tasks > kMaxTasks) num_tasks = kMaxTasks;
+  const TaskStats *this_task = FindThisTask(stats, num_tasks);
+  ASSERT_NE(this_task, nullptr);
+  ASSERT_EQ(GetCurrentTaskId(), this_task->id);
+
+  // Each thread is its own task.
+  Handle thread_handles[2];
+  pthread_t thread;
+  ASSERT_EQ(pthread_create(&thread, nullptr, RecordCurrentTask, thread_handles),
+            0);
+  ASSERT_EQ(pthread_join(thread, nullptr), 0);
+  ASSERT_EQ(thread_handles[0], thread_handles[1]);
+  ASSERT_NE(thread_handles[0], sys_get_current_task());
+}
+
+TEST_SUITE(VDSO) {
+  RUN_TEST(ClockIsMonotonic);
+  RUN_TEST(ClockTracksUptime);
+  RUN_TEST(VDSOCurrentTask);
+}
+
+// Sum the numbers sent on the channel with this id until a 0 arrives, then
+// reply with the sum.
+void *SumMessages(void *arg) {
+  channel_t chan;
+  if (channel_attach(&chan, reinterpret_cast<uint32_t>(arg))) return nullptr;
+  uint32_t sum = 0, num;
+  while (channel_recv(&chan, &num, sizeof(num)) == sizeof(num) && num)
+    sum += num;
+  channel_send(&chan, &sum, sizeof(sum));
+  channel_close(&chan);
+  return nullptr;
+}
+
+TEST(ChannelRoundTrip) {
+  channel_t chan;
+  int32_t id = channel_create(&chan);
+  ASSERT_GE(id, 0);
+
+  uint32_t num;
+  ASSERT_EQ(channel_try_recv(&chan, &num, sizeof(num)), CHANNEL_EMPTY);
+  ASSERT_EQ(channel_try_send(&chan, &num, CHANNEL_MAX_MESSAGE + 1),
+            CHANNEL_MSG_TOO_BIG);
+
+  // More messages than slots, so the sender has to wait for the receiver.
+  pthread_t thread;
+  ASSERT_EQ(pthread_create(&thread, nullptr, SumMessages,
+                           reinterpret_cast<void *>(id)),
+            0);
+  for (num = 1; num <= 1000; ++num)
+    ASSERT_EQ(channel_send(&chan, &num, sizeof(num)), 0);
+  num = 0;
+  ASSERT_EQ(channel_send(&chan, &num, sizeof(num)), 0);
+
+  uint32_t sum;
+  ASSERT_EQ(channel_recv(&chan, &sum, sizeof(sum)), sizeof(sum));
+  ASSERT_EQ(sum, 500500);
+  ASSERT_EQ(pthread_join(thread, nullptr), 0);
+  channel_close(&chan);
+
+  // The channel is gone once nothing maps it.
+  channel_t stale;
+  ASSERT_EQ(channel_attach(&stale, static_cast<uint32_t>(id)),
+            CHANNEL_NOT_FOUND);
+}
+
+TEST_SUITE(Channels) { RUN_TEST(ChannelRoundTrip); }
+
+constexpr uint32_t kIPCStop = UINT32_MAX;
+
+struct IPCClientRun {
+  Handle server;
+  uint32_t num_calls;
+  uint32_t num_right;
+};
+
+void *CallAdder(void *arg) {
+  auto *run = static_cast<IPCClientRun *>(arg);
+  for (uint32_t i = 0; i < run->num_calls; ++i) {
+    IPCMessage msg = {run->server, {i, 2 * i, 3 * i, 4 * i}};
+    if (sys_ipc_call(&msg) || msg.task != run->server) continue;
+    if (msg.words[0] == 10 * i && msg.words[3] == i) ++run->num_right;
+  }
+  IPCMessage stop = {run->server, {kIPCStop, 0, 0, 0}};
+  sys_ipc_call(&stop);
+  return nullptr;
+}
+
+// This task serves calls from a thread, replying with the sum of the words.
+TEST(IPCCallAndReply) {
+  Handle self = sys_get_current_task();
+  IPCMessage msg = {self, {}};
+  ASSERT_EQ(sys_ipc_call(&msg), IPC_INVALID);
+  ASSERT_EQ(sys_ipc_reply(&msg), IPC_INVALID);
+
+  IPCClientRun run = {self, /*num_calls=*/1000, /*num_right=*/0};
+  pthread_t client;
+  ASSERT_EQ(pthread_create(&client, nullptr, CallAdder, &run), 0);
+
+  msg.task = HANDLE_INVALID;
+  while (true) {
+    ASSERT_EQ(sys_ipc_reply_and_wait(&msg), 0);
+    if (msg.words[0] == kIPCStop) break;
+    uint32_t first = msg.words[0];
+    msg.words[0] = first + msg.words[1] + msg.words[2] + msg.words[3];
+    msg.words[3] = first;
+  }
+  ASSERT_EQ(sys_ipc_reply(&msg), 0);
+  ASSERT_EQ(pthread_join(client, nullptr), 0);
+  ASSERT_EQ(run.num_right, run.num_calls);
+}
+
+TEST_SUITE(IPC) { RUN_TEST(IPCCallAndReply); }
+
+struct CopyPeer {
+  volatile Handle handle;
+  volatile bool done;
+};
+
+void *PublishHandle(void *arg) {
+  auto *peer = static_cast<CopyPeer *>(arg);
+  peer->handle = sys_get_current_task();
+  while (!peer->done) sys_sleep(1);
+  return nullptr;
+}
+
+// Copies to a thread go through the kernel's temporary mapping like copies to
+// any other task, but land in memory this task can check directly.
+TEST(CopyAcrossPages) {
+  auto *first = reinterpret_cast<uint8_t *>(0xE0000000);
+  uint8_t *second = first + kPageSize4M;
+  ASSERT_EQ(sys_map_page(first), MAP_SUCCESS);
+  ASSERT_EQ(sys_map_page(second), MAP_SUCCESS);
+
+  CopyPeer peer = {HANDLE_INVALID, false};
+  pthread_t thread;
+  ASSERT_EQ(pthread_create(&thread, nullptr, PublishHandle, &peer), 0);
+  while (peer.handle == HANDLE_INVALID) sys_sleep(1);
+
+  uint8_t src[64];
+  for (uint32_t i = 0; i < sizeof(src); ++i) src[i] = static_cast<uint8_t>(i);
+  uint8_t *remote = second - 32;
+  sys_copy_to_task(peer.handle, remote, src, sizeof(src));
+  ASSERT_EQ(memcmp(remote, src, sizeof(src)), 0);
+
+  uint8_t dst[64] = {};
+  sys_copy_from_task(peer.handle, dst, remote, sizeof(dst));
+  ASSERT_EQ(memcmp(dst, src, sizeof(dst)), 0);
+
+  // Scatter one remote fragment across three local ones.
+  memset(dst, 0, sizeof(dst));
+  iovec local[] = {{dst, 10}, {dst + 10, 20}, {dst + 30, 34}};
+  iovec remote_vec[] = {{remote, sizeof(src)}};
+  ASSERT_EQ(sys_copy_from_task_v(peer.handle, local, 3, remote_vec, 1),
+            sizeof(src));
+  ASSERT_EQ(memcmp(dst, src, sizeof(dst)), 0);
+
+  // Gather them back somewhere else.
+  iovec other_remote[] = {{first, sizeof(src)}};
+  ASSERT_EQ(sys_copy_to_task_v(peer.handle, local, 3, other_remote, 1),
+            sizeof(src));
+  ASSERT_EQ(memcmp(first, src, sizeof(src)), 0);
+
+  // The copy stops where the mapping ends.
+  iovec past_end[] = {{second + kPageSize4M - 8, 16}};
+  ASSERT_EQ(sys_copy_from_task_v(peer.handle, local, 3, past_end, 1), 8);
+
+  peer.done = true;
+  ASSERT_EQ(pthread_join(thread, nullptr), 0);
+  sys_unmap_page(first);
+  sys_unmap_page(second);
+}
+
+TEST_SUITE(CrossTaskCopy) { RUN_TEST(CopyAcrossPages); }
+
+constexpr uint32_t kShmSize = kPageSize4M + kPageSize4M / 2;
+
+// Map the object by name at a fixed address, check what the creator wrote at
+// both ends, and answer at the end of the second page.
+void *CheckShm(void *arg) {
+  void *addr = reinterpret_cast<void *>(0xD0000000);
+  uint32_t size;
+  if (sys_shm_map("test-shm", &addr, &size) ||
+      addr != reinterpret_cast<void *>(0xD0000000) || size != kShmSize)
+    return nullptr;
+  auto *words = static_cast<uint32_t *>(addr);
+  uint32_t last = kShmSize / sizeof(uint32_t) - 1;
+  if (words[0] == 0x1234 && words[last] == 0x5678) words[last - 1] = 0x9ABC;
+  sys_shm_unmap(addr, size);
+  *static_cast<bool *>(arg) = true;
+  return nullptr;
+}
+
+TEST(SharedMemoryByName) {
+  void *addr = nullptr;
+  ASSERT_EQ(sys_shm_create("", kShmSize, &addr), SHM_INVALID);
+  ASSERT_EQ(sys_shm_create("test-shm", SHM_MAX_SIZE + 1, &addr), SHM_INVALID);
+  ASSERT_EQ(sys_shm_create("test-shm", kShmSize, &addr), 0);
+  ASSERT_NE(addr, nullptr);
+
+  void *other = nullptr;
+  ASSERT_EQ(sys_shm_create("test-shm", kShmSize, &other), SHM_EXISTS);
+  uint32_t size;
+  ASSERT_EQ(sys_shm_map("no-such-shm", &other, &size), SHM_NOT_FOUND);
+
+  auto *words = static_cast<uint32_t *>(addr);
+  uint32_t last = kShmSize / sizeof(uint32_t) - 1;
+  words[0] = 0x1234;
+  words[last] = 0x5678;
+
+  bool checked = false;
+  pthread_t thread;
+  ASSERT_EQ(pthread_create(&thread, nullptr, CheckShm, &checked), 0);
+  ASSERT_EQ(pthread_join(thread, nullptr), 0);
+  ASSERT_TRUE(checked);
+  ASSERT_EQ(words[last - 1], 0x9ABC);
+
+  // The object goes away with its last mapping.
+  sys_shm_unmap(addr, kShmSize);
+  other = nullptr;
+  ASSERT_EQ(sys_shm_map("test-shm", &other, &size), SHM_NOT_FOUND);
+}
+
+TEST_SUITE(SharedMemory) { RUN_TEST(SharedMemoryByName); }
+
+// More than the pipe buffer holds, so the writer has to wait for the reader.
+constexpr uint32_t kPipeTestBytes = 3 * 4096 + 100;
+
+uint8_t PipePatternByte(uint32_t offset) {
+  return static_cast<uint8_t>(offset % 251);
+}
+
+// Write a pattern to stdout, which the test made a pipe for this thread.
+void *WritePattern(void *) {
+  uint8_t chunk[100];
+  for (uint32_t sent = 0; sent < kPipeTestBytes; sent += sizeof(chunk)) {
+    uint32_t len = kPipeTestBytes - sent;
+    if (len > sizeof(chunk)) len = sizeof(chunk);
+    for (uint32_t i = 0; i < len; ++i) chunk[i] = PipePatternByte(sent + i);
+    if (sys_write(STDOUT_FD, chunk, len) != static_cast<int32_t>(len)) break;
+  }
+  return nullptr;
+}
+
+TEST(PipeToThread) {
+  uint32_t fds[2];
+  ASSERT_EQ(sys_pipe(fds), 0);
+  char c = 'x';
+  ASSERT_EQ(sys_read(fds[1], &c, 1), FD_INVALID);
+  ASSERT_EQ(sys_write(fds[0], &c, 1), FD_INVALID);
+  ASSERT_EQ(sys_set_spawn_stdio(fds[1], STDOUT_FD), FD_INVALID);
+
+  ASSERT_EQ(sys_set_spawn_stdio(STDIN_FD, fds[1]), 0);
+  pthread_t thread;
+  ASSERT_EQ(pthread_create(&thread, nullptr, WritePattern, nullptr), 0);
+  ASSERT_EQ(sys_set_spawn_stdio(STDIN_FD, STDOUT_FD), 0);
+  ASSERT_EQ(sys_close(fds[1]), 0);
+
+  // The thread has the only write end left, so this reads until it exits.
+  uint8_t buffer[300];
+  uint32_t total = 0;
+  bool matches = true;
+  int32_t read;
+  while ((read = sys_read(fds[0], buffer, sizeof(buffer))) > 0) {
+    for (int32_t i = 0; i < read; ++i)
+      if (buffer[i] != PipePatternByte(total + static_cast<uint32_t>(i)))
+        matches = false;
+    total += static_cast<uint32_t>(read);
+  }
+  ASSERT_EQ(read, 0);
+  ASSERT_EQ(total, kPipeTestBytes);
+  ASSERT_TRUE(matches);
+  ASSERT_EQ(pthread_join(thread, nullptr), 0);
+  ASSERT_EQ(sys_close(fds[0]), 0);
+  ASSERT_EQ(sys_close(fds[0]), FD_INVALID);
+}
+
+TEST(PipeWithoutReader) {
+  uint32_t fds[2];
+  ASSERT_EQ(sys_pipe(fds), 0);
+  ASSERT_EQ(sys_close(fds[0]), 0);
+  char c = 'x';
+  ASSERT_EQ(sys_write(fds[1], &c, 1), PIPE_BROKEN);
+  ASSERT_EQ(sys_close(fds[1]), 0);
+}
+
+TEST_SUITE(Pipes) {
+  RUN_TEST(PipeToThread);
+  RUN_TEST(PipeWithoutReader);
+}
+
+TEST(RingBatchesSyscalls) {
+  SyscallRing *ring;
+  ASSERT_EQ(ring_create(&ring), 0);
+  SyscallRing *other;
+  ASSERT_EQ(ring_create(&other), RING_EXISTS);
+
+  uint32_t first = 0xC8000000;
+  uint32_t second = first + kPageSize4M;
+  const char msg[] = "Written through the syscall ring\n";
+  RingSubmission subs[] = {
+      {SYS_map_page, {first}, 1, 0},
+      {SYS_map_page, {second}, 2, 0},
+      {SYS_map_page, {first}, 3, 0},
+      {SYS_write,
+       {STDOUT_FD, reinterpret_cast<uint32_t>(msg), sizeof(msg) - 1},
+       4,
+       0},
+      {SYS_exit_user_task, {}, 5, 0},  // Rings cannot run this.
+      {SYS_unmap_page, {first}, 6, 0},
+      {SYS_unmap_page, {second}, 7, 0},
+  };
+  constexpr uint32_t kNumSubs = sizeof(subs) / sizeof(*subs);
+  int32_t expected[kNumSubs] = {
+      MAP_SUCCESS, MAP_SUCCESS, MAP_ALREADY_MAPPED, sizeof(msg) - 1,
+      SYSCALL_ENOSYS, 0, 0};
+
+  for (const RingSubmission &sub : subs) ASSERT_TRUE(ring_queue(ring, &sub));
+  ASSERT_EQ(ring_submit(ring), kNumSubs);
+
+  RingCompletion completion;
+  for (uint32_t i = 0; i < kNumSubs; ++i) {
+    ASSERT_TRUE(ring_reap(ring, &completion));
+    ASSERT_EQ(completion.user_data, i + 1);
+    ASSERT_EQ(completion.result, expected[i]);
+  }
+  ASSERT_FALSE(ring_reap(ring, &completion));
+  ASSERT_EQ(ring_submit(ring), 0);
+}
+
+TEST_SUITE(Rings) { RUN_TEST(RingBatchesSyscalls); }
+
+TEST(PollPipe) {
+  uint32_t fds[2];
+  ASSERT_EQ(sys_pipe(fds), 0);
+  PollEntry entries[] = {
+      {POLL_FD, fds[0], POLL_IN, 0, 0},
+      {POLL_FD, fds[1], POLL_OUT, 0, 0},
+  };
+
+  // Only the write end is ready while the pipe is empty.
+  ASSERT_EQ(sys_poll(entries, 2, /*timeout_ms=*/0), 1);
+  ASSERT_EQ(entries[0].revents, 0);
+  ASSERT_EQ(entries[1].revents, POLL_OUT);
+  ASSERT_EQ(sys_poll(entries, 1, /*timeout_ms=*/20), 0);
+
+  char c = 'x';
+  ASSERT_EQ(sys_write(fds[1], &c, 1), 1);
+  ASSERT_EQ(sys_poll(entries, 1, TIMEOUT_INFINITE), 1);
+  ASSERT_EQ(entries[0].revents, POLL_IN);
+
+  // What is left can still be read after the last write end closes.
+  ASSERT_EQ(sys_close(fds[1]), 0);
+  ASSERT_EQ(sys_poll(entries, 2, TIMEOUT_INFINITE), 2);
+  ASSERT_EQ(entries[0].revents, POLL_IN | POLL_HUP);
+  ASSERT_EQ(entries[1].revents, POLL_INVALID);
+  ASSERT_EQ(sys_close(fds[0]), 0);
+
+  PollEntry too_many[POLL_MAX + 1] = {};
+  ASSERT_EQ(sys_poll(too_many, POLL_MAX + 1, /*timeout_ms=*/0), POLL_TOO_MANY);
+}
+
+TEST(PollTaskExit) {
+  Handle handle = sys::CreateTask(kSlowExitProgram, sizeof(kSlowExitProgram));
+  PollEntry entry = {POLL_TASK, handle, 0, 0, 0};
+  ASSERT_EQ(sys_poll(&entry, 1, /*timeout_ms=*/0), 0);
+  ASSERT_EQ(sys_poll(&entry, 1, TIMEOUT_INFINITE), 1);
+  ASSERT_EQ(entry.revents, POLL_EXITED);
+  ASSERT_EQ(sys_wait_any_task(&handle, 1, WAIT_NOHANG), 0);
+}
+
+uint32_t PollWord;
+
+void *BumpPollWord(void *) {
+  __atomic_store_n(&PollWord, 1, __ATOMIC_SEQ_CST);
+  sys_futex_wake(&PollWord, 1);
+  return nullptr;
+}
+
+TEST(PollFutex) {
+  PollWord = 0;
+  PollEntry entries[] = {
+      {POLL_FUTEX, reinterpret_cast<uint32_t>(&PollWord), 0, 0, 0},
+      {POLL_FD, STDOUT_FD, 0, 0, 0},  // Waits for nothing.
+  };
+  ASSERT_EQ(sys_poll(entries, 2, /*timeout_ms=*/0), 0);
+
+  pthread_t thread;
+  ASSERT_EQ(pthread_create(&thread, nullptr, BumpPollWord, nullptr), 0);
+  ASSERT_EQ(sys_poll(entries, 2, TIMEOUT_INFINITE), 1);
+  ASSERT_EQ(entries[0].revents, POLL_CHANGED);
+  ASSERT_EQ(entries[1].revents, 0);
+  ASSERT_EQ(pthread_join(thread, nullptr), 0);
+}
+
+TEST_SUITE(Poll) {
+  RUN_TEST(PollPipe);
+  RUN_TEST(PollTaskExit);
+  RUN_TEST(PollFutex);
+}
+
+TEST(StaleTaskHandle) {
+  Handle handle = sys::CreateTask(kExitProgram, sizeof(kExitProgram));
+  ASSERT_NE(handle, HANDLE_INVALID);
+  ASSERT_EQ(sys_destroy_task(handle), 0);
+
+  // The handle is closed with its task, so it cannot reach the next task even
+  // if that one reuses its entry.
+  Handle next = sys::CreateTask(kExitProgram, sizeof(kExitProgram));
+  ASSERT_NE(next, handle);
+  ASSERT_EQ(sys_destroy_task(handle), SYSCALL_EBADF);
+  uint32_t word;
+  iovec vec = {&word, sizeof(word)};
+  ASSERT_EQ(sys_copy_from_task_v(handle, &vec, 1, &vec, 1), SYSCALL_EBADF);
+  ASSERT_EQ(sys_destroy_task(next), 0);
+}
+
+TEST(ForgedTaskHandle) {
+  // Values this task was never given do not name any task.
+  ASSERT_EQ(sys_destroy_task(HANDLE_INVALID), SYSCALL_EBADF);
+  ASSERT_EQ(sys_destroy_task(0xdeadbeef), SYSCALL_EBADF);
+  ASSERT_EQ(sys_close_handle(0xdeadbeef), SYSCALL_EBADF);
+
+  PollEntry entry = {};
+  entry.type = POLL_TASK;
+  entry.id = 0xdeadbeef;
+  ASSERT_EQ(sys_poll(&entry, 1, /*timeout_ms=*/0), 1);
+  ASSERT_EQ(entry.revents, POLL_INVALID);
+
+  // A bad handle fails the wait before an exited task after it is destroyed.
+  Handle handles[] = {0xdeadbeef,
+                      sys::CreateTask(kExitProgram, sizeof(kExitProgram))};
+  ASSERT_EQ(sys_wait_any_task(handles, 2, /*flags=*/0), SYSCALL_EBADF);
+  ASSERT_EQ(sys_destroy_task(handles[1]), 0);
+}
+
+TEST(DupAndCloseHandle) {
+  Handle handle = sys::CreateTask(kExitProgram, sizeof(kExitProgram));
+  Handle dup;
+  ASSERT_EQ(sys_dup_handle(handle, HANDLE_INVALID, &dup), 0);
+  ASSERT_NE(dup, handle);
+
+  // Closing one handle leaves the task reachable through the other, but only
+  // one of them can destroy it.
+  Handle other;
+  ASSERT_EQ(sys_dup_handle(handle, HANDLE_INVALID, &other), 0);
+  ASSERT_EQ(sys_close_handle(handle), 0);
+  ASSERT_EQ(sys_close_handle(handle), SYSCALL_EBADF);
+  ASSERT_EQ(sys_wait_any_task(&dup, 1, /*flags=*/0), 0);
+  ASSERT_EQ(sys_destroy_task(other), SYSCALL_EBADF);
+
+  // A task keeps its handle to itself.
+  ASSERT_EQ(sys_close_handle(sys_get_current_task()), SYSCALL_EBADF);
+  ASSERT_EQ(sys_destroy_task(sys_get_current_task()), SYSCALL_EBADF);
+}
+
+TEST(HandleTableFull) {
+  constexpr uint32_t kMaxDups = 64;
+  Handle dups[kMaxDups];
+  uint32_t num = 0;
+  while (num < kMaxDups && sys_dup_handle(sys_get_current_task(),
+                                          HANDLE_INVALID, &dups[num]) == 0)
+    ++num;
+  ASSERT_NE(num, kMaxDups);
+  ASSERT_EQ(sys::CreateTask(kExitProgram, sizeof(kExitProgram)),
+            HANDLE_INVALID);
+  for (uint32_t i = 0; i < num; ++i) ASSERT_EQ(sys_close_handle(dups[i]), 0);
+
+  Handle handle = sys::CreateTask(kExitProgram, sizeof(kExitProgram));
+  ASSERT_NE(handle, HANDLE_INVALID);
+  ASSERT_EQ(sys_destroy_task(handle), 0);
+}
+
+TEST_SUITE(Handles) {
+  RUN_TEST(StaleTaskHandle);
+  RUN_TEST(ForgedTaskHandle);
+  RUN_TEST(DupAndCloseHandle);
+  RUN_TEST(HandleTableFull);
+}
+
+// A multicall record writing `size` bytes of `buf` to `fd`.
+MultiCall WriteCall(uint32_t fd, const char *buf, uint32_t size) {
+  return {SYS_write,
+          {fd, reinterpret_cast<uint32_t>(buf), size, 0, 0},
+          /*result=*/0};
+}
+
+TEST(MulticallRunsInOrder) {
+  uint32_t fds[2];
+  ASSERT_EQ(sys_pipe(fds), 0);
+
+  // Calls that cannot be batched fail without stopping the others.
+  MultiCall calls[] = {
+      WriteCall(fds[1], "ab", 2),
+      {SYS_exit_user_task, {}, /*result=*/0},
+      WriteCall(fds[1], "cd", 2),
+  };
+  ASSERT_EQ(sys_multicall(calls, 3, /*flags=*/0), 3);
+  ASSERT_EQ(calls[0].result, 2);
+  ASSERT_EQ(calls[1].result, SYSCALL_ENOSYS);
+  ASSERT_EQ(calls[2].result, 2);
+
+  char buffer[5] = {};
+  ASSERT_EQ(sys_read(fds[0], buffer, 4), 4);
+  ASSERT_STREQ(buffer, "abcd");
+  ASSERT_EQ(sys_close(fds[0]), 0);
+  ASSERT_EQ(sys_close(fds[1]), 0);
+}
+
+TEST(MulticallStopOnError) {
+  uint32_t fds[2];
+  ASSERT_EQ(sys_pipe(fds), 0);
+
+  // Writing to the read end fails.
+  MultiCall calls[] = {
+      WriteCall(fds[1], "a", 1),
+      WriteCall(fds[0], "b", 1),
+      WriteCall(fds[1], "c", 1),
+  };
+  ASSERT_EQ(sys_multicall(calls, 3, MULTICALL_STOP_ON_ERROR), 2);
+  ASSERT_EQ(calls[0].result, 1);
+  ASSERT_EQ(calls[1].result, FD_INVALID);
+
+  // Only the call before the failure was made.
+  char buffer[4] = {};
+  ASSERT_EQ(sys_read(fds[0], buffer, 3), 1);
+  ASSERT_STREQ(buffer, "a");
+
+  // Without the flag, the calls after the failure are made too.
+  ASSERT_EQ(sys_multicall(calls, 3, /*flags=*/0), 3);
+  ASSERT_EQ(calls[0].result, 1);
+  ASSERT_EQ(calls[1].result, FD_INVALID);
+  ASSERT_EQ(calls[2].result, 1);
+
+  memset(buffer, 0, sizeof(buffer));
+  ASSERT_EQ(sys_read(fds[0], buffer, 3), 2);
+  ASSERT_STREQ(buffer, "ac");
+  ASSERT_EQ(sys_close(fds[0]), 0);
+  ASSERT_EQ(sys_close(fds[1]), 0);
+
+  MultiCall many[MULTICALL_MAX + 1];
+  ASSERT_EQ(sys_multicall(many, MULTICALL_MAX + 1, /*flags=*/0),
+            MULTICALL_TOO_MANY);
+}
+
+TEST_SUITE(Multicall) {
+  RUN_TEST(MulticallRunsInOrder);
+  RUN_TEST(MulticallStopOnError);
+}
+
 TEST(HelloWorldPICStatic) { ASSERT_EQ(system("/hello-world-PIC-static"), 0); }
 
 TEST(Ls) { ASSERT_EQ(system("/bin/ls"), 0); }
 
+TEST(LsPipedToCat) { ASSERT_EQ(system("/bin/ls | /bin/cat"), 0); }
+
 TEST_SUITE(RunProgramTests) {
   RUN_TEST(HelloWorldPICStatic);
   RUN_TEST(Ls);
+  RUN_TEST(LsPipedToCat);
 }
 
 }  // namespace
@@ -1316,6 +2317,21 @@ int main() {
   tests.RunSuite(TupleSuite);
   tests.RunSuite(VFS);
   tests.RunSuite(RTTI);
+  tests.RunSuite(Syscalls);
+  tests.RunSuite(Spawn);
+  tests.RunSuite(Threads);
+  tests.RunSuite(Sleep);
+  tests.RunSuite(VDSO);
+  tests.RunSuite(Scheduling);
+  tests.RunSuite(Channels);
+  tests.RunSuite(IPC);
+  tests.RunSuite(CrossTaskCopy);
+  tests.RunSuite(SharedMemory);
+  tests.RunSuite(Pipes);
+  tests.RunSuite(Rings);
+  tests.RunSuite(Poll);
+  tests.RunSuite(Handles);
+  tests.RunSuite(Multicall);
   tests.RunSuite(RunProgramTests);
 
   return 0;